@@ -12,6 +12,11 @@
 #include <stdio.h>
 
 #define VOIGT_QUICK 0x00001   //Quick integration.
+
+/* Instruction sets of the Voigt kernel:                                    */
+#define VOIGT_SCALAR 0
+#define VOIGT_AVX2   1
+#define VOIGT_AVX512 2
 extern int _voigt_maxelements;
 
 //function definition (voigt.h)
@@ -22,9 +27,11 @@ extern int _voigt_maxelements;
 #endif
 
 /* voigt.c */
-extern inline int voigtf P_((int nwn, float *wn, float wn0, double alphaL, double alphaD, float *vpro, double eps));
+extern int voigtsetlevel P_((int level));
+extern void voigtrow P_((double x0, double dx, double y, int n, double scale, float *res));
+extern int voigtf P_((int nwn, float *wn, float wn0, double alphaL, double alphaD, float *vpro, double eps));
 extern int voigtn P_((int nwn, double dwn, double alphaL, double alphaD, float **vpro, double eps, int flags));
-extern inline int voigtn2 P_((int m, int nwn, double dwn, double alphaL, double alphaD, float **vpro, double eps, int flags));
+extern int voigtn2 P_((int m, int nwn, double dwn, double alphaL, double alphaD, float **vpro, double eps, int flags));
 
 
 #undef P_
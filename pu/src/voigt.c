@@ -2,115 +2,84 @@
 // Transit is under an open-source, reproducible-research license (see LICENSE).
 
 /*
-  voigt.c: Functions to return a Voigt profile according to the numerical
-  approximation described by Pierlusi et al. in
-  J. Quant. Spectrosc. Radiat. Transfer., Vol 18 pp.555
+  voigt.c: Functions to return a Voigt profile.  Originally based on the
+  numerical approximation described by Pierlusi et al. in
+  J. Quant. Spectrosc. Radiat. Transfer., Vol 18 pp.555, now on the
+  rational approximation of the Faddeeva function by Weideman (1994).
 
    Normalized line shape is given by:
     \Psi(x,y) = \frac{y}{\pi}
                 \int_{-\infty}^{\infty} \frac{\exp(-t^2)}{y^2+(x-t)^2} {\rm d}t
-   However, all the functions to be used will be approximations in
-   different regions to the function:
+   which is computed from the Faddeeva function:
      Psi(x,y) = Re[w(z=x+iy)]
               = Re[exp(-z^2)(1-erf(-iz))]
 
    (c) Patricio Rojo 2003                                                  */
 
-  /* TD: Set iteration limit from fitted function and not convergence
-     check!  */
   /* TD: check that function using voigt array hanndles correctly if the
      item happens to be exactly in between two bins: it should be 0.5
      the contribution from its of its boundary bin in the first and
      latter \emph{center shift position}*/
 //\omitfh
 #include <profile.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define VOIGT_X86 1
+#include <immintrin.h>
+#endif
 
 #define SQRTLN2 0.83255461115769775635
-#define TWOOSQRTPI 1.12837916709551257389
 #define SQRTLN2PI  0.46971863934982566689
-
-#define A1  0.46131350
-#define A2  0.19016350
-#define A3  0.09999216
-#define A4  1.78449270
-#define A5  0.002883894
-#define A6  5.52534370
-
-#define B1  0.51242424
-#define B2  0.27525510
-#define B3  0.05176536
-#define B4  2.72474500
-
-#define MAXCONV 61
-/* ferf[n]= 1/(n!(2n+1)) */
-static double ferf[MAXCONV] = {
-  1.000000000000000000000,    //0
-  0.333333333333333333333,    //1
-  0.100000000000000000000,    //2
-  2.38095238095238095238e-2,  //3
-  4.62962962962962962963e-3,  //4
-  7.57575757575757575758e-4,  //5
-  1.06837606837606837607e-4,  //6
-  1.32275132275132275132e-5,  //7
-  1.45891690009337068161e-6,  //8
-  1.45038522231504687645e-7,  //9
-  1.31225329638028050726e-8,  //10
-  1.08922210371485733805e-9,  //11
-  8.35070279514723959168e-11, //12
-  5.94779401363763503681e-12, //13
-  3.95542951645852576340e-13, //14
-  2.46682701026445692771e-14, //15
-  1.44832646435981372650e-15, //16
-  8.03273501241577360914e-17, //17
-  4.22140728880708823303e-18, //18
-  2.10785519144213582486e-19, //19
-  1.00251649349077191670e-20, //20
-  4.55184675892820028624e-22, //21
-  1.97706475387790517483e-23, //22
-  8.23014929921422135684e-25, //23
-  3.28926034917575173275e-26, //24
-  1.26410789889891635220e-27, //25
-  4.67848351551848577373e-29, //26
-  1.66976179341737202699e-30, //27
-  5.75419164398217177220e-32, //28
-  1.91694286210978253077e-33, //29
-  6.18030758822279613746e-35, //30
-  1.93035720881510785656e-36, //31
-  5.84675500746883629630e-38, //32
-  1.71885606280178362397e-39, //33
-  4.90892396452342296700e-41, //34
-  1.36304126177913957635e-42, //35
-  3.68249351546114573519e-44, //36
-  9.68728023887076175384e-46, //37
-  2.48306909745491159104e-47, //38
-  6.20565791963739670594e-49, //39
-  1.51310794954121709805e-50, //40
-  3.60157930981012591661e-52, //41
-  8.37341968387228154283e-54, //42
-  1.90254122728987952724e-55, //43
-  4.22678975419355257584e-57, //44
-  9.18642950239868569596e-59, //45
-  1.95410258232417110410e-60, //46
-  4.07013527785325672298e-62, //47
-  8.30461450592911058168e-64, //48
-  1.66058051345108993284e-65, //49
-  3.25539546201302778914e-67, //50
-  6.25918411694871134025e-69, //51
-  1.18076183891157008800e-70, //52
-  2.18621042295388572103e-72, //53
-  3.97425272266506578576e-74, //54
-  7.09571739181805357327e-76, //55
-  1.24466597738907071213e-77, //56
-  2.14564844309633852739e-79, //57
-  3.63615636540051474579e-81, //58
-  6.05939744697137480783e-83, //59
-  9.93207019544894768776e-85
+#define SQRTPIINV  0.56418958354775628695  /* 1/sqrt(pi)                    */
+
+/* Re[w(z)] is evaluated with the rational approximation of Weideman
+   (1994, SIAM J. Numer. Anal. 31, 1497) with N=32 terms:
+     w(z) = 2 p(Z)/(L-iz)^2 + 1/(sqrt(pi)(L-iz)),  Z = (L+iz)/(L-iz),
+   where p is a polynomial of degree N-1, and L = sqrt(N/sqrt(2)).  The
+   absolute error is ~1e-13 over the upper half plane, with no branches on
+   (x, y), so whole arrays of x are evaluated with vector instructions.    */
+#define WEID_N 32
+#define WEID_L 4.756828460010884
+/* Coefficients of p, highest degree first:                                 */
+static const double weid_a[WEID_N] = {
+  -1.30255212179359728e-12,
+  3.74129199842698767e-12,
+  8.02722471826555761e-12,
+  -2.15443635154244362e-11,
+  -5.54422271981103165e-11,
+  1.16579232378732911e-10,
+  4.15375171758380901e-10,
+  -5.23100791849362423e-10,
+  -3.20801434028350485e-09,
+  8.12481110168405962e-10,
+  2.37975537747958654e-08,
+  2.29304423643439392e-08,
+  -1.48130789232037152e-07,
+  -4.18407639687923272e-07,
+  4.25583313798383323e-07,
+  4.40153173207613602e-06,
+  6.82103194306338256e-06,
+  -2.14096192055202028e-05,
+  -1.30754492549511880e-04,
+  -2.45329802699423283e-04,
+  3.92591360698801850e-04,
+  4.51954110534580344e-03,
+  1.90061557848448803e-02,
+  5.73044035298368032e-02,
+  1.40607162268936381e-01,
+  2.95444510715085540e-01,
+  5.46013972063932873e-01,
+  9.01925489364799438e-01,
+  1.34554416923454379e+00,
+  1.82566962963248147e+00,
+  2.26353729990026631e+00,
+  2.57225340812456871e+00
 };
+
 int _voigt_maxelements=99999;
 int _voigt_computeeach=10;
 
-#define NFCN(x,y) (x<1?15:(int)(6.842*x+8.0))
-
 static inline int
 meanintegSimp(PREC_VOIGT *in,
               PREC_VOIGT *out,
@@ -129,75 +98,260 @@ meanintegTrap(PREC_VOIGT *in,
               PREC_VOIGT d);
 
 
-static inline void
-voigtxy(double x,
-        double y,
-        PREC_VOIGT *res,
-        PREC_VOIGT eps,
-        PREC_VOIGTP alphaD){
-  int i, n;
-  long double or, nr, oi, ni, ar, ai; 
-  const long double x2y2 = x*x-y*y;
-  const long double xy2 = 2*x*y;
-  const long double cosxy = cosl(xy2);
-  const long double sinxy = sinl(xy2);
-
-#ifdef _VOIGT_USE_CONVERG
-  if(eps>0) n = MAXCONV;
-  else 
-#endif /* Precision convergence */
-    n = NFCN(x, y) + 1;
-
-  if(x<3 && y<1.8){ /* Region I */
-    ar = or =  y;
-    ai = oi = -x;
-    i = 1;
-    while(1){
-      ni = or*xy2  + oi*x2y2;
-      nr = or*x2y2 - oi*xy2 ;
-#ifdef _VOIGT_USE_CONVERG
-      if(n == MAXCONV){
-        if(i > n){
-          fprintf(stderr, "%s:: No convergence after %i iterations in "
-                          "VOIGTXY() calculations (voigt.c file)\n",
-                          __FILE__, MAXCONV);
-          break;
-        }
-        if(fabs(ferf[i]*(cosxy*nr + sinxy*ni))<eps)
-          break;
+/*\fcnfh
+  Re[w(x+iy)] for y >= 0 (Weideman's approximation), clipped at zero.      */
+static inline double
+weideman(double x,
+         double y){
+  double u = WEID_L + y,        /* L - iz = u - ix                         */
+         v = WEID_L - y,        /* L + iz = v + ix                         */
+         x2 = x*x,
+         id = 1.0/(u*u + x2),   /* 1/|L-iz|^2                              */
+         zr = (u*v - x2)*id,    /* Z = (L+iz)/(L-iz)                       */
+         zi = (u + v)*x*id,
+         r2 = 2.0*zr,           /* Z^2 - r2 Z + s2 = 0                     */
+         s2 = zr*zr + zi*zi,
+         b = weid_a[0], bp = 0.0, t, pr, pi, res;
+  int k;
+
+  /* p(Z) with real coefficients, by a second-order real recurrence
+     (Knuth, TAOCP 4.6.4), half the work of a complex Horner scheme:        */
+  for (k=1; k<WEID_N-1; k++){
+    t  = weid_a[k] + r2*b - s2*bp;
+    bp = b;
+    b  = t;
+  }
+  pr = b*zr + weid_a[WEID_N-1] - s2*bp;
+  pi = b*zi;
+  /* Re[2p/(L-iz)^2 + 1/(sqrt(pi)(L-iz))]:                                  */
+  res = (2.0*(pr*(u*u-x2) - pi*2.0*u*x)*id + SQRTPIINV*u)*id;
+  return res > 0.0 ? res : 0.0;
+}
+
+
+/*\fcnfh
+  res[i] = scale * Re[w(x0 + i*dx + iy)], for i in [0, n), scalar version. */
+static void
+voigtrow_scalar(double x0,
+                double dx,
+                double y,
+                int n,
+                double scale,
+                PREC_VOIGT *res){
+  int i;
+  for (i=0; i<n; i++)
+    res[i] = scale*weideman(x0 + i*dx, y);
+}
+
+
+#ifdef VOIGT_X86
+/* Vectors evaluated together by the vector kernels, so that the latency of
+   the Horner recurrence of one vector is hidden by the others:             */
+#define VOIGT_NV 4
+
+/*\fcnfh
+  res[i] = scale * Re[w(x0 + i*dx + iy)], AVX2 version.                    */
+__attribute__((target("avx2,fma")))
+static void
+voigtrow_avx2(double x0,
+              double dx,
+              double y,
+              int n,
+              double scale,
+              PREC_VOIGT *res){
+  __m256d u  = _mm256_set1_pd(WEID_L + y),
+          uv = _mm256_set1_pd((WEID_L + y)*(WEID_L - y)),
+          u2 = _mm256_set1_pd((WEID_L + y)*(WEID_L + y)),
+          s  = _mm256_set1_pd(2*WEID_L),
+          vx0 = _mm256_set1_pd(x0),
+          vdx = _mm256_set1_pd(dx),
+          vsc = _mm256_set1_pd(scale),
+          one = _mm256_set1_pd(1.0),
+          two = _mm256_set1_pd(2.0),
+          spi = _mm256_set1_pd(SQRTPIINV),
+          idx = _mm256_set_pd(3, 2, 1, 0),
+          x[VOIGT_NV], x2[VOIGT_NV], id[VOIGT_NV], zr[VOIGT_NV],
+          zi[VOIGT_NV], r2[VOIGT_NV], s2[VOIGT_NV], b[VOIGT_NV],
+          bp[VOIGT_NV], pr, pi, ak, t, r;
+  PREC_VOIGT tail[4*VOIGT_NV], *out;
+  int i, k, q;
+
+  for (i=0; i<n; i+=4*VOIGT_NV){
+    /* The last (partial) block goes through a buffer:                      */
+    out = i+4*VOIGT_NV <= n ? res+i : tail;
+#pragma GCC unroll 4
+    for (q=0; q<VOIGT_NV; q++){
+      x[q]  = _mm256_fmadd_pd(_mm256_add_pd(_mm256_set1_pd(i+4*q), idx),
+                              vdx, vx0);
+      x2[q] = _mm256_mul_pd(x[q], x[q]);
+      id[q] = _mm256_div_pd(one, _mm256_add_pd(u2, x2[q]));
+      zr[q] = _mm256_mul_pd(_mm256_sub_pd(uv, x2[q]), id[q]);
+      zi[q] = _mm256_mul_pd(_mm256_mul_pd(s, x[q]), id[q]);
+      r2[q] = _mm256_add_pd(zr[q], zr[q]);
+      s2[q] = _mm256_fmadd_pd(zr[q], zr[q], _mm256_mul_pd(zi[q], zi[q]));
+      b[q]  = _mm256_set1_pd(weid_a[0]);
+      bp[q] = _mm256_setzero_pd();
+    }
+    for (k=1; k<WEID_N-1; k++){
+      ak = _mm256_set1_pd(weid_a[k]);
+#pragma GCC unroll 4
+      for (q=0; q<VOIGT_NV; q++){
+        t     = _mm256_fnmadd_pd(s2[q], bp[q],
+                                 _mm256_fmadd_pd(r2[q], b[q], ak));
+        bp[q] = b[q];
+        b[q]  = t;
       }
-      else 
-#endif /* Precision convergence */
-        if(i > n) break;
-      ai += ni*ferf[i];
-      ar += nr*ferf[i];
-
-      oi = ni;
-      or = nr;
-      i++;
     }
-    (*(res)) = SQRTLN2PI/alphaD*exp(-x2y2)*
-               (cosxy*(1-ar*TWOOSQRTPI)-sinxy*ai*TWOOSQRTPI);
+    ak = _mm256_set1_pd(weid_a[WEID_N-1]);
+#pragma GCC unroll 4
+    for (q=0; q<VOIGT_NV; q++){
+      pr = _mm256_fmadd_pd(b[q], zr[q], _mm256_fnmadd_pd(s2[q], bp[q], ak));
+      pi = _mm256_mul_pd(b[q], zi[q]);
+      r = _mm256_fmsub_pd(pr, _mm256_sub_pd(u2, x2[q]),
+                          _mm256_mul_pd(pi, _mm256_mul_pd(two,
+                                        _mm256_mul_pd(u, x[q]))));
+      r = _mm256_mul_pd(_mm256_fmadd_pd(_mm256_mul_pd(two, r), id[q],
+                                        _mm256_mul_pd(spi, u)), id[q]);
+      r = _mm256_max_pd(r, _mm256_setzero_pd());
+      _mm_storeu_ps(out+4*q, _mm256_cvtpd_ps(_mm256_mul_pd(vsc, r)));
+    }
+    if (out == tail)
+      memcpy(res+i, tail, (n-i)*sizeof(PREC_VOIGT));
   }
-  else if(x<5 && y<5){    /* Region II  */
-    ar = xy2*xy2;
-    nr = xy2*x;
-    ni = x2y2-A2;
-    ai = x2y2-A4;
-    oi = x2y2-A6;
-    (*(res)) = SQRTLN2PI/alphaD*(A1*((nr-ni*y)/(ni*ni+ar)) +
-                                 A3*((nr-ai*y)/(ai*ai+ar)) +
-                                 A5*((nr-oi*y)/(oi*oi+ar)) );
+}
+
+
+/*\fcnfh
+  res[i] = scale * Re[w(x0 + i*dx + iy)], AVX-512 version.                 */
+__attribute__((target("avx512f")))
+static void
+voigtrow_avx512(double x0,
+                double dx,
+                double y,
+                int n,
+                double scale,
+                PREC_VOIGT *res){
+  __m512d u  = _mm512_set1_pd(WEID_L + y),
+          uv = _mm512_set1_pd((WEID_L + y)*(WEID_L - y)),
+          u2 = _mm512_set1_pd((WEID_L + y)*(WEID_L + y)),
+          s  = _mm512_set1_pd(2*WEID_L),
+          vx0 = _mm512_set1_pd(x0),
+          vdx = _mm512_set1_pd(dx),
+          vsc = _mm512_set1_pd(scale),
+          one = _mm512_set1_pd(1.0),
+          two = _mm512_set1_pd(2.0),
+          spi = _mm512_set1_pd(SQRTPIINV),
+          idx = _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0),
+          x[VOIGT_NV], x2[VOIGT_NV], id[VOIGT_NV], zr[VOIGT_NV],
+          zi[VOIGT_NV], r2[VOIGT_NV], s2[VOIGT_NV], b[VOIGT_NV],
+          bp[VOIGT_NV], pr, pi, ak, t, r;
+  PREC_VOIGT tail[8*VOIGT_NV], *out;
+  int i, k, q;
+
+  for (i=0; i<n; i+=8*VOIGT_NV){
+    /* The last (partial) block goes through a buffer:                      */
+    out = i+8*VOIGT_NV <= n ? res+i : tail;
+#pragma GCC unroll 4
+    for (q=0; q<VOIGT_NV; q++){
+      x[q]  = _mm512_fmadd_pd(_mm512_add_pd(_mm512_set1_pd(i+8*q), idx),
+                              vdx, vx0);
+      x2[q] = _mm512_mul_pd(x[q], x[q]);
+      id[q] = _mm512_div_pd(one, _mm512_add_pd(u2, x2[q]));
+      zr[q] = _mm512_mul_pd(_mm512_sub_pd(uv, x2[q]), id[q]);
+      zi[q] = _mm512_mul_pd(_mm512_mul_pd(s, x[q]), id[q]);
+      r2[q] = _mm512_add_pd(zr[q], zr[q]);
+      s2[q] = _mm512_fmadd_pd(zr[q], zr[q], _mm512_mul_pd(zi[q], zi[q]));
+      b[q]  = _mm512_set1_pd(weid_a[0]);
+      bp[q] = _mm512_setzero_pd();
+    }
+    for (k=1; k<WEID_N-1; k++){
+      ak = _mm512_set1_pd(weid_a[k]);
+#pragma GCC unroll 4
+      for (q=0; q<VOIGT_NV; q++){
+        t     = _mm512_fnmadd_pd(s2[q], bp[q],
+                                 _mm512_fmadd_pd(r2[q], b[q], ak));
+        bp[q] = b[q];
+        b[q]  = t;
+      }
+    }
+    ak = _mm512_set1_pd(weid_a[WEID_N-1]);
+#pragma GCC unroll 4
+    for (q=0; q<VOIGT_NV; q++){
+      pr = _mm512_fmadd_pd(b[q], zr[q], _mm512_fnmadd_pd(s2[q], bp[q], ak));
+      pi = _mm512_mul_pd(b[q], zi[q]);
+      r = _mm512_fmsub_pd(pr, _mm512_sub_pd(u2, x2[q]),
+                          _mm512_mul_pd(pi, _mm512_mul_pd(two,
+                                        _mm512_mul_pd(u, x[q]))));
+      r = _mm512_mul_pd(_mm512_fmadd_pd(_mm512_mul_pd(two, r), id[q],
+                                        _mm512_mul_pd(spi, u)), id[q]);
+      r = _mm512_max_pd(r, _mm512_setzero_pd());
+      _mm256_storeu_ps(out+8*q, _mm512_cvtpd_ps(_mm512_mul_pd(vsc, r)));
+    }
+    if (out == tail)
+      memcpy(res+i, tail, (n-i)*sizeof(PREC_VOIGT));
   }
-  else{                   /* Region III */
-    ar = xy2*xy2;
-    nr = xy2*x;
-    ni = x2y2-B2;
-    ai = x2y2-B4;
-    (*(res)) = SQRTLN2PI/alphaD*(B1*((nr-ni*y)/(ni*ni+ar)) +
-                                 B3*((nr-ai*y)/(ai*ai+ar)) );
+}
+#endif
+
+
+/* Selected kernel (-1: not yet selected):                                  */
+static int voigt_level = -1;
+static void (*voigtrow_fcn)(double, double, double, int, double,
+                            PREC_VOIGT *) = voigtrow_scalar;
+
+
+/*\fcnfh
+  Use the Voigt kernel of instruction set 'level' (VOIGT_SCALAR,
+  VOIGT_AVX2, or VOIGT_AVX512), or of the best instruction set supported by
+  the host CPU if level < 0.  Levels not supported by the CPU fall back to
+  the next supported one.  Call it before using the kernel from several
+  threads.
+  Return: the level in use                                                  */
+int
+voigtsetlevel(int level){
+  int best = VOIGT_SCALAR;
+#ifdef VOIGT_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    best = VOIGT_AVX2;
+  if (__builtin_cpu_supports("avx512f"))
+    best = VOIGT_AVX512;
+#endif
+  if (level < 0 || level > best)
+    level = best;
+
+  switch(level){
+#ifdef VOIGT_X86
+  case VOIGT_AVX512:
+    voigtrow_fcn = voigtrow_avx512;
+    break;
+  case VOIGT_AVX2:
+    voigtrow_fcn = voigtrow_avx2;
+    break;
+#endif
+  default:
+    level = VOIGT_SCALAR;
+    voigtrow_fcn = voigtrow_scalar;
   }
-} __attribute__((always_inline))
+  return voigt_level = level;
+}
+
+
+/*\fcnfh
+  Evaluate the normalized Voigt function (times 'scale') on the equispaced
+  array x_i = x0 + i*dx:  res[i] = scale * Re[w(x_i + iy)],  for i in
+  [0, n), with y >= 0.                                                      */
+void
+voigtrow(double x0,        /* First normalized position                     */
+         double dx,        /* Normalized position spacing                   */
+         double y,         /* Normalized width                              */
+         int n,            /* Number of positions                           */
+         double scale,     /* Scale factor                                  */
+         PREC_VOIGT *res){ /* Output array                                  */
+  if (voigt_level < 0)
+    voigtsetlevel(-1);
+  voigtrow_fcn(x0, dx, y, n, scale, res);
+}
 
 
 //\fcnfh
@@ -211,18 +365,15 @@ voigtf(int nwn,            /* Number of wavenumber bins where the function is
        PREC_VOIGTP alphaL, /* Lorentz width                                */
        PREC_VOIGTP alphaD, /* Doppler width                                */
        PREC_VOIGT *vpro,   /* Profile values array                         */
-       PREC_VOIGTP eps){   /* Precision to which the profile is calculated.
-                              If negative, a fixed number of iterations is
-                              calculated. */
-  double y, x;
+       PREC_VOIGTP eps){   /* Unused, the approximation error is ~1e-13    */
+  double y;
   int i;
 
   y = SQRTLN2*alphaL/alphaD;
 
-  for(i=0; i<nwn; i++){
-    x = SQRTLN2*fabs(wn[i]-wn0)/alphaD;
-    voigtxy(x, y, vpro+i, eps, alphaD);
-  }
+  for(i=0; i<nwn; i++)
+    voigtrow(SQRTLN2*(wn[i]-wn0)/alphaD, 0.0, y, 1, SQRTLN2PI/alphaD,
+             vpro+i);
   return 1;
 }
 
@@ -238,9 +389,7 @@ voigtn2(int m,              /* Number of fine resolution bins (deviation
         PREC_VOIGTP alphaL, /* Lorentz width                                */
         PREC_VOIGTP alphaD, /* Doppler width                                */
         PREC_VOIGT **vpro,  /* Array (m by nwn) where to store the profile  */
-        PREC_VOIGTP eps,    /* Precision to which the profile is to be
-                               calculated. If negative, a fixed number of
-                               iterations are performed.                    */
+        PREC_VOIGTP eps,    /* Unused, the approximation error is ~1e-13    */
         int flags){         /* Miscellaneous flags, so far there is support
                                for: 'VOIGT_QUICK' that performs a quick
                                integration, i.e., the height multiplied
@@ -251,7 +400,6 @@ voigtn2(int m,              /* Number of fine resolution bins (deviation
      lower value of the bin (not the center as usual).                    */
 
   double y,      /* Normalized width:    y = sqrt(ln 2) * alphaL/alphaD   */
-         x,      /* Normalized position: x = sqrt(ln 2) * |nu-nu0|/alphaD */
          ddwn,   /* Spacing between wavenumbers                           */
          dcshft; /* Centershift spacing                                   */
   int i, j;
@@ -320,10 +468,8 @@ voigtn2(int m,              /* Number of fine resolution bins (deviation
        array is not possible because the center of
        the profile won't always coincide with the center of the array;
        only when \vr{m}=0. Then, for each element of the array.          */
-    for(i=0; i<nint; i++){
-      x = SQRTLN2*fabs(dint*i-shft)/alphaD;
-      voigtxy(x, y, aint+i, eps, alphaD);
-    }
+    voigtrow(-SQRTLN2*shft/alphaD, SQRTLN2*dint/alphaD, y, nint,
+             SQRTLN2PI/alphaD, aint);
 
     /* Integration: */
     /* If user wants a quick integration, return the value at the
@@ -372,9 +518,7 @@ voigtn(int nwn,            /* Number of wavenumber sample of the profile    */
        PREC_VOIGTP alphaL, /* Lorentz width                                 */
        PREC_VOIGTP alphaD, /* Doppler width                                 */
        PREC_VOIGT **vpro,  /* Array (m by nwn) where to store the profile   */
-       PREC_VOIGTP eps,    /* Precision to which the profile is to be
-                              calculated. If negative, a fixed number of
-                              iterations are performed.                     */
+       PREC_VOIGTP eps,    /* Unused, the approximation error is ~1e-13     */
        int flags){         /* Miscellaneous flags, so far there is support 
                               for: 'VOIGT_QUICK' that performs a quick
                               integration, i.e., the height multiplied
@@ -385,7 +529,6 @@ voigtn(int nwn,            /* Number of wavenumber sample of the profile    */
      lower value of the bin (not the center as usual).                    */
 
   double y,      /* Normalized width:    y = sqrt(ln 2) * alphaL/alphaD   */
-         x,      /* Normalized position: x = sqrt(ln 2) * |nu-nu0|/alphaD */
          ddwn;   /* Centershift spacing                                   */
   int i;
 
@@ -445,10 +588,8 @@ voigtn(int nwn,            /* Number of wavenumber sample of the profile    */
      array is not possible because the center of
      the profile won't always coincide with the center of the array;
      only when \vr{m}=0. Then, for each element of the array.          */
-  for(i=0; i<nint; i++){
-    x = SQRTLN2*fabs(dint*i-dwn)/alphaD;
-    voigtxy(x, y, aint+i, eps, alphaD);
-  }
+  voigtrow(-SQRTLN2*dwn/alphaD, SQRTLN2*dint/alphaD, y, nint,
+           SQRTLN2PI/alphaD, aint);
 
   /* Integration:                                                           */
   /* If user wants a quick integration, return the value at the
@@ -554,20 +695,9 @@ meanintegTrap(PREC_VOIGT *in,        /* Input Array */
 }
 
 #undef SQRTLN2
-#undef TWOOSQRTPI
-#undef MAXCONV
-#undef NFCN
-#undef VOIGTXY
-
-#undef A1
-#undef A2
-#undef A3
-#undef A4
-#undef A5
-#undef A6
-
-#undef B1
-#undef B2
-#undef B3
-#undef B4
+#undef SQRTLN2PI
+#undef SQRTPIINV
+#undef WEID_N
+#undef WEID_L
+#undef VOIGT_NV
 
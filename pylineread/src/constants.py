@@ -20,7 +20,9 @@ C1   = 4 * sc.epsilon_0 * sc.m_e * sc.c**2 / sc.e**2 * 0.01  # cm^-1
 C2   = sc.h * sc.c / sc.k * 100.0        # cm / Kelvin units
 
 # Version Constants:
-TLI_VERSION = 6  # TLI version
+TLI_VERSION = 7  # TLI version
+TLI_BLOCK   = 64 # Line records per block (TLI v7)
+TLI_MINLGF  = -99.0  # log10(gf) of padding records (TLI v7)
 LR_VERSION  = 0  # Lineread version
 LR_REVISION = 0  # Lineread revision
 
@@ -397,30 +397,54 @@ if __name__ == "__main__":
     plt.ylabel("Wavelength  (um)")
     plt.savefig("wavelength.png")
 
-  # Pack:
-  transinfo = "" if six.PY2 else b""
-  # Write the number of transitions:
-  TLIout.write(struct.pack("Q", nTransitions))
-  ut.lrprint(verbose-3, "Writing {:d} transition lines.".format(nTransitions))
-  # Write the number of transitions for each isotope:
+  # Pack the line records (TLI v7).  Each isotope is padded to a whole
+  # number of blocks, and sorted by decreasing wavenumber:
+  nblocks = (Nisotran + c.TLI_BLOCK - 1) // c.TLI_BLOCK
+  Nisorec = nblocks * c.TLI_BLOCK
+  nRecords = np.sum(Nisorec)
+  rectype = np.dtype([("dwn", np.float32), ("elow", np.float32),
+                      ("lgf", np.float32), ("isoid", np.uint16),
+                      ("pad", np.uint16)])
+  records = np.zeros(nRecords, rectype)
+  wnbase  = np.zeros(nRecords // c.TLI_BLOCK, np.double)
+  ihi = 0
+  irec = 0
+  for j in np.arange(len(Nisotran)):
+    ilo  = ihi
+    ihi += Nisotran[j]
+    # Increasing wavelengths give decreasing wavenumbers:
+    wn = 1.0 / (wlength[ilo:ihi] * c.MTC)
+    wn = np.concatenate((wn, np.zeros(Nisorec[j] - Nisotran[j])))
+    base = wn[::c.TLI_BLOCK]
+    recs = records[irec:irec+Nisorec[j]]
+    recs["dwn"] = wn - np.repeat(base, c.TLI_BLOCK)
+    recs["elow"][:Nisotran[j]] = elow[ilo:ihi]
+    recs["lgf"] = c.TLI_MINLGF
+    with np.errstate(divide="ignore"):
+      lgf = np.log10(gf[ilo:ihi])
+    recs["lgf"][:Nisotran[j]] = np.where(gf[ilo:ihi] > 0, lgf,
+                                         c.TLI_MINLGF)
+    recs["isoid"] = isoID[ilo]
+    wnbase[irec//c.TLI_BLOCK:(irec+Nisorec[j])//c.TLI_BLOCK] = base
+    irec += Nisorec[j]
+
+  # Write the number of line records:
+  TLIout.write(struct.pack("Q", nRecords))
+  ut.lrprint(verbose-3, "Writing {:d} transition lines ({:d} records).".
+                         format(nTransitions, nRecords))
+  # Write the number of records for each isotope:
   nIso = len(Nisotran)
   # Note that nIso may differ from accumiso, since accum iso accounts for
   # all the existing isotopes for an species, whereas nIso accounts only
   # for the isotopes that do have line transitions in the given range.
   TLIout.write(struct.pack("i",nIso))
-  TLIout.write(struct.pack(str(nIso)+"Q", *list(Nisotran)))
+  TLIout.write(struct.pack(str(nIso)+"Q", *list(Nisorec)))
+  TLIout.write(struct.pack("i", c.TLI_BLOCK))
 
   # Write the Line-transition data:
   ti = time.time()
-  transinfo += struct.pack("{:d}d".format(nTransitions), *list(wlength))
-  transinfo += struct.pack("{:d}h".format(nTransitions), *list(isoID))
-  transinfo += struct.pack("{:d}d".format(nTransitions), *list(elow))
-  transinfo += struct.pack("{:d}d".format(nTransitions), *list(gf))
-  tf = time.time()
-  ut.lrprint(verbose-3, "Packing time: {:8.3f} seconds".format(tf-ti))
-
-  ti = time.time()
-  TLIout.write(transinfo)
+  TLIout.write(wnbase.tobytes())
+  TLIout.write(records.tobytes())
   tf = time.time()
   ut.lrprint(verbose-3, "Writing time: {:8.3f} seconds".format(tf-ti))
 
@@ -7,9 +7,23 @@
 #define P_(s) ()
 #endif
 
+/* Lines of the opacity grid that can pass the extinction threshold at
+   each grid temperature (see cullmolext()):                                */
+struct linecull{
+  long ntemp;               /* Number of grid temperatures                  */
+  PREC_ATM *temp;           /* Grid temperatures [ntemp]                    */
+  double **kmax;            /* Maximum line strength per species
+                               [ntemp][Nmol]                                */
+  unsigned long long **pass; /* Bit ln%64 of word ln/64 is set if line ln
+                                passes the threshold [ntemp][n_l/64]        */
+};
+
 /* src/extinction.c */
-extern int getprofile P_((float **pr,         double dwn, float dop,
+extern long profilesize P_((double dwn, float dop, float lor, float ta,
+                            int nwave));
+extern int getprofile P_((float *pr,          double dwn, float dop,
                                  float lor, float ta, int nwave));
+extern void getphaseprofile P_((float *pp, float *pr, long n, int ofactor));
 extern void savefile_extinct P_((char *filename, double **e, short *c,
                                  long nrad, long nwav));
 extern void restfile_extinct P_((char *filename, double **e, short *c,
@@ -24,7 +38,13 @@ extern int restextinct P_((FILE *in, PREC_NREC nrad, short niso, PREC_NREC nwn,
                            struct extinction *ex));
 extern int computemolext P_((struct transit *tr, PREC_RES **kiso,
                    PREC_ATM temp, PREC_ATM *density, double *Z, int permol));
+extern int streammolext P_((struct transit *tr, long nitems, PREC_RES ***kiso,
+                    PREC_ATM *temp, PREC_ATM **density, double **Z,
+                    int permol));
+extern void cullmolext P_((struct transit *tr));
+extern void freemem_linecull P_((struct linecull *cull));
 extern int interpolmolext P_((struct transit *tr, PREC_NREC r, PREC_RES **kiso));
+extern void histcrossover P_((struct transit *tr));
 extern void computeextscat P_((double *e, long n, 
                                struct extscat *sc,
                                double *pressure,
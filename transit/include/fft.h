@@ -0,0 +1,24 @@
+// Copyright (C) 2015-2016 University of Central Florida. All rights reserved.
+// Transit is under an open-source, reproducible-research license (see LICENSE).
+
+#if __STDC__ || defined(__cplusplus)
+#define P_(s) s
+#else
+#define P_(s) ()
+#endif
+
+/* Plan of the real FFT of length n (see src/fft.c):                        */
+struct fftplan{
+  long n;       /* Transform length, a power of two                         */
+  int lg;       /* log2(n)                                                  */
+  double *tw;   /* Twiddle factors exp(-2 pi i k/n), k < n/2 [n]            */
+  long *rev;    /* Bit-reversal permutation of length n/2                   */
+};
+
+/* src/fft.c */
+extern struct fftplan *fftplan P_((long n));
+extern void fftreal P_((struct fftplan *plan, double *x));
+extern void fftrealinv P_((struct fftplan *plan, double *x));
+extern void fftmultiply P_((double *x, const double *y, long n));
+
+#undef P_
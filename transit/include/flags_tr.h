@@ -103,6 +103,32 @@
 #define TRPI_GRID         0x010000  /* intens_grid()    completed           */
 #define TRPI_OPACITY      0x020000  /* idxrefrac()      completed           */
 
+/* Line-by-line extinction engines: */
+#define TLE_LINE          0x000000 /* Add the profile of each line        */
+#define TLE_HIST          0x000001 /* Bin the lines into histograms, then
+                                      convolve them with the profiles     */
+
+/* States of a Voigt profile of the width grid (see makeprofile()): */
+#define TPROF_EMPTY       0x000000 /* Not computed                        */
+#define TPROF_BUSY        0x000001 /* Being computed by a thread          */
+#define TPROF_READY       0x000002 /* Computed                            */
+
+/* Opacity-file grid sample types (see struct opacityhead): */
+#define TOPA_F64          0x000000 /* double (PREC_RES)                   */
+#define TOPA_F32          0x000001 /* float                               */
+#define TOPA_LOG16        0x000002 /* unsigned short, log quantized       */
+
+/* TOPA_LOG16 encoding: code q (1 to 65535) of a row with largest value
+   x0 stands for x0*exp(-(65535-q)*TOPA_LOGSTEP), 0 for zero, so values
+   down to x0*exp(-TOPA_LOGRANGE) (1e-30*x0) are kept to a relative error
+   of exp(TOPA_LOGSTEP/2)-1 = 5.3e-4, smaller ones are flushed to zero:   */
+#define TOPA_LOGRANGE     69.07755278982137 /* ln(1e30)                   */
+#define TOPA_LOGSTEP      (TOPA_LOGRANGE/65534)
+
+/* Opacity-file grid axis orders: */
+#define TOPA_LTMW         0x000000 /* [layer][temp][mol][wave]            */
+#define TOPA_LWTM         0x000001 /* [layer][wave][temp][mol]            */
+
 /* Flags for tr_output: */
 #define TOUT_ERROR        0x000001
 #define TOUT_WARN         0x000002
@@ -116,8 +142,11 @@
 
 /* Shared memory flags: */
 #define TSHM_START        0x000000 /* Default state     */
-#define TSHM_INIT         0x000001 /* Space initialized */
 #define TSHM_WRITTEN      0x000002 /* Space written     */
-#define TSHM_ERROR        0x000004 /* Error             */
+
+#define TSHM_MAXPROC      4096     /* Processes sharing a grid             */
+#define TSHM_NAMELEN      64       /* Coordinator-segment name length      */
+#define TSHM_INITPOLL     5000     /* 1-ms polls for a coordinator to be
+                                      initialized by its creator           */
 
 #endif /* _FLAGS_TR_H */
@@ -0,0 +1,41 @@
+// Copyright (C) 2015-2016 University of Central Florida. All rights reserved.
+// Transit is under an open-source, reproducible-research license (see LICENSE).
+
+#include <pthread.h>
+
+#if __STDC__ || defined(__cplusplus)
+#define P_(s) s
+#else
+#define P_(s) ()
+#endif
+
+/* Double-buffered stream of line transitions from the TLI file (see
+   src/linestream.c):                                                       */
+struct linestream{
+  struct transit *tr;
+  FILE *fp;                      /* TLI file                                */
+  PREC_NREC chunksize;           /* Number of lines per chunk               */
+  struct line_transition buf[2]; /* Chunk buffers                           */
+  PREC_NREC size[2];             /* Capacity of each buffer (lines), which
+                                    grows for chains longer than a chunk   */
+  PREC_NREC nbuf[2];             /* Number of lines in each buffer          */
+  int filled[2];                 /* Buffer holds a chunk not yet released   */
+  int held;                      /* Buffer handed out to the caller, or -1  */
+  int next;                      /* Buffer of the next chunk to hand out    */
+  int rng;                       /* Isotope range of the reading position   */
+  PREC_NREC pos;                 /* Reading position within the range       */
+  pthread_t reader;              /* Reader thread                           */
+  int running;                   /* Reader thread started for this pass     */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/* src/linestream.c */
+extern void linestreamopen P_((struct transit *tr, struct linestream *ls,
+                               long extra));
+extern void linestreamstart P_((struct linestream *ls));
+extern struct line_transition *linestreamnext P_((struct linestream *ls,
+                                                  PREC_NREC *n));
+extern void linestreamclose P_((struct linestream *ls));
+
+#undef P_
@@ -10,11 +10,20 @@
 /* src/opacity.c */
 extern int opacity P_((struct transit *tr));
 extern int calcprofiles P_((struct transit *tr));
+extern void makeprofile P_((struct transit *tr, int idop, int ilor));
+extern void saveprofiles P_((struct transit *tr, long nmin));
+extern void opastrides P_((struct opacity *op, long *stride));
 extern int calcopacity P_((struct transit *tr, FILE *fp));
+extern int writeopacity P_((struct transit *tr, FILE *fp));
+extern long beginopacity P_((struct transit *tr, FILE *fp));
+extern void putopacity P_((struct transit *tr, long r, long t,
+                           PREC_RES **block));
+extern int endopacity P_((struct transit *tr));
+extern int mapopacity P_((struct transit *tr, FILE *fp));
+extern int extendopacity P_((struct transit *tr));
+extern int mergeopacity P_((char **in, int nin, char *out));
 extern int readopacity P_((struct transit *tr, FILE *fp));
 extern int shareopacity P_((struct transit *tr, FILE *fp));
-extern int attachopacity P_((struct transit *tr));
-extern int mountopacity P_((struct transit *tr));
 extern int freemem_opacity P_((struct opacity *op, long *pi));
 
 #undef P_
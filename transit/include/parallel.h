@@ -0,0 +1,18 @@
+// Copyright (C) 2015-2016 University of Central Florida. All rights reserved.
+// Transit is under an open-source, reproducible-research license (see LICENSE).
+
+#if __STDC__ || defined(__cplusplus)
+#define P_(s) s
+#else
+#define P_(s) ()
+#endif
+
+/* Worker function: process work item 'item' with thread index 'tid'       */
+typedef void (*parallelfcn)(void *arg, long item, int tid);
+
+/* src/parallel.c */
+extern int parallelthreads P_((int nthreads));
+extern int parallelrun P_((int nthreads, long nitems, parallelfcn fcn,
+                           void *arg));
+
+#undef P_
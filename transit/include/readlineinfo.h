@@ -15,6 +15,16 @@ extern int readtli_bin P_((FILE *fp, struct transit *tr, struct lineinfo *li));
 extern int setimol P_((struct transit *tr));
 extern int checkrange P_((struct transit *tr, struct lineinfo *li));
 extern int readinfo_tli P_((struct transit *tr, struct lineinfo *li));
+extern PREC_NREC packlines P_((struct line_transition *lt, PREC_NREC n0,
+                               PREC_LNDATA *wl, short *isoid,
+                               PREC_LNDATA *elow, PREC_LNDATA *gf,
+                               PREC_NREC n));
+extern PREC_NREC readlinecols P_((FILE *fp, struct lineinfo *li,
+                                  struct line_transition *lt, PREC_NREC n0,
+                                  PREC_NREC first, PREC_NREC n));
+extern PREC_NREC readlinerecs P_((FILE *fp, struct lineinfo *li,
+                                  struct line_transition *lt, PREC_NREC n0,
+                                  PREC_NREC first, PREC_NREC n));
 extern int readdatarng P_((struct transit *tr, struct lineinfo *li));
 extern int readlineinfo P_((struct transit *tr));
 extern int freemem_isotopes P_((struct isotopes *iso, long *pi));
@@ -92,11 +92,23 @@ struct atm_isoprop{    /* Proportional-abundance isotopic parameters: */
 };
 
 
+/* Packed line transition, as stored in memory and in TLI v7 files.  The
+   wavenumber is stored as an offset from the first line of its block of
+   LT_BLOCK records:                                                        */
+struct linerecord{
+  float dwn;             /* Wavenumber offset from the block base (cm-1)    */
+  float elow;            /* Lower-state energy (TLI units)                  */
+  float lgf;             /* log10(gf)                                       */
+  unsigned short isoid;  /* Isotope index in li->isov (0 to niso-1)         */
+  unsigned short pad;    /* Padding to 16 bytes                             */
+};
+
+/* Wavenumber of record ln of a line_transition:                            */
+#define ltwn(lt, ln) ((lt)->wnbase[(ln)>>LT_BLOCKBITS] + (lt)->rec[ln].dwn)
+
 struct line_transition{  /* Line transition parameters:                     */
-  PREC_LNDATA *wl;       /* Wavelength                                      */
-  PREC_LNDATA *elow;     /* Lower-state energy                              */
-  PREC_LNDATA *gf;       /* gf value                                        */
-  short *isoid;          /* Isotope ID (Assumed to be in range)             */
+  struct linerecord *rec; /* Line records, each isotope starts a block      */
+  double *wnbase;        /* Wavenumber of the first record per block (cm-1) */
   double wfct;           /* wl units factor to cgs                          */
   double efct;           /* elow units factor to cgs                        */
 };
@@ -115,7 +127,15 @@ struct lineinfo{             /* Line information parameters:                */
   prop_isov *isov;           /* Variable isotope information (w/temp) [iso] */
   prop_dbnoext *db;          /* Temperature info from databases [DB]        */
   double tmin, tmax;         /* Min and max allowed TLI temperatures        */
-  PREC_NREC n_l;             /* Number of lines in database                 */
+  PREC_NREC n_l;             /* Number of line records (including padding)  */
+  /* Lines left in the TLI file to be streamed (see linestream.c):          */
+  int nrng;                  /* Number of ranges of lines (one per isotope) */
+  PREC_NREC *rngfirst,       /* TLI index of the first line of each range   */
+            *rngn;           /* Number of lines of each range               */
+  long wl_loc, iso_loc,      /* File position of the wavelength, isotope    */
+       el_loc, gf_loc;       /* ID, lower energy, and gf columns (TLI v6)   */
+  long blk_loc, rec_loc;     /* File position of the block wavenumbers and
+                                of the records (TLI v7)                     */
 };
 
 
@@ -143,34 +163,139 @@ struct extinction{
 };
 
 
+/* Coordinator of an opacity grid shared among processes (--shareOpacity),
+   in a named shared-memory segment (see shareopacity()):                   */
 struct opacityhint{
-  int master_PID;       /* Process that will write the shared memory        */
-  int num_attached;     /* Count of processes attached to the main segment  */
-  volatile long status; /* Flags concerning the state of the shared memory  */
-  long Nwave, Ntemp, Nlayer, Nmol; /* Info necessary for sizing shared mem  */
+  pthread_mutex_t lock; /* Robust, process-shared lock, held by the master
+                           while it loads the grid                          */
+  int ready;            /* Set once the lock is initialized                 */
+  long status;          /* State of the grid segment (TSHM_*)               */
+  long Nwave, Ntemp, Nlayer, Nmol; /* Grid dimensions                       */
+  size_t size;          /* Size of the grid segment                         */
+  int nproc;            /* Number of attached processes                     */
+  pid_t pid[TSHM_MAXPROC]; /* Attached processes                            */
 };
 
 
+/* Header of an opacity file (see writeopacity()).  It is followed by the
+   completion map (char [Nlayer*Ntemp], set once the (layer, temperature)
+   block is written, see putopacity()), by the FNV-1a hash of each block
+   (unsigned long [Nlayer*Ntemp], see opablocksum()), by the molecule IDs
+   (int [Nmol]) and the temperature, pressure, and wavenumber arrays
+   (PREC_RES [Ntemp], [Nlayer], [Nwave]), each starting on an 8-byte
+   boundary, in the TOPA_LOG16 type by the scale of each (layer,
+   temperature, molecule) row (double [Nlayer*Ntemp*Nmol]), and, at the
+   page-aligned byte 'data', by the opacity grid, which is mapped read only
+   by mapopacity():                                                         */
+struct opacityhead{
+  char magic[8];        /* "TROPAC"                                         */
+  int version;          /* opacityversion                                   */
+  int headsize;         /* sizeof(struct opacityhead)                       */
+  int dtype;            /* Grid sample type (TOPA_F64, F32, or LOG16)       */
+  int order;            /* Grid axis order (TOPA_LTMW or TOPA_LWTM)         */
+  long Nmol, Ntemp, Nlayer, Nwave; /* Grid dimensions                       */
+  long done;            /* File offset of the completion map                */
+  long sums;            /* File offset of the block checksums               */
+  long data;            /* File offset of the grid                          */
+  long size;            /* File size                                        */
+  int shard, nshard;    /* Shard of the grid and number of shards (see
+                           --opashard), 0 and 1 for a whole grid           */
+  int nmerged;          /* Number of shards merged into the grid (see
+                           mergeopacity()), 0 if it was computed whole     */
+  long core, ncore;     /* First wavenumber and number of wavenumbers of
+                           the shard's own range, the rest pads it         */
+  unsigned long inputs; /* Hash of the inputs of the calculation beyond the
+                           axes (see opainputs())                           */
+  unsigned long checksum; /* FNV-1a hash of the header (up to this field)
+                             and of the axis arrays                         */
+  long created;         /* Creation time (seconds since the Epoch)          */
+  char host[64];        /* Host that computed or merged the grid           */
+};
+
+
+/* A Voigt profile is symmetric, the arena stores for each width cell only
+   the samples from the center outwards, h[0..ps] (ps=profsize), followed
+   by the same samples split by oversampling phase (see getphaseprofile()).
+   Half profile and phase-split half profile of cell (i, j) of op:          */
+#define profhalf(op, i, j)  ((op)->profarena + \
+                             (op)->profoff[(long)(i)*(op)->nLor + (j)])
+#define profphase(op, i, j) (profhalf(op, i, j) + (op)->profsize[i][j] + 1)
+/* Sample k (0 to 2*ps) of the full profile of half profile h:              */
+#define profsample(h, ps, k) ((h)[(k) < (ps) ? (ps)-(k) : (k)-(ps)])
+
 struct opacity{
-  PREC_RES ****o;         /* Opacity grid [temp][iso][rad][wav]             */
-  PREC_VOIGT ***profile;  /* Voigt profiles [nDop][nLor][2*profsize+1]      */
+  PREC_RES ****o;         /* Opacity grid [layer][temp][mol][wave], only in
+                             the TOPA_LTMW order, else NULL                 */
+  void *grid;             /* Opacity grid, or the run's window of it        */
+  long stride[4];         /* Strides of grid's layer, temperature, molecule,
+                             and wavenumber axes (see opastrides())         */
+  int order;              /* Axis order of grid (TOPA_* flags)              */
+  int dtype;              /* Sample type of grid (TOPA_* flags)             */
+  double *qscale,         /* TOPA_LOG16 scale of each grid row              */
+         *qlut;           /* TOPA_LOG16 decoding table [65536]              */
+  PREC_VOIGT *profarena;  /* Voigt profiles of all the width cells, in one
+                             cache-line aligned block (see calcprofiles())  */
+  long *profoff;          /* Offset of each cell's profile in profarena,
+                             aliased cells share it [nDop*nLor]             */
+  long profarenasize;     /* Number of PREC_VOIGT samples in profarena      */
+  int *profstate;         /* State of each cell's profile, which is
+                             computed on first use (TPROF_*) [nDop*nLor]    */
+  long nprofbuilt;        /* Number of profiles computed in this run        */
   PREC_NREC **profsize;   /* Half-size of Voigt profiles [nDop][nLor]       */
+  double ***pspec;        /* Profile spectra for the FFT convolution of the
+                             TLE_HIST engine, made on demand [nDop][nLor]   */
+  double tmac, tfft;      /* Measured cost of a direct-convolution multiply-
+                             add, and of an FFT convolution per n*log2(n)   */
   double *aDop,           /* Sample of Doppler widths [nDop]                */
          *aLor;           /* Sample of Lorentz widths [nLor]                */
+  double proftol;         /* Width-grid tolerance: if positive, the widths
+                             are chosen by widthgrid() and the lines blend
+                             their bracketing profiles, else they take the
+                             nearest profile of log-spaced widths           */
   PREC_RES *temp,         /* Opacity-grid temperature array                 */
            *press,        /* Opacity-grid pressure array                    */
            *wns;          /* Opacity-grid wavenumber array                  */
   PREC_ATM **ziso;        /* Partition function per isotope [niso][Ntemp]   */
   int *molID;             /* Opacity-grid molecule ID array                 */
+  int *isoslot;           /* Index in molID of each isotope's molecule      */
+  struct linecull *cull;  /* Lines that pass the extinction threshold per
+                             grid temperature (see cullmolext())            */
+  void *profmap;          /* Mapped Voigt-profile cache, or NULL            */
+  size_t profmapsize;     /* Size of the mapped profile cache               */
+  struct opacity *base;   /* Grid being extended, whose blocks are reused
+                             (see extendopacity()), or NULL                 */
+  int shard, nshard,      /* Shard of the grid and number of shards         */
+      nmerged;            /* Number of shards merged into the grid (see
+                             struct opacityhead)                            */
+  long core, ncore;       /* The shard's own wavenumbers: first, number     */
+  unsigned long inputs;   /* Hash of the inputs of the grid beyond its axes
+                             (see struct opacityhead)                       */
   long Nwave, Ntemp, Nlayer, Nmol, /* Number of elements in opacity grid    */
       nDop, nLor;         /* Number of Doppler and Lorentz-width samples    */
-  int hintID;             /* Shared memory ID of the hint segment           */
-  struct opacityhint *hint; /* Information about the shared memory          */
-  int mainID;             /* Shared memory ID of the main segment           */
-  void *mainaddr;         /* Shared memory address of the main segment      */
+  void *opamap;           /* Mapped opacity file, or NULL                   */
+  size_t opamapsize;      /* Size of the mapped opacity file                */
+  struct opacityhint *hint; /* Shared-memory coordinator, or NULL          */
+  char shmname[TSHM_NAMELEN]; /* Name of the coordinator segment            */
+  void *mainaddr;         /* Attached shared opacity grid segment, or NULL  */
+  size_t mainsize;        /* Size of the shared opacity grid segment        */
 };
 
 
+/* Sample k of the opacity grid of op (see op->stride) decoded to double,
+   where row is the sample's (layer, temperature, molecule) index,
+   (r*Ntemp + t)*Nmol + m:                                                  */
+static __inline__ double
+opasample(struct opacity *op,
+          long k,
+          long row){
+  if (op->dtype == TOPA_F32)
+    return ((float *)op->grid)[k];
+  if (op->dtype == TOPA_LOG16)
+    return op->qscale[row] * op->qlut[((unsigned short *)op->grid)[k]];
+  return ((PREC_RES *)op->grid)[k];
+}
+
+
 struct idxref{
   PREC_RES *n;   /* Index of refraction [rad]                               */
 };
@@ -317,7 +442,8 @@ struct transithint{
        *f_toomuch,      /* Output toomuch filename                          */
        *f_outsample,    /* Output sample filename                           */
        *f_outintens,    /* Output intensity filename                        */
-       *f_molfile;      /* Known molecular info filename                    */
+       *f_molfile,      /* Known molecular info filename                    */
+       *f_profcache;    /* Voigt-profile cache filename                     */
   PREC_NREC ot;         /* Radius index at which to print output from tau   */
   prop_samp rads, ips,  /* Sampling properties of radius, impact parameter, */
        wavs, wns, temp; /*   wavelength, wavenumber, and temperature        */
@@ -331,11 +457,23 @@ struct transithint{
                            accepted it goes to tr.ds.op.vf                  */
   int nDop, nLor;       /* Number of broadening width samples               */
   float dmin, dmax, lmin, lmax; /* Broadening-width samples boundaries      */
+  double proftol;       /* Width-grid tolerance, 0 for a fixed grid         */
   int verbnoise;        /* Noisiest verbose level in a non debugging run    */ 
   _Bool mass;           /* Whether the abundances read by getatm are by
                            mass or number                                   */
   _Bool opabreak;       /* Break after opacity calculation flag             */
   _Bool opashare;       /* Attempt to place opacity grid in shared memory.  */
+  int opaorder;         /* Axis order of a new opacity file (TOPA_*)        */
+  int opadtype;         /* Sample type of a new opacity file (TOPA_*)       */
+  _Bool opaextend;      /* Extend an existing opacity file with the run's
+                           temperatures and molecules                       */
+  int opashard,         /* Shard of the opacity grid to compute, and       */
+      opanshard;        /* number of shards (see --opashard)                */
+  char *opamol;         /* Molecules of the opacity grid (comma separated),
+                           NULL for all                                     */
+  int nthreads;         /* Number of threads                                */
+  int lineengine;       /* Line-by-line extinction engine (TLE_* flags)     */
+  double linebuffer;    /* Line-buffer size (MB), 0 to load all lines       */
   long fl;              /* flags                                            */
   _Bool userefraction;  /* Whether to use variable refraction               */
   _Bool savefiles;      /* Whether to save files                            */
@@ -370,7 +508,10 @@ struct transit{
        *f_toomuch,   /* Output toomuch filename                             */
        *f_outsample, /* Output sample filename                              */
        *f_outintens, /* Output intensity filename                           */
-       *f_molfile;   /* Known molecular info filename                       */
+       *f_molfile,   /* Known molecular info filename                       */
+       *f_profcache; /* Voigt-profile cache filename, NULL for no cache     */
+  char *profcachedir; /* Directory of the default profile cache file (named
+                         after the profile grid), NULL if it is given       */
   PREC_NREC ot;      /* Radius index at which to print output from tau      */
 
   FILE *fp_atm, *fp_opa, *fp_out, *fp_line; /* Pointers to files            */
@@ -384,6 +525,19 @@ struct transit{
   prop_atm atm;      /* Sampled atmospheric data                            */
   _Bool opabreak;    /* Break after opacity calculation                     */
   _Bool opashare;    /* Attempt to place opacity grid in shared memory.     */
+  int opaorder;      /* Axis order of a new opacity file (TOPA_* flags)     */
+  int opadtype;      /* Sample type of a new opacity file (TOPA_* flags)    */
+  _Bool opaextend;   /* Extend an existing opacity file with the run's
+                        temperatures and molecules                          */
+  int opashard,      /* Shard of the opacity grid to compute, and          */
+      opanshard;     /* number of shards, 1 for the whole grid             */
+  long opacore[2];   /* First wavenumber (in wns) and number of wavenumbers
+                        of the shard's own range (see makewnsample())      */
+  char *opamol;      /* Molecules of the opacity grid (comma separated),
+                        NULL for all                                        */
+  int nthreads;      /* Number of threads                                   */
+  int lineengine;    /* Line-by-line extinction engine (TLE_* flags)        */
+  long linebuffer;   /* Line-buffer size (bytes), 0 to load all lines       */
   int ndivs,         /* Number of exact divisors of the oversampling factor */
      *odivs;         /* Exact divisors of the oversampling factor           */
   int voigtfine;     /* Number of fine-bins of the Voigt function           */
@@ -10,8 +10,11 @@
 #include <stdarg.h>
 #include <math.h>
 #include <errno.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -27,7 +30,16 @@
 #include <stdio.h>
 #include <alloca.h>
 
-#define compattliversion 6
+#define compattliversion 7  /* TLI version written by pylineread          */
+#define mintliversion    6  /* Oldest TLI version that can be read          */
+#define profcacheversion 5  /* Voigt-profile cache file version             */
+#define opacityversion   6  /* Opacity file version (1: no header)          */
+
+/* Number of line records per block of struct line_transition (the block
+   wavenumbers keep the float offsets of the records accurate):             */
+#define LT_BLOCKBITS 6
+#define LT_BLOCK     (1<<LT_BLOCKBITS)
+#define LT_MINLGF    (-99.0)  /* log10(gf) of padding records and gf=0   */
 
 #include <flags_tr.h>
 #include <constants_tr.h>
@@ -159,6 +171,10 @@ extern void freemem_transit P_((struct transit *tr));
 #include <makesample.h>
 #include <extinction.h>
 #include <opacity.h>
+#include <parallel.h>
+#include <vecops.h>
+#include <fft.h>
+#include <linestream.h>
 #include <idxrefraction.h>
 #include <tau.h>
 #include <argum.h>
@@ -0,0 +1,23 @@
+// Copyright (C) 2015-2016 University of Central Florida. All rights reserved.
+// Transit is under an open-source, reproducible-research license (see LICENSE).
+
+#if __STDC__ || defined(__cplusplus)
+#define P_(s) s
+#else
+#define P_(s) ()
+#endif
+
+/* Instruction sets of the vector kernels:                                  */
+#define VEC_SCALAR 0
+#define VEC_AVX2   1
+#define VEC_AVX512 2
+
+/* src/vecops.c */
+extern int  veclevel P_((void));
+extern void vecsetlevel P_((int level));
+extern void vecaxpy P_((double *y, const float *x, double a, long n));
+extern void vecaxpyrev P_((double *y, const float *x, double a, long n));
+extern void vecaxpy2 P_((double *y, const double *x, double a,
+                          const double *z, double b, long n));
+
+#undef P_
@@ -12,6 +12,7 @@ pu_objs = [op.realpath(f) for f in glob.glob("../pu/src/*.o")
 transit_module = Extension('_transit_module',
       sources = ['python/transit_wrap.c'],
       include_dirs=[numpy.get_include()],
+      extra_link_args=['-pthread'],
       extra_objects = transit_objs + pu_objs)
 
 setup (name="transit_module",
@@ -88,6 +88,8 @@ processparameters(int argc,            /* Number of command-line args  */
     CLA_SOLUTION_TYPE,
     CLA_INTENS_GRID,
     CLA_OPACITYFILE,
+    CLA_OPAORDER,
+    CLA_OPADTYPE,
     CLA_TEMPLOW,
     CLA_TEMPHIGH,
     CLA_TEMPDELT,
@@ -97,6 +99,9 @@ processparameters(int argc,            /* Number of command-line args  */
     CLA_GSURF,
     CLA_OPABREAK,
     CLA_OPASHARE,
+    CLA_OPAEXTEND,
+    CLA_OPASHARD,
+    CLA_OPAMOL,
     CLA_NDOP,
     CLA_NLOR,
     CLA_DMIN,
@@ -106,6 +111,11 @@ processparameters(int argc,            /* Number of command-line args  */
     CLA_QSCALE,
     CLA_QMOL,
     CLA_SAVEFILES,
+    CLA_NTHREADS,
+    CLA_LINEENGINE,
+    CLA_LINEBUFFER,
+    CLA_PROFCACHE,
+    CLA_PROFTOL,
   };
 
   /* Generate the command-line option parser: */
@@ -127,6 +137,9 @@ processparameters(int argc,            /* Number of command-line args  */
     {"config_file",   'c', ADDPARAMFILE, NULL, "file",
      "Read command-line arguments from <file>."
      " '" DOTCFGFILENM PREPEXTRACFGFILES"'."},
+    {"nthreads", CLA_NTHREADS, required_argument, "1", "integer",
+     "Number of threads used to compute the opacity grid and the "
+     "line-by-line extinction."},
 
     /* Input and output options:              */
     {NULL,          0,             HELPTITLE,         NULL, NULL,
@@ -232,6 +245,16 @@ processparameters(int argc,            /* Number of command-line args  */
     {"nwidth",  'a',      required_argument, "20",   "number",
      "Number of the max-widths (the greater of Voigt or Doppler widths) "
      "that needs to be contained in a calculated profile."},
+    {"proftol", CLA_PROFTOL, required_argument, "0",  "tolerance",
+     "If positive, choose the width samples so that blending the two "
+     "bracketing profiles of a line is accurate to this fraction of the "
+     "profile peak (ndop and nlor are then ignored).  If 0, use ndop and "
+     "nlor log-spaced samples and the nearest profile."},
+    {"profcache", CLA_PROFCACHE, required_argument, NULL, "filename",
+     "Voigt-profile cache file, reused while the profile parameters do "
+     "not change.  'none' disables the cache.  By default, use "
+     "'transit_voigt.<uid>.<hash>.cache' in $TMPDIR (or /tmp), named "
+     "after the user and the profile parameters."},
 
     /* Extinction calculation options:                                      */
     {NULL,         0,               HELPTITLE,         NULL,    NULL,
@@ -239,6 +262,13 @@ processparameters(int argc,            /* Number of command-line args  */
     {"ethreshold", CLA_ETHRESH,   required_argument, "1e-8",    "ethreshold",
      "Minimum extinction-coefficient ratio (w.r.t. maximum in a layer) to "
      "consider in the calculation."},
+    {"lineengine", CLA_LINEENGINE, required_argument, "line",  "engine",
+     "Line-by-line extinction engine: 'line' adds the profile of each line, "
+     "'hist' bins the lines into a histogram per profile shape and "
+     "convolves it with the profile (faster for dense line lists)."},
+    {"linebuffer", CLA_LINEBUFFER, required_argument, "0",     "megabytes",
+     "If positive, do not load the line transitions into memory, but "
+     "stream them from the TLI file through buffers of this total size."},
     {"cloud",      CLA_CLOUD,      required_argument, NULL,
      "cloudtype,cloudext,cloudtop,cloudbot",
      "Gray-opacity layer with extinction linearly increasing from 0 at "
@@ -279,6 +309,26 @@ processparameters(int argc,            /* Number of command-line args  */
      "If set, End execution after the opacity-grid calculation."},
     {"shareOpacity",      CLA_OPASHARE,  no_argument, NULL, NULL,
      "If set, attempt to place the opacity grid into shared memory."},
+    {"opaextend",        CLA_OPAEXTEND, no_argument, NULL, NULL,
+     "If set, extend an existing opacity file with the temperatures and "
+     "molecules of the run that it lacks, computing only the missing "
+     "blocks."},
+    {"opashard",  CLA_OPASHARD,   required_argument, NULL,    "k/n",
+     "Compute only shard k (0 to n-1) of the opacity grid: the k-th of n "
+     "equal wavenumber ranges, padded by the reach of the line profiles.  "
+     "Merge the shards with opamerge."},
+    {"opamol",    CLA_OPAMOL,     required_argument, NULL,    "mol1,mol2,...",
+     "Compute the opacity grid only for these molecules (merge the files "
+     "of the other molecules with opamerge)."},
+    {"opaorder",  CLA_OPAORDER,   required_argument, "ltmw",  "order",
+     "Axis order of a new opacity file: 'ltmw' ([layer][temp][mol][wave]) "
+     "or 'lwtm' ([layer][wave][temp][mol], which the interpolation of a "
+     "layer reads sequentially)."},
+    {"opatype",   CLA_OPADTYPE,   required_argument, "f64",   "type",
+     "Sample type of a new opacity file: 'f64' (double), 'f32' (float, "
+     "relative error < 6e-8), or 'log16' (16-bit logarithm, relative "
+     "error < 5.3e-4, values below 1e-30 times the largest of their "
+     "layer, temperature, and molecule are set to zero)."},
 
     /* Resulting ray options:                 */
     {NULL,        0,            HELPTITLE,         NULL, NULL,
@@ -416,6 +466,20 @@ processparameters(int argc,            /* Number of command-line args  */
     case CLA_ETHRESH:    /* Minimum extiction-coefficient threshold */
       hints->ethresh = atof(optarg);
       break;
+    case CLA_LINEBUFFER: /* Line-buffer size                        */
+      hints->linebuffer = atof(optarg);
+      break;
+    case CLA_LINEENGINE: /* Line-by-line extinction engine          */
+      if (strcmp(optarg, "line") == 0)
+        hints->lineengine = TLE_LINE;
+      else if (strcmp(optarg, "hist") == 0)
+        hints->lineengine = TLE_HIST;
+      else{
+        tr_output(TOUT_ERROR, "Invalid line engine '%s', it must be "
+                              "'line' or 'hist'.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
     case 's':            /* Ray-solution type name     */
       hints->solname = (char *)realloc(hints->solname, strlen(optarg)+1);
       strcpy(hints->solname, optarg);
@@ -428,6 +492,11 @@ processparameters(int argc,            /* Number of command-line args  */
       hints->f_line = (char *)realloc(hints->f_line, strlen(optarg)+1);
       strcpy(hints->f_line, optarg);
       break;
+    case CLA_PROFCACHE:  /* Voigt-profile cache file name                   */
+      hints->f_profcache = (char *)realloc(hints->f_profcache,
+                                           strlen(optarg)+1);
+      strcpy(hints->f_profcache, optarg);
+      break;
     case CLA_MOLFILE:    /* Known molecular information                     */
       hints->f_molfile = (char *)realloc(hints->f_molfile, strlen(optarg)+1);
       strcpy(hints->f_molfile, optarg);
@@ -494,6 +563,47 @@ processparameters(int argc,            /* Number of command-line args  */
     case CLA_OPASHARE: /* Bool: Place opacity grid in shared memory         */
       hints->opashare = 1;
       break;
+    case CLA_OPAEXTEND: /* Bool: Extend an existing opacity file            */
+      hints->opaextend = 1;
+      break;
+    case CLA_OPASHARD: /* Shard of the opacity grid to compute         */
+      if (sscanf(optarg, "%d/%d", &hints->opashard, &hints->opanshard) != 2 ||
+          hints->opashard < 0 || hints->opashard >= hints->opanshard){
+        tr_output(TOUT_ERROR, "Invalid opacity shard '%s', it must be 'k/n' "
+                              "with 0 <= k < n.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case CLA_OPAMOL:   /* Molecules of the opacity grid               */
+      hints->opamol = xstrdup(optarg);
+      break;
+    case CLA_OPADTYPE: /* Sample type of a new opacity file           */
+      if (strcmp(optarg, "f64") == 0)
+        hints->opadtype = TOPA_F64;
+      else if (strcmp(optarg, "f32") == 0)
+        hints->opadtype = TOPA_F32;
+      else if (strcmp(optarg, "log16") == 0)
+        hints->opadtype = TOPA_LOG16;
+      else{
+        tr_output(TOUT_ERROR, "Invalid opacity sample type '%s', it must be "
+                              "'f64', 'f32', or 'log16'.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case CLA_OPAORDER: /* Axis order of a new opacity file            */
+      if (strcmp(optarg, "ltmw") == 0)
+        hints->opaorder = TOPA_LTMW;
+      else if (strcmp(optarg, "lwtm") == 0)
+        hints->opaorder = TOPA_LWTM;
+      else{
+        tr_output(TOUT_ERROR, "Invalid opacity axis order '%s', it must be "
+                              "'ltmw' or 'lwtm'.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case CLA_NTHREADS: /* Number of threads                                 */
+      hints->nthreads = atoi(optarg);
+      break;
 
     /* Radius parameters:                                                   */
     case CLA_RADLOW:  /* Lower limit                                        */
@@ -570,6 +680,9 @@ processparameters(int argc,            /* Number of command-line args  */
     case CLA_LMAX:
       hints->lmax = atof(optarg);
       break;
+    case CLA_PROFTOL:
+      hints->proftol = atof(optarg);
+      break;
 
     case 'q':  /* Quiet run:                                                */
       verblevel = 1;
@@ -774,6 +887,7 @@ int
 acceptgenhints(struct transit *tr){
   /* Pointer to transithint:                       */
   struct transithint *th = tr->ds.th;
+  char *tmpdir;
 
   /* Accept output spectrum file:                  */
   if(th->f_outspec)
@@ -790,6 +904,19 @@ acceptgenhints(struct transit *tr){
   /* FINDME: Should check if the file exists:                               */
   tr->f_molfile   = th->f_molfile;
 
+  /* Voigt-profile cache file (by default in the temporary directory,
+     named once the profile grid is known, see calcprofiles()):             */
+  tr->f_profcache  = th->f_profcache;
+  tr->profcachedir = NULL;
+  if (th->f_profcache == NULL){
+    tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL || *tmpdir == '\0')
+      tmpdir = "/tmp";
+    tr->profcachedir = tmpdir;
+  }
+  else if (strcmp(th->f_profcache, "none") == 0)
+    tr->f_profcache = NULL;
+
   /* Initialize solution type, accept hinted solution if it's in list:      */
   if(acceptsoltype(&tr->sol, th->solname) != 0){
     tr_output(TOUT_ERROR, "Solution kind '%s' is invalid.\n"
@@ -837,6 +964,44 @@ acceptgenhints(struct transit *tr){
   /* Pass flag to place opacity grid in shared memory:                      */
   tr->opashare = th->opashare;
 
+  /* Axis order and sample type of a new opacity file:                     */
+  tr->opaorder = th->opaorder;
+  tr->opadtype = th->opadtype;
+
+  /* Pass flag to extend an existing opacity file:                          */
+  tr->opaextend = th->opaextend;
+
+  /* Shard and molecules of a new opacity file:                             */
+  tr->opashard  = th->opashard;
+  tr->opanshard = th->opanshard > 1 ? th->opanshard : 1;
+  tr->opamol    = th->opamol;
+
+  /* Number of threads:                                                     */
+  if (th->nthreads < 1){
+    tr_output(TOUT_ERROR, "Number of threads (%d) has to be positive.\n",
+      th->nthreads);
+    return -1;
+  }
+  tr->nthreads = th->nthreads;
+
+  /* Line-by-line extinction engine:                                        */
+  tr->lineengine = th->lineengine;
+
+  /* Width-grid tolerance:                                                  */
+  if (th->proftol < 0 || th->proftol >= 1){
+    tr_output(TOUT_ERROR, "Voigt-profile tolerance (%g) has to be in the "
+      "[0, 1) range.\n", th->proftol);
+    return -1;
+  }
+
+  /* Line-buffer size:                                                      */
+  if (th->linebuffer < 0){
+    tr_output(TOUT_ERROR, "Line-buffer size (%g MB) cannot be negative.\n",
+      th->linebuffer);
+    return -1;
+  }
+  tr->linebuffer = th->linebuffer * 1024 * 1024;
+
   /* Set interpolation function flag:                                       */
   switch(tr->fl & TRU_SAMPBITS){
   case TRU_SAMPLIN:
@@ -1039,6 +1204,8 @@ freemem_hints(struct transithint *h){
   free(h->f_toomuch);
   free(h->f_outsample);
   free(h->f_molfile);
+  free(h->f_profcache);
+  free(h->opamol);
 
   /* Free other strings:                                                    */
   free(h->solname);
@@ -3,20 +3,17 @@
 
 #include <transit.h>
 
-/* FUNCTION: Wrapper to calculate a Voigt profile
-   Return: 1/2 of the number of points in the profile                       */
-int
-getprofile(PREC_VOIGT **pr,  /* Pointer to 1D profile                       */
-           PREC_RES dwn,     /* wavenumber spacing                          */
-           PREC_VOIGT dop,   /* Doppler width                               */
-           PREC_VOIGT lor,   /* Lorentz width                               */
-           float ta,         /* times of alpha                              */
-           int nwave){       /* Maximum half-size of profile                */
-
+/* FUNCTION: Half-size of the Voigt profile of the given widths, i.e., the
+   number of samples on each side of the center.                            */
+long
+profilesize(PREC_RES dwn,     /* wavenumber spacing                         */
+            PREC_VOIGT dop,   /* Doppler width                              */
+            PREC_VOIGT lor,   /* Lorentz width                              */
+            float ta,         /* times of alpha                             */
+            int nwave){       /* Maximum half-size of profile               */
   PREC_VOIGTP bigalpha, /* Largest width (Doppler or Lorentz)               */
               wvgt;     /* Calculated half-width of profile                 */
-  int nvgt,             /* Number of points in profile                      */
-      j;                /* Auxiliary index                                  */
+  long nvgt;            /* Number of points in profile                      */
 
   /* Get the largest width (alpha Doppler or Lorentz):                      */
   bigalpha = dop;
@@ -37,23 +34,93 @@ getprofile(PREC_VOIGT **pr,  /* Pointer to 1D profile                       */
   /* Basic check that 'lor' or 'dop' are within sense:                      */
   if(nvgt < 0) {
     tr_output(TOUT_ERROR,
-      "Number of Voigt bins (%d) are not positive. Doppler width: "
+      "Number of Voigt bins (%ld) are not positive. Doppler width: "
       "%g, Lorentz width: %g.\n", nvgt, dop, lor);
     exit(EXIT_FAILURE);
   }
+  return nvgt/2;
+}
+
+
+/* FUNCTION: Wrapper to calculate a Voigt profile.  Store in pr the
+   profilesize()+1 samples from the center outwards, the mean of the two
+   sides of the profile computed by voigtn().
+   Return: 1/2 of the number of points in the profile                       */
+int
+getprofile(PREC_VOIGT *pr,   /* Half profile                                */
+           PREC_RES dwn,     /* wavenumber spacing                          */
+           PREC_VOIGT dop,   /* Doppler width                               */
+           PREC_VOIGT lor,   /* Lorentz width                               */
+           float ta,         /* times of alpha                              */
+           int nwave){       /* Maximum half-size of profile                */
+  PREC_VOIGT *full;     /* Full profile                                     */
+  long psize = profilesize(dwn, dop, lor, ta, nwave),
+       nvgt  = 2*psize + 1, /* Number of points in profile                  */
+       k;
+  int j;
 
-  /* Allocate profile array:                                                */
-  *pr = (PREC_VOIGT *)calloc(nvgt, sizeof(PREC_VOIGT));
+  full = (PREC_VOIGT *)calloc(nvgt, sizeof(PREC_VOIGT));
 
   /* Calculate voigt using a width that gives an integer number of 'dwn'
      spaced bins:                                                           */
-  if((j=voigtn(nvgt, dwn*(long)(nvgt/2), lor, dop, pr, -1,
+  if((j=voigtn(nvgt, dwn*psize, lor, dop, &full, -1,
                nvgt > _voigt_maxelements ? VOIGT_QUICK:0)) != 1) {
     tr_output(TOUT_ERROR, "voigtn2() returned error code %i.\n", j);
     exit(EXIT_FAILURE);
   }
 
-  return nvgt/2;
+  /* Where the profile is well resolved voigtn() averages each bin from
+     its lower edge, which shifts the profile by half a sample; the mean of
+     the two sides is centered:                                             */
+  for (k=0; k<=psize; k++)
+    pr[k] = 0.5*(full[psize+k] + full[psize-k]);
+  free(full);
+  return psize;
+}
+
+
+/* FUNCTION: Split a half profile by oversampling phase.  A line adds the
+   profile samples pr[d], pr[d+ofactor], pr[d+2*ofactor], ... (on either
+   side of the center) into consecutive output wavenumbers, where the
+   phase p = d%ofactor depends on the position of the line center.  Store
+   in pp the ofactor sub-profiles, one after the other, so that these
+   samples are contiguous (see profphasesub()).                             */
+void
+getphaseprofile(PREC_VOIGT *pp,  /* Phase-split half profile                */
+                PREC_VOIGT *pr,  /* Half profile                            */
+                long n,          /* Number of samples (half-size + 1)       */
+                int ofactor){    /* Oversampling factor                     */
+  long p, k, i=0;
+
+  for   (p=0; p<ofactor && p<n; p++)
+    for (k=p; k<n; k+=ofactor)
+      pp[i++] = pr[k];
+}
+
+
+/* FUNCTION: Sub-profile of phase p of a phase-split half profile pp of n
+   samples.  For n = q*ofactor + r, sub-profile p starts at p*q + min(p, r)
+   and has q+1 samples if p < r, else q samples.                           */
+static inline PREC_VOIGT *
+profphasesub(PREC_VOIGT *pp,
+             long n,
+             int ofactor,
+             long p){
+  return pp + p*(n/ofactor) + (p < n%ofactor ? p : n%ofactor);
+}
+
+
+/* FUNCTION: Make sure that the profile [idop][ilor] is computed before it
+   is read (see makeprofile()).  Most calls find it ready.                  */
+static inline void
+profready(struct transit *tr,
+          int idop,
+          int ilor){
+  struct opacity *op = tr->ds.op;
+
+  if (__atomic_load_n(op->profstate + (long)idop*op->nLor + ilor,
+                      __ATOMIC_ACQUIRE) != TPROF_READY)
+    makeprofile(tr, idop, ilor);
 }
 
 
@@ -275,43 +342,985 @@ restextinct(FILE *in,
 }
 
 
-/* FUNCTION: Compute the molecular extinction.
-   Store results in kiso.  If permol is true, calculate extinction per
-   molecule separately; else, collapse all extinction into kiso[0].         */
-int
-computemolext(struct transit *tr, /* transit struct                         */
-              PREC_RES **kiso,    /* Extinction coefficient array [mol][wn] */
-              PREC_ATM temp,      /* Temperature                            */
-              PREC_ATM *density,  /* Density per species                    */
-              double *Z,          /* Partition Function per isotope         */
-              int permol){        /* Calculate the extinction per molecule  */
+/* Constants of one computemolext() call, shared (read only) by the
+   routines that add line profiles into an extinction array:                */
+struct lineaccum{
+  struct transit *tr;      /* transit struct                                */
+  struct line_transition *lt; /* Line transitions                           */
+  PREC_NREC nlines;        /* Number of line transitions                    */
+  PREC_ATM temp;           /* Temperature                                   */
+  PREC_ATM *density;       /* Density per species                           */
+  int permol;              /* Calculate the extinction per molecule         */
+  PREC_VOIGTP *alphal,     /* Lorentz width per isotope                     */
+              *alphad;     /* Doppler width (divided by wavenumber)         */
+  int *idop, *ilor;        /* Width-sample indices per isotope              */
+  double *wlor;            /* Weight of Lorentz-width sample ilor+1 per
+                              isotope (blended profiles, see addlines())    */
+  int *doptab;             /* Doppler-width index at the start of each
+                              wavenumber block [niso*ndblk]                 */
+  long ndblk;              /* Number of wavenumber blocks                   */
+  int *islot;              /* Output species index per isotope, -1 to leave
+                              the isotope out (see calcopacity())           */
+  unsigned long long *pass; /* Lines that can pass the threshold (one bit
+                               per line, see cullmolext()), or NULL for all */
+  double *kmax;            /* Maximum line strength per species             */
+  double *lstr;            /* Line strength without isotope factors [nlines]*/
+  double *ifct;            /* Isotope factors of the line strength [niso]   */
+};
+
+/* Line counters of addlines():                                             */
+struct linecount{
+  PREC_NREC nadd,  /* Number of co-added lines                              */
+            nskip, /* Number of skipped lines                               */
+            neval; /* Number of evaluated profiles                          */
+};
+
+
+/* Lines per word of the line bitmaps of struct linecull:                  */
+#define PASS_WORD 64
+
+/* Output wavenumbers per block of the Doppler-index table (log2):         */
+#define DOP_BLOCKBITS 6
+
+/* Number of oversampled wavenumbers per histogram page:                  */
+#define HIST_PAGE 16384
+
+/* Line-strength histograms of the TLE_HIST engine.  There is one histogram
+   over the oversampled wavenumber array per (Doppler width, Lorentz width,
+   species) cell.  The histograms are split into pages that are allocated
+   when a line first falls in them:                                         */
+struct linehist{
+  long ncell;         /* Number of cells (nDop*nLor*Nmol)                   */
+  long npage;         /* Number of pages per histogram                      */
+  double ***h;        /* Histogram pages [ncell][npage][HIST_PAGE]          */
+  long *imin, *imax;  /* Range of binned oversampled indices per cell       */
+};
+
+
+/* FUNCTION: Initialize an empty set of line histograms.                    */
+static void
+histinit(struct linehist *hist,
+         struct lineaccum *la){
+  struct transit *tr = la->tr;
+  struct opacity *op = tr->ds.op;
+
+  hist->ncell = op->nDop * op->nLor * (la->permol ? op->Nmol : 1);
+  hist->npage = tr->owns.n/HIST_PAGE + 1;
+  hist->h    = (double ***)calloc(hist->ncell, sizeof(double **));
+  hist->imin = (long *)calloc(hist->ncell, sizeof(long));
+  hist->imax = (long *)calloc(hist->ncell, sizeof(long));
+}
+
+
+/* FUNCTION: Add a line strength into the histogram of a cell.              */
+static inline void
+histadd(struct linehist *hist,
+        long c,        /* Cell index                                        */
+        long iown,     /* Oversampled wavenumber index of the line          */
+        double k){     /* Line strength                                     */
+  long pg = iown/HIST_PAGE;
+
+  if (hist->h[c] == NULL){
+    hist->h[c] = (double **)calloc(hist->npage, sizeof(double *));
+    hist->imin[c] = hist->imax[c] = iown;
+  }
+  if (hist->h[c][pg] == NULL)
+    hist->h[c][pg] = (double *)calloc(HIST_PAGE, sizeof(double));
+  hist->h[c][pg][iown-pg*HIST_PAGE] += k;
+
+  if (iown < hist->imin[c])
+    hist->imin[c] = iown;
+  if (iown > hist->imax[c])
+    hist->imax[c] = iown;
+}
+
+
+/* FUNCTION: Length of the FFT that convolves a histogram with a profile
+   of half-size ps, at least twice the profile length.                     */
+static long
+histfftsize(long ps){
+  long nfft = 4;
+  while (nfft < 2*(2*ps+1))
+    nfft <<= 1;
+  return nfft;
+}
+
+
+/* FUNCTION: Transform of the profile [idop][ilor] zero-padded to nfft
+   samples, computed the first time a histogram needs it and kept until
+   freemem_opacity().  Aliased profiles (see calcprofiles()) share their
+   spectrum.  Threads racing to compute a spectrum publish only one.
+   Return: packed spectrum (see fftreal())                                  */
+static double *
+profspectrum(struct opacity *op,
+             int idop,
+             int ilor,
+             long nfft){
+  PREC_VOIGT *half;
+  double *spec;
+  long k, ps;
+
+  while (idop > 0 && profhalf(op, idop, ilor) == profhalf(op, idop-1, ilor))
+    idop--;
+  if (op->pspec[idop][ilor] != NULL)
+    return op->pspec[idop][ilor];
+
+  ps   = op->profsize[idop][ilor];
+  half = profhalf(op, idop, ilor);
+  spec = (double *)calloc(nfft, sizeof(double));
+  for (k=0; k<2*ps+1; k++)
+    spec[k] = profsample(half, ps, k);
+  fftreal(fftplan(nfft), spec);
+
+  if (!__sync_bool_compare_and_swap(&op->pspec[idop][ilor], NULL, spec))
+    free(spec);
+  return op->pspec[idop][ilor];
+}
+
+
+/* FUNCTION: Direct convolution of the histogram of cell c with the profile
+   of half profile half and half-size ps.  The output wavenumber j takes
+   the sum over the binned samples x within ps of the sample of*j:
+      acc[j-j0] += sum_x  h[x] * half[|of*j - x|],
+   which are the same products that addlines() adds one line at a time.   */
+static void
+histdirect(struct linehist *hist,
+           long c,
+           PREC_VOIGT *half,
+           long ps,
+           int of,
+           PREC_RES *acc,
+           long j0,
+           long nj){
+  long pg, j, x, x0, x1, xlo, xhi, xmid, jlo, jhi, c0;
+  double *hp, sum;
+
+  for (pg=hist->imin[c]/HIST_PAGE; pg<=hist->imax[c]/HIST_PAGE; pg++){
+    if ((hp=hist->h[c][pg]) == NULL)
+      continue;
+    /* Binned range of this page:                                           */
+    x0 = pg*HIST_PAGE;
+    x1 = x0 + HIST_PAGE - 1;
+    if (x0 < hist->imin[c])
+      x0 = hist->imin[c];
+    if (x1 > hist->imax[c])
+      x1 = hist->imax[c];
+
+    /* Output wavenumbers reached by the profiles of this range:            */
+    jlo = x0 - ps <= 0 ? 0 : (x0 - ps + of - 1)/of;
+    jhi = (x1 + ps)/of;
+    if (jlo < j0)
+      jlo = j0;
+    if (jhi > j0+nj-1)
+      jhi = j0+nj-1;
+
+    for (j=jlo; j<=jhi; j++){
+      c0  = of*j;
+      xlo = c0 - ps > x0 ? c0 - ps : x0;
+      xhi = c0 + ps < x1 ? c0 + ps : x1;
+      /* Samples up to and beyond the profile center:                       */
+      xmid = c0 < xhi ? c0 : xhi;
+      sum = 0.0;
+      for (x=xlo; x<=xmid; x++)
+        sum += hp[x-pg*HIST_PAGE] * half[c0-x];
+      for (x=(c0 < xlo ? xlo : c0+1); x<=xhi; x++)
+        sum += hp[x-pg*HIST_PAGE] * half[x-c0];
+      acc[j-j0] += sum;
+    }
+  }
+}
+
+
+/* FUNCTION: FFT (overlap-add) convolution of the histogram of cell c with
+   the profile of half-size ps and packed spectrum spec of length nfft.
+   The binned range is split into segments of nfft-2*ps samples, such that
+   each segment convolved with the profile fits in nfft samples.            */
+static void
+histfft(struct linehist *hist,
+        long c,
+        double *spec,
+        long nfft,
+        long ps,
+        int of,
+        PREC_RES *acc,
+        long j0,
+        long nj){
+  struct fftplan *plan = fftplan(nfft);
+  long nseg = nfft - 2*ps, /* Segment length                               */
+       s, x, xend, pg, j, jlo, jhi;
+  double *buf = (double *)calloc(nfft, sizeof(double));
+
+  for (s=hist->imin[c]; s<=hist->imax[c]; s+=nseg){
+    xend = s + nseg - 1;
+    if (xend > hist->imax[c])
+      xend = hist->imax[c];
+
+    /* Copy the segment out of the histogram pages and zero-pad it:        */
+    for (x=s; x<=xend; x++){
+      pg = x/HIST_PAGE;
+      buf[x-s] = hist->h[c][pg] == NULL ? 0.0 :
+                 hist->h[c][pg][x-pg*HIST_PAGE];
+    }
+    for (x=xend+1-s; x<nfft; x++)
+      buf[x] = 0.0;
+
+    fftreal(plan, buf);
+    fftmultiply(buf, spec, nfft);
+    fftrealinv(plan, buf);
+
+    /* Sample of*j of the convolution is buf[of*j - s + ps]:                */
+    jlo = s - ps <= 0 ? 0 : (s - ps + of - 1)/of;
+    jhi = (xend + ps)/of;
+    if (jlo < j0)
+      jlo = j0;
+    if (jhi > j0+nj-1)
+      jhi = j0+nj-1;
+    for (j=jlo; j<=jhi; j++)
+      acc[j-j0] += buf[of*j - s + ps];
+  }
+  free(buf);
+}
+
+
+/* FUNCTION: Convolve each non-empty histogram with the profile of its
+   cell and add the result into acc (see addlines() for the layout of
+   acc).  Each histogram is convolved directly or by FFT, whichever is
+   estimated to be faster from the costs measured by histcrossover().      */
+static void
+histconvolve(struct linehist *hist,
+             struct lineaccum *la,
+             PREC_RES **acc,
+             long j0,
+             long nj){
+  struct transit *tr = la->tr;
+  struct opacity *op = tr->ds.op;
+  int of = tr->owns.o,
+      Nmol = la->permol ? op->Nmol : 1;
+  long c, ps, nfft, nbin;
+  int m, idop, ilor;
+  double tdirect, tfft;
+
+  for (c=0; c<hist->ncell; c++){
+    if (hist->h[c] == NULL)
+      continue;
+    m    = c % Nmol;
+    ilor = (c/Nmol) % op->nLor;
+    idop =  c/Nmol  / op->nLor;
+    ps   = op->profsize[idop][ilor];
+    profready(tr, idop, ilor);
+
+    /* Estimated cost of each method:                                       */
+    nbin = hist->imax[c] - hist->imin[c] + 1;
+    nfft = histfftsize(ps);
+    tdirect = op->tmac * (nbin + 2*ps)/of * (nbin < 2*ps+1 ? nbin : 2*ps+1);
+    tfft    = op->tfft * ((nbin-1)/(nfft-2*ps) + 1) * nfft * log2(nfft);
+
+    if (tfft < tdirect)
+      histfft(hist, c, profspectrum(op, idop, ilor, nfft), nfft, ps, of,
+              acc[m], j0, nj);
+    else
+      histdirect(hist, c, profhalf(op, idop, ilor), ps, of, acc[m], j0, nj);
+  }
+}
+
+
+/* FUNCTION: Measure the time of a direct-convolution multiply-add
+   (op->tmac) and of a real FFT convolution per n*log2(n) (op->tfft).
+   histconvolve() chooses between the direct and the FFT convolution from
+   these costs.                                                              */
+void
+histcrossover(struct transit *tr){
+  struct opacity *op = tr->ds.op;
+  struct fftplan *plan;
+  struct timeval tv;
+  long nfft=4096, ps=1024, j, x, nrep, ncross;
+  double *h, *buf, *spec, t0, dt, sum;
+  volatile double sink=0; /* Keeps the timed loops from being optimized out */
+  PREC_VOIGT *prof;
+
+  h    = (double *)calloc(nfft, sizeof(double));
+  buf  = (double *)calloc(nfft, sizeof(double));
+  spec = (double *)calloc(nfft, sizeof(double));
+  prof = (PREC_VOIGT *)calloc(2*ps+1, sizeof(PREC_VOIGT));
+  for (x=0; x<nfft; x++)
+    h[x] = spec[x] = 1.0/(x+1);
+  for (x=0; x<2*ps+1; x++)
+    prof[x] = 1.0/(x+1);
+
+  /* Direct convolution, one output per 2*ps+1 multiply-adds:               */
+  nrep = 0;
+  gettimeofday(&tv, NULL);
+  t0 = tv.tv_sec + 1e-6*tv.tv_usec;
+  do{
+    for (j=0; j<64; j++){
+      sum = 0.0;
+      for (x=0; x<2*ps+1; x++)
+        sum += h[j+x] * prof[2*ps-x];
+      sink += sum;
+    }
+    nrep++;
+    gettimeofday(&tv, NULL);
+    dt = tv.tv_sec + 1e-6*tv.tv_usec - t0;
+  } while (dt < 2e-3);
+  op->tmac = dt/(nrep*64*(2*ps+1));
+
+  /* FFT convolution:                                                       */
+  plan = fftplan(nfft);
+  fftreal(plan, spec);
+  nrep = 0;
+  gettimeofday(&tv, NULL);
+  t0 = tv.tv_sec + 1e-6*tv.tv_usec;
+  do{
+    for (x=0; x<nfft; x++)
+      buf[x] = h[x];
+    fftreal(plan, buf);
+    fftmultiply(buf, spec, nfft);
+    fftrealinv(plan, buf);
+    sink += buf[0];
+    nrep++;
+    gettimeofday(&tv, NULL);
+    dt = tv.tv_sec + 1e-6*tv.tv_usec - t0;
+  } while (dt < 2e-3);
+  op->tfft = dt/(nrep*nfft*log2(nfft));
+
+  /* Profile half-size above which a long histogram goes to the FFT:        */
+  for (ncross=1; ncross<(1L<<30); ncross*=2){
+    nfft = histfftsize(ncross);
+    if (op->tfft*nfft*log2(nfft)/(nfft-2*ncross) <
+        op->tmac*(2*ncross+1)/tr->owns.o)
+      break;
+  }
+  tr_output(TOUT_INFO, "Histogram convolution by FFT for profile half-sizes "
+    "above ~%ld samples.\n", ncross);
+
+  free(h);
+  free(buf);
+  free(spec);
+  free(prof);
+}
+
+
+/* FUNCTION: Free the line histograms.                                      */
+static void
+histfree(struct linehist *hist){
+  long c, pg;
+
+  for (c=0; c<hist->ncell; c++){
+    if (hist->h[c] == NULL)
+      continue;
+    for (pg=0; pg<hist->npage; pg++)
+      if (hist->h[c][pg] != NULL)
+        free(hist->h[c][pg]);
+    free(hist->h[c]);
+  }
+  free(hist->h);
+  free(hist->imin);
+  free(hist->imax);
+}
+
+
+/* FUNCTION: Index of the closest Doppler-width sample to the width of a
+   line of isotope i at wavenumber wavn (output index idwn).  The width is
+   monotonic in wavenumber, so the index is found by stepping from the one
+   at the start of the line's block (la->doptab).  Where the Doppler width
+   is negligible compared to the Lorentz width, use la->idop[i].           */
+static inline int
+dopindex(struct lineaccum *la,
+         double *aDop,
+         int nDop,
+         int i,
+         PREC_RES wavn,
+         long idwn){
+  int idop;
+  double ad = la->alphad[i]*wavn;
+
+  /* FINDME: de-hard code this threshold                                    */
+  if (ad/la->alphal[i] < 1e-1)
+    return la->idop[i];
+
+  idop = la->doptab[i*la->ndblk + (idwn>>DOP_BLOCKBITS)];
+  while (idop+1 < nDop && fabs(aDop[idop+1]-ad) <  fabs(aDop[idop]-ad))
+    idop++;
+  while (idop   > 0    && fabs(aDop[idop-1]-ad) <= fabs(aDop[idop]-ad))
+    idop--;
+  return idop;
+}
+
+
+/* FUNCTION: Index k of the sample a[k] <= x < a[k+1] bracketing x among
+   the n increasing samples a (clamped to the ends), and in *w the weight
+   of a[k+1].  The weights are linear in 1/width, so that the blended peak
+   of two Doppler (or two Lorentz) profiles scales as the true one.  k is
+   a first guess.                                                           */
+static inline int
+widthbracket(double *a,
+             int n,
+             double x,
+             int k,
+             double *w){
+  while (k+2 < n && a[k+1] <= x)
+    k++;
+  while (k > 0   && a[k]   >  x)
+    k--;
+  if (n < 2){
+    *w = 0.0;
+    return 0;
+  }
+  if (k > n-2)
+    k = n-2;
+  *w = (1/a[k] - 1/x)/(1/a[k] - 1/a[k+1]);
+  *w = *w < 0.0 ? 0.0 : *w > 1.0 ? 1.0 : *w;
+  return k;
+}
+
+
+/* FUNCTION: Lower Doppler-width sample bracketing the width of a line of
+   isotope i at wavenumber wavn (output index idwn), and in *w the weight of
+   the upper one (as dopindex(), for blended profiles).                     */
+static inline int
+dopbracket(struct lineaccum *la,
+           double *aDop,
+           int nDop,
+           int i,
+           PREC_RES wavn,
+           long idwn,
+           double *w){
+  double ad = la->alphad[i]*wavn;
+
+  if (ad/la->alphal[i] < 1e-1){
+    *w = 0.0;
+    return la->idop[i];
+  }
+  return widthbracket(aDop, nDop, ad,
+                      la->doptab[i*la->ndblk + (idwn>>DOP_BLOCKBITS)], w);
+}
+
+
+/* FUNCTION: Follow the chain of lines co-added to line ln (at wavenumber
+   wavn): the next lines, up to hi-1, of the same isotope that fall within
+   one oversampled interval of the oversampled wavenumber closest to line
+   ln.  Store the index of that wavenumber in *iown and the summed line
+   strength (la->lstr) of the chain in *lstr.
+   Return: the index of the last line of the chain                          */
+static inline PREC_NREC
+linechain(struct lineaccum *la,
+          PREC_NREC ln,
+          PREC_NREC hi,
+          PREC_RES wavn,
+          int *iown,
+          double *lstr){
+  struct transit *tr = la->tr;
+  struct line_transition *lt = la->lt;
+  PREC_RES odwn = tr->owns.d/tr->owns.o;  /* Oversampling interval          */
+  double sum = la->lstr[ln];
+  int i = lt->rec[ln].isoid, io;
+
+  /* Index of closest oversampled wavenumber:                               */
+  io = (wavn - tr->wns.i)/odwn;
+  if (fabs(wavn - tr->owns.v[io+1]) < fabs(wavn - tr->owns.v[io]))
+    io++;
+
+  /* Check if the next line falls on the same sampling index:               */
+  while (ln+1 < hi && lt->rec[ln+1].isoid == i &&
+         fabs(ltwn(lt, ln+1) - tr->owns.v[io]) < odwn){
+    ln++;
+    /* Add the contribution from this line into the opacity:                */
+    sum += la->lstr[ln];
+  }
+  *iown = io;
+  *lstr = sum;
+  return ln;
+}
+
+
+/* FUNCTION: Index of the first line in [ln, hi) whose bit is set in pass,
+   or hi if none.                                                           */
+static inline PREC_NREC
+nextpass(unsigned long long *pass,
+         PREC_NREC ln,
+         PREC_NREC hi){
+  PREC_NREC w = ln/PASS_WORD;
+  unsigned long long bits = pass[w] & (~0ULL << (ln%PASS_WORD));
+
+  while (bits == 0){
+    if (++w*PASS_WORD >= hi)
+      return hi;
+    bits = pass[w];
+  }
+  ln = w*PASS_WORD + __builtin_ctzll(bits);
+  return ln < hi ? ln : hi;
+}
+
+
+/* FUNCTION: Add k times the profile [idop][ilor] of a line centered at
+   oversampled index iown (output index idwn) into acc, where acc[j-j0]
+   holds the extinction at output wavenumber index j for j in [j0, j0+nj).
+   Profile values falling outside of this range are dropped.                */
+static inline void
+addprofile(struct lineaccum *la,
+           PREC_RES *acc,
+           long j0,
+           long nj,
+           int idop,
+           int ilor,
+           int iown,
+           long idwn,
+           double k){
+  struct opacity *op = la->tr->ds.op;
+  PREC_VOIGT *phase,                  /* Phase-split half profile           */
+             *sub;                    /* Profile samples to add             */
+  PREC_RES *kacc;                     /* Accumulator at first sample        */
+  long beg_j, ps, psize, d, nsamp, nlow, subw, j, minj, maxj, offset;
+  int ofactor = la->tr->owns.o;
+
+  /* Sub-sampling offset between center of line and dyn-sampled wn:       */
+  subw   = iown - idwn*ofactor;
+  /* Offset between the profile and the wavenumber-array indices:         */
+  ps     = op->profsize[idop][ilor];
+  offset = iown - ps;
+  /* Range that contributes to the opacity:                               */
+  /* Set the lower and upper indices of the profile to be used:           */
+  minj = idwn - (ps - subw) / ofactor;
+  maxj = idwn + (ps + subw) / ofactor;
+  if (minj < j0)
+    minj = j0;
+  if (maxj >= j0+nj)
+    maxj = j0+nj-1;
+
+  /* Profile sample at minj, skip the wavenumbers before the profile:     */
+  beg_j = ofactor*minj - offset;
+  if (beg_j < 0){
+    minj  += (ofactor - 1 - beg_j)/ofactor;
+    beg_j  = ofactor*minj - offset;
+  }
+  /* Full-profile samples beg_j, beg_j+ofactor, ..., are at distances
+     d, d-ofactor, ..., from the center below it, and d', d'+ofactor, ...,
+     from it on, which are contiguous in the sub-profiles of phases
+     d%ofactor and d'%ofactor of the half profile (see getphaseprofile()): */
+  psize = 2*ps + 1;
+  nsamp = (psize - 1 - beg_j)/ofactor + 1;
+  if (nsamp > maxj - minj + 1)
+    nsamp = maxj - minj + 1;
+  if (beg_j >= psize || nsamp <= 0)
+    return;
+  profready(la->tr, idop, ilor);
+  phase = profphase(op, idop, ilor);
+  kacc  = acc + minj - j0;
+
+  /* Add the contribution from this line to the opacity spectrum, the
+     samples below the center in reverse order:                           */
+  nlow = 0;
+  if (beg_j < ps){
+    d    = ps - beg_j;
+    nlow = (d-1)/ofactor + 1;
+    if (nlow > nsamp)
+      nlow = nsamp;
+    sub = profphasesub(phase, ps+1, ofactor, d%ofactor) + d/ofactor;
+    if (nlow < 8)
+      for (j=0; j<nlow; j++)
+        kacc[j] += k * sub[-j];
+    else
+      vecaxpyrev(kacc, sub, k, nlow);
+  }
+  if (nlow < nsamp){
+    d   = beg_j + nlow*ofactor - ps;
+    sub = profphasesub(phase, ps+1, ofactor, d%ofactor) + d/ofactor;
+    if (nsamp-nlow < 8)
+      for (j=nlow; j<nsamp; j++)
+        kacc[j] += k * sub[j-nlow];
+    else
+      vecaxpy(kacc+nlow, sub, k, nsamp-nlow);
+  }
+}
+
+
+/* FUNCTION: Add the profiles of the lines with index in [lo, hi) into
+   acc, where acc[m][j-j0] holds the extinction at output wavenumber index
+   j for j in [j0, j0+nj).  Profile values falling outside of this range
+   are dropped.  A chain of co-added lines never extends beyond hi.
+   With a fixed width grid (op->proftol == 0), a line takes the profile of
+   the nearest widths; with an adaptive grid, it blends the profiles of
+   the (up to four) bracketing widths with bilinear weights.
+   If hist is not NULL, add the line strengths into the histograms instead
+   (TLE_HIST engine), the caller then convolves them with histconvolve().   */
+static void
+addlines(struct lineaccum *la,   /* Call constants                          */
+         PREC_NREC lo,           /* First line index                        */
+         PREC_NREC hi,           /* Last line index (not included)          */
+         PREC_RES **acc,         /* Extinction accumulator [mol][nj]        */
+         long j0,                /* Wavenumber index of acc[m][0]           */
+         long nj,                /* Length of the accumulator               */
+         struct linecount *cnt,  /* Line counters                           */
+         struct linehist *hist){ /* Line histograms, or NULL                */
+  struct transit *tr = la->tr;
+  struct opacity    *op =tr->ds.op;
+  struct isotopes   *iso=tr->ds.iso;
+  struct line_transition *lt=la->lt;
+
+  double *aDop=op->aDop;              /* Doppler-width sample               */
+  int nDop=op->nDop;                  /* Number of Doppler samples          */
+  int Nmol = la->permol ? op->Nmol : 1; /* Number of species in acc         */
+
+  PREC_NREC ln, last;
+  PREC_RES wavn;
+  double propto_k, wdop=0.0, wlor=0.0, w;
+  int i, m=0, c, idop, ilor, iown, idwn;
+
+  /* Wavenumber sampling intervals:                                         */
+  PREC_RES  dwn = tr->wns.d /tr->wns.o;   /* Output array                   */
+  PREC_NREC onwn = tr->owns.n;
+
+  for (ln=lo; ln<hi; ln++){
+    /* Skip to the next line that can pass the threshold (see
+       cullmolext()):                                                       */
+    if (la->pass != NULL && (ln = nextpass(la->pass, ln, hi)) == hi)
+      break;
+    wavn = ltwn(lt, ln);
+    i    = lt->rec[ln].isoid;
+    if (la->permol)
+      m = la->islot[i];
+
+    if ((wavn < tr->wns.i) || (wavn > tr->owns.v[onwn-1]) || m < 0)
+      continue;
+
+    /* Extinction coefficient (factors depending on the line transition),
+       co-adding the next lines that fall on the same sampling index:       */
+    last = linechain(la, ln, hi, wavn, &iown, &propto_k);
+    cnt->nadd += last - ln;
+    ln = last;
+
+    /* The rest of the factors:                                             */
+    propto_k *= la->ifct[i];
+
+    /* If line is too weak, skip it:                                        */
+    if (propto_k < tr->ds.th->ethresh * la->kmax[m]){
+      cnt->nskip++;
+      continue;
+    }
+    /* Multiply by the species density:                                     */
+    if (la->permol == 0)
+      propto_k *= la->density[iso->imol[i]];
+
+    /* Index of closest (but not larger than) coarse-sampling wavenumber:   */
+    idwn = (wavn - tr->wns.i)/dwn;
+
+    /* Doppler width according to the current wavenumber, unless it is
+       negligible compared to the Lorentz width:                            */
+    ilor = la->ilor[i];
+    if (op->proftol > 0){
+      idop = dopbracket(la, aDop, nDop, i, wavn, idwn, &wdop);
+      wlor = la->wlor[i];
+    }
+    else
+      idop = dopindex(la, aDop, nDop, i, wavn, idwn);
+
+    /* Corners (idop+c%2, ilor+c/2) of the width cell:                      */
+    for (c=0; c<4; c++){
+      w = (c&1 ? wdop : 1.0-wdop) * (c&2 ? wlor : 1.0-wlor);
+      if (w == 0.0)
+        continue;
+      /* Bin the line, its profile is added later by histconvolve():        */
+      if (hist != NULL)
+        histadd(hist, ((long)(idop+(c&1))*op->nLor + ilor+(c>>1))*Nmol + m,
+                iown, w*propto_k);
+      else
+        addprofile(la, acc[m], j0, nj, idop+(c&1), ilor+(c>>1), iown, idwn,
+                   w*propto_k);
+    }
+    cnt->neval++;
+  }
+}
+
+
+/* Wavenumber tiles of a tiled computemolext() call:                        */
+struct linetiles{
+  struct lineaccum *la;    /* Call constants                                */
+  int ntiles;              /* Number of tiles                               */
+  long *jtile;             /* Output-wavenumber index of tile boundaries    */
+  int nruns;               /* Number of single-isotope runs of lines        */
+  PREC_NREC *run;          /* Run boundaries [nruns+1]                      */
+  long halo;               /* Profile half-width in output samples          */
+  PREC_RES ***acc;         /* Tile accumulators [ntiles][Nmol][nacc]        */
+  long *j0, *nacc;         /* Accumulator start index and length [ntiles]   */
+  struct linecount *cnt;   /* Line counters [ntiles]                        */
+};
+
+
+/* FUNCTION: Index of the first line in [lo, hi) with wavenumber < wnb.
+   Line wavenumbers decrease with index within a single-isotope run.      */
+static PREC_NREC
+linebelow(struct line_transition *lt,
+          PREC_NREC lo,
+          PREC_NREC hi,
+          double wnb){
+  PREC_NREC mid;
+  while (lo < hi){
+    mid = lo + (hi-lo)/2;
+    if (ltwn(lt, mid) < wnb)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+
+/* FUNCTION: Move the boundary b of a run [rs, re) forward until line b
+   starts a new co-added chain.  A line whose wavenumber is two oversampled
+   intervals away from the previous line is never co-added into the
+   previous chain, so tiles split there reproduce the serial result.       */
+static PREC_NREC
+linebreak(struct line_transition *lt,
+          PREC_NREC rs,
+          PREC_NREC re,
+          PREC_NREC b,
+          double odwn){
+  if (b <= rs)
+    return rs;
+  while (b < re && ltwn(lt, b-1) - ltwn(lt, b) < 2*odwn)
+    b++;
+  return b;
+}
+
+
+/* FUNCTION: Line-index range [*lo, *hi) of run k owned by tile t.          */
+static void
+tilelines(struct linetiles *lti,
+          int t,
+          int k,
+          PREC_NREC *lo,
+          PREC_NREC *hi){
+  struct transit *tr = lti->la->tr;
+  struct line_transition *lt=lti->la->lt;
+  PREC_NREC rs = lti->run[k], re = lti->run[k+1];
+  double dwn  = tr->wns.d /tr->wns.o,
+         odwn = tr->owns.d/tr->owns.o;
+
+  /* Higher wavenumbers come first in a run, i.e., the upper tile edge
+     gives the lower line index:                                            */
+  *lo = rs;
+  if (t < lti->ntiles-1)
+    *lo = linebreak(lt, rs, re, linebelow(lt, rs, re,
+                    tr->wns.i + lti->jtile[t+1]*dwn), odwn);
+  *hi = re;
+  if (t > 0)
+    *hi = linebreak(lt, rs, re, linebelow(lt, rs, re,
+                    tr->wns.i + lti->jtile[t]*dwn), odwn);
+}
+
+
+/* FUNCTION: Worker for one wavenumber tile.  Accumulate the tile lines
+   into a private array spanning the tile plus the profile wings.           */
+static void
+addtile(void *arg,
+        long item,
+        int tid){
+  struct linetiles *lti = (struct linetiles *)arg;
+  struct transit *tr = lti->la->tr;
+  struct line_transition *lt=lti->la->lt;
+  int t = item, k, m, Nmol = lti->la->permol ? tr->ds.op->Nmol : 1;
+  PREC_NREC lo, hi;
+  double wnmin=0, wnmax=0,
+         dwn = tr->wns.d/tr->wns.o;
+  long jmin, jmax, nwn=tr->wns.n;
+  struct linehist hist;
+
+  /* Wavenumber extent of the lines of this tile:                           */
+  for (k=0; k<lti->nruns; k++){
+    tilelines(lti, t, k, &lo, &hi);
+    if (lo >= hi)
+      continue;
+    if (wnmax == 0 || ltwn(lt, lo) > wnmax)
+      wnmax = ltwn(lt, lo);
+    if (wnmin == 0 || ltwn(lt, hi-1) < wnmin)
+      wnmin = ltwn(lt, hi-1);
+  }
+  if (wnmax == 0)
+    return;
+
+  /* Accumulator range, clipped to the output array:                        */
+  jmin = (long)((wnmin - tr->wns.i)/dwn) - lti->halo;
+  jmax = (long)((wnmax - tr->wns.i)/dwn) + lti->halo;
+  if (jmin < 0)
+    jmin = 0;
+  if (jmax >= nwn)
+    jmax = nwn-1;
+  if (jmax < jmin)
+    return;
+  lti->j0[t]   = jmin;
+  lti->nacc[t] = jmax - jmin + 1;
+
+  lti->acc[t]    = (PREC_RES **)calloc(Nmol, sizeof(PREC_RES *));
+  lti->acc[t][0] = (PREC_RES  *)calloc(Nmol*lti->nacc[t], sizeof(PREC_RES));
+  for (m=1; m<Nmol; m++)
+    lti->acc[t][m] = lti->acc[t][0] + m*lti->nacc[t];
+
+  if (tr->lineengine == TLE_HIST)
+    histinit(&hist, lti->la);
+  for (k=0; k<lti->nruns; k++){
+    tilelines(lti, t, k, &lo, &hi);
+    addlines(lti->la, lo, hi, lti->acc[t], lti->j0[t], lti->nacc[t],
+             lti->cnt+t, tr->lineengine == TLE_HIST ? &hist : NULL);
+  }
+  if (tr->lineengine == TLE_HIST){
+    histconvolve(&hist, lti->la, lti->acc[t], lti->j0[t], lti->nacc[t]);
+    histfree(&hist);
+  }
+}
+
+
+/* FUNCTION: Add the line profiles into kiso splitting the output
+   wavenumber range into tiles that are processed by nthreads threads.
+   Each tile owns the lines centered in it and accumulates them into a
+   private array that includes a halo for the profile wings.  The tile
+   arrays are then added into kiso in tile order.                          */
+static void
+addlinestiled(struct lineaccum *la,   /* Call constants                     */
+              PREC_RES **kiso,        /* Extinction array [mol][wn]         */
+              int nthreads,           /* Number of threads                  */
+              struct linecount *cnt){ /* Line counters                      */
+  struct transit *tr = la->tr;
+  struct opacity *op = tr->ds.op;
+  struct line_transition *lt=la->lt;
+  struct linetiles lti;
+  PREC_NREC ln, nlines=la->nlines, maxsize=0;
+  long j, nwn=tr->wns.n;
+  int t, m, i, k, niso=tr->ds.iso->n_i,
+      Nmol = la->permol ? op->Nmol : 1;
+
+  lti.la = la;
+
+  /* Split the lines into runs of a single isotope:                         */
+  lti.run = (PREC_NREC *)calloc(2, sizeof(PREC_NREC));
+  lti.nruns = 0;
+  for (ln=1; ln<=nlines; ln++)
+    if (ln == nlines || lt->rec[ln].isoid != lt->rec[ln-1].isoid){
+      lti.run = (PREC_NREC *)realloc(lti.run,
+                                     (lti.nruns+2)*sizeof(PREC_NREC));
+      lti.run[++lti.nruns] = ln;
+    }
+  lti.run[0] = 0;
+
+  /* Largest profile half-width among the isotopes' Lorentz widths (and
+     the upper bracketing ones of blended profiles):                        */
+  for (i=0; i<niso; i++)
+    for (j=0; j<op->nDop; j++)
+      for (k=la->ilor[i]; k<=la->ilor[i]+(la->wlor[i] > 0); k++)
+        if (op->profsize[j][k] > maxsize)
+          maxsize = op->profsize[j][k];
+  lti.halo = maxsize/tr->owns.o + 2;
+
+  /* Tile boundaries in the output wavenumber array:                        */
+  lti.ntiles = 4*nthreads;
+  if (lti.ntiles > nwn)
+    lti.ntiles = nwn;
+  lti.jtile = (long *)calloc(lti.ntiles+1, sizeof(long));
+  for (t=0; t<=lti.ntiles; t++)
+    lti.jtile[t] = t*nwn/lti.ntiles;
+
+  lti.acc  = (PREC_RES ***)calloc(lti.ntiles, sizeof(PREC_RES **));
+  lti.j0   = (long *)calloc(lti.ntiles, sizeof(long));
+  lti.nacc = (long *)calloc(lti.ntiles, sizeof(long));
+  lti.cnt  = (struct linecount *)calloc(lti.ntiles, sizeof(struct linecount));
+
+  parallelrun(nthreads, lti.ntiles, addtile, &lti);
+
+  /* Reduce the tile accumulators:                                          */
+  for (t=0; t<lti.ntiles; t++){
+    if (lti.acc[t] == NULL)
+      continue;
+    for (m=0; m<Nmol; m++)
+      for (j=0; j<lti.nacc[t]; j++)
+        kiso[m][lti.j0[t]+j] += lti.acc[t][m][j];
+    cnt->nadd  += lti.cnt[t].nadd;
+    cnt->nskip += lti.cnt[t].nskip;
+    cnt->neval += lti.cnt[t].neval;
+    free(lti.acc[t][0]);
+    free(lti.acc[t]);
+  }
+
+  free(lti.acc);
+  free(lti.j0);
+  free(lti.nacc);
+  free(lti.cnt);
+  free(lti.jtile);
+  free(lti.run);
+}
+
+
+/* Line-strength pass of a computemolext() call:                           */
+struct linestrength{
+  struct line_transition *lt; /* Line transitions                           */
+  PREC_NREC nlines;           /* Number of line transitions                 */
+  PREC_ATM temp;              /* Temperature                                */
+  double *lstr;               /* Output line strengths [nlines]             */
+  unsigned long long *pass;   /* Lines to evaluate (bitmap), or NULL for all */
+};
+
+/* Number of lines per line-strength work item:                             */
+#define LSTR_CHUNK 65536
+
+
+/* FUNCTION: Evaluate the temperature-dependent factors of the strength of
+   the lines in work item 'item' (gf times level population times induced
+   emission).  gf and the level population share a single exponential.
+   The inner loop has no branches so that it can be vectorized.  Groups of
+   PASS_WORD lines without a bit set in ls->pass are skipped.              */
+static void
+linestrength(void *arg,
+             long item,
+             int tid){
+  struct linestrength *ls = (struct linestrength *)arg;
+  struct line_transition *lt = ls->lt;
+  struct linerecord *rec = lt->rec;
+  double *lstr = ls->lstr;
+  double efct = EXPCTE*lt->efct/ls->temp, /* Level-population exponent     */
+         wfct = EXPCTE/ls->temp;          /* Induced-emission exponent      */
+  PREC_NREC ln, b, e, lo = item*(PREC_NREC)LSTR_CHUNK,
+            hi = lo + LSTR_CHUNK;
+
+  if (hi > ls->nlines)
+    hi = ls->nlines;
+  for (b=lo; b<hi; b+=PASS_WORD){
+    if (ls->pass != NULL && ls->pass[b/PASS_WORD] == 0)
+      continue;
+    e = b + PASS_WORD < hi ? b + PASS_WORD : hi;
+    for (ln=b; ln<e; ln++)
+      lstr[ln] = exp(LN10*rec[ln].lgf - efct*rec[ln].elow)
+                 * (1-exp(-wfct*ltwn(lt, ln)));
+  }
+}
+
+
+/* FUNCTION: Set up the constants of the extinction at one temperature and
+   set of densities: the isotope widths, width-sample indices, and line-
+   strength factors.  Zero the extinction array kiso.                       */
+static void
+molextinit(struct transit *tr,    /* transit struct                         */
+           struct lineaccum *la,  /* Constants to set up                    */
+           PREC_RES **kiso,       /* Extinction coefficient array [mol][wn] */
+           PREC_ATM temp,         /* Temperature                            */
+           PREC_ATM *density,     /* Density per species                    */
+           double *Z,             /* Partition Function per isotope         */
+           int permol){           /* Calculate the extinction per molecule  */
 
   /* Transit structures:                                                    */
   struct opacity    *op =tr->ds.op;
   struct isotopes   *iso=tr->ds.iso;
   struct molecules  *mol=tr->ds.mol;
-  struct line_transition *lt=&(tr->ds.li->lt);
 
-  PREC_NREC ln;
-  int i, m=0, mm,
-      *idop, *ilor;
-  long j, maxj, minj, offset;
+  int i, mm, k;
+  long j, b;
+  double wnb;
 
   /* Voigt profile variables:                                               */
-  PREC_VOIGT ***profile=op->profile;  /* Voigt profile                      */
-  PREC_NREC **profsize=op->profsize;  /* Voigt-profile half-size            */
   double *aDop=op->aDop,          /* Doppler-width sample                   */
          *aLor=op->aLor;          /* Lorentz-width sample                   */
   int nDop=op->nDop,              /* Number of Doppler samples              */
       nLor=op->nLor;              /* Number of Lorentz samples              */
 
-  PREC_NREC subw,
-            nlines=tr->ds.li->n_l; /* Number of line transitions            */
-  PREC_RES wavn, next_wn;
   double fdoppler, florentz, /* Doppler and Lorentz-broadening factors      */
          csdiameter;         /* Collision diameter                          */
-  double propto_k;
-  double *kmax, *kmin;       /* Maximum and minimum values of propto_k      */
 
   PREC_VOIGTP *alphal, *alphad;
 
@@ -319,36 +1328,36 @@ computemolext(struct transit *tr, /* transit struct                         */
       nmol = mol->nmol,       /* Number of species in atmosphere            */
       Nmol;                   /* Number of species with line-transitions    */
 
-  int iown, idwn;             /* Line-center indices                        */
-
   double maxwidth=0,   /* Maximum width between Lorentz and Doppler         */
          minwidth=1e5; /* Minimum width among isotopes in a Layer           */
 
-  int ofactor=tr->owns.o;  /* Dynamic oversampling factor                   */
-
-  PREC_NREC nadd  = 0, /* Number of co-added lines                          */
-            nskip = 0, /* Number of skipped lines                           */
-            neval = 0; /* Number of evaluated profiles                      */
-
   /* Wavenumber array variables:                                            */
   PREC_RES   *wn = tr->wns.v;
   PREC_NREC  nwn = tr->wns.n,
             onwn = tr->owns.n;
-
-  /* Wavenumber sampling intervals:                                         */
-  PREC_RES  dwn = tr->wns.d /tr->wns.o,   /* Output array                   */
-           odwn = tr->owns.d/tr->owns.o;  /* Oversampling array             */
+  PREC_RES   dwn = tr->wns.d/tr->wns.o;
 
   /* Allocate alpha Lorentz and Doppler arrays:                             */
-  alphal = (PREC_VOIGTP *)calloc(niso, sizeof(PREC_VOIGTP));
-  alphad = (PREC_VOIGTP *)calloc(niso, sizeof(PREC_VOIGTP));
+  alphal = la->alphal = (PREC_VOIGTP *)calloc(niso, sizeof(PREC_VOIGTP));
+  alphad = la->alphad = (PREC_VOIGTP *)calloc(niso, sizeof(PREC_VOIGTP));
 
   /* Allocate width indices array:                                          */
-  idop = (int *)calloc(niso, sizeof(int));
-  ilor = (int *)calloc(niso, sizeof(int));
-
-  kmax = (double *)calloc(op->Nmol, sizeof(double));
-  kmin = (double *)calloc(op->Nmol, sizeof(double));
+  la->idop = (int *)calloc(niso, sizeof(int));
+  la->ilor = (int *)calloc(niso, sizeof(int));
+  la->wlor = (double *)calloc(niso, sizeof(double));
+  la->ndblk  = (nwn>>DOP_BLOCKBITS) + 1;
+  la->doptab = (int *)calloc(niso*la->ndblk, sizeof(int));
+  /* Output species of the isotopes (see calcopacity()):                    */
+  la->islot = op->isoslot;
+  la->pass  = NULL;
+
+  la->kmax = (double *)calloc(op->Nmol, sizeof(double));
+  la->ifct = (double *)calloc(niso,      sizeof(double));
+
+  la->tr      = tr;
+  la->temp    = temp;
+  la->density = density;
+  la->permol  = permol;
 
   /* Number of species in output array:                                     */
   if (permol)
@@ -390,141 +1399,502 @@ computemolext(struct transit *tr, /* transit struct                         */
     minwidth = fmin(minwidth, maxwidth);
 
     /* Search for aDop and aLor indices for alphal[i] and alphad[i]:        */
-    idop[i] = binsearchapprox(aDop, alphad[i]*wn[0], 0, nDop);
-    ilor[i] = binsearchapprox(aLor, alphal[i],       0, nLor);
+    la->idop[i] = binsearchapprox(aDop, alphad[i]*wn[0], 0, nDop);
+    la->ilor[i] = binsearchapprox(aLor, alphal[i],       0, nLor);
+    /* Lower bracketing Lorentz width of blended profiles:                  */
+    if (op->proftol > 0)
+      la->ilor[i] = widthbracket(aLor, nLor, alphal[i], la->ilor[i],
+                                 la->wlor+i);
+    /* Doppler index of the lines where the Doppler width is negligible
+       (see addlines()): the width at which the lines cross that limit:    */
+    if (alphad[i]*tr->owns.v[onwn-1] >= 1e-1*alphal[i])
+      la->idop[i] = binsearchapprox(aDop, 1e-1*alphal[i], 0, nDop);
+
+    /* Doppler index at the start of each wavenumber block (see
+       dopindex()):                                                         */
+    for (b=0; b<la->ndblk; b++){
+      wnb = tr->wns.i + (b<<DOP_BLOCKBITS)*dwn;
+      k = la->idop[i];
+      if (alphad[i]*wnb/alphal[i] >= 1e-1)
+        k = binsearchapprox(aDop, alphad[i]*wnb, 0, nDop);
+      la->doptab[i*la->ndblk + b] = k < nDop ? k : nDop-1;
+    }
+
+    /* Isotope factors of the line strength (abundance, cross-section
+       constant, isotope mass, and partition function):                     */
+    la->ifct[i] = SIGCTE*iso->isoratio[i] / (iso->isof[i].m * Z[i]);
   }
 
   tr_output(TOUT_DEBUG, "Minimum width in layer: %.9f\n", minwidth);
+}
+
+
+/* FUNCTION: Evaluate the line strengths la->lstr of the la->nlines lines
+   la->lt with nthreads threads.                                            */
+static void
+molextstrength(struct lineaccum *la,
+               int nthreads){
+  struct linestrength ls;
+
+  ls.lt     = la->lt;
+  ls.nlines = la->nlines;
+  ls.temp   = la->temp;
+  ls.lstr   = la->lstr;
+  ls.pass   = la->pass;
+  parallelrun(nthreads, (la->nlines+LSTR_CHUNK-1)/LSTR_CHUNK, linestrength,
+              &ls);
+}
+
+
+/* FUNCTION: Update the maximum line strength per species, la->kmax, with
+   the lines la->lt (line strengths in la->lstr).                           */
+static void
+molextkmax(struct lineaccum *la){
+  struct transit *tr = la->tr;
+  struct line_transition *lt=la->lt;
+  PREC_NREC ln, onwn=tr->owns.n;
+  PREC_RES wavn;
+  double propto_k;
+  int i, m=0;
 
-  /* Determine the maximum and minimum line-strength per isotope:           */
-  for(ln=0; ln<nlines; ln++){
+  for(ln=0; ln<la->nlines; ln++){
     /* Wavenumber of line transition:                                       */
-    wavn = 1.0 / (lt->wl[ln] * lt->wfct);
+    wavn = ltwn(lt, ln);
     /* Isotope ID of line:                                                  */
-    i = lt->isoid[ln];
+    i = lt->rec[ln].isoid;
     /* Species index in output array:                                       */
-    if (permol)
-      m = valueinarray(op->molID, mol->ID[iso->imol[i]], op->Nmol);
+    if (la->permol)
+      m = la->islot[i];
 
     /* If it is beyond the lower limit, skip to next line transition:       */
-    if ((wavn < tr->wns.i) || (wavn > tr->owns.v[onwn-1]))
+    if ((wavn < tr->wns.i) || (wavn > tr->owns.v[onwn-1]) || m < 0)
       continue;
 
     /* Calculate the extinction coefficient except the broadening factor:   */
-    propto_k = iso->isoratio[i]               *       /* Density            */
-            SIGCTE     * lt->gf[ln]           *       /* Constant * gf      */
-            exp(-EXPCTE*lt->efct*lt->elow[ln]/temp) * /* Level population   */
-            (1-exp(-EXPCTE*wavn/temp))        /       /* Induced emission   */
-            iso->isof[i].m                    /       /* Isotope mass       */
-            Z[i];                                     /* Partition function */
+    propto_k = la->lstr[ln] * la->ifct[i];
     /* Maximum line strength among all transitions for each species:        */
-    if (kmax[m] == 0){
-      kmax[m] = kmin[m] = propto_k;
-    } else{
-      kmax[m] = fmax(kmax[m], propto_k);
-      kmin[m] = fmin(kmin[m], propto_k);
-    }
+    la->kmax[m] = fmax(la->kmax[m], propto_k);
   }
+}
+
+
+/* FUNCTION: Add the profiles of the lines la->lt into kiso with nthreads
+   threads, using the engine tr->lineengine.                                */
+static void
+molextadd(struct lineaccum *la,     /* Call constants                       */
+          PREC_RES **kiso,          /* Extinction array [mol][wn]           */
+          int nthreads,             /* Number of threads                    */
+          struct linecount *cnt){   /* Line counters                        */
+  struct transit *tr = la->tr;
+  struct linehist hist;       /* Line histograms (TLE_HIST engine)          */
+
+  if (nthreads > 1)
+    addlinestiled(la, kiso, nthreads, cnt);
+  else if (tr->lineengine == TLE_HIST){
+    histinit(&hist, la);
+    addlines(la, 0, la->nlines, kiso, 0, tr->wns.n, cnt, &hist);
+    histconvolve(&hist, la, kiso, 0, tr->wns.n);
+    histfree(&hist);
+  }
+  else
+    addlines(la, 0, la->nlines, kiso, 0, tr->wns.n, cnt, NULL);
+}
+
+
+/* FUNCTION: Print the line counters of nlines processed lines.            */
+static void
+molextcount(struct linecount *cnt,
+            double nlines){
+  tr_output(TOUT_DEBUG, "Number of co-added lines:     %8lli  (%5.2f%%)\n",
+    cnt->nadd,  cnt->nadd*100.0/nlines);
+  tr_output(TOUT_DEBUG, "Number of skipped profiles:   %8lli  (%5.2f%%)\n",
+    cnt->nskip, cnt->nskip*100.0/nlines);
+  tr_output(TOUT_DEBUG, "Number of evaluated profiles: %8lli  (%5.2f%%)\n",
+    cnt->neval, cnt->neval*100.0/nlines);
+}
+
+
+/* FUNCTION: Free the arrays allocated by molextinit().                     */
+static void
+molextfree(struct lineaccum *la){
+  free(la->alphal);
+  free(la->alphad);
+  free(la->idop);
+  free(la->ilor);
+  free(la->wlor);
+  free(la->doptab);
+  free(la->kmax);
+  free(la->ifct);
+}
+
+
+/* FUNCTION: Compute the molecular extinction.
+   Store results in kiso.  If permol is true, calculate extinction per
+   molecule separately, in the slots op->isoslot of the isotopes (the
+   isotopes with a negative slot are left out); else, collapse all
+   extinction into kiso[0].  The line profiles are added by tr->nthreads
+   threads, each working on its own range of wavenumbers (unless already
+   called from a worker thread).  With the TLE_HIST engine
+   (tr->lineengine), the lines are first binned by profile shape and each
+   histogram is then convolved once.
+   If the lines were not loaded (tr->linebuffer > 0), they are streamed
+   from the TLI file by streammolext().                                     */
+int
+computemolext(struct transit *tr, /* transit struct                         */
+              PREC_RES **kiso,    /* Extinction coefficient array [mol][wn] */
+              PREC_ATM temp,      /* Temperature                            */
+              PREC_ATM *density,  /* Density per species                    */
+              double *Z,          /* Partition Function per isotope         */
+              int permol){        /* Calculate the extinction per molecule  */
+  struct lineaccum la;        /* Constants for the profile accumulation     */
+  struct linecount cnt={0, 0, 0}; /* Co-added, skipped, and evaluated lines */
+  struct linecull *cull = permol ? tr->ds.op->cull : NULL;
+  int nthreads;               /* Number of threads                          */
+  long t;
+
+  if (tr->ds.li->lt.rec == NULL && tr->linebuffer > 0)
+    return streammolext(tr, 1, &kiso, &temp, &density, &Z, permol);
+
+  molextinit(tr, &la, kiso, temp, density, Z, permol);
+  la.lt     = &(tr->ds.li->lt);
+  la.nlines = tr->ds.li->n_l;
+
+  /* At an opacity-grid temperature, take the lines that can pass the
+     threshold and the maximum line strengths from cullmolext():            */
+  for (t=0; cull != NULL && t < cull->ntemp; t++)
+    if (cull->temp[t] == temp){
+      la.pass = cull->pass[t];
+      memcpy(la.kmax, cull->kmax[t], tr->ds.op->Nmol*sizeof(double));
+      break;
+    }
+
+  /* Evaluate the line strengths once, for both the threshold test and the
+     profile accumulation:                                                  */
+  nthreads = parallelthreads(tr->nthreads);
+  la.lstr  = (double *)calloc(la.nlines, sizeof(double));
+  molextstrength(&la, nthreads);
+
+  /* Determine the maximum line-strength per species:                       */
+  if (la.pass == NULL)
+    molextkmax(&la);
 
   /* Compute the spectra, proceed for every line:                           */
-  for (ln=0; ln<nlines; ln++){
-    wavn = 1.0/(lt->wl[ln]*lt->wfct);
-    i    = lt->isoid[ln];
-    if (permol)
-      m = valueinarray(op->molID, mol->ID[iso->imol[i]], op->Nmol);
+  molextadd(&la, kiso, nthreads, &cnt);
+  molextcount(&cnt, la.nlines);
+
+  /* Free allocated memory:                                                 */
+  molextfree(&la);
+  free(la.lstr);
+  return 0;
+}
+
 
+/* FUNCTION: Mark in pass the lines of the co-added chains whose strength
+   passes the threshold at opacity-grid temperature index t, and store the
+   maximum line strength per species in kmax.  lstr is a scratch array of
+   li->n_l line strengths.                                                  */
+static void
+cullpass(struct transit *tr,
+         long t,
+         unsigned long long *pass,
+         double *kmax,
+         double *lstr){
+  struct opacity  *op =tr->ds.op;
+  struct isotopes *iso=tr->ds.iso;
+  struct lineaccum la;
+  PREC_NREC ln, last, nlines=tr->ds.li->n_l, onwn=tr->owns.n;
+  PREC_RES wavn;
+  double propto_k;
+  int i, m, iown;
+
+  memset(&la, 0, sizeof(struct lineaccum));
+  la.tr      = tr;
+  la.lt      = &tr->ds.li->lt;
+  la.nlines  = nlines;
+  la.temp    = op->temp[t];
+  la.permol  = 1;
+  la.islot   = op->isoslot;
+  la.lstr    = lstr;
+  la.kmax    = kmax;
+  la.ifct    = (double *)calloc(iso->n_i, sizeof(double));
+  /* Isotope factors of the line strength, as in molextinit():              */
+  for (i=0; i<iso->n_i; i++)
+    la.ifct[i] = SIGCTE*iso->isoratio[i] / (iso->isof[i].m * op->ziso[i][t]);
+
+  molextstrength(&la, parallelthreads(tr->nthreads));
+  memset(kmax, 0, op->Nmol*sizeof(double));
+  molextkmax(&la);
+
+  /* The same chains and threshold test as addlines():                      */
+  memset(pass, 0, (nlines+PASS_WORD-1)/PASS_WORD*sizeof(unsigned long long));
+  for (ln=0; ln<nlines; ln++){
+    wavn = ltwn(la.lt, ln);
     if ((wavn < tr->wns.i) || (wavn > tr->owns.v[onwn-1]))
       continue;
+    i    = la.lt->rec[ln].isoid;
+    if ((m = la.islot[i]) < 0)
+      continue;
+    last = linechain(&la, ln, nlines, wavn, &iown, &propto_k);
+    propto_k *= la.ifct[i];
+    if (!(propto_k < tr->ds.th->ethresh * kmax[m]))
+      for (; ln<=last; ln++)
+        pass[ln/PASS_WORD] |= 1ULL << (ln%PASS_WORD);
+    ln = last;
+  }
+  free(la.ifct);
+}
 
-    /* Extinction coefficient (factors depending on the line transition):   */
-    propto_k = lt->gf[ln]                              *
-               exp(-EXPCTE*lt->efct*lt->elow[ln]/temp) *
-               (1-exp(-EXPCTE*wavn/temp));
-
-    /* Index of closest oversampled wavenumber:                             */
-    iown = (wavn - tr->wns.i)/odwn;
-    if (fabs(wavn - tr->owns.v[iown+1]) < fabs(wavn - tr->owns.v[iown]))
-      iown++;
-
-    /* Check if the next line falls on the same sampling index:             */
-    while (ln != nlines-1 && lt->isoid[ln+1] == i){
-      next_wn = 1.0/(lt->wl[ln+1]*lt->wfct);
-      if (fabs(next_wn - tr->owns.v[iown]) < odwn){
-        nadd++;
-        ln++;
-        /* Add the contribution from this line into the opacity:            */
-        propto_k += lt->gf[ln]                                    *
-                    exp(-EXPCTE * lt->efct * lt->elow[ln] / temp) *
-                    (1-exp(-EXPCTE*next_wn/temp));
-      }
-      else
-        break;
-    }
-    /* The rest of the factors:                                             */
-    propto_k *= SIGCTE*iso->isoratio[i] / (iso->isof[i].m * Z[i]);
 
-    /* If line is too weak, skip it:                                        */
-    if (propto_k < tr->ds.th->ethresh * kmax[m]){
-      nskip++;
-      continue;
-    }
-    /* Multiply by the species density:                                     */
-    if (permol == 0)
-      propto_k *= density[iso->imol[i]];
+/* FUNCTION: Drop the line records whose bit is not set in keep.  The
+   kept lines of each isotope are packed again into blocks, and each
+   isotope is padded to a whole block.
+   Return: the number of records left                                       */
+static PREC_NREC
+cullcompact(struct line_transition *lt,
+            PREC_NREC nlines,
+            unsigned long long *keep){
+  PREC_NREC ln, n=0, nblocks=(nlines+LT_BLOCK-1)>>LT_BLOCKBITS;
+  double *base, wn;
+  int isoid;
 
-    /* Index of closest (but not larger than) coarse-sampling wavenumber:   */
-    idwn = (wavn - tr->wns.i)/dwn;
+  /* Keep the old block wavenumbers while the records are overwritten:     */
+  base = (double *)calloc(nblocks, sizeof(double));
+  memcpy(base, lt->wnbase, nblocks*sizeof(double));
 
-    /* FINDME: de-hard code this threshold                                  */
-    /* Update Doppler width according to the current wavenumber:            */
-    if (alphad[i]*wavn/alphal[i] >= 1e-1){
-      /* Recalculate index for Doppler width:                               */
-      idop[i] = binsearchapprox(aDop, alphad[i]*wavn, 0, nDop);
+  for (ln=0; ln<nlines; ln++){
+    isoid = lt->rec[ln].isoid;
+    if (keep[ln/PASS_WORD] & (1ULL << (ln%PASS_WORD))){
+      wn = base[ln>>LT_BLOCKBITS] + lt->rec[ln].dwn;
+      /* A new block takes the old block wavenumber of its first line, so
+         that the lines from that old block keep their exact offsets:       */
+      if ((n & (LT_BLOCK-1)) == 0)
+        lt->wnbase[n>>LT_BLOCKBITS] = base[ln>>LT_BLOCKBITS];
+      lt->rec[n] = lt->rec[ln];
+      lt->rec[n].dwn = wn - lt->wnbase[n>>LT_BLOCKBITS];
+      n++;
     }
+    /* Pad the last block of the isotope as packlines():                    */
+    if (ln+1 == nlines || lt->rec[ln+1].isoid != isoid)
+      for (; (n & (LT_BLOCK-1)) != 0; n++){
+        lt->rec[n].dwn   = -lt->wnbase[n>>LT_BLOCKBITS];
+        lt->rec[n].elow  = 0;
+        lt->rec[n].lgf   = LT_MINLGF;
+        lt->rec[n].isoid = isoid;
+        lt->rec[n].pad   = 0;
+      }
+  }
+  free(base);
 
-    /* Sub-sampling offset between center of line and dyn-sampled wn:       */
-    subw   = iown - idwn*ofactor;
-    /* Offset between the profile and the wavenumber-array indices:         */
-    offset = iown - profsize[idop[i]][ilor[i]];
-    /* Range that contributes to the opacity:                               */
-    /* Set the lower and upper indices of the profile to be used:           */
-    minj = idwn - (profsize[idop[i]][ilor[i]] - subw) / ofactor;
-    maxj = idwn + (profsize[idop[i]][ilor[i]] + subw) / ofactor;
-    if (minj < 0)
-      minj = 0;
-    if (maxj >= nwn)
-      maxj = nwn-1;
-
-    /* Add the contribution from this line to the opacity spectrum:         */
-    /* Adding in more complex but faster array indexing based on simpler
-     * pointer arrithmatic                                                  */
-    PREC_VOIGT * tmp_point = profile[idop[i]][ilor[i]];
-    int beg_j = ofactor*minj - offset;
-    for(j=minj; j<=maxj; ++j){
-        if (beg_j > 2*profsize[idop[i]][ilor[i]])
-            break;
-        if (beg_j >= 0)
-            kiso[m][j] += propto_k * tmp_point[beg_j];
-        beg_j += ofactor;
-    }
-    neval++;
+  lt->rec    = (struct linerecord *)realloc(lt->rec,
+                                    (n>0 ? n : 1)*sizeof(struct linerecord));
+  lt->wnbase = (double *)realloc(lt->wnbase,
+                                 ((n>>LT_BLOCKBITS)+1)*sizeof(double));
+  return n;
+}
+
+
+/* FUNCTION: Prepare the opacity-grid calculation (permol) at the grid
+   temperatures op->temp.  A chain of co-added lines whose strength fails
+   the ethresh test at every grid temperature is never added, so its lines
+   are dropped from memory.  For each grid temperature, store the maximum
+   line strength per species and the lines of the chains that pass, so
+   that computemolext() evaluates only those lines at every layer.
+   The kept lines are re-packed, so their wavenumbers change by up to the
+   float precision of the records.                                          */
+void
+cullmolext(struct transit *tr){
+  struct opacity *op = tr->ds.op;
+  struct lineinfo *li = tr->ds.li;
+  struct linecull *cull;
+  unsigned long long *keep;
+  PREC_NREC nlines=li->n_l, npass;
+  double *lstr;
+  long t, w, nwords;
+
+  /* Only for lines in memory and a non-zero threshold:                     */
+  if (li->lt.rec == NULL || nlines == 0 || tr->ds.th->ethresh <= 0)
+    return;
+
+  cull = (struct linecull *)calloc(1, sizeof(struct linecull));
+  cull->ntemp   = op->Ntemp;
+  cull->temp    = (PREC_ATM *)calloc(op->Ntemp, sizeof(PREC_ATM));
+  cull->kmax    = (double  **)calloc(op->Ntemp, sizeof(double *));
+  cull->kmax[0] = (double   *)calloc(op->Ntemp*op->Nmol, sizeof(double));
+  cull->pass    = (unsigned long long **)calloc(op->Ntemp,
+                                          sizeof(unsigned long long *));
+  for (t=0; t<op->Ntemp; t++){
+    cull->temp[t] = op->temp[t];
+    cull->kmax[t] = cull->kmax[0] + t*op->Nmol;
   }
 
-  tr_output(TOUT_DEBUG, "Number of co-added lines:     %8lli  (%5.2f%%)\n",
-    nadd,  nadd*100.0/nlines);
-  tr_output(TOUT_DEBUG, "Number of skipped profiles:   %8lli  (%5.2f%%)\n",
-    nskip, nskip*100.0/nlines);
-  tr_output(TOUT_DEBUG, "Number of evaluated profiles: %8lli  (%5.2f%%)\n",
-    neval, neval*100.0/nlines);
+  /* Lines that pass at any grid temperature:                               */
+  nwords = (nlines+PASS_WORD-1)/PASS_WORD;
+  keep   = (unsigned long long *)calloc(nwords, sizeof(unsigned long long));
+  cull->pass[0] = (unsigned long long *)calloc(nwords,
+                                               sizeof(unsigned long long));
+  lstr = (double *)calloc(nlines, sizeof(double));
+  for (t=0; t<op->Ntemp; t++){
+    cullpass(tr, t, cull->pass[0], cull->kmax[t], lstr);
+    for (w=0; w<nwords; w++)
+      keep[w] |= cull->pass[0][w];
+  }
+  free(cull->pass[0]);
+
+  /* Drop the other lines:                                                  */
+  li->n_l = cullcompact(&li->lt, nlines, keep);
+  free(keep);
+  tr_output(TOUT_INFO, "Dropped %lli of %lli line records that are below "
+    "the extinction threshold at all grid temperatures.\n",
+    nlines - li->n_l, nlines);
+
+  /* Lines that pass at each grid temperature, among the kept ones:         */
+  nlines = li->n_l;
+  nwords = (nlines+PASS_WORD-1)/PASS_WORD;
+  for (t=0; t<op->Ntemp; t++){
+    cull->pass[t] = (unsigned long long *)calloc(nwords > 0 ? nwords : 1,
+                                           sizeof(unsigned long long));
+    cullpass(tr, t, cull->pass[t], cull->kmax[t], lstr);
+    for (w=0, npass=0; w<nwords; w++)
+      npass += __builtin_popcountll(cull->pass[t][w]);
+    tr_output(TOUT_DEBUG, "Lines above the threshold at %7.1f K: %lli.\n",
+      op->temp[t], npass);
+  }
+  free(lstr);
+  op->cull = cull;
+}
 
-  /* Free allocated memory:                                                 */
-  free(alphal);
-  free(alphad);
-  free(idop);
-  free(ilor);
-  free(kmax);
-  free(kmin);
 
+/* FUNCTION: Free a struct linecull made by cullmolext().                   */
+void
+freemem_linecull(struct linecull *cull){
+  long t;
+
+  if (cull == NULL)
+    return;
+  for (t=0; t<cull->ntemp; t++)
+    free(cull->pass[t]);
+  free(cull->pass);
+  free(cull->kmax[0]);
+  free(cull->kmax);
+  free(cull->temp);
+  free(cull);
+}
+
+
+/* Work of one chunk of a streammolext() call:                              */
+struct streamwork{
+  struct lineaccum *la;       /* Call constants per item                    */
+  PREC_RES ***kiso;           /* Extinction arrays per item                 */
+  struct line_transition *lt; /* Chunk lines                                */
+  PREC_NREC nlines;           /* Number of lines in the chunk               */
+  int pass;                   /* 0: maximum line strength, 1: profiles      */
+  double **lstr;              /* Line-strength scratch per thread           */
+  struct linecount *cnt;      /* Line counters per thread                   */
+};
+
+
+/* FUNCTION: Process the current chunk for one item of a streammolext()
+   call, serially.                                                          */
+static void
+streamitem(void *arg,
+           long item,
+           int tid){
+  struct streamwork *sw = (struct streamwork *)arg;
+  struct lineaccum *la = sw->la + item;
+
+  la->lt     = sw->lt;
+  la->nlines = sw->nlines;
+  la->lstr   = sw->lstr[tid];
+  molextstrength(la, 1);
+  if (sw->pass == 0)
+    molextkmax(la);
+  else
+    molextadd(la, sw->kiso[item], 1, sw->cnt+tid);
+}
+
+
+/* FUNCTION: Compute the molecular extinction of nitems sets of
+   temperature, densities, and partition functions, streaming the lines
+   from the TLI file in chunks (see linestream.c) instead of holding them
+   in memory.  The lines are read twice: the first pass finds the maximum
+   line strengths, the second one adds the profiles.  The items of a chunk
+   are shared among tr->nthreads threads; a single item is instead split
+   into wavenumber tiles as in computemolext().
+   Return: 0 on success                                                     */
+int
+streammolext(struct transit *tr,  /* transit struct                         */
+             long nitems,         /* Number of items                        */
+             PREC_RES ***kiso,    /* Extinction arrays [item][mol][wn]      */
+             PREC_ATM *temp,      /* Temperature per item                   */
+             PREC_ATM **density,  /* Density per item and species           */
+             double **Z,          /* Partition Function per item and isotope*/
+             int permol){         /* Calculate the extinction per molecule  */
+  struct lineaccum *la;
+  struct linestream ls;
+  struct streamwork sw;
+  struct linecount cnt={0, 0, 0};
+  long n, nlstr;
+  int t, nthreads, nscratch;
+
+  nthreads = parallelthreads(tr->nthreads);
+  nscratch = nitems > 1 ? nthreads : 1;
+
+  la = (struct lineaccum *)calloc(nitems, sizeof(struct lineaccum));
+  for (n=0; n<nitems; n++)
+    molextinit(tr, la+n, kiso[n], temp[n], density[n], Z[n], permol);
+
+  /* The line-strength scratch arrays count against the line buffer:        */
+  linestreamopen(tr, &ls, nscratch*sizeof(double));
+  sw.la   = la;
+  sw.kiso = kiso;
+  sw.lstr    = (double **)calloc(nscratch, sizeof(double *));
+  sw.lstr[0] = (double  *)calloc(nscratch*ls.chunksize, sizeof(double));
+  for (t=1; t<nscratch; t++)
+    sw.lstr[t] = sw.lstr[0] + t*ls.chunksize;
+  nlstr = ls.chunksize;
+  sw.cnt = (struct linecount *)calloc(nscratch, sizeof(struct linecount));
+
+  for (sw.pass=0; sw.pass<2; sw.pass++){
+    linestreamstart(&ls);
+    while ((sw.lt=linestreamnext(&ls, &sw.nlines)) != NULL){
+      /* A chunk grown to hold a long co-added chain (see readchunk()):     */
+      if (sw.nlines > nlstr){
+        nlstr = sw.nlines;
+        sw.lstr[0] = (double *)realloc(sw.lstr[0],
+                                       nscratch*nlstr*sizeof(double));
+        for (t=1; t<nscratch; t++)
+          sw.lstr[t] = sw.lstr[0] + t*nlstr;
+      }
+      if (nitems > 1)
+        parallelrun(nthreads, nitems, streamitem, &sw);
+      /* Single item, split the chunk among the threads:                    */
+      else{
+        la->lt     = sw.lt;
+        la->nlines = sw.nlines;
+        la->lstr   = sw.lstr[0];
+        molextstrength(la, nthreads);
+        if (sw.pass == 0)
+          molextkmax(la);
+        else
+          molextadd(la, kiso[0], nthreads, sw.cnt);
+      }
+    }
+  }
+  linestreamclose(&ls);
+
+  for (t=0; t<nscratch; t++){
+    cnt.nadd  += sw.cnt[t].nadd;
+    cnt.nskip += sw.cnt[t].nskip;
+    cnt.neval += sw.cnt[t].neval;
+  }
+  molextcount(&cnt, (double)nitems*tr->ds.li->n_l);
+
+  for (n=0; n<nitems; n++)
+    molextfree(la+n);
+  free(la);
+  free(sw.lstr[0]);
+  free(sw.lstr);
+  free(sw.cnt);
   return 0;
 }
 
@@ -540,11 +1910,16 @@ interpolmolext(struct transit *tr, /* transit struct                        */
   struct molecules *mol=tr->ds.mol;
 
   long Nmol, Ntemp, Nwave;
-  PREC_RES *gtemp;
+  long *s=op->stride; /* Grid strides of layer, temp., mol., wavenumber  */
+  long klo, rowlo; /* Grid sample and row of the layer at the lower temp.  */
+  PREC_RES *gtemp,
+           *e=kiso[r],   /* Layer's extinction                              */
+           *lo;          /* A molecule's row at the lower temperature       */
+  float    *flo;
   int       *gmol;
   int itemp, imol,
-      i, m;   /* for-loop indices                                           */
-  double ext; /* Interpolated extinction coefficient                        */
+      i, j, m, n; /* for-loop indices, number of molecules to add           */
+  double wlo, whi; /* Weights of the lower and upper grid temperatures      */
 
   /* Layer temperature:                                                     */
   PREC_ATM temp = tr->atm.t[r] * tr->atm.tfct;
@@ -557,25 +1932,66 @@ interpolmolext(struct transit *tr, /* transit struct                        */
   /* Wavenumber array size:                                                 */
   Nwave = op->Nwave;
 
+  /* The grid molecules of the atmosphere, and their density times each
+     temperature weight [Nmol]:                                             */
+  int    sel[Nmol+1];
+  double clo[Nmol+1], chi[Nmol+1];
+
   /* Interpolate:                                                           */
-  /* Find index of grid-temperature immediately lower than temp:            */
+  /* Find index of grid-temperature immediately lower than temp (the last
+     grid temperature interpolates in the last interval):                   */
   itemp = binsearchapprox(gtemp, temp, 0, Ntemp);
   if (temp < gtemp[itemp])
     itemp--;
+  if (itemp == Ntemp-1 && itemp > 0)
+    itemp--;
   tr_output(TOUT_DEBUG, "Temperature: T[%i]=%.0f < %.2f < T[%.i]=%.0f\n",
     itemp, gtemp[itemp], temp, itemp+1, gtemp[itemp+1]);
 
-  for (i=0; i < Nwave; i++){
-    /* Add contribution from each molecule:                                 */
-    for (m=0; m < Nmol; m++){
-      /* Linear interpolation of the extinction coefficient:                */
-      ext = (op->o[r][itemp  ][m][i] * (gtemp[itemp+1]-temp) +
-             op->o[r][itemp+1][m][i] * (temp - gtemp[itemp]) ) /
-                                                 (gtemp[itemp+1]-gtemp[itemp]);
-      imol = valueinarray(mol->ID, gmol[m], mol->nmol);
-      kiso[r][i] += mol->molec[imol].d[r] * ext;
+  /* Once per layer: the weights, and the molecules (skip the grid
+     molecules that are not in the atmosphere) with their density:          */
+  wlo = (gtemp[itemp+1] - temp)/(gtemp[itemp+1] - gtemp[itemp]);
+  whi = (temp - gtemp[itemp]  )/(gtemp[itemp+1] - gtemp[itemp]);
+  for (n=m=0; m < Nmol; m++){
+    imol = valueinarray(mol->ID, gmol[m], mol->nmol);
+    if (imol < 0)
+      continue;
+    sel[n] = m;
+    clo[n] = mol->molec[imol].d[r] * wlo;
+    chi[n] = mol->molec[imol].d[r] * whi;
+    n++;
+  }
+
+  klo   = r*s[0] + itemp*s[1];
+  rowlo = (r*Ntemp + itemp)*Nmol;
+  /* Contiguous wavenumber rows ([layer][temp][mol][wave] order): a
+     vector multiply-add over the wavenumbers per molecule (see vecops.c):  */
+  if (op->dtype == TOPA_F64 && s[3] == 1){
+    for (j=0; j < n; j++){
+      lo = (PREC_RES *)op->grid + klo + sel[j]*s[2];
+      vecaxpy2(e, lo, clo[j], lo + s[1], chi[j], Nwave);
     }
+    return 0;
   }
+  if (op->dtype == TOPA_F32 && s[3] == 1){
+    for (j=0; j < n; j++){
+      flo = (float *)op->grid + klo + sel[j]*s[2];
+      vecaxpy(e, flo,        clo[j], Nwave);
+      vecaxpy(e, flo + s[1], chi[j], Nwave);
+    }
+    return 0;
+  }
+
+  /* Any other axis order (see opastrides()), in the [layer][wave][temp][mol]
+     order this loop reads the layer sequentially.  Reduced-precision
+     samples are decoded on the fly (see opasample()):                      */
+  for (i=0; i < Nwave; i++)
+    for (j=0; j < n; j++){
+      m = sel[j];
+      e[i] += clo[j]*opasample(op, klo + m*s[2] + i*s[3], rowlo + m) +
+              chi[j]*opasample(op, klo + s[1] + m*s[2] + i*s[3],
+                               rowlo + Nmol + m);
+    }
 
   return 0;
 }
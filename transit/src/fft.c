@@ -0,0 +1,180 @@
+// Copyright (C) 2015-2016 University of Central Florida. All rights reserved.
+// Transit is under an open-source, reproducible-research license (see LICENSE).
+
+/* Radix-2 fast Fourier transform of real sequences.  A real sequence of
+   length n is transformed with a complex FFT of length n/2 followed by a
+   split step.  The transform is done in place in the packed layout:
+     x[0] = X[0],  x[1] = X[n/2],  x[2k] + i x[2k+1] = X[k]  (0 < k < n/2),
+   where X[k] = sum_t x[t] exp(-2 pi i k t/n).                              */
+
+#include <transit.h>
+
+/* Plans for every power-of-two length, built on first use and kept until
+   the end of the run:                                                      */
+static struct fftplan *plans[64];
+
+
+/* FUNCTION: Get the plan for real transforms of length n (a power of two,
+   n >= 4).  Plans are shared by all threads, a plan built concurrently by
+   two threads is published only once.
+   Return: pointer to the plan                                              */
+struct fftplan *
+fftplan(long n){
+  struct fftplan *plan;
+  long k, j, bit, m=n/2;
+  int lg=0;
+
+  while ((1L<<lg) < n)
+    lg++;
+  if (plans[lg] != NULL)
+    return plans[lg];
+
+  plan = (struct fftplan *)calloc(1, sizeof(struct fftplan));
+  plan->n  = n;
+  plan->lg = lg;
+  /* Twiddle factors exp(-2 pi i k/n) for k in [0, n/2):                    */
+  plan->tw = (double *)calloc(2*m, sizeof(double));
+  for (k=0; k<m; k++){
+    plan->tw[2*k  ] =  cos(2*PI*k/n);
+    plan->tw[2*k+1] = -sin(2*PI*k/n);
+  }
+  /* Bit-reversal permutation of the length-n/2 complex transform:          */
+  plan->rev = (long *)calloc(m, sizeof(long));
+  for (k=1, j=0; k<m; k++){
+    for (bit=m>>1; j&bit; bit>>=1)
+      j ^= bit;
+    j |= bit;
+    plan->rev[k] = j;
+  }
+
+  if (!__sync_bool_compare_and_swap(plans+lg, NULL, plan)){
+    free(plan->tw);
+    free(plan->rev);
+    free(plan);
+  }
+  return plans[lg];
+}
+
+
+/* FUNCTION: In-place complex FFT of length n/2 of the interleaved array z,
+   forward (sign=-1) or unnormalized backward (sign=1).                    */
+static void
+fftcomplex(struct fftplan *plan,
+           double *z,
+           int sign){
+  long m=plan->n/2, len, half, i, k, step, a, b;
+  double *tw=plan->tw, wr, wi, tr, ti;
+
+  for (i=1; i<m; i++)
+    if (plan->rev[i] > i){
+      k = plan->rev[i];
+      tr = z[2*i];  z[2*i]   = z[2*k];   z[2*k]   = tr;
+      ti = z[2*i+1]; z[2*i+1] = z[2*k+1]; z[2*k+1] = ti;
+    }
+
+  for (len=2; len<=m; len<<=1){
+    half = len/2;
+    /* exp(-2 pi i k/len) = tw[k*step], the n-point table:                  */
+    step = plan->n/len;
+    for (i=0; i<m; i+=len)
+      for (k=0; k<half; k++){
+        wr =       tw[2*k*step];
+        wi = -sign*tw[2*k*step+1];
+        a = 2*(i+k);
+        b = a + 2*half;
+        tr = wr*z[b]   - wi*z[b+1];
+        ti = wr*z[b+1] + wi*z[b];
+        z[b]   = z[a]   - tr;
+        z[b+1] = z[a+1] - ti;
+        z[a]   += tr;
+        z[a+1] += ti;
+      }
+  }
+}
+
+
+/* FUNCTION: In-place forward transform of the real array x of length
+   plan->n into the packed layout.                                          */
+void
+fftreal(struct fftplan *plan,
+        double *x){
+  long m=plan->n/2, k;
+  double er, ei, or, oi, wr, wi, tr, ti, x0;
+
+  fftcomplex(plan, x, -1);
+
+  /* Split Z[k] = FFT(x[2t] + i x[2t+1]) into the real-sequence transform:
+     X[k] = E - i w O,  X[m-k] = conj(E + i w O),  with w = exp(-2 pi i k/n),
+     E = (Z[k] + conj(Z[m-k]))/2,  O = (Z[k] - conj(Z[m-k]))/2:             */
+  x0   = x[0];
+  x[0] = x0 + x[1];
+  x[1] = x0 - x[1];
+  for (k=1; k<=m/2; k++){
+    er = 0.5*(x[2*k]   + x[2*(m-k)]);
+    ei = 0.5*(x[2*k+1] - x[2*(m-k)+1]);
+    or = 0.5*(x[2*k]   - x[2*(m-k)]);
+    oi = 0.5*(x[2*k+1] + x[2*(m-k)+1]);
+    wr = plan->tw[2*k];
+    wi = plan->tw[2*k+1];
+    /* i w O:                                                               */
+    tr = -(wr*oi + wi*or);
+    ti =   wr*or - wi*oi;
+    x[2*k]       =  er - tr;
+    x[2*k+1]     =  ei - ti;
+    x[2*(m-k)]   =  er + tr;
+    x[2*(m-k)+1] = -ei - ti;
+  }
+}
+
+
+/* FUNCTION: In-place inverse of fftreal(), including the 1/n scaling.      */
+void
+fftrealinv(struct fftplan *plan,
+           double *x){
+  long m=plan->n/2, k;
+  double er, ei, or, oi, wr, wi, dr, di, x0;
+
+  /* Undo the split step, Z[k] = E + O,  Z[m-k] = conj(E - O),  with
+     O = i conj(w) (X[k] - conj(X[m-k]))/2:                                 */
+  x0   = x[0];
+  x[0] = 0.5*(x0 + x[1]);
+  x[1] = 0.5*(x0 - x[1]);
+  for (k=1; k<=m/2; k++){
+    er = 0.5*(x[2*k]   + x[2*(m-k)]);
+    ei = 0.5*(x[2*k+1] - x[2*(m-k)+1]);
+    dr = 0.5*(x[2*k]   - x[2*(m-k)]);
+    di = 0.5*(x[2*k+1] + x[2*(m-k)+1]);
+    wr =  plan->tw[2*k];
+    wi = -plan->tw[2*k+1];
+    /* i (wr + i wi) (dr + i di):                                           */
+    or = -(wr*di + wi*dr);
+    oi =   wr*dr - wi*di;
+    x[2*k]       =  er + or;
+    x[2*k+1]     =  ei + oi;
+    x[2*(m-k)]   =  er - or;
+    x[2*(m-k)+1] = -(ei - oi);
+  }
+
+  fftcomplex(plan, x, 1);
+  for (k=0; k<2*m; k++)
+    x[k] /= m;
+}
+
+
+/* FUNCTION: Multiply in place the packed transform x by the packed
+   transform y, both of length n.                                           */
+void
+fftmultiply(double *x,
+            const double *y,
+            long n){
+  long k;
+  double xr;
+
+  x[0] *= y[0];
+  x[1] *= y[1];
+  for (k=2; k<n; k+=2){
+    xr     = x[k]*y[k]   - x[k+1]*y[k+1];
+    x[k+1] = x[k]*y[k+1] + x[k+1]*y[k];
+    x[k]   = xr;
+  }
+}
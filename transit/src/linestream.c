@@ -0,0 +1,237 @@
+// Copyright (C) 2015-2016 University of Central Florida. All rights reserved.
+// Transit is under an open-source, reproducible-research license (see LICENSE).
+
+/* Streaming of the line transitions from the TLI file, for line lists that
+   do not fit in memory (tr->linebuffer > 0).  The lines are handed out in
+   chunks of ls->chunksize lines.  A reader thread fills one buffer while
+   the caller works on the other one.  Chunks never span two isotope
+   ranges, and a chunk ends only where the next line cannot be co-added to
+   the previous one (see linebreak() in extinction.c), so that a chunked
+   computation adds the same profiles as one over the whole list; a chunk
+   without such a break grows its buffer until it has one.  Chunks of TLI
+   v7 files start and end at block boundaries, so that the records are
+   read as they are.                                                        */
+
+#include <transit.h>
+
+/* Bytes per line of the two chunk buffers (records and block
+   wavenumbers), plus the columns read from a TLI v6 file:                  */
+#define LS_LINEBYTES (2*(sizeof(struct linerecord) + 1) +                \
+                      3*sizeof(PREC_LNDATA) + sizeof(short))
+
+
+/* FUNCTION: Grow buffer 'slot' to hold n lines, keeping its contents.     */
+static void
+linestreamgrow(struct linestream *ls,
+               int slot,
+               PREC_NREC n){
+  struct line_transition *lt = ls->buf + slot;
+
+  lt->rec    = (struct linerecord *)realloc(lt->rec,
+                                            n*sizeof(struct linerecord));
+  lt->wnbase = (double *)realloc(lt->wnbase,
+                                 (n>>LT_BLOCKBITS)*sizeof(double));
+  if (lt->rec == NULL || lt->wnbase == NULL){
+    tr_output(TOUT_ERROR, "Cannot allocate the line buffers (%li "
+      "lines).\n", n);
+    exit(EXIT_FAILURE);
+  }
+  ls->size[slot] = n;
+}
+
+
+/* FUNCTION: Read the next chunk of lines into buffer 'slot', starting at
+   the current reading position, and advance the position.  A chunk that
+   holds no chain break grows its buffer until it reaches one, so that no
+   co-added chain is split.
+   Return: the number of lines read, 0 at the end of the line list          */
+static PREC_NREC
+readchunk(struct linestream *ls,
+          int slot){
+  struct transit *tr = ls->tr;
+  struct lineinfo *li = tr->ds.li;
+  struct line_transition *lt = ls->buf + slot;
+  PREC_NREC n, b, first;
+  double odwn = tr->owns.d/tr->owns.o;
+  /* TLI v7 chunks must end at a block boundary:                            */
+  int step = li->tli_ver < 7 ? 1 : LT_BLOCK;
+
+  while (ls->rng < li->nrng && ls->pos >= li->rngn[ls->rng]){
+    ls->rng++;
+    ls->pos = 0;
+  }
+  if (ls->rng == li->nrng)
+    return 0;
+
+  first = li->rngfirst[ls->rng] + ls->pos;
+  while (1){
+    n = li->rngn[ls->rng] - ls->pos;
+    if (n > ls->size[slot])
+      n = ls->size[slot];
+
+    if (li->tli_ver < 7)
+      readlinecols(ls->fp, li, lt, 0, first, n);
+    else
+      readlinerecs(ls->fp, li, lt, 0, first, n);
+
+    /* The rest of the range fits in the chunk:                             */
+    if (ls->pos + n == li->rngn[ls->rng])
+      break;
+    /* Else end the chunk before the last line that starts a new co-added
+       chain (the rest is read again):                                      */
+    for (b=n-step; b>0; b-=step)
+      if (ltwn(lt, b-1) - ltwn(lt, b) >= 2*odwn)
+        break;
+    if (b > 0){
+      n = b;
+      break;
+    }
+    tr_output(TOUT_WARN, "A chain of co-added lines is longer than a chunk "
+      "of %li lines, growing the line buffer to %li lines.\n", n, 2*n);
+    linestreamgrow(ls, slot, 2*ls->size[slot]);
+  }
+  ls->pos += n;
+  return n;
+}
+
+
+/* FUNCTION: Reader thread, fill the buffers alternately until the end of
+   the line list.                                                           */
+static void *
+linereader(void *arg){
+  struct linestream *ls = (struct linestream *)arg;
+  PREC_NREC n;
+  int slot = 0;
+
+  do{
+    pthread_mutex_lock(&ls->lock);
+    while (ls->filled[slot] || ls->held == slot)
+      pthread_cond_wait(&ls->cond, &ls->lock);
+    pthread_mutex_unlock(&ls->lock);
+
+    n = readchunk(ls, slot);
+
+    pthread_mutex_lock(&ls->lock);
+    ls->nbuf[slot]   = n;
+    ls->filled[slot] = 1;
+    pthread_cond_broadcast(&ls->cond);
+    pthread_mutex_unlock(&ls->lock);
+    slot ^= 1;
+  } while (n > 0);
+  return NULL;
+}
+
+
+/* FUNCTION: Open the TLI file for streaming and allocate the buffers.
+   The number of lines per chunk is set such that the buffers plus
+   'extra' bytes per line used by the caller fit in tr->linebuffer.        */
+void
+linestreamopen(struct transit *tr,
+               struct linestream *ls,
+               long extra){
+  int k;
+
+  memset(ls, 0, sizeof(struct linestream));
+  ls->tr = tr;
+  if ((ls->fp=fopen(tr->f_line, "rb")) == NULL){
+    tr_output(TOUT_ERROR, "Cannot open the TLI file '%s' to stream the "
+      "line transitions.\n", tr->f_line);
+    exit(EXIT_FAILURE);
+  }
+
+  /* A whole number of blocks per chunk:                                    */
+  ls->chunksize = tr->linebuffer / (LS_LINEBYTES + extra) / LT_BLOCK;
+  if (ls->chunksize < 1)
+    ls->chunksize = 1;
+  ls->chunksize *= LT_BLOCK;
+  for (k=0; k<2; k++){
+    ls->buf[k].wfct   = tr->ds.li->lt.wfct;
+    ls->buf[k].efct   = tr->ds.li->lt.efct;
+    linestreamgrow(ls, k, ls->chunksize);
+  }
+  pthread_mutex_init(&ls->lock, NULL);
+  pthread_cond_init(&ls->cond, NULL);
+  tr_output(TOUT_DEBUG, "Line stream of %li lines per chunk.\n",
+    ls->chunksize);
+}
+
+
+/* FUNCTION: Wait for the reader thread of the current pass, if any.        */
+static void
+linestreamjoin(struct linestream *ls){
+  if (ls->running)
+    pthread_join(ls->reader, NULL);
+  ls->running = 0;
+}
+
+
+/* FUNCTION: Start a pass over the line list from the first line.  The
+   reader thread starts filling the first buffer right away.                */
+void
+linestreamstart(struct linestream *ls){
+  linestreamjoin(ls);
+  ls->rng  = 0;
+  ls->pos  = 0;
+  ls->held = -1;
+  ls->next = 0;
+  ls->filled[0] = ls->filled[1] = 0;
+  if (pthread_create(&ls->reader, NULL, linereader, ls) == 0)
+    ls->running = 1;
+  else
+    tr_output(TOUT_WARN, "Could not start the line-reader thread, the "
+      "lines will be read without overlapping the computation.\n");
+}
+
+
+/* FUNCTION: Release the chunk handed out by the previous call, and get the
+   next chunk of the pass.
+   Return: the chunk lines, NULL at the end of the pass                    */
+struct line_transition *
+linestreamnext(struct linestream *ls,
+               PREC_NREC *n){
+  int slot;
+
+  /* No reader thread, read synchronously into the first buffer:            */
+  if (!ls->running){
+    *n = readchunk(ls, 0);
+    return *n > 0 ? ls->buf : NULL;
+  }
+
+  pthread_mutex_lock(&ls->lock);
+  if (ls->held >= 0){
+    ls->filled[ls->held] = 0;
+    ls->held = -1;
+    pthread_cond_broadcast(&ls->cond);
+  }
+  slot = ls->next;
+  while (!ls->filled[slot])
+    pthread_cond_wait(&ls->cond, &ls->lock);
+  *n = ls->nbuf[slot];
+  if (*n > 0){
+    ls->held = slot;
+    ls->next = slot ^ 1;
+  }
+  pthread_mutex_unlock(&ls->lock);
+
+  return *n > 0 ? ls->buf+slot : NULL;
+}
+
+
+/* FUNCTION: Close the TLI file and free the buffers.                       */
+void
+linestreamclose(struct linestream *ls){
+  PREC_NREC n;
+  int k;
+
+  /* Let the reader run to the end of the pass:                             */
+  while (ls->running && linestreamnext(ls, &n) != NULL)
+    ;
+  linestreamjoin(ls);
+  for (k=0; k<2; k++){
+    free(ls->buf[k].rec);
+    free(ls->buf[k].wnbase);
+  }
+  pthread_mutex_destroy(&ls->lock);
+  pthread_cond_destroy(&ls->cond);
+  fclose(ls->fp);
+}
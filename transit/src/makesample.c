@@ -380,6 +380,32 @@ makewnsample(struct transit *tr){
   }
   rsamp.d = hsamp->d;
 
+  /* Shard of the opacity grid (--opashard): its own share of the
+     wavenumbers, padded on both sides by the reach of the widest line
+     profile, so that the lines just outside the share are included:        */
+  tr->opacore[0] = 0;
+  tr->opacore[1] = 0;
+  if (tr->opanshard > 1){
+    long n = ((1.0+1e-8)*rsamp.f - rsamp.i)/rsamp.d + 1, /* Whole sample    */
+         c0 = n* tr->opashard     /tr->opanshard,  /* Shard's own range     */
+         c1 = n*(tr->opashard + 1)/tr->opanshard,
+         pad = ceil(tr->timesalpha*fmax(th->dmax, th->lmax)/rsamp.d),
+         e0 = c0 - pad < 0 ? 0 : c0 - pad,         /* Padded range          */
+         e1 = c1 + pad > n ? n : c1 + pad;
+    if (c1 <= c0){
+      tr_output(TOUT_ERROR, "Opacity shard %d of %d holds no wavenumbers "
+        "(the sample has %ld).\n", tr->opashard, tr->opanshard, n);
+      exit(EXIT_FAILURE);
+    }
+    rsamp.f = rsamp.i + (e1-1)*rsamp.d;
+    rsamp.i = rsamp.i +  e0   *rsamp.d;
+    tr->opacore[0] = c0 - e0;
+    tr->opacore[1] = c1 - c0;
+    tr_output(TOUT_INFO, "Opacity shard %d of %d: wavenumbers %ld to %ld "
+      "of %ld, padded to %ld to %ld.\n", tr->opashard, tr->opanshard, c0,
+      c1-1, n, e0, e1-1);
+  }
+
   /* Make the oversampled wavenumber sampling:                              */
   res = makesample1(&tr->owns, &rsamp, TRH_WN);
   /* Make the wavenumber sampling:                                          */
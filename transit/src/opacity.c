@@ -2,6 +2,81 @@
 // Transit is under an open-source, reproducible-research license (see LICENSE).
 
 #include <transit.h>
+#include <sched.h>
+#include <stddef.h>
+
+/* FUNCTION: Open the opacity file 'name' for reading and writing, creating
+   it if it does not exist.  An existing file is not truncated: only the
+   process that holds its lock starts it over (see beginopacity()).
+   Return: the file, NULL if it cannot be opened                            */
+static FILE *
+opaopen(char *name){
+  FILE *fp;
+  int fd;
+
+  if ((fd = open(name, O_RDWR | O_CREAT, 0644)) < 0)
+    return NULL;
+  if ((fp = fdopen(fd, "r+b")) == NULL)
+    close(fd);
+  return fp;
+}
+
+
+/* FUNCTION: Wait until no process is computing the opacity file fp (see
+   beginopacity()), which may then be finished.
+   Return: the size of the file, -1 if it cannot be read                    */
+static long
+opawait(struct transit *tr,
+        FILE *fp){
+  struct flock lock;
+  struct stat st;
+  int fd = fileno(fp);
+
+  memset(&lock, 0, sizeof(struct flock));
+  lock.l_type   = F_RDLCK;
+  lock.l_whence = SEEK_SET;
+  if (fcntl(fd, F_SETLK, &lock) != 0){
+    tr_output(TOUT_INFO, "Waiting for another process computing the "
+      "opacity file '%s'.\n", tr->f_opa);
+    while (fcntl(fd, F_SETLKW, &lock) != 0 && errno == EINTR)
+      ;
+  }
+  lock.l_type = F_UNLCK;
+  fcntl(fd, F_SETLK, &lock);
+  return fstat(fd, &st) == 0 ? (long)st.st_size : -1;
+}
+
+
+/* FUNCTION: Calculate the grid of opacities into the opacity file
+   tr->fp_opa (open for reading and writing), resuming the blocks left by
+   an interrupted calculation, and map the finished file for this run.     */
+static void
+buildopacity(struct transit *tr){
+  /* Calculate Voigt profiles:                                              */
+  tr_output(TOUT_INFO, "Calculating grid of Voigt profiles.\n");
+  calcprofiles(tr);
+
+  /* Calculate the grid of opacities:                                       */
+  tr_output(TOUT_INFO, "Calculating new grid of opacities: '%s'.\n",
+                             tr->f_opa);
+  calcopacity(tr, tr->fp_opa);
+  saveprofiles(tr, 1);
+
+  /* Free the line-transition memory:                                       */
+  freemem_linetransition(&tr->ds.li->lt, &tr->pi);
+  tr->pi |= TRPI_READDATA;
+  tr->pi |= TRPI_READINFO;
+
+  if (mapopacity(tr, tr->fp_opa) != 0){
+    tr_output(TOUT_ERROR, "Cannot map the new opacity file '%s'.\n",
+      tr->f_opa);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Set progress indicator:                                                */
+  tr->pi |= TRPI_OPACITY;
+}
+
 
 /* FUNCTION:  Calculate the opacity due to molecular transitions.
    Return: 0 on success                                                     */
@@ -9,6 +84,7 @@ int
 opacity(struct transit *tr){
   struct transithint *th = tr->ds.th; /* transithint struct                 */
   static struct opacity op;           /* The opacity struct                 */
+  int rn;
 
   /* Set the opacity struct's mem to 0:                                     */
   memset(&op, 0, sizeof(struct opacity));
@@ -39,8 +115,9 @@ opacity(struct transit *tr){
   /* Opacity file specified, but it just doesn't exist yet:                 */
   if (file_exists == -1) {
 
-    /* Open file for writing:                                               */
-    tr->fp_opa = fopen(tr->f_opa, "wb");
+    /* Open file for writing (and mapping), without truncating the file of
+       a process that created it meanwhile:                                 */
+    tr->fp_opa = opaopen(tr->f_opa);
 
     /* Immediately return if the file could not be opened:                  */
     if (tr->fp_opa == NULL){
@@ -49,22 +126,8 @@ opacity(struct transit *tr){
       return -1;
     }
 
-    /* Calculate Voigt profiles:                                            */
-    tr_output(TOUT_INFO, "Calculating grid of Voigt profiles.\n");
-    calcprofiles(tr);
-
     /* Calculate the grid of opacities:                                     */
-    tr_output(TOUT_INFO, "Calculating new grid of opacities: '%s'.\n",
-                               tr->f_opa);
-    calcopacity(tr, tr->fp_opa);
-
-    /* Free the line-transition memory:                                     */
-    freemem_linetransition(&tr->ds.li->lt, &tr->pi);
-    tr->pi |= TRPI_READDATA;
-    tr->pi |= TRPI_READINFO;
-
-    /* Set progress indicator and return success:                           */
-    tr->pi |= TRPI_OPACITY;
+    buildopacity(tr);
     return 0;
   }
 
@@ -86,135 +149,458 @@ opacity(struct transit *tr){
     return 0;
   }
 
-  /* Should attempt to use shared memory:                                   */
-  if (tr->opashare) {
-
-    /* Get ID or create shared opacityhint struct:                          */
-    key_t hintkey = ftok(tr->f_opa, 'a');
-    op.hintID = shmget(hintkey, sizeof(struct opacityhint), 0644 | IPC_CREAT);
+  /* Wait for a process computing the file.  An empty file was just
+     created by a process that has not locked it yet: join it:              */
+  if (opawait(tr, tr->fp_opa) == 0){
+    fclose(tr->fp_opa);
+    if ((tr->fp_opa = opaopen(tr->f_opa)) == NULL){
+      tr_output(TOUT_ERROR, "Opacity filename '%s' cannot be opened for "
+        "writing.\n", tr->f_opa);
+      exit(EXIT_FAILURE);
+    }
+    buildopacity(tr);
+    return 0;
+  }
 
-    /* If reserving the hint segment was unsuccessful, give up:             */
-    if (op.hintID == -1) {
+  /* Extend the grid with the run's temperatures and molecules it lacks:    */
+  if (tr->opaextend && extendopacity(tr) == 0)
+    return 0;
 
-      tr_output(TOUT_WARN, "Could not get hint shared memory ID.\n");
+  /* Map the grid of opacities of a file with header, the processes of a
+     node share it through the page cache:                                  */
+  rn = mapopacity(tr, tr->fp_opa);
+  if (rn == 0){
+    tr_output(TOUT_INFO, "Mapped opacity file: '%s'.\n", tr->f_opa);
+    tr->pi |= TRPI_OPACITY;
+    return 0;
+  }
+  /* Resume the calculation of a partial grid:                              */
+  if (rn == 2){
+    fclose(tr->fp_opa);
+    tr->fp_opa = fopen(tr->f_opa, "r+b");
+    if (tr->fp_opa == NULL){
+      tr_output(TOUT_ERROR, "Partial opacity file '%s' cannot be opened "
+        "for writing.\n", tr->f_opa);
+      exit(EXIT_FAILURE);
+    }
+    buildopacity(tr);
+    return 0;
+  }
+  if (rn < 0){
+    tr_output(TOUT_ERROR, "Invalid opacity file '%s'.  Delete it to "
+      "recalculate it.\n", tr->f_opa);
+    exit(EXIT_FAILURE);
+  }
+  tr_output(TOUT_WARN, "Opacity file '%s' has no header (version 1), it "
+    "will be read into memory.  Delete it to recalculate it in the "
+    "current version, which is memory mapped.\n", tr->f_opa);
+  rewind(tr->fp_opa);
 
+  /* Share the grid among the processes of the node that read the file:    */
+  if (tr->opashare) {
+    tr_output(TOUT_INFO, "Sharing opacity file: '%s'.\n", tr->f_opa);
+    if (shareopacity(tr, tr->fp_opa) != 0) {
       /* Read the grid of opacities from file:                              */
       tr_output(TOUT_INFO, "Reading opacity file: '%s'.\n", tr->f_opa);
-      readopacity(tr, tr->fp_opa);
-
-      /* Set progress indicator and return success:                         */
-      tr->pi |= TRPI_OPACITY;
-      return 0;
+      rewind(tr->fp_opa);
+      rn = readopacity(tr, tr->fp_opa);
     }
+  }
 
-    /* Attach to the hint shared memory segment:                            */
-    op.hint = shmat(op.hintID, (void *) 0, 0);
+  /* Should not attempt to use shared memory:                               */
+  else {
 
-    /* If attaching was unsuccessful, give up.                              */
-    if (op.hint == (struct opacityhint *) -1) {
+    /* Read the grid of opacities from file:                                */
+    tr_output(TOUT_INFO, "Reading opacity file: '%s'.\n", tr->f_opa);
+    rn = readopacity(tr, tr->fp_opa);
+  }
+  if (rn < 0){
+    tr_output(TOUT_ERROR, "Invalid opacity file '%s'.  Delete it to "
+      "recalculate it.\n", tr->f_opa);
+    exit(EXIT_FAILURE);
+  }
 
-      tr_output(TOUT_WARN, "Could not attach to hint shared memory.\n");
+  /* Set progress indicator and return success:                           */
+  tr->pi |= TRPI_OPACITY;
+  return 0;
+}
 
-      /* Read the grid of opacities from file:                              */
-      tr_output(TOUT_INFO, "Reading opacity file: '%s'.\n", tr->f_opa);
-      readopacity(tr, tr->fp_opa);
 
-      /* Set progress indicator and return success:                         */
-      tr->pi |= TRPI_OPACITY;
-      return 0;
-    }
+/* FUNCTION: Continue the 64-bit FNV-1a hash h over the n bytes of buf.     */
+static unsigned long
+fnv1a(unsigned long h,
+      const void *buf,
+      size_t n){
+  const unsigned char *c = (const unsigned char *)buf;
+
+  while (n--)
+    h = (h ^ *c++) * 0x100000001b3UL;
+  return h;
+}
 
-    /* If no process has claimed to be the master, claim it:                */
-    if (op.hint->master_PID == 0)
-      op.hint->master_PID = getpid();
 
-    /* Wait a few cycles in case multiple processes claimed it at once:     */
-    int i;
-    for (i = 0; i < 10; i++);
+/* Parameters that determine the Voigt-profile grid, the key of the
+   profile cache file:                                                      */
+struct profcachekey{
+  double dwn;          /* Profile sampling interval (wns.d/owns.o)          */
+  double dmin, dmax,   /* Doppler-width range                               */
+         lmin, lmax;   /* Lorentz-width range                               */
+  long nwave;          /* Maximum profile half-size (owns.n)                */
+  double proftol;      /* Adaptive width-grid tolerance (0 for log-spaced)  */
+  int nDop, nLor;      /* Number of width samples                           */
+  int ofactor;         /* Oversampling factor (phase split)                 */
+  float timesalpha;    /* Profile half-width in units of the largest width  */
+};
+
+/* Header of the profile cache file.  It is followed by the profile
+   half-sizes, the arena offsets, and the profile states (op->profsize,
+   op->profoff, and op->profstate, each [nDop*nLor] longs), and, at byte
+   'data', by the profile arena.  Only the TPROF_READY profiles are set.   */
+struct profcachehead{
+  char magic[8];       /* "TRVOIGT"                                         */
+  int version;         /* profcacheversion                                  */
+  int voigtsize;       /* sizeof(PREC_VOIGT)                                */
+  struct profcachekey key; /* Grid parameters                               */
+  long data;           /* File offset of the profile arena                  */
+  long size;           /* File size                                         */
+};
+
+
+/* FUNCTION: Set the key of the profile grid of tr.                        */
+static void
+profcachekey(struct transit *tr,
+             struct profcachekey *key){
+  struct transithint *th = tr->ds.th;
+
+  /* Zero the padding, the key is compared byte by byte:                    */
+  memset(key, 0, sizeof(struct profcachekey));
+  key->dwn   = tr->wns.d/tr->owns.o;
+  key->dmin  = th->dmin;
+  key->dmax  = th->dmax;
+  key->lmin  = th->lmin;
+  key->lmax  = th->lmax;
+  key->nwave = tr->owns.n;
+  key->nDop  = tr->ds.op->nDop;
+  key->nLor  = tr->ds.op->nLor;
+  key->proftol = th->proftol;
+  key->ofactor    = tr->owns.o;
+  key->timesalpha = tr->timesalpha;
+}
 
-    /* Check again to see if this process claimed the memory:               */
-    if (op.hint->master_PID == getpid()) {
 
-      /* Share the grid of opacities from file:                             */
-      tr_output(TOUT_INFO, "Sharing opacity file: '%s'.\n", tr->f_opa);
+/* FUNCTION: Name the default profile cache file after the user and the
+   key of the profile grid, in the directory tr->profcachedir, so that
+   runs with other profile parameters, or of other users, keep their own
+   cache files.                                                             */
+static void
+profcachename(struct transit *tr,
+              struct profcachekey *key){
+  struct transithint *th = tr->ds.th;
+
+  th->f_profcache = (char *)realloc(th->f_profcache,
+                                    strlen(tr->profcachedir)+48);
+  sprintf(th->f_profcache, "%s/transit_voigt.%u.%016lx.cache",
+          tr->profcachedir, (unsigned int)geteuid(),
+          fnv1a(0xcbf29ce484222325UL, key, sizeof(struct profcachekey)));
+  tr->f_profcache = th->f_profcache;
+}
 
-      if (shareopacity(tr, tr->fp_opa) || mountopacity(tr)) {
 
-        tr_output(TOUT_WARN, "Shared memory sh/mt error. Aborting.\n");
-        op.hint->status |= TSHM_ERROR;
+/* FUNCTION: Map the profile cache file tr->f_profcache and point the
+   profile arena of tr->ds.op into it.  The half-sizes and offsets of the
+   file must match those of op.  The mapping is private: the pages of the
+   cached profiles stay shared with other processes through the page
+   cache, while the profiles missing from the file can still be computed
+   into it.  A default cache file (see profcachename()) is only read if
+   it belongs to the user.
+   Return: 0 on success, 1 if there is no cache file for this key           */
+static int
+readprofcache(struct transit *tr,
+              struct profcachekey *key){
+  struct opacity *op=tr->ds.op;
+  struct profcachehead *head;
+  struct stat st;
+  FILE *fp;
+  void *map;
+  long c, ncell=(long)op->nDop*op->nLor, *psize, *off, *state;
+
+  if ((fp=fopen(tr->f_profcache, "rb")) == NULL)
+    return 1;
+  if (fstat(fileno(fp), &st) != 0 ||
+      (tr->profcachedir != NULL && st.st_uid != geteuid()) ||
+      st.st_size < sizeof(struct profcachehead) + 3*ncell*sizeof(long)){
+    fclose(fp);
+    return 1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+             fileno(fp), 0);
+  fclose(fp);
+  if (map == MAP_FAILED)
+    return 1;
 
-        /* Read the grid of opacities from file:                            */
-        tr_output(TOUT_INFO, "Reading opacity file: '%s'.\n",
-                                    tr->f_opa);
-        readopacity(tr, tr->fp_opa);
-      }
+  /* Check the version, key, and arena layout:                              */
+  head  = (struct profcachehead *)map;
+  psize = (long *)(head + 1);
+  off   = psize + ncell;
+  state = off   + ncell;
+  if (strncmp(head->magic, "TRVOIGT", 8) != 0              ||
+      head->version   != profcacheversion                  ||
+      head->voigtsize != sizeof(PREC_VOIGT)                ||
+      memcmp(&head->key, key, sizeof(struct profcachekey)) ||
+      head->size != st.st_size || head->data % 64 != 0     ||
+      head->data + op->profarenasize*sizeof(PREC_VOIGT) != head->size){
+    munmap(map, st.st_size);
+    return 1;
+  }
+  for (c=0; c<ncell; c++)
+    if (psize[c] != op->profsize[0][c] || off[c] != op->profoff[c]){
+      munmap(map, st.st_size);
+      return 1;
+    }
 
-      /* Assuming that all processes have attached to the two shared
-         memory segments, mark them for destruction as soon as all of the
-         processes have detached.                                           */
-      struct shmid_ds buf1, buf2;
-      shmctl(op.hintID, IPC_STAT, &buf1);
+  for (c=0; c<ncell; c++)
+    op->profstate[c] = state[c] == TPROF_READY ? TPROF_READY : TPROF_EMPTY;
+  op->profarena   = (PREC_VOIGT *)((char *)map + head->data);
+  op->profmap     = map;
+  op->profmapsize = st.st_size;
+  return 0;
+}
 
-      do {
-        shmctl(op.mainID, IPC_STAT, &buf2);
-      }
-      while (buf2.shm_nattch != buf1.shm_nattch);
 
-      tr_output(TOUT_DEBUG, "Marking shared memory for removal.\n");
-      shmctl(op.hintID, IPC_RMID, &buf1);
-      shmctl(op.mainID, IPC_RMID, &buf2);
+/* FUNCTION: Write the profile arena of tr->ds.op and the states of its
+   profiles to the profile cache file tr->f_profcache.  The file is
+   written under a temporary name and then renamed, so that other
+   processes see either the old or the new file.                            */
+static void
+writeprofcache(struct transit *tr){
+  struct opacity *op=tr->ds.op;
+  struct profcachehead head;
+  char *tmpname;
+  FILE *fp;
+  int fd, ok;
+  long c, ncell=(long)op->nDop*op->nLor, *psize, *state, npad;
+  static const char zeros[64];
+
+  psize = (long *)calloc(2*ncell, sizeof(long));
+  state = psize + ncell;
+  for (c=0; c<ncell; c++){
+    psize[c] = op->profsize[0][c];
+    state[c] = op->profstate[c] == TPROF_READY ? TPROF_READY : TPROF_EMPTY;
+  }
 
-      /* Set progress indicator and return success:                         */
-      tr->pi |= TRPI_OPACITY;
-      return 0;
+  memset(&head, 0, sizeof(struct profcachehead));
+  strncpy(head.magic, "TRVOIGT", 8);
+  head.version   = profcacheversion;
+  head.voigtsize = sizeof(PREC_VOIGT);
+  profcachekey(tr, &head.key);
+  head.data = (sizeof(struct profcachehead) + 3*ncell*sizeof(long) + 63)
+              / 64 * 64;
+  head.size = head.data + op->profarenasize*sizeof(PREC_VOIGT);
+  npad = head.data - sizeof(struct profcachehead) - 3*ncell*sizeof(long);
+
+  tmpname = (char *)calloc(strlen(tr->f_profcache)+8, sizeof(char));
+  sprintf(tmpname, "%s.XXXXXX", tr->f_profcache);
+  if ((fd=mkstemp(tmpname)) < 0 || (fp=fdopen(fd, "wb")) == NULL){
+    tr_output(TOUT_WARN, "Cannot write the Voigt-profile cache file "
+      "'%s'.\n", tr->f_profcache);
+    if (fd >= 0){
+      close(fd);
+      unlink(tmpname);
     }
+    free(tmpname);
+    free(psize);
+    return;
+  }
+  fchmod(fd, 0644);
+
+  ok  = fwrite(&head, sizeof(struct profcachehead), 1, fp) == 1;
+  ok &= fwrite(psize,       sizeof(long), ncell, fp) == ncell;
+  ok &= fwrite(op->profoff, sizeof(long), ncell, fp) == ncell;
+  ok &= fwrite(state,       sizeof(long), ncell, fp) == ncell;
+  ok &= fwrite(zeros, 1, npad, fp) == npad;
+  ok &= fwrite(op->profarena, sizeof(PREC_VOIGT), op->profarenasize, fp)
+        == op->profarenasize;
+  ok &= fflush(fp) == 0 && fsync(fd) == 0;
+  ok &= fclose(fp) == 0;
+  /* A cache file of another user in a sticky directory (e.g., /tmp)
+     cannot be replaced, and is left as is:                                 */
+  if (ok && rename(tmpname, tr->f_profcache) == 0)
+    tr_output(TOUT_INFO, "Saved the Voigt profiles to the cache file "
+      "'%s'.\n", tr->f_profcache);
+  else{
+    tr_output(TOUT_WARN, "Cannot write the Voigt-profile cache file "
+      "'%s': %s.\n", tr->f_profcache, strerror(errno));
+    unlink(tmpname);
+  }
+  free(tmpname);
+  free(psize);
+}
 
-    else {
 
-      while ((op.hint->status & TSHM_WRITTEN) == 0) {
+/* FUNCTION: Whether the profile of Doppler width i and Lorentz width j is
+   taken from the previous Doppler width, because the Doppler width <<
+   Lorentz width.                                                           */
+static inline int
+profalias(struct opacity *op,
+          int i,
+          int j){
+  return op->aDop[i]*10.0 < op->aLor[j]  &&  i != 0;
+}
 
-        /* If there's an error with the shared memory, abort.               */
-        if (op.hint->status & TSHM_ERROR) {
 
-          tr_output(TOUT_WARN, "Shared memory error. Aborting.\n");
+/* FUNCTION: Compute the half Voigt profile of cell (idop, ilor) of the
+   width grid, and its phase-split copy, into the cell's slot of the
+   profile arena, unless it is already computed.  An aliased cell takes the
+   profile of its source cell.  The first thread to claim an empty cell
+   computes it and then publishes it by setting its state to TPROF_READY
+   (release); the threads that find it busy wait for that.  A thread that
+   reads TPROF_READY (acquire) sees the whole profile.                      */
+void
+makeprofile(struct transit *tr,
+            int idop,
+            int ilor){
+  struct opacity *op=tr->ds.op;     /* Opacity struct                       */
+  long c = (long)idop*op->nLor + ilor, s;
+  int i = idop, state;
+  PREC_VOIGT *half;
+
+  /* Source cell of the profile:                                            */
+  while (i > 0 && profalias(op, i, ilor))
+    i--;
+  s = (long)i*op->nLor + ilor;
+
+  while ((state=__atomic_load_n(op->profstate+s, __ATOMIC_ACQUIRE))
+         != TPROF_READY){
+    if (state == TPROF_EMPTY &&
+        __sync_bool_compare_and_swap(op->profstate+s, TPROF_EMPTY,
+                                     TPROF_BUSY)){
+      half = profhalf(op, i, ilor);
+      getprofile(half, tr->wns.d/tr->owns.o, op->aDop[i], op->aLor[ilor],
+                 tr->timesalpha, tr->owns.n);
+      getphaseprofile(profphase(op, i, ilor), half, op->profsize[i][ilor]+1,
+                      tr->owns.o);
+      __sync_fetch_and_add(&op->nprofbuilt, 1);
+      __atomic_store_n(op->profstate+s, TPROF_READY, __ATOMIC_RELEASE);
+      tr_output(TOUT_DEBUG, "Profile[%2d][%2d] size = %4li  (D=%.3g, "
+        "L=%.3g).\n", i, ilor, 2*op->profsize[i][ilor]+1, op->aDop[i],
+        op->aLor[ilor]);
+    }
+    else
+      sched_yield();
+  }
+  if (c != s)
+    __atomic_store_n(op->profstate+c, TPROF_READY, __ATOMIC_RELEASE);
+}
 
-          /* Read the grid of opacities from file:                          */
-          tr_output(TOUT_INFO, "Reading opacity file: '%s'.\n", tr->f_opa);
-          readopacity(tr, tr->fp_opa);
 
-          /* Set progress indicator and return success:                     */
-          tr->pi |= TRPI_OPACITY;
-          return 0;
-        }
-      }
-    }
+/* Maximum number of width samples of an adaptive width grid:             */
+#define WIDTH_MAXSAMP 1000
 
-    /* If there's an error attaching or mounting the memory, abort.     */
-    if (attachopacity(tr) || mountopacity(tr)) {
 
-      tr_output(TOUT_WARN, "Shared memory att/mt error. Aborting.\n");
+/* FUNCTION: Sample the Voigt profile of Doppler width dop and Lorentz
+   width lor over the 2*ps+1 samples of the profile grid around the center
+   (as getprofile()).                                                       */
+static void
+widthprofile(struct transit *tr,
+             double dop,
+             double lor,
+             long ps,
+             PREC_VOIGT *pr){
+  voigtn(2*ps+1, tr->wns.d/tr->owns.o*ps, lor, dop, &pr, -1,
+         2*ps+1 > _voigt_maxelements ? VOIGT_QUICK : 0);
+}
 
-      /* Read the grid of opacities from file:                          */
-      tr_output(TOUT_INFO, "Reading opacity file: '%s'.\n", tr->f_opa);
-      readopacity(tr, tr->fp_opa);
-    }
-  }
 
-  /* Should not attempt to use shared memory:                               */
-  else {
+/* FUNCTION: Error of blending the profiles of widths a0 and a1 (Doppler
+   widths if isdop, else Lorentz widths; the other width is fixed to
+   other) at their log-midpoint, with the linear weights of addlines(),
+   relative to the peak of the true profile at the midpoint.  The error is
+   measured within the extent of the narrower profile, the truncation of
+   the wings (timesalpha) does not depend on the width grid.                */
+static double
+blenderror(struct transit *tr,
+           double a0,
+           double a1,
+           double other,
+           int isdop){
+  double am = sqrt(a0*a1),
+         w  = (1/a0 - 1/am)/(1/a0 - 1/a1),
+         err=0.0;
+  long ps = profilesize(tr->wns.d/tr->owns.o, isdop ? a0 : other,
+                        isdop ? other : a0, tr->timesalpha, tr->owns.n), k;
+  PREC_VOIGT *p0, *pm, *p1;
+
+  p0 = (PREC_VOIGT *)calloc(3*(2*ps+1), sizeof(PREC_VOIGT));
+  pm = p0 + 2*ps+1;
+  p1 = pm + 2*ps+1;
+  widthprofile(tr, isdop ? a0 : other, isdop ? other : a0, ps, p0);
+  widthprofile(tr, isdop ? am : other, isdop ? other : am, ps, pm);
+  widthprofile(tr, isdop ? a1 : other, isdop ? other : a1, ps, p1);
+  for (k=0; k<2*ps+1; k++)
+    err = fmax(err, fabs((1-w)*p0[k] + w*p1[k] - pm[k]));
+  err /= pm[ps];
+  free(p0);
+  return err;
+}
 
-    /* Read the grid of opacities from file:                                */
-    tr_output(TOUT_INFO, "Reading opacity file: '%s'.\n", tr->f_opa);
-    readopacity(tr, tr->fp_opa);
-  }
 
-  /* Set progress indicator and return success:                           */
-  tr->pi |= TRPI_OPACITY;
-  return 0;
+/* FUNCTION: Append to w (*n samples so far) the widths between a0 and a1,
+   bisecting (in log scale) the intervals whose blend error exceeds
+   tol.                                                                     */
+static void
+widthsplit(struct transit *tr,
+           double a0,
+           double a1,
+           double other,
+           int isdop,
+           double tol,
+           double *w,
+           int *n){
+  double am = sqrt(a0*a1);
+
+  if (*n >= WIDTH_MAXSAMP-1 || a1 < a0*1.001 ||
+      blenderror(tr, a0, a1, other, isdop) <= tol)
+    return;
+  widthsplit(tr, a0, am, other, isdop, tol, w, n);
+  if (*n < WIDTH_MAXSAMP-1)
+    w[(*n)++] = am;
+  widthsplit(tr, am, a1, other, isdop, tol, w, n);
 }
 
 
-/*  FUNCTION:  Calculate a grid of Voigt profiles.                          */
+/* FUNCTION: Adaptive grid of widths from wmin to wmax: the widths are
+   inserted where blending the two neighbouring profiles is off by more
+   than tol of the profile peak.  The Doppler widths are checked with the
+   smallest Lorentz width and vice versa, where the profile changes
+   fastest with the width.
+   Return: the width array, its size in *n                                  */
+static double *
+widthgrid(struct transit *tr,
+          double wmin,
+          double wmax,
+          double other,
+          int isdop,
+          double tol,
+          int *n){
+  double *w = (double *)calloc(WIDTH_MAXSAMP, sizeof(double));
+
+  *n = 0;
+  w[(*n)++] = wmin;
+  if (wmax > wmin){
+    widthsplit(tr, wmin, wmax, other, isdop, tol, w, n);
+    w[(*n)++] = wmax;
+  }
+  return w;
+}
+
+
+/*  FUNCTION:  Set up the grid of Voigt profiles, of log-spaced widths or,
+    if th->proftol > 0, of the widths of widthgrid().  The half profiles and
+    their phase-split copies are stored in a single arena, each cell
+    starting on a cache line; op->profoff holds the offset of each cell.
+    Most cells are not used by a given atmosphere, so the profiles are
+    computed on first use by makeprofile(), or taken from the profile
+    cache file.                                                             */
 int
 calcprofiles(struct transit *tr){
   struct transithint *th = tr->ds.th; /* transithint struct                 */
@@ -222,21 +608,30 @@ calcprofiles(struct transit *tr){
   int i, j;                         /* for-loop indices                     */
   int nDop, nLor;                   /* Number of Doppler and Lorentz-widths */
   double Lmin, Lmax, Dmin, Dmax;    /* Minimum and maximum widths           */
-  PREC_VOIGT ***profile;            /* Grid of Voigt profiles               */
-  float timesalpha=tr->timesalpha;  /* Voigt wings width                    */
-  struct timeval tv;  /* Time-keeping variables                             */
-  double t0=0.0;
+  struct profcachekey key;          /* Profile-cache key                    */
+  long c, n, ncached;
 
-  /* Make logscale grid for the profile widths:                             */
+  /* Make logscale grid for the profile widths, or an adaptive grid:       */
   /* FINDME: Add check that these numbers make sense                        */
-  nDop = op->nDop = th->nDop;
-  nLor = op->nLor = th->nLor;
   Dmin = th->dmin;
   Dmax = th->dmax;
   Lmin = th->lmin;
   Lmax = th->lmax;
-  op->aDop = logspace(Dmin, Dmax, nDop);
-  op->aLor = logspace(Lmin, Lmax, nLor);
+  op->proftol = th->proftol;
+  if (op->proftol > 0){
+    op->aDop = widthgrid(tr, Dmin, Dmax, Lmin, 1, op->proftol, &nDop);
+    op->aLor = widthgrid(tr, Lmin, Lmax, Dmin, 0, op->proftol, &nLor);
+    tr_output(TOUT_INFO, "Adaptive width grid (tolerance %g): %d Doppler "
+      "and %d Lorentz widths.\n", op->proftol, nDop, nLor);
+  }
+  else{
+    nDop = th->nDop;
+    nLor = th->nLor;
+    op->aDop = logspace(Dmin, Dmax, nDop);
+    op->aLor = logspace(Lmin, Lmax, nLor);
+  }
+  op->nDop = nDop;
+  op->nLor = nLor;
 
   /* Allocate array for the profile half-size:                              */
   op->profsize    = (PREC_NREC **)calloc(nDop,      sizeof(PREC_NREC *));
@@ -244,40 +639,399 @@ calcprofiles(struct transit *tr){
   for (i=1; i<nDop; i++)
     op->profsize[i] = op->profsize[0] + i*nLor;
 
-  /* Allocate grid of Voigt profiles:                                       */
-  op->profile    = (PREC_VOIGT ***)calloc(nDop,      sizeof(PREC_VOIGT **));
-  op->profile[0] = (PREC_VOIGT  **)calloc(nDop*nLor, sizeof(PREC_VOIGT *));
-  for (i=1; i<nDop; i++){
-    op->profile[i] = op->profile[0] + i*nLor;
-  }
-  profile = op->profile;
-  tr_output(TOUT_RESULT, "Number of Voigt profiles: %d.\n", nDop*nLor);
-
-  t0 = timestart(tv, "Begin Voigt profiles calculation.");
-  /* Evaluate the profiles for the array of widths:                         */
+  /* Profile half-sizes and arena offsets, skipping the profiles where the
+     Doppler width << Lorentz width, which are set to the previous
+     profile.  Each cell holds 2*(profsize+1) samples, padded to a whole
+     number of cache lines:                                                 */
+  op->profoff   = (long *)calloc(nDop*nLor, sizeof(long));
+  op->profstate = (int  *)calloc(nDop*nLor, sizeof(int));
+  n = 0;
   for   (i=0; i<nDop; i++){
     for (j=0; j<nLor; j++){
-      /* Skip calculation if Doppler width << Lorentz width:                */
-      /* Set size and pointer to previous profile:                          */
-      if (op->aDop[i]*10.0 < op->aLor[j]  &&  i != 0){
+      c = i*nLor + j;
+      if (profalias(op, i, j)){
         op->profsize[i][j] = op->profsize[i-1][j];
-        profile[i][j] = profile[i-1][j];
+        op->profoff[c]     = op->profoff[c-nLor];
       }
-      else{ /* Calculate a new profile for given widths:                    */
-        op->profsize[i][j] = getprofile(&profile[i][j],
-                             tr->wns.d/tr->owns.o, op->aDop[i], op->aLor[j],
-                             timesalpha, tr->owns.n);
+      else{
+        op->profsize[i][j] = profilesize(tr->wns.d/tr->owns.o, op->aDop[i],
+                               op->aLor[j], tr->timesalpha, tr->owns.n);
+        op->profoff[c] = n;
+        n += (2*(op->profsize[i][j]+1)*sizeof(PREC_VOIGT) + 63)/64
+             * 64/sizeof(PREC_VOIGT);
       }
-      tr_output(TOUT_DEBUG, "Profile[%2d][%2d] size = %4li  (D=%.3g, "
-        "L=%.3g).\n", i, j, 2*op->profsize[i][j]+1, op->aDop[i], op->aLor[j]);
     }
   }
-  t0 = timecheck(verblevel, 0, 0, "End Voigt-profile calculation.", tv, t0);
+  op->profarenasize = n;
+  op->nprofbuilt    = 0;
+
+  /* Allocate grid of profile spectra, filled on demand by the TLE_HIST
+     engine (see histconvolve()):                                           */
+  op->pspec    = (double ***)calloc(nDop,      sizeof(double **));
+  op->pspec[0] = (double  **)calloc(nDop*nLor, sizeof(double *));
+  for (i=1; i<nDop; i++)
+    op->pspec[i] = op->pspec[0] + i*nLor;
+  tr_output(TOUT_RESULT, "Number of Voigt profiles: %d (%.1f MB).\n",
+    nDop*nLor, n*sizeof(PREC_VOIGT)/1048576.0);
+
+  /* Select the vector kernels for the profile calculation and
+     accumulation (before the worker threads use them):                     */
+  tr_output(TOUT_INFO, "Vector kernels: %s.\n",
+    veclevel() == VEC_AVX512 ? "AVX-512" :
+    veclevel() == VEC_AVX2   ? "AVX2"    : "scalar");
+
+  /* Map the profiles from the cache file if it matches this grid:        */
+  op->profmap = NULL;
+  profcachekey(tr, &key);
+  if (tr->profcachedir != NULL)
+    profcachename(tr, &key);
+  if (tr->f_profcache != NULL){
+    if (readprofcache(tr, &key) == 0){
+      for (c=0, ncached=0; c<nDop*nLor; c++)
+        ncached += op->profstate[c] == TPROF_READY;
+      tr_output(TOUT_INFO, "Read %ld Voigt profiles from the cache file "
+        "'%s'.\n", ncached, tr->f_profcache);
+    }
+  }
+
+  if (op->profmap == NULL){
+    if (posix_memalign((void **)&op->profarena, 64,
+                       (n > 0 ? n : 1)*sizeof(PREC_VOIGT)) != 0)
+      transitallocerror(n);
+    memset(op->profarena, 0, n*sizeof(PREC_VOIGT));
+  }
+
+  /* Direct/FFT crossover of the histogram convolution:                     */
+  if (tr->lineengine == TLE_HIST)
+    histcrossover(tr);
   return 0;
 }
 
+
+/* FUNCTION: Report the number of Voigt profiles computed on demand since
+   the last save, and save them to the profile cache file, if there are
+   at least nmin of them (each save rewrites the whole arena).              */
+void
+saveprofiles(struct transit *tr,
+             long nmin){
+  struct opacity *op=tr->ds.op;
+
+  if (op == NULL || op->profstate == NULL || op->nprofbuilt == 0 ||
+      op->nprofbuilt < nmin)
+    return;
+  tr_output(TOUT_RESULT, "Computed %ld Voigt profiles (of %d).\n",
+    op->nprofbuilt, op->nDop*op->nLor);
+  op->nprofbuilt = 0;
+  if (tr->f_profcache != NULL)
+    writeprofcache(tr);
+}
+
+/* Alignment of the opacity grid in the opacity file:                     */
+#define OPA_ALIGN 4096
+
+
+/* FUNCTION: Strides (in samples) of the layer, temperature, molecule,
+   and wavenumber axes of the contiguous opacity grid op->grid, which is
+   stored in the axis order op->order.                                      */
+void
+opastrides(struct opacity *op,
+           long *stride){
+  if (op->order == TOPA_LWTM){
+    stride[2] = 1;
+    stride[1] = op->Nmol;
+    stride[3] = op->Ntemp*op->Nmol;
+    stride[0] = op->Nwave*op->Ntemp*op->Nmol;
+  }
+  else{
+    stride[3] = 1;
+    stride[2] = op->Nwave;
+    stride[1] = op->Nmol*op->Nwave;
+    stride[0] = op->Ntemp*op->Nmol*op->Nwave;
+  }
+}
+
+
+/* FUNCTION: Set op->grid to the opacity grid 'grid', with strides
+   op->stride, in the axis order op->order and sample type op->dtype.  For
+   double samples in the [Nlayer][Ntemp][Nmol][Nwave] order, point op->o
+   into it too; its pointer arrays are contiguous, so that
+   freemem_opacity() frees op->o[0][0], op->o[0], and op->o.                */
+static void
+mountgrid(struct opacity *op,
+          void *grid){
+  long r, t, i, Nlayer=op->Nlayer, Ntemp=op->Ntemp, Nmol=op->Nmol,
+       *s=op->stride;
+
+  op->grid = grid;
+  if (op->order != TOPA_LTMW || op->dtype != TOPA_F64)
+    return;
+  op->o       = (PREC_RES ****)calloc(Nlayer,            sizeof(PREC_RES ***));
+  op->o[0]    = (PREC_RES  ***)calloc(Nlayer*Ntemp,      sizeof(PREC_RES **));
+  op->o[0][0] = (PREC_RES   **)calloc(Nlayer*Ntemp*Nmol, sizeof(PREC_RES *));
+  for     (r=0; r<Nlayer; r++){
+    op->o[r] = op->o[0] + r*Ntemp;
+    for   (t=0; t<Ntemp; t++){
+      op->o[r][t] = op->o[0][0] + (r*Ntemp + t)*Nmol;
+      for (i=0; i<Nmol; i++)
+        op->o[r][t][i] = (PREC_RES *)grid + r*s[0] + t*s[1] + i*s[2];
+    }
+  }
+}
+
+
+/* FUNCTION: Whether the (layer r, temperature t) block of the opacity file
+   mapped in op->opamap is written (see putopacity()).                      */
+static inline int
+opablockdone(struct opacity *op,
+             long r,
+             long t){
+  return ((char *)op->opamap)[sizeof(struct opacityhead) + r*op->Ntemp + t];
+}
+
+
+/* Arguments shared by the opacity-grid workers:                           */
+struct opacitywork{
+  struct transit *tr;
+  int nthreads;        /* Number of threads                                 */
+  long nbatch;         /* Blocks per pass over the streamed TLI file        */
+  long nitems;         /* Number of blocks to compute                       */
+  long *item;          /* Blocks to compute (r*Ntemp + t) [nitems]          */
+  int compute;         /* Whether to compute the blocks, else they are only
+                          copied from op->base                              */
+  long *btemp;         /* Index in op->base of each grid temperature, -1 if
+                          new [Ntemp], or NULL                              */
+  PREC_RES ***block;   /* Per-slot block [nslot][Nmol][Nwave]               */
+  PREC_ATM **density;  /* Per-slot density scratch  [nslot][nmol]           */
+  double **Z;          /* Per-slot partition scratch [nslot][niso]          */
+};
+
+
+/* FUNCTION: Set the density and partition-function arrays of work slot k
+   for the (layer r, temperature t) block, and clear its block.            */
+static void
+opacityslot(struct opacitywork *work,
+            int k,
+            long r,
+            long t){
+  struct transit *tr = work->tr;
+  struct opacity *op=tr->ds.op;     /* Opacity struct                       */
+  struct isotopes  *iso=tr->ds.iso; /* Isotopes struct                      */
+  struct molecules *mol=tr->ds.mol; /* Molecules struct                     */
+  int j;
+
+  for (j=0; j < mol->nmol; j++)
+    work->density[k][j] = stateeqnford(tr->ds.at->mass, mol->molec[j].q[r],
+                  tr->atm.mm[r], mol->mass[j], op->press[r], op->temp[t]);
+  for (j=0; j < iso->n_i; j++)
+    work->Z[k][j] = op->ziso[j][t];
+  memset(work->block[k][0], 0, op->Nmol*op->Nwave*sizeof(PREC_RES));
+}
+
+
+/* FUNCTION: Copy the rows of the molecules of the grid being extended,
+   op->base, into the (layer r, temperature t) block, if op->base has the
+   temperature.  Its molecules are the first ones of the grid.              */
+static void
+reuseblock(struct opacitywork *work,
+           long r,
+           long t,
+           PREC_RES **block){
+  struct opacity *op=work->tr->ds.op, *base=op->base;
+  long bt, m, w, k, *s;
+
+  if (base == NULL || (bt = work->btemp[t]) < 0)
+    return;
+  s = base->stride;
+  for (m=0; m < base->Nmol; m++){
+    k = r*s[0] + bt*s[1] + m*s[2];
+    for (w=0; w < op->Nwave; w++)
+      block[m][w] = opasample(base, k + w*s[3],
+                              (r*base->Ntemp + bt)*base->Nmol + m);
+  }
+}
+
+
+/* FUNCTION: Compute the extinction of one (layer, temperature) block of
+   the opacity grid, work item i, and write it to the opacity file.  Each
+   thread uses its own block and scratch arrays, so the result does not
+   depend on the number of threads.                                         */
+static void
+opacitylayertemp(void *arg,
+                 long i,
+                 int tid){
+  struct opacitywork *work = (struct opacitywork *)arg;
+  struct transit *tr = work->tr;
+  struct opacity *op=tr->ds.op;     /* Opacity struct                       */
+  long r = work->item[i] / op->Ntemp, /* Layer index                        */
+       t = work->item[i] % op->Ntemp; /* Temperature index                  */
+  int rn;
+
+  if (t == 0)
+    tr_output(TOUT_DEBUG, "\nOpacity Grid at layer %03ld/%03ld.\n",
+      r+1, op->Nlayer);
+
+  opacityslot(work, tid, r, t);
+  if(work->compute &&
+     (rn=computemolext(tr, work->block[tid], op->temp[t], work->density[tid],
+                       work->Z[tid], 1)) != 0){
+    tr_output(TOUT_ERROR, "extinction() returned error code %i.\n", rn);
+    exit(EXIT_FAILURE);
+  }
+  reuseblock(work, r, t, work->block[tid]);
+  putopacity(tr, r, t, work->block[tid]);
+}
+
+
+/* FUNCTION: Compute the extinction of the blocks of work with the lines
+   streamed from the TLI file, one pass over the file per batch of
+   work->nbatch blocks, and write them to the opacity file.  Each block
+   adds its lines serially, as in opacitylayertemp(), so that the grid
+   does not depend on the number of threads.                                */
+static void
+streamopacity(struct opacitywork *work){
+  struct transit *tr = work->tr;
+  struct opacity *op=tr->ds.op;     /* Opacity struct                       */
+  long i, n, k, r, t;
+  PREC_ATM *temp;
+  int rn, nthreads=tr->nthreads;
+
+  temp = (PREC_ATM *)calloc(work->nbatch, sizeof(PREC_ATM));
+  tr_output(TOUT_INFO, "Computing opacity grid with %d thread(s), streaming "
+    "the line transitions for %ld blocks at a time.\n", work->nthreads,
+    work->nbatch);
+  for (i=0; i < work->nitems; i+=n){
+    n = work->nitems - i < work->nbatch ? work->nitems - i : work->nbatch;
+    for (k=0; k<n; k++){
+      r = work->item[i+k] / op->Ntemp;
+      t = work->item[i+k] % op->Ntemp;
+      opacityslot(work, k, r, t);
+      temp[k] = op->temp[t];
+    }
+    /* A single block would otherwise be split into wavenumber tiles:      */
+    if (n == 1)
+      tr->nthreads = 1;
+    rn = streammolext(tr, n, work->block, temp, work->density, work->Z, 1);
+    tr->nthreads = nthreads;
+    if (rn != 0){
+      tr_output(TOUT_ERROR, "extinction() returned error code %i.\n", rn);
+      exit(EXIT_FAILURE);
+    }
+    for (k=0; k<n; k++){
+      r = work->item[i+k] / op->Ntemp;
+      t = work->item[i+k] % op->Ntemp;
+      reuseblock(work, r, t, work->block[k]);
+      putopacity(tr, r, t, work->block[k]);
+    }
+  }
+  free(temp);
+}
+
+
+/* Relative tolerance of a match between grid temperatures:                */
+#define OPA_TEMPTOL 1e-9
+
+/* FUNCTION: Index of the temperature temp in the n temperatures t.
+   Return: the index, -1 if temp is not there                               */
+static long
+tempindex(PREC_RES *t,
+          long n,
+          double temp){
+  long i;
+
+  for (i=0; i<n; i++)
+    if (fabs(t[i] - temp) <= OPA_TEMPTOL*temp)
+      return i;
+  return -1;
+}
+
+
+/* FUNCTION: Merge the temperatures of the grid being extended, op->base,
+   into the sorted temperatures op->temp.                                   */
+static void
+mergetemp(struct opacity *op){
+  struct opacity *base=op->base;
+  PREC_RES *temp;
+  long i=0, j=0, n=0;
+
+  temp = (PREC_RES *)calloc(op->Ntemp + base->Ntemp, sizeof(PREC_RES));
+  while (i < op->Ntemp || j < base->Ntemp){
+    if (j == base->Ntemp || (i < op->Ntemp && op->temp[i] < base->temp[j]))
+      temp[n] = op->temp[i++];
+    else
+      temp[n] = base->temp[j++];
+    /* Skip the shared temperatures:                                        */
+    if (n == 0 || fabs(temp[n] - temp[n-1]) > OPA_TEMPTOL*temp[n])
+      n++;
+  }
+  free(op->temp);
+  op->temp  = temp;
+  op->Ntemp = n;
+}
+
+
+/* FUNCTION: Whether the molecule 'name' goes in the opacity grid: all of
+   them, or only those listed in tr->opamol (see --opamol).                 */
+static int
+gridmolecule(struct transit *tr,
+             char *name){
+  char *list, *mol, *save;
+  int in = 0;
+
+  if (tr->opamol == NULL)
+    return 1;
+  list = strdup(tr->opamol);
+  for (mol=strtok_r(list, ", ", &save); mol != NULL && !in;
+       mol=strtok_r(NULL, ", ", &save))
+    in = strcmp(mol, name) == 0;
+  free(list);
+  return in;
+}
+
+
+/* FUNCTION: Hash of the inputs of the opacity grid of tr beyond its axes,
+   which a partial grid must share to be resumed: the TLI file (its size
+   and range), the extinction threshold, the Voigt-profile grid, and the
+   abundances and isotope ratios of the atmosphere.                         */
+static unsigned long
+opainputs(struct transit *tr){
+  struct transithint *th = tr->ds.th;
+  struct lineinfo  *li  = tr->ds.li;
+  struct isotopes  *iso = tr->ds.iso;
+  struct molecules *mol = tr->ds.mol;
+  struct profcachekey key;
+  struct stat st;
+  unsigned long h = 0xcbf29ce484222325UL;
+  long size = 0;
+  int j;
+
+  if (tr->f_line != NULL && stat(tr->f_line, &st) == 0)
+    size = st.st_size;
+  h = fnv1a(h, &size,     sizeof(long));
+  h = fnv1a(h, &li->n_l,  sizeof(PREC_NREC));
+  h = fnv1a(h, &li->wi,   sizeof(double));
+  h = fnv1a(h, &li->wf,   sizeof(double));
+  h = fnv1a(h, &th->ethresh, sizeof(double));
+  profcachekey(tr, &key);
+  h = fnv1a(h, &key, sizeof(struct profcachekey));
+  h = fnv1a(h, iso->isoratio, iso->n_i*sizeof(double));
+  h = fnv1a(h, mol->mass,     mol->nmol*sizeof(PREC_ZREC));
+  for (j=0; j < mol->nmol; j++)
+    h = fnv1a(h, mol->molec[j].q, tr->rads.n*sizeof(PREC_ATM));
+  h = fnv1a(h, tr->atm.mm, tr->rads.n*sizeof(double));
+  h = fnv1a(h, &tr->ds.at->mass, sizeof(_Bool));
+  return h;
+}
+
+
 /* FUNCTION:  Calculate opacities for the grid of wavenumber, radius,
-   and temperature arrays for each molecule.                                */
+   and temperature arrays for each molecule, and write them to the opacity
+   file fp (open for reading and writing) as each (layer, temperature)
+   block is done, skipping the blocks that fp already holds (see
+   beginopacity()).  When extending the grid op->base (see
+   extendopacity()), the axes are merged with its own, and its blocks are
+   reused: only the new molecules are computed at its temperatures.  The
+   grid may be a shard (see makewnsample()) of the run's molecules in
+   tr->opamol only: the isotopes of the others get no slot.                */
 int
 calcopacity(struct transit *tr,
             FILE *fp){
@@ -285,14 +1039,12 @@ calcopacity(struct transit *tr,
   struct isotopes  *iso=tr->ds.iso; /* Isotopes struct                      */
   struct molecules *mol=tr->ds.mol; /* Molecules struct                     */
   struct lineinfo *li=tr->ds.li;    /* Lineinfo struct                      */
+  struct opacity *base=op->base;    /* Grid being extended, or NULL         */
   long Nmol, Ntemp, Nlayer, Nwave;  /* Opacity-grid  dimension sizes        */
-  int i, j, t, r,                   /* for-loop indices                     */
-      rn, iso1db;
+  int i, j,                         /* for-loop indices                     */
+      iso1db;
   double *z;
-  int k;
-
-  PREC_ATM *density = (PREC_ATM *)calloc(mol->nmol, sizeof(PREC_ATM));
-  double   *Z       = (double   *)calloc(iso->n_i,  sizeof(double));
+  long k;
 
   /* Make temperature array from hinted values:                             */
   maketempsample(tr);
@@ -300,6 +1052,10 @@ calcopacity(struct transit *tr,
   op->temp = (PREC_RES *)calloc(Ntemp, sizeof(PREC_RES));
   for (i=0; i<Ntemp; i++)
     op->temp[i] = tr->temp.v[i];
+  if (base != NULL){
+    mergetemp(op);
+    Ntemp = op->Ntemp;
+  }
   /* Temperature boundaries check:                                          */
   if (op->temp[0] < li->tmin) {
     tr_output(TOUT_ERROR, "The opacity file attempted to sample a "
@@ -345,20 +1101,33 @@ calcopacity(struct transit *tr,
     op->press[i] = tr->atm.p[i]*tr->atm.pfct;
   tr_output(TOUT_RESULT, "There are %li radius samples.\n", Nlayer);
 
-  /* Make molecules array from transit:                                     */
-  Nmol = op->Nmol = tr->ds.iso->nmol;
-  op->molID = (int *)calloc(Nmol, sizeof(int));
-  tr_output(TOUT_RESULT, "There are %li molecules with line "
-    "transitions.\n", Nmol);
-  for (i=0, j=0; i<iso->n_i; i++){
+  /* Make molecules array from transit, after the molecules of the grid
+     being extended:                                                        */
+  op->molID = (int *)calloc(iso->nmol + (base ? base->Nmol : 0), sizeof(int));
+  for (j=0; base != NULL && j < base->Nmol; j++)
+    op->molID[j] = base->molID[j];
+  for (i=0; i<iso->n_i; i++){
     /* If this molecule is not yet in molID array, add it's universal ID:   */
-    if (valueinarray(op->molID, mol->ID[iso->imol[i]], j) < 0){
+    if (valueinarray(op->molID, mol->ID[iso->imol[i]], j) < 0 &&
+        gridmolecule(tr, mol->name[iso->imol[i]])){
       op->molID[j++] = mol->ID[iso->imol[i]];
       tr_output(TOUT_DEBUG, "Isotope's (%d) molecule ID: %d (%s) "
         "added at position %d.\n", i, op->molID[j-1],
         mol->name[iso->imol[i]], j-1);
     }
   }
+  Nmol = op->Nmol = j;
+  if (Nmol == 0 && tr->opamol != NULL){
+    tr_output(TOUT_ERROR, "None of the molecules with line transitions "
+      "is in the opacity-grid molecules '%s'.\n", tr->opamol);
+    exit(EXIT_FAILURE);
+  }
+  tr_output(TOUT_RESULT, "There are %li molecules with line "
+    "transitions.\n", Nmol);
+  /* Index in molID of each isotope, for the per-line loops:                */
+  op->isoslot = (int *)calloc(iso->n_i, sizeof(int));
+  for (i=0; i<iso->n_i; i++)
+    op->isoslot[i] = valueinarray(op->molID, mol->ID[iso->imol[i]], Nmol);
 
   /* Get wavenumber array from transit:                                     */
   Nwave = op->Nwave = tr->wns.n;
@@ -366,96 +1135,312 @@ calcopacity(struct transit *tr,
   for (i=0; i<Nwave; i++)
     op->wns[i] = tr->wns.v[i];
   tr_output(TOUT_RESULT, "There are %li wavenumber samples.\n", Nwave);
-
-  /* Allocate opacity array:                                                */
+  /* The shard's own wavenumbers (see makewnsample()):                     */
+  op->shard   = tr->opanshard > 1 ? tr->opashard : 0;
+  op->nshard  = tr->opanshard > 1 ? tr->opanshard : 1;
+  op->nmerged = 0;
+  op->core    = tr->opanshard > 1 ? tr->opacore[0] : 0;
+  op->ncore   = tr->opanshard > 1 ? tr->opacore[1] : Nwave;
+  op->inputs  = opainputs(tr);
+  if (base != NULL && base->inputs != op->inputs)
+    tr_output(TOUT_WARN, "The opacity grid being extended was computed with "
+      "another TLI file, extinction threshold, Voigt-profile grid, or "
+      "abundances; its blocks are reused as they are.\n");
+
+  /* Compute the grid into the opacity file, block by block:               */
   if (fp != NULL){
-    op->o      = (PREC_RES ****)       calloc(Nlayer, sizeof(PREC_RES ***));
-    for (r=0; r<Nlayer; r++){
-      op->o[r] = (PREC_RES  ***)       calloc(Ntemp,  sizeof(PREC_RES **));
-      for (t=0; t<Ntemp; t++){
-        op->o[r][t] = (PREC_RES **)    calloc(Nmol,   sizeof(PREC_RES *));
-        for (i=0; i<Nmol; i++){
-          op->o[r][t][i] = (PREC_RES *)calloc(Nwave,  sizeof(PREC_RES));
-        }
-      }
+    struct opacitywork work;
+    long nblock = Nlayer*Ntemp, ndone, nitems, nold=0, nslot, *item;
+    int *isoslot = op->isoslot, *isonew = NULL, phase;
+
+    if ((ndone = beginopacity(tr, fp)) < 0){
+      tr_output(TOUT_ERROR, "Cannot write the opacity file '%s'.\n",
+        tr->f_opa);
+      exit(EXIT_FAILURE);
+    }
+
+    /* The (layer, temperature) blocks not yet in the file; when extending
+       a grid, first those at its temperatures:                             */
+    work.tr = tr;
+    work.nthreads = parallelthreads(tr->nthreads);
+    work.btemp = NULL;
+    if (base != NULL){
+      work.btemp = (long *)calloc(Ntemp, sizeof(long));
+      for (k=0; k<Ntemp; k++)
+        work.btemp[k] = tempindex(base->temp, base->Ntemp, op->temp[k]);
+    }
+    item = (long *)calloc(nblock - ndone + 1, sizeof(long));
+    for (nitems=0, phase=0; phase<2; phase++){
+      for (k=0; k<nblock; k++)
+        if (!opablockdone(op, k/Ntemp, k%Ntemp) &&
+            (base != NULL && work.btemp[k%Ntemp] >= 0) == (phase == 0))
+          item[nitems++] = k;
+      if (phase == 0)
+        nold = nitems;
     }
 
-    if (!op->o[0][0][0])
+    /* With streamed lines, as many blocks per pass over the TLI file as
+       fit in the line buffer, at least one per thread:                     */
+    work.nbatch = work.nthreads;
+    if (tr->linebuffer > 0 && Nmol*Nwave > 0 &&
+        tr->linebuffer/(Nmol*Nwave*(long)sizeof(PREC_RES)) > work.nbatch)
+      work.nbatch = tr->linebuffer/(Nmol*Nwave*(long)sizeof(PREC_RES));
+    if (work.nbatch > nitems && nitems > 0)
+      work.nbatch = nitems;
+    nslot = work.nbatch > work.nthreads ? work.nbatch : work.nthreads;
+
+    /* One block and one set of scratch arrays per thread, or per block of
+       a batch:                                                             */
+    work.block      = (PREC_RES ***)calloc(nslot, sizeof(PREC_RES **));
+    work.block[0]   = (PREC_RES  **)calloc(nslot*Nmol, sizeof(PREC_RES *));
+    work.block[0][0] = (PREC_RES  *)calloc(nslot*Nmol*Nwave,
+                                           sizeof(PREC_RES));
+    if (!work.block[0][0])
       tr_output(TOUT_ERROR, "Allocation fail.\n");
+    work.density    = (PREC_ATM **)calloc(nslot, sizeof(PREC_ATM *));
+    work.density[0] = (PREC_ATM  *)calloc(nslot*mol->nmol,
+                                          sizeof(PREC_ATM));
+    work.Z    = (double **)calloc(nslot, sizeof(double *));
+    work.Z[0] = (double  *)calloc(nslot*iso->n_i, sizeof(double));
+    for (i=0; i<nslot; i++){
+      work.block[i]   = work.block[0]   + i*Nmol;
+      work.density[i] = work.density[0] + i*mol->nmol;
+      work.Z[i]       = work.Z[0]       + i*iso->n_i;
+      for (j=0; j<Nmol; j++)
+        work.block[i][j] = work.block[0][0] + (i*Nmol + j)*Nwave;
+    }
 
-    /* Compute extinction:                                                  */
-    for (r=0;   r<Nlayer; r++){  /* For each layer:                         */
-      tr_output(TOUT_DEBUG, "\nOpacity Grid at layer %03d/%03ld.\n",
-        r+1, Nlayer);
-      for (t=0; t<Ntemp;  t++){  /* For each temperature:                   */
-        /* Get density and partition-function arrays:                       */
-        for (j=0; j < mol->nmol; j++)
-          density[j] = stateeqnford(tr->ds.at->mass, mol->molec[j].q[r],
-                       tr->atm.mm[r], mol->mass[j], op->press[r], op->temp[t]);
-        for (j=0; j < iso->n_i; j++)
-          Z[j] = op->ziso[j][t];
-        if((rn=computemolext(tr, op->o[r][t], op->temp[t], density, Z, 1))
-          != 0) {
-          tr_output(TOUT_ERROR, "extinction() returned error code %i.\n", rn);
-          exit(EXIT_FAILURE);
-        }
+    /* At the temperatures of the grid being extended, compute only the new
+       molecules (leave out the isotopes of its molecules):                 */
+    if (base != NULL){
+      isonew = (int *)calloc(iso->n_i, sizeof(int));
+      for (i=0; i<iso->n_i; i++)
+        isonew[i] = isoslot[i] < base->Nmol ? -1 : isoslot[i];
+      tr_output(TOUT_INFO, "Extending the opacity grid: %ld blocks reuse "
+        "its molecules, %ld blocks are new.\n", nold, nitems-nold);
+    }
+
+    /* Drop the lines that never pass the threshold:                        */
+    if (tr->linebuffer <= 0){
+      cullmolext(tr);
+      tr_output(TOUT_INFO, "Computing opacity grid with %d thread(s).\n",
+        work.nthreads);
+    }
+    for (phase=0; phase<2; phase++){
+      work.item    = item + (phase == 0 ? 0 : nold);
+      work.nitems  = phase == 0 ? nold : nitems - nold;
+      work.compute = phase == 1 || (base != NULL && Nmol > base->Nmol);
+      op->isoslot  = phase == 0 ? isonew : isoslot;
+      if (work.nitems == 0)
+        continue;
+      /* Streamed lines, compute the blocks in batches of work.nbatch, one
+         pass over the TLI file each:                                       */
+      if (tr->linebuffer > 0 && work.compute)
+        streamopacity(&work);
+      /* A single block would otherwise be split into wavenumber tiles:    */
+      else if (work.nitems == 1){
+        k = tr->nthreads;
+        tr->nthreads = 1;
+        opacitylayertemp(&work, 0, 0);
+        tr->nthreads = k;
       }
+      else
+        parallelrun(work.nthreads, work.nitems, opacitylayertemp, &work);
     }
+    op->isoslot = isoslot;
+
+    free(isonew);
+    free(work.btemp);
+    free(item);
+    free(work.block[0][0]);
+    free(work.block[0]);
+    free(work.block);
+    free(work.density[0]);
+    free(work.density);
+    free(work.Z[0]);
+    free(work.Z);
+
+    if (endopacity(tr) != 0){
+      tr_output(TOUT_ERROR, "The opacity file '%s' is incomplete.\n",
+        tr->f_opa);
+      exit(EXIT_FAILURE);
+    }
+    /* The run uses the grid and axes mapped from the file:                 */
+    free(op->molID);
+    free(op->temp);
+    free(op->press);
+    free(op->wns);
+  }
+  tr_output(TOUT_RESULT, "Done.\n");
+  return 0;
+}
 
-    /* Save dimension sizes:                                                */
-    fwrite(&Nmol,   sizeof(long), 1, fp);
-    fwrite(&Ntemp,  sizeof(long), 1, fp);
-    fwrite(&Nlayer, sizeof(long), 1, fp);
-    fwrite(&Nwave,  sizeof(long), 1, fp);
 
-    /* Save arrays:                                                         */
-    fwrite(&op->molID[0], sizeof(int),      Nmol,   fp);
-    fwrite(&op->temp[0],  sizeof(PREC_RES), Ntemp,  fp);
-    fwrite(&op->press[0], sizeof(PREC_RES), Nlayer, fp);
-    fwrite(&op->wns[0],   sizeof(PREC_RES), Nwave,  fp);
+/* FUNCTION: Size in bytes of a grid sample of type dtype.                  */
+static long
+opasize(int dtype){
+  if (dtype == TOPA_F32)
+    return sizeof(float);
+  if (dtype == TOPA_LOG16)
+    return sizeof(unsigned short);
+  return sizeof(PREC_RES);
+}
 
-    /* Save opacity:                                                        */
-    for (r=0; r<Nlayer; r++)
-      for (t=0; t<Ntemp; t++)
-        for (i=0; i<Nmol; i++)
-          fwrite(op->o[r][t][i], sizeof(PREC_RES), Nwave, fp);
 
-    fclose(fp);
+/* FUNCTION: File offset of the block checksums of an opacity file with
+   the dimensions of op, after the header and the completion map.           */
+static inline long
+opasumoffset(struct opacity *op){
+  return (sizeof(struct opacityhead) + op->Nlayer*op->Ntemp + 7)/8*8;
+}
+
+
+/* FUNCTION: File offsets of the axis arrays of an opacity file with the
+   dimensions of op and samples of type dtype: off[0..3] for the molecule
+   IDs, temperatures, pressures, and wavenumbers, off[4] for the row
+   scales, and off[5] for their end.  The completion map and the block
+   checksums lie between the header and off[0].
+   Return: the offset of the grid                                           */
+static long
+opaoffsets(struct opacity *op,
+           int dtype,
+           long *off){
+  off[0] = opasumoffset(op) + op->Nlayer*op->Ntemp*sizeof(unsigned long);
+  off[1] = (off[0] + op->Nmol*sizeof(int) + 7)/8*8;
+  off[2] = off[1] + op->Ntemp *sizeof(PREC_RES);
+  off[3] = off[2] + op->Nlayer*sizeof(PREC_RES);
+  off[4] = off[3] + op->Nwave *sizeof(PREC_RES);
+  off[5] = off[4];
+  if (dtype == TOPA_LOG16)
+    off[5] += op->Nlayer*op->Ntemp*op->Nmol*sizeof(double);
+  return (off[5] + OPA_ALIGN - 1)/OPA_ALIGN*OPA_ALIGN;
+}
+
+
+/* FUNCTION: Checksum of the (layer r, temperature t) block of the opacity
+   file mapped in op->opamap: the FNV-1a hash of its samples as stored
+   (in the file's axis order), and of its row scales for TOPA_LOG16.        */
+static unsigned long
+opablocksum(struct opacity *op,
+            long r,
+            long t){
+  unsigned long h = 0xcbf29ce484222325UL;
+  long s[4], off[6], m, w, k0, es = opasize(op->dtype);
+  char *grid = (char *)op->opamap + opaoffsets(op, op->dtype, off);
+
+  opastrides(op, s);
+  k0 = r*s[0] + t*s[1];
+  if (op->order == TOPA_LTMW)   /* A wavenumber row per molecule            */
+    for (m=0; m < op->Nmol; m++)
+      h = fnv1a(h, grid + (k0 + m*s[2])*es, op->Nwave*es);
+  else                          /* A molecule row per wavenumber            */
+    for (w=0; w < op->Nwave; w++)
+      h = fnv1a(h, grid + (k0 + w*s[3])*es, op->Nmol*es);
+  if (op->dtype == TOPA_LOG16)
+    h = fnv1a(h, (char *)op->opamap + off[4] +
+                 (r*op->Ntemp + t)*op->Nmol*sizeof(double),
+              op->Nmol*sizeof(double));
+  return h;
+}
+
+
+/* FUNCTION: Check the blocks marked done in the opacity file mapped in
+   op->opamap against their checksums.  With 'clear' (a writable mapping),
+   mark the damaged blocks as not done, so that they are computed again.
+   Return: the number of damaged blocks                                     */
+static long
+opacheckblocks(struct opacity *op,
+               int clear){
+  char *done = (char *)op->opamap + sizeof(struct opacityhead);
+  unsigned long *sum = (unsigned long *)((char *)op->opamap +
+                                         opasumoffset(op));
+  long k, nbad=0;
+
+  for (k=0; k < op->Nlayer*op->Ntemp; k++)
+    if (done[k] && opablocksum(op, k/op->Ntemp, k%op->Ntemp) != sum[k]){
+      nbad++;
+      if (clear)
+        done[k] = 0;
+    }
+  return nbad;
+}
+
+
+/* FUNCTION: Scale of a grid row of n samples x in the TOPA_LOG16 type:
+   its largest value.                                                       */
+static double
+opascale(PREC_RES *x,
+         long n){
+  double scale = 0.0;
+  long i;
+
+  for (i=0; i<n; i++)
+    if (x[i] > scale)
+      scale = x[i];
+  return scale;
+}
+
+
+/* FUNCTION: Store x as sample k of 'grid', of type dtype; 'scale' is the
+   scale of the sample's row in the TOPA_LOG16 type (see flags_tr.h).      */
+static void
+opaencode(void *grid,
+          int dtype,
+          long k,
+          double x,
+          double scale){
+  double d;
+
+  if (dtype == TOPA_F32)
+    ((float *)grid)[k] = x;
+  else if (dtype == TOPA_LOG16){
+    d = x > 0 ? log(scale/x)/TOPA_LOGSTEP : 65535;
+    ((unsigned short *)grid)[k] = d < 65534.5 ? 65535 - (long)(d + 0.5) : 0;
   }
-  tr_output(TOUT_RESULT, "Done.\n");
-  return 0;
+  else
+    ((PREC_RES *)grid)[k] = x;
 }
 
 
-/* FUNCTION: Read the opacity file and store values in the transit
-   structure.                                                               */
-int
-readopacity(struct transit *tr,  /* transit struct                          */
-            FILE *fp){           /* Pointer to file to read                 */
-  struct opacity *op=tr->ds.op;  /* opacity struct                          */
-  int i, t, r;  /* for-loop indices                                         */
+/* FUNCTION: Make the TOPA_LOG16 decoding table of op, the value of each
+   code relative to its row scale.                                          */
+static void
+opadecoder(struct opacity *op){
+  long q;
+
+  op->qlut = (double *)calloc(65536, sizeof(double));
+  for (q=1; q<65536; q++)
+    op->qlut[q] = exp(-(65535-q)*TOPA_LOGSTEP);
+}
+
+
+/* FUNCTION: Checksum of an opacity file: the header up to the checksum
+   and the axis arrays of op.  The grid is not included, verifying it
+   would read the whole grid in every process.                              */
+static unsigned long
+opachecksum(struct opacityhead *head,
+            struct opacity *op){
+  unsigned long h = 0xcbf29ce484222325UL;
+
+  h = fnv1a(h, head, offsetof(struct opacityhead, checksum));
+  h = fnv1a(h, op->molID, op->Nmol  *sizeof(int));
+  h = fnv1a(h, op->temp,  op->Ntemp *sizeof(PREC_RES));
+  h = fnv1a(h, op->press, op->Nlayer*sizeof(PREC_RES));
+  h = fnv1a(h, op->wns,   op->Nwave *sizeof(PREC_RES));
+  return h;
+}
+
+
+/* FUNCTION: Print the dimensions and axes of the opacity grid.             */
+static void
+opacityinfo(struct opacity *op){
+  int i;
 
-  /* Read file dimension sizes:                                             */
-  fread(&op->Nmol,   sizeof(long), 1, fp);
-  fread(&op->Ntemp,  sizeof(long), 1, fp);
-  fread(&op->Nlayer, sizeof(long), 1, fp);
-  fread(&op->Nwave,  sizeof(long), 1, fp);
   tr_output(TOUT_INFO, "Opacity grid size: Nmolecules    = %5li\n"
     "                   Ntemperatures = %5li\n"
     "                   Nlayers       = %5li\n"
     "                   Nwavenumbers  = %5li\n",
     op->Nmol, op->Ntemp, op->Nlayer, op->Nwave);
-  tr_output(TOUT_DEBUG, "ftell = %li\n", ftell(fp));
-
-  /* Allocate and read arrays:                                              */
-  op->molID = (int      *)calloc(op->Nmol,   sizeof(int));
-  op->temp  = (PREC_RES *)calloc(op->Ntemp,  sizeof(PREC_RES));
-  op->press = (PREC_RES *)calloc(op->Nlayer, sizeof(PREC_RES));
-  op->wns   = (PREC_RES *)calloc(op->Nwave,  sizeof(PREC_RES));
-  fread(op->molID, sizeof(int),      op->Nmol,   fp);
-  fread(op->temp,  sizeof(PREC_RES), op->Ntemp,  fp);
-  fread(op->press, sizeof(PREC_RES), op->Nlayer, fp);
-  fread(op->wns,   sizeof(PREC_RES), op->Nwave,  fp);
 
   /* DEBUGGING: Print temperature array                                     */
   tr_output(TOUT_DEBUG, "Molecule IDs = [");
@@ -474,158 +1459,1273 @@ readopacity(struct transit *tr,  /* transit struct                          */
   tr_output(TOUT_DEBUG, "\b\b] \n\n");
 
   tr_output(TOUT_DEBUG, "Wavenumber (cm-1) = [");
-  for (i=0; i < 4; i++)
+  for (i=0; i < 4 && i < op->Nwave; i++)
     tr_output(TOUT_DEBUG, "%7.2f, ", op->wns[i]);
   tr_output(TOUT_DEBUG, "..., ");
   for (i=op->Nwave-4; i < op->Nwave; i++)
-    tr_output(TOUT_DEBUG, "%7.2f, ", op->wns[i]);
+    if (i >= 0)
+      tr_output(TOUT_DEBUG, "%7.2f, ", op->wns[i]);
   tr_output(TOUT_DEBUG, "\b\b]\n\n");
+}
+
+
+/* Relative tolerance of the match between the run's axes and those of an
+   opacity grid (of the wavenumber spacing for wavenumbers):                */
+#define OPA_AXISTOL 1e-6
+
+/* FUNCTION: Find the run's layers and wavenumber sample in the axes of the
+   opacity grid of tr->ds.op, which must hold them as a contiguous slab:
+   win[0] and win[1] are the first grid layer and the number of layers,
+   win[2] and win[3] the first grid wavenumber and the number of
+   wavenumbers.  Without a wavenumber sample (tr->wns.n == 0), the window
+   is the whole grid.
+   Return: 0 on success, -1 if the grid does not hold the run               */
+static int
+opawindow(struct transit *tr,
+          long *win){
+  struct opacity *op=tr->ds.op;
+  double d;
+  long i;
+  int ok;
+
+  win[0] = win[2] = 0;
+  win[1] = op->Nlayer;
+  win[3] = op->Nwave;
+  if (tr->wns.n == 0)
+    return 0;
+
+  win[1] = tr->rads.n;
+  win[3] = tr->wns.n;
+  for (win[0]=0; win[0] < op->Nlayer; win[0]++)
+    if (fabs(op->press[win[0]] - tr->atm.p[0]*tr->atm.pfct)
+        <= OPA_AXISTOL*op->press[win[0]])
+      break;
+  d = op->Nwave > 1 ? op->wns[1] - op->wns[0] : tr->wns.d;
+  win[2] = op->Nwave > 0 ? lround((tr->wns.v[0] - op->wns[0])/d) : 0;
+
+  ok = win[0] + win[1] <= op->Nlayer && win[2] >= 0 &&
+       win[2] + win[3] <= op->Nwave;
+  for (i=0; i < win[1] && ok; i++)
+    ok = fabs(op->press[win[0]+i] - tr->atm.p[i]*tr->atm.pfct)
+         <= OPA_AXISTOL*op->press[win[0]+i];
+  for (i=0; i < win[3] && ok; i++)
+    ok = fabs(op->wns[win[2]+i] - tr->wns.v[i]) <= OPA_AXISTOL*fabs(d);
+  if (!ok){
+    tr_output(TOUT_WARN, "The opacity grid (%ld layers, %.4f to %.4f cm-1) "
+      "does not hold the run's %ld layers and wavenumbers (%.4f to %.4f "
+      "cm-1, every %.4g cm-1).\n", op->Nlayer, op->wns[0],
+      op->wns[op->Nwave-1], tr->rads.n, tr->wns.v[0],
+      tr->wns.v[tr->wns.n-1], tr->wns.d);
+    return -1;
+  }
+  if (win[1] < op->Nlayer || win[3] < op->Nwave)
+    tr_output(TOUT_INFO, "Using layers %ld to %ld and wavenumbers %ld to "
+      "%ld of the opacity grid.\n", win[0], win[0]+win[1]-1, win[2],
+      win[2]+win[3]-1);
+  return 0;
+}
+
+
+/* FUNCTION: Restrict the axes and dimensions of op to the window win (see
+   opawindow()) of its whole grid 'grid', of strides op->stride.
+   Return: the grid sample at the origin of the window                      */
+static void *
+opaview(struct opacity *op,
+        long *win,
+        void *grid){
+  op->press += win[0];
+  op->wns   += win[2];
+  if (op->qscale != NULL)
+    op->qscale += win[0]*op->Ntemp*op->Nmol;
+  op->Nlayer = win[1];
+  op->Nwave  = win[3];
+  return (char *)grid +
+         (win[0]*op->stride[0] + win[2]*op->stride[3])*opasize(op->dtype);
+}
+
+
+/* FUNCTION: Fill the header of an opacity file for the grid of op, with
+   its axes in the order 'order' and samples of type dtype, its shard and
+   provenance, and the axis offsets off (see opaoffsets()).                 */
+static void
+opahead(struct opacity *op,
+        int order,
+        int dtype,
+        struct opacityhead *head,
+        long *off){
+  memset(head, 0, sizeof(struct opacityhead));
+  strncpy(head->magic, "TROPAC", 8);
+  head->version  = opacityversion;
+  head->headsize = sizeof(struct opacityhead);
+  head->dtype    = dtype;
+  head->order    = order;
+  head->Nmol     = op->Nmol;
+  head->Ntemp    = op->Ntemp;
+  head->Nlayer   = op->Nlayer;
+  head->Nwave    = op->Nwave;
+  head->done     = sizeof(struct opacityhead);
+  head->sums     = opasumoffset(op);
+  head->data     = opaoffsets(op, dtype, off);
+  head->size     = head->data +
+                   op->Nlayer*op->Ntemp*op->Nmol*op->Nwave*opasize(dtype);
+  head->nshard   = op->nshard > 1 ? op->nshard : 1;
+  head->shard    = op->nshard > 1 ? op->shard  : 0;
+  head->nmerged  = op->nmerged;
+  head->core     = op->ncore > 0 ? op->core  : 0;
+  head->ncore    = op->ncore > 0 ? op->ncore : op->Nwave;
+  head->inputs   = op->inputs;
+  head->checksum = opachecksum(head, op);
+  head->created  = time(NULL);
+  gethostname(head->host, sizeof(head->host)-1);
+}
+
+
+/* FUNCTION: Write the header 'head', the completion map (every block set
+   to 'done'), zero block checksums, the axes of op, and the row scales
+   qscale (zeros if NULL) to fp, up to the grid.
+   Return: 1 on success, 0 on a write error                                 */
+static int
+opawritehead(FILE *fp,
+             struct opacityhead *head,
+             long *off,
+             struct opacity *op,
+             char done,
+             double *qscale){
+  static const char zeros[OPA_ALIGN];
+  long i, n, nblock = op->Nlayer*op->Ntemp;
+  int ok;
+
+  ok  = fwrite(head, sizeof(struct opacityhead), 1, fp) == 1;
+  for (i=0; i < nblock && ok; i++)
+    ok &= fputc(done, fp) != EOF;
+  for (i=head->done+nblock; i < off[0] && ok; i+=n){
+    n = off[0] - i < OPA_ALIGN ? off[0] - i : OPA_ALIGN;
+    ok &= fwrite(zeros, 1, n, fp) == n;
+  }
+  ok &= fwrite(op->molID, sizeof(int), op->Nmol, fp) == op->Nmol;
+  ok &= fwrite(zeros, 1, off[1]-off[0]-op->Nmol*sizeof(int), fp)
+        == off[1]-off[0]-op->Nmol*sizeof(int);
+  ok &= fwrite(op->temp,  sizeof(PREC_RES), op->Ntemp,  fp) == op->Ntemp;
+  ok &= fwrite(op->press, sizeof(PREC_RES), op->Nlayer, fp) == op->Nlayer;
+  ok &= fwrite(op->wns,   sizeof(PREC_RES), op->Nwave,  fp) == op->Nwave;
+  if (qscale != NULL)
+    ok &= fwrite(qscale, 1, off[5]-off[4], fp) == off[5]-off[4];
+  else
+    for (i=off[4]; i < off[5] && ok; i+=n){
+      n = off[5] - i < OPA_ALIGN ? off[5] - i : OPA_ALIGN;
+      ok &= fwrite(zeros, 1, n, fp) == n;
+    }
+  ok &= fwrite(zeros, 1, head->data-off[5], fp) == head->data-off[5];
+  return ok;
+}
+
+
+/* Number of wavenumbers transposed at a time by writeopacity():           */
+#define OPA_WAVECHUNK 4096
+
+/* FUNCTION: Write the opacity grid of tr->ds.op, computed in the
+   [layer][temp][mol][wave] order, to fp: the header, the block checksums,
+   the axis arrays, and the grid in the axis order tr->opaorder and sample
+   type tr->opadtype (see struct opacityhead).  The [layer][wave][temp][mol]
+   order is transposed in chunks of wavenumbers.
+   Return: 0 on success, -1 on a write error                                */
+int
+writeopacity(struct transit *tr,
+             FILE *fp){
+  struct opacity *op=tr->ds.op;  /* opacity struct                          */
+  struct opacityhead head;
+  long off[6], r, t, i, w, w0, nw, row, es, k, nblock=op->Nlayer*op->Ntemp;
+  double *qscale=NULL, scale=0.0;
+  unsigned long *sum;
+  char *buf;
+  int ok;
+
+  if (tr->opadtype == TOPA_LOG16){
+    qscale = (double *)calloc(op->Nlayer*op->Ntemp*op->Nmol, sizeof(double));
+    for     (r=0; r < op->Nlayer; r++)
+      for   (t=0; t < op->Ntemp;  t++)
+        for (i=0; i < op->Nmol;   i++)
+          qscale[(r*op->Ntemp + t)*op->Nmol + i] =
+            opascale(op->o[r][t][i], op->Nwave);
+  }
+  opahead(op, tr->opaorder, tr->opadtype, &head, off);
+  ok = opawritehead(fp, &head, off, op, 1, qscale);
+  es = opasize(head.dtype);
+  /* The block checksums (see opablocksum()) are hashed along:              */
+  sum = (unsigned long *)calloc(nblock, sizeof(unsigned long));
+  for (k=0; k<nblock; k++)
+    sum[k] = 0xcbf29ce484222325UL;
+  if (head.order == TOPA_LTMW){
+    buf = (char *)calloc(op->Nwave, es);
+    for     (r=0; r < op->Nlayer && ok; r++)
+      for   (t=0; t < op->Ntemp;  t++)
+        for (i=0; i < op->Nmol;   i++){
+          row = (r*op->Ntemp + t)*op->Nmol + i;
+          if (qscale != NULL)
+            scale = qscale[row];
+          for (w=0; w < op->Nwave; w++)
+            opaencode(buf, head.dtype, w, op->o[r][t][i][w], scale);
+          sum[r*op->Ntemp + t] = fnv1a(sum[r*op->Ntemp + t], buf,
+                                       op->Nwave*es);
+          ok &= fwrite(buf, es, op->Nwave, fp) == op->Nwave;
+        }
+  }
+  else{
+    buf = (char *)calloc(OPA_WAVECHUNK*op->Ntemp*op->Nmol, es);
+    for   (r=0;  r  < op->Nlayer && ok; r++)
+      for (w0=0; w0 < op->Nwave  && ok; w0+=OPA_WAVECHUNK){
+        nw = op->Nwave - w0 < OPA_WAVECHUNK ? op->Nwave - w0 : OPA_WAVECHUNK;
+        for     (t=0; t < op->Ntemp; t++)
+          for   (i=0; i < op->Nmol;  i++){
+            row = (r*op->Ntemp + t)*op->Nmol + i;
+            if (qscale != NULL)
+              scale = qscale[row];
+            for (w=0; w < nw;        w++)
+              opaencode(buf, head.dtype, (w*op->Ntemp + t)*op->Nmol + i,
+                        op->o[r][t][i][w0+w], scale);
+          }
+        for   (t=0; t < op->Ntemp; t++)
+          for (w=0; w < nw;        w++)
+            sum[r*op->Ntemp + t] = fnv1a(sum[r*op->Ntemp + t],
+                     buf + (w*op->Ntemp + t)*op->Nmol*es, op->Nmol*es);
+        ok &= fwrite(buf, es, nw*op->Ntemp*op->Nmol, fp)
+              == nw*op->Ntemp*op->Nmol;
+      }
+  }
+  for (k=0; k < nblock && qscale != NULL; k++)
+    sum[k] = fnv1a(sum[k], qscale + k*op->Nmol, op->Nmol*sizeof(double));
+  ok &= fseek(fp, head.sums, SEEK_SET) == 0 &&
+        fwrite(sum, sizeof(unsigned long), nblock, fp) == nblock;
+  free(sum);
+  free(buf);
+  free(qscale);
+  ok &= fflush(fp) == 0;
+  return ok ? 0 : -1;
+}
+
+
+/* FUNCTION: Whether the opacity file fd of size 'size', with header old,
+   holds a finished grid (of any dimensions).                               */
+static int
+opafinished(int fd,
+            struct opacityhead *old,
+            long size){
+  long k, n = old->Nlayer*old->Ntemp;
+  char *done;
+  int fin;
+
+  if (strncmp(old->magic, "TROPAC", 8) != 0 ||
+      old->version  != opacityversion             ||
+      old->headsize != sizeof(struct opacityhead) ||
+      old->done     != sizeof(struct opacityhead) ||
+      old->size != size || old->Nlayer <= 0 || old->Ntemp <= 0 ||
+      n > size)
+    return 0;
+  done = (char *)calloc(n, sizeof(char));
+  fin  = pread(fd, done, n, old->done) == n;
+  for (k=0; k < n && fin; k++)
+    fin = done[k] != 0;
+  free(done);
+  return fin;
+}
+
 
-  /* Allocate and read the opacity grid:                                    */
-  op->o      = (PREC_RES ****)       calloc(op->Nlayer, sizeof(PREC_RES ***));
-  for     (r=0; r < op->Nlayer; r++){
-    op->o[r] = (PREC_RES  ***)       calloc(op->Ntemp,  sizeof(PREC_RES **));
-    for   (t=0; t < op->Ntemp; t++){
-      op->o[r][t] = (PREC_RES **)    calloc(op->Nmol,   sizeof(PREC_RES *));
-      for (i=0; i < op->Nmol; i++){
-        op->o[r][t][i] = (PREC_RES *)calloc(op->Nwave,  sizeof(PREC_RES));
+/* FUNCTION: Prepare the opacity file fp (open for reading and writing) to
+   receive the grid of tr->ds.op block by block (see putopacity()), in the
+   axis order tr->opaorder and sample type tr->opadtype, and map it.  The
+   file is locked against other processes computing it at the same time,
+   waiting for one that is: it may have finished the grid meanwhile.  If
+   fp holds a partial grid with the same header (dimensions, axes, axis
+   order, sample type, and inputs, see opainputs()), the blocks it already
+   has are kept, so that an interrupted calculation resumes (those that do
+   not match their checksums are dropped); else the file is started over,
+   once locked.  A finished grid is never started over, other processes
+   may map it: if only its inputs differ, it is kept as it is.
+   Return: the number of blocks already in the file, -1 on failure          */
+long
+beginopacity(struct transit *tr, /* transit struct                          */
+             FILE *fp){          /* Opacity file                            */
+  struct opacity *op=tr->ds.op;  /* opacity struct                          */
+  struct opacityhead head, old, tmp;
+  struct flock lock;
+  struct stat st;
+  long off[6], k, ndone=0, nbad;
+  int fd = fileno(fp), resume, layout, axes=0;
+  char *map;
+
+  memset(&lock, 0, sizeof(struct flock));
+  lock.l_type   = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  if (fcntl(fd, F_SETLK, &lock) != 0){
+    tr_output(TOUT_INFO, "Waiting for another process computing the "
+      "opacity file '%s'.\n", tr->f_opa);
+    while (fcntl(fd, F_SETLKW, &lock) != 0)
+      if (errno != EINTR){
+        tr_output(TOUT_WARN, "Cannot lock the opacity file '%s' (%s).\n",
+          tr->f_opa, strerror(errno));
+        return -1;
       }
+  }
+
+  /* Resume a grid with the same header; tell apart one that differs only
+     by its inputs (same axes, through the checksum):                      */
+  opahead(op, tr->opaorder, tr->opadtype, &head, off);
+  memset(&old, 0, sizeof(struct opacityhead));
+  layout = fstat(fd, &st) == 0 &&
+           pread(fd, &old, sizeof(struct opacityhead), 0)
+             == sizeof(struct opacityhead) && st.st_size == head.size &&
+           memcmp(&old, &head, offsetof(struct opacityhead, inputs)) == 0;
+  resume = layout && old.inputs == head.inputs &&
+           old.checksum == head.checksum;
+  if (layout && !resume){
+    tmp = head;
+    tmp.inputs = old.inputs;
+    axes = opachecksum(&tmp, op) == old.checksum;
+  }
+
+  if (!resume && opafinished(fd, &old, st.st_size)){
+    if (!axes){
+      tr_output(TOUT_ERROR, "The opacity file '%s' holds a finished grid "
+        "with other axes.\n", tr->f_opa);
+      lock.l_type = F_UNLCK;
+      fcntl(fd, F_SETLK, &lock);
+      return -1;
     }
+    tr_output(TOUT_WARN, "The opacity file '%s' was finished with another "
+      "TLI file, extinction threshold, Voigt-profile grid, or abundances; "
+      "it is used as it is.\n", tr->f_opa);
+    head   = old;
+    resume = 1;
+  }
+  else if (!resume){
+    if (axes)
+      tr_output(TOUT_WARN, "The partial opacity file '%s' was computed with "
+        "another TLI file, extinction threshold, Voigt-profile grid, or "
+        "abundances; it is started over.\n", tr->f_opa);
+    rewind(fp);
+    if (ftruncate(fd, 0) != 0 || !opawritehead(fp, &head, off, op, 0, NULL) ||
+        fflush(fp) != 0 || ftruncate(fd, head.size) != 0)
+      return -1;
+  }
+
+  map = mmap(NULL, head.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  op->opamap     = map;
+  op->opamapsize = head.size;
+  op->order      = head.order;
+  op->dtype      = head.dtype;
+  op->qscale     = (double *)(map + off[4]);
+  /* Blocks damaged by the interruption are computed again:                 */
+  if (resume && (nbad = opacheckblocks(op, 1)) > 0)
+    tr_output(TOUT_WARN, "%ld blocks of the opacity grid '%s' do not match "
+      "their checksums, they are computed again.\n", nbad, tr->f_opa);
+  for (k=0; k < op->Nlayer*op->Ntemp; k++)
+    ndone += opablockdone(op, k/op->Ntemp, k%op->Ntemp);
+  if (resume)
+    tr_output(TOUT_INFO, "Resuming the opacity grid '%s': %ld of %ld "
+      "blocks are done.\n", tr->f_opa, ndone, op->Nlayer*op->Ntemp);
+  return ndone;
+}
+
+
+/* FUNCTION: Write the bytes lo to hi of a file mapping to the file.        */
+static void
+opasync(char *lo,
+        char *hi){
+  long page = sysconf(_SC_PAGESIZE);
+  char *start = lo - (unsigned long)lo % page;
+
+  msync(start, hi - start, MS_SYNC);
+}
+
+
+/* FUNCTION: Write the (layer r, temperature t) block of the grid,
+   block[mol][wave], to its final place in the opacity file prepared by
+   beginopacity(), encoded in the file's sample type (with its row scales
+   for TOPA_LOG16), and mark it done, with its checksum, once it is on
+   disk.  Threads may write different blocks at the same time.              */
+void
+putopacity(struct transit *tr,
+           long r,
+           long t,
+           PREC_RES **block){
+  struct opacity *op=tr->ds.op;  /* opacity struct                          */
+  char *map = (char *)op->opamap, *done, *grid;
+  unsigned long *sum = (unsigned long *)(map + opasumoffset(op)) +
+                       r*op->Ntemp + t;
+  long s[4], off[6], m, w, k0, es = opasize(op->dtype);
+  double *scale = op->qscale + (r*op->Ntemp + t)*op->Nmol;
+
+  opastrides(op, s);
+  grid = map + opaoffsets(op, op->dtype, off);
+  k0   = r*s[0] + t*s[1];
+  for (m=0; m < op->Nmol; m++){
+    if (op->dtype == TOPA_LOG16)
+      scale[m] = opascale(block[m], op->Nwave);
+    for (w=0; w < op->Nwave; w++)
+      opaencode(grid, op->dtype, k0 + m*s[2] + w*s[3], block[m][w],
+                op->dtype == TOPA_LOG16 ? scale[m] : 0.0);
   }
+  opasync(grid + k0*es,
+          grid + (k0 + (op->Nmol-1)*s[2] + (op->Nwave-1)*s[3] + 1)*es);
+  if (op->dtype == TOPA_LOG16)
+    opasync((char *)scale, (char *)(scale + op->Nmol));
+  *sum = opablocksum(op, r, t);
+  opasync((char *)sum, (char *)(sum + 1));
+
+  done = map + sizeof(struct opacityhead) + r*op->Ntemp + t;
+  *done = 1;
+  opasync(done, done+1);
+}
 
-  /* Read the opacity grid:                                                 */
-  for     (r=0; r < op->Nlayer; r++)
-    for   (t=0; t < op->Ntemp;  t++)
-      for (i=0; i < op->Nmol;   i++)
-        fread(op->o[r][t][i], sizeof(PREC_RES), op->Nwave, fp);
 
+/* FUNCTION: Unmap and unlock the opacity file of beginopacity().
+   Return: 0 if the file holds every block, 1 otherwise                     */
+int
+endopacity(struct transit *tr){
+  struct opacity *op=tr->ds.op;  /* opacity struct                          */
+  struct flock lock;
+  long k, ndone=0;
+
+  for (k=0; k < op->Nlayer*op->Ntemp; k++)
+    ndone += opablockdone(op, k/op->Ntemp, k%op->Ntemp);
+  munmap(op->opamap, op->opamapsize);
+  op->opamap = NULL;
+  op->qscale = NULL;
+
+  memset(&lock, 0, sizeof(struct flock));
+  lock.l_type   = F_UNLCK;
+  lock.l_whence = SEEK_SET;
+  fcntl(fileno(tr->fp_opa), F_SETLK, &lock);
+  return ndone != op->Nlayer*op->Ntemp;
+}
+
+
+/* FUNCTION: Map the opacity file fp read only, and point the axes and the
+   grid of tr->ds.op into the mapping, restricted to the run's layers and
+   wavenumbers (see opawindow()).  Nothing is copied: processes that map
+   the same file share a single copy of it in the page cache, and a
+   process only pages in its window.
+   Return: 0 on success, 1 if the file has no header (version 1, read it
+           with readopacity()), 2 if the grid is partial (resume it with
+           calcopacity()), -1 if the file is invalid or does not hold the
+           run                                                              */
+int
+mapopacity(struct transit *tr,  /* transit struct                           */
+           FILE *fp){           /* Opacity file                             */
+  struct opacity *op=tr->ds.op; /* opacity struct                           */
+  struct opacityhead head;
+  struct stat st;
+  long off[6], k, win[4];
+  time_t created;
+  char *map;
+  int fd = fileno(fp);
+
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(struct opacityhead) ||
+      pread(fd, &head, sizeof(struct opacityhead), 0)
+        != sizeof(struct opacityhead) ||
+      strncmp(head.magic, "TROPAC", 8) != 0)
+    return 1;
+
+  if (head.version != opacityversion ||
+      head.headsize != sizeof(struct opacityhead)){
+    tr_output(TOUT_WARN, "Opacity file version %d, this transit reads "
+      "version %d.\n", head.version, opacityversion);
+    return -1;
+  }
+  if ((head.dtype != TOPA_F64 && head.dtype != TOPA_F32 &&
+       head.dtype != TOPA_LOG16) ||
+      (head.order != TOPA_LTMW && head.order != TOPA_LWTM)){
+    tr_output(TOUT_WARN, "Unknown opacity-grid type (%d) or axis order "
+      "(%d).\n", head.dtype, head.order);
+    return -1;
+  }
+  op->Nmol   = head.Nmol;
+  op->Ntemp  = head.Ntemp;
+  op->Nlayer = head.Nlayer;
+  op->Nwave  = head.Nwave;
+  if (head.Nmol < 0 || head.Ntemp < 0 || head.Nlayer < 0 ||
+      head.Nwave < 0 || head.size != st.st_size ||
+      head.done != sizeof(struct opacityhead) ||
+      head.sums != opasumoffset(op) ||
+      head.data != opaoffsets(op, head.dtype, off) || head.size != head.data +
+      op->Nlayer*op->Ntemp*op->Nmol*op->Nwave*opasize(head.dtype)){
+    tr_output(TOUT_WARN, "The opacity file size (%ld bytes) does not match "
+      "its header (%ld bytes).\n", (long)st.st_size, head.size);
+    return -1;
+  }
+
+  map = mmap(NULL, head.size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED){
+    tr_output(TOUT_WARN, "Cannot map the opacity file (%s).\n",
+      strerror(errno));
+    return -1;
+  }
+  op->molID = (int      *)(map + off[0]);
+  op->temp  = (PREC_RES *)(map + off[1]);
+  op->press = (PREC_RES *)(map + off[2]);
+  op->wns   = (PREC_RES *)(map + off[3]);
+  if (opachecksum(&head, op) != head.checksum){
+    tr_output(TOUT_WARN, "Wrong opacity-file checksum.\n");
+    munmap(map, head.size);
+    op->molID = NULL;
+    op->temp  = op->press = op->wns = NULL;
+    return -1;
+  }
+
+  op->order   = head.order;
+  op->dtype   = head.dtype;
+  op->shard   = head.shard;
+  op->nshard  = head.nshard;
+  op->nmerged = head.nmerged;
+  op->core    = head.core;
+  op->ncore   = head.ncore;
+  op->inputs  = head.inputs;
+  op->opamap     = map;
+  op->opamapsize = head.size;
+  for (k=0; k < op->Nlayer*op->Ntemp; k++)
+    if (!opablockdone(op, k/op->Ntemp, k%op->Ntemp)){
+      tr_output(TOUT_WARN, "The opacity file misses (layer, temperature) "
+        "blocks of an interrupted calculation.\n");
+      munmap(map, head.size);
+      op->opamap = NULL;
+      op->molID  = NULL;
+      op->temp   = op->press = op->wns = NULL;
+      return 2;
+    }
+  opastrides(op, op->stride);
+  if (opawindow(tr, win) != 0){
+    munmap(map, head.size);
+    op->opamap = NULL;
+    op->molID  = NULL;
+    op->temp   = op->press = op->wns = NULL;
+    return -1;
+  }
+  if (op->dtype == TOPA_LOG16){
+    op->qscale = (double *)(map + off[4]);
+    opadecoder(op);
+  }
+  if (head.nshard > 1)
+    tr_output(TOUT_INFO, "The opacity file is shard %d of %d, its own "
+      "wavenumbers are %ld to %ld.\n", head.shard, head.nshard, head.core,
+      head.core + head.ncore - 1);
+  else if (head.nmerged > 0)
+    tr_output(TOUT_INFO, "The opacity file was merged from %d shards.\n",
+      head.nmerged);
+  created = head.created;
+  tr_output(TOUT_DEBUG, "Opacity file made on '%.63s' at %s", head.host,
+    ctime(&created));
+  mountgrid(op, opaview(op, win, map + head.data));
+  opacityinfo(op);
   return 0;
 }
 
 
-/* FUNCTION: Read the opacity file and store values in shared memory.       */
+/* FUNCTION: Extend the complete opacity file tr->fp_opa with the run's
+   temperatures and molecules that it lacks (--opaextend): compute the
+   grid over the merged axes into the file '<f_opa>.extend', reusing the
+   blocks of the old grid (see calcopacity()), and replace the old file
+   with it.  An interrupted extension resumes from '<f_opa>.extend'.  The
+   run's layers and wavenumbers must be those of the old grid, and its
+   isotopes must cover the old grid's molecules.  The new file keeps the
+   old one's sample type and axis order.
+   Return: 0 if the grid was extended and mapped, 1 if there is nothing to
+           add or the file cannot be extended (it is used as it is)         */
 int
-shareopacity(struct transit *tr, /* transit struct                          */
+extendopacity(struct transit *tr){
+  static struct opacity base;       /* The grid being extended              */
+  struct opacity *op=tr->ds.op;
+  struct isotopes  *iso=tr->ds.iso;
+  struct molecules *mol=tr->ds.mol;
+  long i, nnew=0, win[4], nwave=tr->wns.n;
+  char *name;
+  FILE *fp;
+  int rn, m;
+
+  /* Map the whole old grid (see opawindow()):                              */
+  memset(&base, 0, sizeof(struct opacity));
+  tr->ds.op = &base;
+  tr->wns.n = 0;
+  rn = mapopacity(tr, tr->fp_opa);
+  tr->wns.n = nwave;
+  if (rn == 0 && (opawindow(tr, win) != 0 || win[1] != base.Nlayer ||
+                  win[3] != base.Nwave)){
+    tr_output(TOUT_WARN, "Only an opacity grid with the run's layers and "
+      "wavenumbers can be extended.\n");
+    munmap(base.opamap, base.opamapsize);
+    free(base.qlut);
+    rn = -1;
+  }
+  else if (rn == 0 && opacheckblocks(&base, 0) > 0){
+    tr_output(TOUT_WARN, "The opacity grid '%s' has blocks that do not "
+      "match their checksums, it cannot be extended.\n", tr->f_opa);
+    munmap(base.opamap, base.opamapsize);
+    free(base.qlut);
+    rn = -1;
+  }
+  tr->ds.op = op;
+  if (rn != 0)
+    return 1;
+
+  /* Count the run's temperatures and molecules that the grid lacks:        */
+  maketempsample(tr);
+  for (i=0; i < tr->temp.n; i++)
+    nnew += tempindex(base.temp, base.Ntemp, tr->temp.v[i]) < 0;
+  for (i=0; i < iso->n_i; i++)
+    nnew += valueinarray(base.molID, mol->ID[iso->imol[i]], base.Nmol) < 0;
+  if (nnew == 0){
+    munmap(base.opamap, base.opamapsize);
+    free(base.qlut);
+    return 1;
+  }
+  /* The run recomputes each molecule of the grid at the new temperatures,
+     it needs the isotopes of all of them:                                  */
+  for (m=0; m < base.Nmol; m++){
+    for (i=0; i < iso->n_i; i++)
+      if (mol->ID[iso->imol[i]] == base.molID[m])
+        break;
+    if (i == iso->n_i){
+      tr_output(TOUT_ERROR, "The opacity grid '%s' has the molecule of ID "
+        "%d, which has no isotope in this run, it cannot be extended.\n",
+        tr->f_opa, base.molID[m]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  /* The extended file keeps the sample type and axis order of the old one
+     (not those of --opatype and --opaorder):                               */
+  tr->opadtype = base.dtype;
+  tr->opaorder = base.order;
+
+  name = (char *)calloc(strlen(tr->f_opa) + 8, sizeof(char));
+  sprintf(name, "%s.extend", tr->f_opa);
+  if ((fp = opaopen(name)) == NULL){
+    tr_output(TOUT_ERROR, "Opacity filename '%s' cannot be opened for "
+      "writing.\n", name);
+    exit(EXIT_FAILURE);
+  }
+  tr_output(TOUT_INFO, "Extending the opacity grid '%s' with the run's "
+    "temperatures and molecules into '%s'.\n", tr->f_opa, name);
+  fclose(tr->fp_opa);
+  tr->fp_opa = fp;
+  op->base = &base;
+  buildopacity(tr);
+  op->base = NULL;
+  munmap(base.opamap, base.opamapsize);
+  free(base.qlut);
+
+  /* Another run extending the same grid may have waited for this one and
+     moved the finished file first:                                         */
+  if (rename(name, tr->f_opa) != 0){
+    if (errno == ENOENT)
+      tr_output(TOUT_ERROR, "The extended opacity file '%s' was already "
+        "moved to '%s' by another run extending the same grid.\n", name,
+        tr->f_opa);
+    else
+      tr_output(TOUT_ERROR, "Cannot replace the opacity file '%s' with "
+        "'%s' (%s).\n", tr->f_opa, name, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  free(name);
+  return 0;
+}
+
+
+/* FUNCTION: Unmap the opacity files of the nin grids sh (see
+   mapopacity()) and free them.                                             */
+static void
+unmapshards(struct opacity *sh,
+            int nin){
+  int i;
+
+  for (i=0; i<nin; i++){
+    if (sh[i].opamap != NULL)
+      munmap(sh[i].opamap, sh[i].opamapsize);
+    free(sh[i].qlut);
+  }
+  free(sh);
+}
+
+
+/* FUNCTION: Merge the opacity-file shards in[0..nin-1] (see --opashard and
+   --opamol) into the opacity file 'out'.  The shards must have the same
+   layers, temperatures, and wavenumber spacing; their own wavenumber
+   ranges (without the pads) must tile one range, and each molecule of
+   each range must come from exactly one shard.  The merged grid takes the
+   axis order and sample type of the first shard, and is written block by
+   block from the mapped shards (see putopacity()), whose blocks must
+   match their checksums: only one block is in memory, and an interrupted
+   merge resumes.
+   Return: 0 on success, -1 if the shards cannot be merged                  */
+int
+mergeopacity(char **in,
+             int nin,
+             char *out){
+  struct transit tr;         /* Transit struct of the merged file           */
+  struct opacity op,         /* The merged grid                             */
+                 *sh;        /* The shards                                  */
+  long *first,               /* First merged wavenumber of each range       */
+       ndone=0, r, t, w, k, *s, row;
+  int *ord,                  /* Shards sorted by their own wavenumbers      */
+      *range,                /* Range of the merged grid of each shard      */
+      *from, *smol,          /* Shard and its molecule of each (range,
+                                molecule) of the merged grid                */
+      i, j, g, m, nrange, ok=1;
+  PREC_RES **block, d=0.0;
+  FILE *fp;
+  struct stat ost, ist;
+
+  /* The output must not be one of the shards (the merge would overwrite
+     the grid it reads):                                                    */
+  if (stat(out, &ost) == 0)
+    for (i=0; i<nin; i++)
+      if (stat(in[i], &ist) == 0 &&
+          ist.st_dev == ost.st_dev && ist.st_ino == ost.st_ino){
+        tr_output(TOUT_ERROR, "The merged opacity file '%s' is the shard "
+          "'%s'.\n", out, in[i]);
+        return -1;
+      }
+
+  /* Map the whole grid of each shard (see opawindow()):                    */
+  memset(&tr, 0, sizeof(struct transit));
+  sh = (struct opacity *)calloc(nin, sizeof(struct opacity));
+  for (i=0; i<nin && ok; i++){
+    tr.ds.op = sh + i;
+    if ((fp = fopen(in[i], "rb")) == NULL){
+      tr_output(TOUT_ERROR, "Cannot open the opacity shard '%s'.\n", in[i]);
+      ok = 0;
+      break;
+    }
+    if (mapopacity(&tr, fp) != 0){
+      tr_output(TOUT_ERROR, "'%s' is not a complete opacity file.\n", in[i]);
+      ok = 0;
+    }
+    else if (opacheckblocks(sh + i, 0) > 0){
+      tr_output(TOUT_ERROR, "The opacity shard '%s' has blocks that do not "
+        "match their checksums.\n", in[i]);
+      ok = 0;
+    }
+    fclose(fp);
+    if (ok && sh[i].Nwave > 1 && d == 0.0)
+      d = sh[i].wns[1] - sh[i].wns[0];
+  }
+
+  /* Same layers, temperatures, and wavenumber spacing:                     */
+  for (i=1; i<nin && ok; i++){
+    ok = sh[i].Nlayer == sh[0].Nlayer && sh[i].Ntemp == sh[0].Ntemp;
+    for (k=0; k < sh[0].Nlayer && ok; k++)
+      ok = fabs(sh[i].press[k] - sh[0].press[k])
+           <= OPA_AXISTOL*fabs(sh[0].press[k]);
+    for (k=0; k < sh[0].Ntemp  && ok; k++)
+      ok = fabs(sh[i].temp[k]  - sh[0].temp[k])
+           <= OPA_AXISTOL*fabs(sh[0].temp[k]);
+    if (ok && sh[i].Nwave > 1)
+      ok = fabs(sh[i].wns[1] - sh[i].wns[0] - d) <= OPA_AXISTOL*fabs(d);
+    if (!ok)
+      tr_output(TOUT_ERROR, "The opacity shards '%s' and '%s' have different "
+        "layers, temperatures, or wavenumber spacing.\n", in[0], in[i]);
+  }
+  if (!ok){
+    unmapshards(sh, nin);
+    return -1;
+  }
+
+  /* Sort the shards by their own wavenumbers, which make the ranges of
+     the merged grid, one after the other:                                  */
+  ord   = (int  *)calloc(nin, sizeof(int));
+  range = (int  *)calloc(nin, sizeof(int));
+  first = (long *)calloc(nin+1, sizeof(long));
+  for (i=0; i<nin; i++){
+    for (j=i; j > 0 && sh[ord[j-1]].wns[sh[ord[j-1]].core] >
+                       sh[i].wns[sh[i].core]; j--)
+      ord[j] = ord[j-1];
+    ord[j] = i;
+  }
+  for (nrange=0, j=0; j<nin && ok; j++){
+    struct opacity *a = sh + ord[j], *b = sh + ord[j > 0 ? j-1 : 0];
+    double gap = a->wns[a->core] - (j > 0 ? b->wns[b->core] : 0.0);
+
+    if (j > 0 && fabs(gap) <= OPA_AXISTOL*fabs(d)){
+      /* Same range as the previous shard (other molecules):                */
+      ok = a->ncore == b->ncore;
+    }
+    else{
+      ok = j == 0 || fabs(gap - b->ncore*d) <= OPA_AXISTOL*fabs(d);
+      first[nrange+1] = first[nrange] + a->ncore;
+      nrange++;
+    }
+    range[ord[j]] = nrange - 1;
+    if (!ok)
+      tr_output(TOUT_ERROR, "The own wavenumbers of the opacity shards '%s' "
+        "and '%s' overlap or leave a gap.\n", in[ord[j-1]], in[ord[j]]);
+  }
+
+  /* The molecules, and the shard of each range and molecule:              */
+  memset(&op, 0, sizeof(struct opacity));
+  for (i=0; i<nin; i++)
+    op.Nmol += sh[i].Nmol;
+  op.molID = (int *)calloc(op.Nmol, sizeof(int));
+  for (op.Nmol=0, i=0; i<nin; i++)
+    for (m=0; m < sh[i].Nmol; m++)
+      if (valueinarray(op.molID, sh[i].molID[m], op.Nmol) < 0)
+        op.molID[op.Nmol++] = sh[i].molID[m];
+  from = (int *)calloc(nrange*op.Nmol, sizeof(int));
+  smol = (int *)calloc(nrange*op.Nmol, sizeof(int));
+  for (k=0; k < nrange*op.Nmol; k++)
+    from[k] = -1;
+  for (i=0; i<nin && ok; i++)
+    for (m=0; m < sh[i].Nmol && ok; m++){
+      k = range[i]*op.Nmol + valueinarray(op.molID, sh[i].molID[m], op.Nmol);
+      if (!(ok = from[k] < 0))
+        tr_output(TOUT_ERROR, "The opacity shards '%s' and '%s' both hold "
+          "molecule %d at the same wavenumbers.\n", in[from[k]], in[i],
+          sh[i].molID[m]);
+      from[k] = i;
+      smol[k] = m;
+    }
+  for (k=0; k < nrange*op.Nmol && ok; k++)
+    if (!(ok = from[k] >= 0))
+      tr_output(TOUT_ERROR, "No opacity shard holds molecule %d at "
+        "wavenumbers %ld to %ld of the merged grid.\n", op.molID[k%op.Nmol],
+        first[k/op.Nmol], first[k/op.Nmol+1]-1);
+  if (!ok){
+    free(op.molID);
+    free(from);
+    free(smol);
+    free(ord);
+    free(range);
+    free(first);
+    unmapshards(sh, nin);
+    return -1;
+  }
+
+  /* Axes of the merged grid, the shards' own wavenumbers:                  */
+  op.Nlayer  = sh[0].Nlayer;
+  op.Ntemp   = sh[0].Ntemp;
+  op.Nwave   = first[nrange];
+  op.press   = sh[0].press;
+  op.temp    = sh[0].temp;
+  op.wns     = (PREC_RES *)calloc(op.Nwave, sizeof(PREC_RES));
+  op.nshard  = 1;
+  op.nmerged = nin;
+  op.inputs  = 0xcbf29ce484222325UL;
+  for (i=0; i<nin; i++)
+    op.inputs = fnv1a(op.inputs, &sh[i].inputs, sizeof(unsigned long));
+  for (i=0; i<nin; i++)
+    for (w=0; w < sh[i].ncore; w++)
+      op.wns[first[range[i]] + w] = sh[i].wns[sh[i].core + w];
+
+  if ((fp = opaopen(out)) == NULL){
+    tr_output(TOUT_ERROR, "Opacity filename '%s' cannot be opened for "
+      "writing.\n", out);
+    ok = 0;
+  }
+  tr.ds.op     = &op;
+  tr.f_opa     = out;
+  tr.fp_opa    = fp;
+  tr.opaorder  = sh[0].order;
+  tr.opadtype  = sh[0].dtype;
+  if (ok && (ndone = beginopacity(&tr, fp)) < 0){
+    tr_output(TOUT_ERROR, "Cannot write the opacity file '%s'.\n", out);
+    ok = 0;
+  }
+
+  /* Assemble each block from the shards:                                   */
+  if (ok){
+    tr_output(TOUT_INFO, "Merging %d opacity shards into '%s': %ld "
+      "molecules, %ld wavenumbers, %ld of %ld blocks to write.\n", nin, out,
+      op.Nmol, op.Nwave, op.Nlayer*op.Ntemp - ndone, op.Nlayer*op.Ntemp);
+    block    = (PREC_RES **)calloc(op.Nmol, sizeof(PREC_RES *));
+    block[0] = (PREC_RES  *)calloc(op.Nmol*op.Nwave, sizeof(PREC_RES));
+    for (j=1; j < op.Nmol; j++)
+      block[j] = block[0] + j*op.Nwave;
+    for (k=0; k < op.Nlayer*op.Ntemp; k++){
+      r = k/op.Ntemp;
+      t = k%op.Ntemp;
+      if (opablockdone(&op, r, t))
+        continue;
+      for (g=0; g<nrange; g++)
+        for (j=0; j < op.Nmol; j++){
+          i   = from[g*op.Nmol + j];
+          m   = smol[g*op.Nmol + j];
+          s   = sh[i].stride;
+          row = (r*sh[i].Ntemp + t)*sh[i].Nmol + m;
+          for (w=0; w < sh[i].ncore; w++)
+            block[j][first[g] + w] = opasample(sh + i,
+                     r*s[0] + t*s[1] + m*s[2] + (sh[i].core + w)*s[3], row);
+        }
+      putopacity(&tr, r, t, block);
+    }
+    free(block[0]);
+    free(block);
+    ok = endopacity(&tr) == 0;
+  }
+  if (fp != NULL)
+    fclose(fp);
+
+  free(op.wns);
+  free(op.molID);
+  free(from);
+  free(smol);
+  free(ord);
+  free(range);
+  free(first);
+  unmapshards(sh, nin);
+  return ok ? 0 : -1;
+}
+
+
+/* FUNCTION: Read an opacity file without header (version 1): the four
+   dimensions (long), the axis arrays, and the grid, and store values in
+   the transit structure.  Only the run's window of the grid (see
+   opawindow()) is read, for the grid molecules of the run's atmosphere.
+   Return: 0 on success, -1 if the file does not hold the run               */
+int
+readopacity(struct transit *tr,  /* transit struct                          */
             FILE *fp){           /* Pointer to file to read                 */
   struct opacity *op=tr->ds.op;  /* opacity struct                          */
-  struct opacityhint *oh=op->hint;  /* opacity hint struct                  */
+  struct molecules *mol=tr->ds.mol;
+  long win[4], r, t, m, nmol, ngrid, nread=0, data;
+  PREC_RES *grid;
+  int *msel;
 
   /* Read file dimension sizes:                                             */
   fread(&op->Nmol,   sizeof(long), 1, fp);
   fread(&op->Ntemp,  sizeof(long), 1, fp);
   fread(&op->Nlayer, sizeof(long), 1, fp);
   fread(&op->Nwave,  sizeof(long), 1, fp);
-  tr_output(TOUT_INFO, "Opacity grid size: Nmolecules    = %5li\n"
-    "                   Ntemperatures = %5li\n"
-    "                   Nlayers       = %5li\n"
-    "                   Nwavenumbers  = %5li\n",
-    op->Nmol, op->Ntemp, op->Nlayer, op->Nwave);
   tr_output(TOUT_DEBUG, "ftell = %li\n", ftell(fp));
 
-  /* Copy dimensional data into the shared hint struct:                     */
-  oh->Nwave = op->Nwave;
-  oh->Ntemp = op->Ntemp;
-  oh->Nlayer = op->Nlayer;
-  oh->Nmol = op->Nmol;
+  /* Allocate and read arrays:                                              */
+  op->molID = (int      *)calloc(op->Nmol,   sizeof(int));
+  op->temp  = (PREC_RES *)calloc(op->Ntemp,  sizeof(PREC_RES));
+  op->press = (PREC_RES *)calloc(op->Nlayer, sizeof(PREC_RES));
+  op->wns   = (PREC_RES *)calloc(op->Nwave,  sizeof(PREC_RES));
+  fread(op->molID, sizeof(int),      op->Nmol,   fp);
+  fread(op->temp,  sizeof(PREC_RES), op->Ntemp,  fp);
+  fread(op->press, sizeof(PREC_RES), op->Nlayer, fp);
+  fread(op->wns,   sizeof(PREC_RES), op->Nwave,  fp);
+  data = ftell(fp);
+
+  if (opawindow(tr, win) != 0)
+    return -1;
+  /* The grid molecules of the atmosphere:                                  */
+  msel = (int *)calloc(op->Nmol, sizeof(int));
+  for (nmol=m=0; m < op->Nmol; m++)
+    if (mol == NULL || valueinarray(mol->ID, op->molID[m], mol->nmol) >= 0)
+      msel[nmol++] = m;
+
+  /* Allocate the window of the grid, stored contiguously, and read its
+     [wave] rows:                                                           */
+  ngrid = win[1]*op->Ntemp*nmol*win[3];
+  grid  = (PREC_RES *)calloc(ngrid, sizeof(PREC_RES));
+  for     (r=0; r < win[1];    r++)
+    for   (t=0; t < op->Ntemp; t++)
+      for (m=0; m < nmol;      m++)
+        if (fseek(fp, data + ((((win[0]+r)*op->Ntemp + t)*op->Nmol + msel[m])
+                              *op->Nwave + win[2])*sizeof(PREC_RES),
+                  SEEK_SET) == 0)
+          nread += fread(grid + ((r*op->Ntemp + t)*nmol + m)*win[3],
+                         sizeof(PREC_RES), win[3], fp);
+  if (nread != ngrid)
+    tr_output(TOUT_WARN, "The opacity file is shorter than its "
+      "dimensions.\n");
+
+  for (m=0; m < nmol; m++)
+    op->molID[m] = op->molID[msel[m]];
+  op->Nmol = nmol;
+  free(msel);
+  memmove(op->press, op->press+win[0], win[1]*sizeof(PREC_RES));
+  memmove(op->wns,   op->wns  +win[2], win[3]*sizeof(PREC_RES));
+  op->Nlayer = win[1];
+  op->Nwave  = win[3];
+  opastrides(op, op->stride);
+  mountgrid(op, grid);
+  opacityinfo(op);
+  return 0;
+}
 
-  /* If creating and attaching the main segment fails, return:              */
-  if (attachopacity(tr))
-    return 1;
 
-  /* Read arrays:                                                           */
-  char *p = op->mainaddr;
-  fread(p, sizeof(int),      op->Nmol,   fp);
-  p += sizeof(int) * op->Nmol;
-  fread(p,  sizeof(PREC_RES), op->Ntemp,  fp);
-  p += sizeof(PREC_RES) * op->Ntemp;
-  fread(p, sizeof(PREC_RES), op->Nlayer, fp);
-  p += sizeof(PREC_RES) * op->Nlayer;
-  fread(p,   sizeof(PREC_RES), op->Nwave,  fp);
-  p += sizeof(PREC_RES) * op->Nwave;
-
-  /* Read opacity grid:                                                     */
-  fread(p, sizeof(PREC_RES),
-        op->Nmol * op->Ntemp * op->Nlayer * op->Nwave, fp);
-
-  oh->status |= TSHM_WRITTEN;
+/* FUNCTION: Name of the shared-memory coordinator of the opacity file fp,
+   made of the file's device, inode, size, and modification time, so that
+   a rewritten file gets new segments.  The grid segment appends ".grid".
+   Return: 0 on success, -1 if the file cannot be identified               */
+static int
+shmname(FILE *fp,
+        char *name,
+        size_t n){
+  struct stat st;
+
+  if (fstat(fileno(fp), &st) != 0)
+    return -1;
+  snprintf(name, n, "/transit.%lx.%lx.%lx.%lx", (unsigned long)st.st_dev,
+           (unsigned long)st.st_ino, (unsigned long)st.st_size,
+           (unsigned long)st.st_mtime);
   return 0;
 }
 
 
-/* FUNCTION: Locate (or create) and attach to the main shared memory.
-   Return: 0 on success, 1 on failure                                       */
-int
-attachopacity(struct transit *tr){ /* transit struct                        */
-  struct opacity *op=tr->ds.op;   /* opacity struct                         */
-  struct opacityhint *oh=op->hint;  /* opacity hint struct                  */
+/* FUNCTION: Open (or create) and map the coordinator segment 'name'.
+   Exactly one process creates it (O_EXCL) and initializes its robust,
+   process-shared lock; the others wait for the 'ready' flag, which takes
+   microseconds.  A segment that never gets ready was left by a process
+   that died while creating it, and is created again.
+   Return: the mapped coordinator, NULL on failure                          */
+static struct opacityhint *
+shmhint(char *name){
+  struct opacityhint *oh;
+  pthread_mutexattr_t attr;
+  struct timespec ms = {0, 1000000};
+  struct stat st;
+  int fd, i, try;
+
+  for (try=0; try<3; try++){
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0){
+      if (ftruncate(fd, sizeof(struct opacityhint)) != 0){
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+      }
+      oh = mmap(NULL, sizeof(struct opacityhint), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+      close(fd);
+      if (oh == MAP_FAILED){
+        shm_unlink(name);
+        return NULL;
+      }
+      pthread_mutexattr_init(&attr);
+      pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+      pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+      pthread_mutex_init(&oh->lock, &attr);
+      pthread_mutexattr_destroy(&attr);
+      __atomic_store_n(&oh->ready, 1, __ATOMIC_RELEASE);
+      return oh;
+    }
+    if (errno != EEXIST)
+      return NULL;
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)    /* Removed by its last user in the meantime              */
+      continue;
+    oh = MAP_FAILED;
+    for (i=0; i<TSHM_INITPOLL; i++){
+      if (oh == MAP_FAILED && fstat(fd, &st) == 0 &&
+          st.st_size == sizeof(struct opacityhint))
+        oh = mmap(NULL, sizeof(struct opacityhint), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+      if (oh != MAP_FAILED && __atomic_load_n(&oh->ready, __ATOMIC_ACQUIRE))
+        break;
+      nanosleep(&ms, NULL);
+    }
+    close(fd);
+    if (i < TSHM_INITPOLL)
+      return oh;
+
+    tr_output(TOUT_WARN, "Removing the abandoned shared-memory segment "
+      "'%s'.\n", name);
+    if (oh != MAP_FAILED)
+      munmap(oh, sizeof(struct opacityhint));
+    shm_unlink(name);
+  }
+  return NULL;
+}
 
-  op->Nwave = oh->Nwave;
-  op->Ntemp = oh->Ntemp;
-  op->Nlayer = oh->Nlayer;
-  op->Nmol = oh->Nmol;
-
-  /* Size of the main shared memory, starting with: grid */
-  long long main_shm_size  
-    = sizeof(PREC_RES) * op->Nmol * op->Ntemp * op->Nlayer * op->Nwave
-    + sizeof(int) * op->Nmol          /* op->molID  */
-    + sizeof(PREC_RES) * op->Ntemp    /* op->temp   */
-    + sizeof(PREC_RES) * op->Nlayer   /* op->press  */
-    + sizeof(PREC_RES) * op->Nwave;   /* op->wns    */
-
-  /* Allocate or locate the main shared memory:                             */
-  key_t mainkey = ftok(tr->f_opa, 'b');
-  op->mainID = shmget(mainkey, main_shm_size, 0644 | IPC_CREAT);
-
-  /* If allocation failed, abort:                                           */
-  if (op->mainID == -1) {
-    tr_output(TOUT_WARN, "Failed to allocate main shared memory.\n");
-    return 1;
+
+/* FUNCTION: Lock the coordinator oh.  If the previous holder died with the
+   lock, a grid it left half loaded is discarded (the caller loads it
+   again).  Processes that died without detaching are dropped from the
+   list of attached processes.                                              */
+static void
+shmlock(struct opacityhint *oh,
+        char *gridname){
+  int i, n;
+
+  if (pthread_mutex_lock(&oh->lock) == EOWNERDEAD){
+    if (!(oh->status & TSHM_WRITTEN)){
+      tr_output(TOUT_WARN, "A process died while loading the shared "
+        "opacity grid, it will be loaded again.\n");
+      shm_unlink(gridname);
+    }
+    pthread_mutex_consistent(&oh->lock);
   }
+  for (i=n=0; i<oh->nproc; i++)
+    if (kill(oh->pid[i], 0) == 0 || errno != ESRCH)
+      oh->pid[n++] = oh->pid[i];
+  oh->nproc = n;
+}
 
-  /* Attach to the main shared memory:                                      */
-  op->mainaddr = shmat(op->mainID, (void *) 0, 0);
 
-  if (op->mainaddr == (void *) -1) {
-    tr_output(TOUT_WARN, "Failed to attach to main shared memory.\n");
+/* FUNCTION: Detach this process from the coordinator of op.  The last
+   process to detach removes the segments (mappings of them stay valid).    */
+static void
+shmrelease(struct opacity *op){
+  struct opacityhint *oh = op->hint;
+  char gridname[TSHM_NAMELEN+8];
+  pid_t pid = getpid();
+  int i, n;
+
+  snprintf(gridname, sizeof(gridname), "%s.grid", op->shmname);
+  shmlock(oh, gridname);
+  for (i=n=0; i<oh->nproc; i++)
+    if (oh->pid[i] != pid)
+      oh->pid[n++] = oh->pid[i];
+  oh->nproc = n;
+  if (n == 0){
+    tr_output(TOUT_DEBUG, "Removing the shared opacity grid.\n");
+    oh->status = TSHM_START;
+    shm_unlink(gridname);
+    shm_unlink(op->shmname);
+  }
+  pthread_mutex_unlock(&oh->lock);
+  munmap(oh, sizeof(struct opacityhint));
+  op->hint = NULL;
+}
+
+
+/* FUNCTION: Load an opacity file without header (version 1) into a new
+   grid segment, laid out as a version-2 file after its header, and record
+   its dimensions in the coordinator.  Called with the coordinator locked.
+   Return: 0 on success, 1 on failure                                       */
+static int
+shmload(struct transit *tr,
+        FILE *fp,
+        char *gridname){
+  struct opacity *op = tr->ds.op;
+  struct opacityhint *oh = op->hint;
+  long off[6], data, ngrid;
+  size_t size;
+  char *p;
+  int fd, rn;
+
+  if (fread(&op->Nmol,   sizeof(long), 1, fp) != 1 ||
+      fread(&op->Ntemp,  sizeof(long), 1, fp) != 1 ||
+      fread(&op->Nlayer, sizeof(long), 1, fp) != 1 ||
+      fread(&op->Nwave,  sizeof(long), 1, fp) != 1)
+    return 1;
+  data  = opaoffsets(op, TOPA_F64, off);
+  ngrid = op->Nlayer*op->Ntemp*op->Nmol*op->Nwave;
+  size  = data + ngrid*sizeof(PREC_RES);
+
+  /* Always a new segment: processes still mapping a previous one (e.g.,
+     of a dead master) keep theirs:                                         */
+  shm_unlink(gridname);
+  fd = shm_open(gridname, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    return 1;
+  if (ftruncate(fd, size) != 0){
+    close(fd);
+    shm_unlink(gridname);
+    return 1;
+  }
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED){
+    shm_unlink(gridname);
+    return 1;
+  }
+
+  rn = fread(p+off[0], sizeof(int),      op->Nmol,   fp) == op->Nmol   &&
+       fread(p+off[1], sizeof(PREC_RES), op->Ntemp,  fp) == op->Ntemp  &&
+       fread(p+off[2], sizeof(PREC_RES), op->Nlayer, fp) == op->Nlayer &&
+       fread(p+off[3], sizeof(PREC_RES), op->Nwave,  fp) == op->Nwave  &&
+       fread(p+data,   sizeof(PREC_RES), ngrid,      fp) == ngrid;
+  munmap(p, size);
+  if (!rn){
+    tr_output(TOUT_WARN, "The opacity file is shorter than its "
+      "dimensions.\n");
+    shm_unlink(gridname);
     return 1;
   }
 
-  oh->num_attached++;
+  oh->Nmol   = op->Nmol;
+  oh->Ntemp  = op->Ntemp;
+  oh->Nlayer = op->Nlayer;
+  oh->Nwave  = op->Nwave;
+  oh->size   = size;
   return 0;
 }
 
 
-/* FUNCTION: Create pointers to the opacity values in shared memory.
-   Return: 0 on success                                                     */
+/* FUNCTION: Share the grid of an opacity file without header (version 1)
+   among the processes of a node (--shareOpacity).  The first process to
+   take the coordinator's lock is the master: it loads the grid into a
+   shared-memory segment while it holds the lock, so the other processes
+   sleep in the lock instead of polling.  If the master dies while
+   loading, the next process to get the lock loads the grid.  Each process
+   attaches the whole grid read only and registers in the coordinator, the
+   last one to detach (freemem_opacity()) removes the segments; each
+   process then uses its window of the grid (see opawindow()).
+   Return: 0 on success, 1 if the grid could not be shared                  */
 int
-mountopacity(struct transit *tr){ /* transit struct                         */
-  struct opacity *op=tr->ds.op;   /* opacity struct                         */
-  int i, t, r;  /* for-loop indices                                         */
-
-  char *p = op->mainaddr;
-  op->molID = (int *) p;
-  p += sizeof(int) * op->Nmol;
-  op->temp = (PREC_RES *) p;
-  p += sizeof(PREC_RES) * op->Ntemp;
-  op->press = (PREC_RES *) p;
-  p += sizeof(PREC_RES) * op->Nlayer;
-  op->wns = (PREC_RES *) p;
-  p += sizeof(PREC_RES) * op->Nwave;
-
-  op->o      = (PREC_RES ****)       calloc(op->Nlayer, sizeof(PREC_RES ***));
-  for     (r=0; r < op->Nlayer; r++){
-    op->o[r] = (PREC_RES  ***)       calloc(op->Ntemp,  sizeof(PREC_RES **));
-    for   (t=0; t < op->Ntemp; t++){
-      op->o[r][t] = (PREC_RES **)    calloc(op->Nmol,   sizeof(PREC_RES *));
-      for (i=0; i < op->Nmol; i++){
-        op->o[r][t][i] = (PREC_RES *) p /* Map the 4D structure to 1D.      */
-                                      + r * op->Ntemp * op->Nmol * op->Nwave
-                                      + t * op->Nmol * op->Nwave
-                                      + i * op->Nwave;
-      }
+shareopacity(struct transit *tr, /* transit struct                          */
+             FILE *fp){          /* Opacity file, after the version check   */
+  struct opacity *op=tr->ds.op;  /* opacity struct                          */
+  struct opacityhint *oh;        /* Shared-memory coordinator               */
+  char gridname[TSHM_NAMELEN+8];
+  char *p = MAP_FAILED;
+  long off[6], data, win[4];
+  int fd;
+
+  if (shmname(fp, op->shmname, TSHM_NAMELEN) != 0 ||
+      (oh = op->hint = shmhint(op->shmname)) == NULL){
+    tr_output(TOUT_WARN, "Could not open the shared-memory coordinator.\n");
+    return 1;
+  }
+  snprintf(gridname, sizeof(gridname), "%s.grid", op->shmname);
+
+  shmlock(oh, gridname);
+  if (oh->nproc == TSHM_MAXPROC){
+    pthread_mutex_unlock(&oh->lock);
+    munmap(oh, sizeof(struct opacityhint));
+    op->hint = NULL;
+    return 1;
+  }
+  oh->pid[oh->nproc++] = getpid();
+
+  if (!(oh->status & TSHM_WRITTEN)){
+    tr_output(TOUT_INFO, "Loading the opacity grid into shared memory.\n");
+    if (shmload(tr, fp, gridname) == 0)
+      oh->status = TSHM_WRITTEN;
+  }
+  /* Attach the grid before unlocking, so it cannot be removed meanwhile:   */
+  if (oh->status & TSHM_WRITTEN){
+    fd = shm_open(gridname, O_RDONLY, 0);
+    if (fd >= 0){
+      p = mmap(NULL, oh->size, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
     }
   }
+  pthread_mutex_unlock(&oh->lock);
+
+  if (p == MAP_FAILED){
+    tr_output(TOUT_WARN, "Could not attach the shared opacity grid.\n");
+    shmrelease(op);
+    return 1;
+  }
 
+  op->Nmol   = oh->Nmol;
+  op->Ntemp  = oh->Ntemp;
+  op->Nlayer = oh->Nlayer;
+  op->Nwave  = oh->Nwave;
+  op->mainaddr = p;
+  op->mainsize = oh->size;
+  data = opaoffsets(op, TOPA_F64, off);
+  op->molID = (int      *)(p + off[0]);
+  op->temp  = (PREC_RES *)(p + off[1]);
+  op->press = (PREC_RES *)(p + off[2]);
+  op->wns   = (PREC_RES *)(p + off[3]);
+  opastrides(op, op->stride);
+  if (opawindow(tr, win) != 0){
+    munmap(p, oh->size);
+    op->mainaddr = NULL;
+    op->molID = NULL;
+    op->temp  = op->press = op->wns = NULL;
+    shmrelease(op);
+    return 1;
+  }
+  mountgrid(op, opaview(op, win, p + data));
+  opacityinfo(op);
   return 0;
 }
 
@@ -635,18 +2735,52 @@ mountopacity(struct transit *tr){ /* transit struct                         */
 int
 freemem_opacity(struct opacity *op, /* Opacity structure                    */
                 long *pi){          /* transit progress flag                */
+  long i;
+
   /* Free arrays:                                                           */
-  free(op->o[0][0][0]); /* The opacity                                      */
-  free(op->o[0][0]);
-  free(op->o[0]);
-  free(op->o);
+  if (op->opamap != NULL)   /* The opacity: mapped, shared, or allocated    */
+    munmap(op->opamap, op->opamapsize);
+  else if (op->mainaddr != NULL)
+    munmap(op->mainaddr, op->mainsize);
+  else
+    free(op->grid);
+  if (op->hint != NULL)     /* Detach from the shared-memory coordinator    */
+    shmrelease(op);
+  op->opamap   = NULL;
+  op->mainaddr = NULL;
+  op->grid     = NULL;
+  op->qscale   = NULL;
+  free(op->qlut);
+  if (op->o != NULL){
+    free(op->o[0][0]);
+    free(op->o[0]);
+    free(op->o);
+    op->o = NULL;
+  }
+
+  if (op->profmap != NULL)  /* The Voigt-profile arena, mapped or computed  */
+    munmap(op->profmap, op->profmapsize);
+  else
+    free(op->profarena);
+  free(op->profoff);
+  free(op->profstate);
 
-  free(op->profile[0][0]); /* The Voigt profiles                            */
-  free(op->profile[0]);
-  free(op->profile);
+  if (op->profsize != NULL){  /* The Voigt-profile half-size                */
+    free(op->profsize[0]);
+    free(op->profsize);
+  }
+
+  if (op->pspec != NULL){     /* The profile spectra                        */
+    for (i=0; i<op->nDop*op->nLor; i++)
+      if (op->pspec[0][i] != NULL)
+        free(op->pspec[0][i]);
+    free(op->pspec[0]);
+    free(op->pspec);
+  }
 
-  free(op->profsize[0]);  /* The Voigt-profile half-size                    */
-  free(op->profsize);
+  free(op->isoslot);
+  freemem_linecull(op->cull);
+  op->cull = NULL;
 
   /* Update progress indicator and return:                                  */
   *pi &= ~(TRPI_OPACITY | TRPI_TAU);
@@ -0,0 +1,108 @@
+// Copyright (C) 2015-2016 University of Central Florida. All rights reserved.
+// Transit is under an open-source, reproducible-research license (see LICENSE).
+
+#include <transit.h>
+#include <pthread.h>
+
+/* Non-zero while the current thread is running a parallelrun() worker.
+   Nested calls then run serially on the calling thread.                    */
+static __thread int inworker = 0;
+
+/* Work shared by the threads of one parallelrun() call:                    */
+struct parallelwork{
+  parallelfcn fcn;    /* Function to process each item                      */
+  void *arg;          /* Argument passed through to fcn                     */
+  long nitems;        /* Number of work items                               */
+  long next;          /* Next item to be handed out                         */
+};
+
+/* Per-thread argument:                                                     */
+struct parallelthread{
+  struct parallelwork *work;
+  int tid;            /* Thread index, in [0, nthreads)                     */
+};
+
+
+/* FUNCTION: Number of threads that a parallelrun() call would use from
+   the current thread, given the requested number of threads.
+   Return: 1 inside a worker thread or if nthreads < 1, else nthreads       */
+int
+parallelthreads(int nthreads){
+  if (inworker || nthreads < 1)
+    return 1;
+  return nthreads;
+}
+
+
+/* FUNCTION: Thread loop, hand out work items until none are left.          */
+static void *
+parallelworker(void *arg){
+  struct parallelthread *pt = (struct parallelthread *)arg;
+  struct parallelwork *work = pt->work;
+  long item;
+
+  inworker = 1;
+  while ((item=__sync_fetch_and_add(&work->next, 1)) < work->nitems)
+    work->fcn(work->arg, item, pt->tid);
+  inworker = 0;
+  return NULL;
+}
+
+
+/* FUNCTION: Call fcn(arg, item, tid) for every item in [0, nitems) using
+   up to nthreads threads (the calling thread included).  Items are handed
+   out dynamically, so fcn must not depend on the order of evaluation;
+   tid in [0, nthreads) can index per-thread scratch memory.
+   Return: 0 on success                                                     */
+int
+parallelrun(int nthreads,     /* Number of threads                          */
+            long nitems,      /* Number of work items                       */
+            parallelfcn fcn,  /* Function to evaluate for each item         */
+            void *arg){       /* Argument passed through to fcn             */
+  struct parallelwork work;
+  struct parallelthread *pt;
+  pthread_t *threads;
+  long k;
+  int i, nstarted;
+
+  nthreads = parallelthreads(nthreads);
+  if (nthreads > nitems)
+    nthreads = nitems;
+
+  /* Serial evaluation:                                                     */
+  if (nthreads <= 1){
+    for (k=0; k<nitems; k++)
+      fcn(arg, k, 0);
+    return 0;
+  }
+
+  work.fcn    = fcn;
+  work.arg    = arg;
+  work.nitems = nitems;
+  work.next   = 0;
+
+  threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+  pt = (struct parallelthread *)calloc(nthreads,
+                                       sizeof(struct parallelthread));
+  for (i=0; i<nthreads; i++){
+    pt[i].work = &work;
+    pt[i].tid  = i;
+  }
+
+  /* Launch the helper threads, the calling thread acts as thread 0:        */
+  for (nstarted=1; nstarted<nthreads; nstarted++)
+    if (pthread_create(threads+nstarted, NULL, parallelworker,
+                       pt+nstarted) != 0){
+      tr_output(TOUT_WARN, "Could only start %d of %d threads.\n",
+                nstarted, nthreads);
+      break;
+    }
+  parallelworker(pt);
+
+  for (i=1; i<nstarted; i++)
+    pthread_join(threads[i], NULL);
+
+  free(threads);
+  free(pt);
+  return 0;
+}
@@ -105,12 +105,12 @@ readtli_bin(FILE *fp,
   fread(&li->lr_ver,  sizeof(unsigned short), 1, fp);
   fread(&li->lr_rev,  sizeof(unsigned short), 1, fp);
   /* Check compatibility of versions:                                       */
-  if(li->tli_ver != compattliversion) {
+  if(li->tli_ver < mintliversion || li->tli_ver > compattliversion) {
     tr_output(TOUT_ERROR,
       "The version of the TLI file: %i (lineread v%i.%i) is not "
       "compatible with this version of transit, which can only "
-      "read version %i.\n", li->tli_ver, li->lr_ver,
-      li->lr_rev, compattliversion);
+      "read versions %i to %i.\n", li->tli_ver, li->lr_ver,
+      li->lr_rev, mintliversion, compattliversion);
     exit(EXIT_FAILURE);
   }
 
@@ -391,7 +391,8 @@ readinfo_tli(struct transit *tr,
                              li->wi, li->wf);
 
   /* Declare linetransition struct and set wavelength and lower energy unit
-     factors (As of TLI v5, always in microns and cm-1, respectively):      */
+     factors (As of TLI v5, always in microns and cm-1, respectively;
+     TLI v7 stores wavenumbers in cm-1 instead of wavelengths):             */
   struct line_transition *lt = &li->lt;
   lt->wfct = TLI_WAV_UNITS;
   lt->efct = TLI_E_UNITS;
@@ -403,9 +404,146 @@ readinfo_tli(struct transit *tr,
 }
 
 
+/* FUNCTION:
+  Pack n lines, given as TLI v6 columns (wavelength, isotope ID, lower-
+  state energy, and gf), into the records of lt from record n0 on, which
+  must start a block.  The last block is padded with records at zero
+  wavenumber and of negligible strength, so that they are never added.
+  Return: the number of records written (n rounded up to LT_BLOCK)        */
+PREC_NREC
+packlines(struct line_transition *lt, /* Line transitions                   */
+          PREC_NREC n0,               /* First record to write              */
+          PREC_LNDATA *wl,            /* Wavelength (TLI units)             */
+          short *isoid,               /* Isotope ID                         */
+          PREC_LNDATA *elow,          /* Lower-state energy (TLI units)     */
+          PREC_LNDATA *gf,            /* gf                                 */
+          PREC_NREC n){               /* Number of lines                    */
+  struct linerecord *rec = lt->rec + n0;
+  double *base = lt->wnbase + (n0>>LT_BLOCKBITS);
+  PREC_NREC ln, nrec = (n + LT_BLOCK - 1) & ~(PREC_NREC)(LT_BLOCK - 1);
+  double wn;
+
+  for (ln=0; ln<n; ln++){
+    wn = 1.0/(wl[ln]*lt->wfct);
+    if ((ln & (LT_BLOCK-1)) == 0)
+      base[ln>>LT_BLOCKBITS] = wn;
+    rec[ln].dwn   = wn - base[ln>>LT_BLOCKBITS];
+    rec[ln].elow  = elow[ln];
+    rec[ln].lgf   = gf[ln] > 0 ? log10(gf[ln]) : LT_MINLGF;
+    rec[ln].isoid = isoid[ln];
+    rec[ln].pad   = 0;
+  }
+  for (; ln<nrec; ln++){
+    rec[ln].dwn   = -base[ln>>LT_BLOCKBITS];
+    rec[ln].elow  = 0;
+    rec[ln].lgf   = LT_MINLGF;
+    rec[ln].isoid = isoid[n-1];
+    rec[ln].pad   = 0;
+  }
+  return nrec;
+}
+
+
+/* Number of lines read at a time from the columns of a TLI v6 file:       */
+#define TLI_PIECE (1024*LT_BLOCK)
+
+/* FUNCTION:
+  Read the n lines starting at line 'first' of a TLI v6 file, and pack
+  them into lt from record n0 on (see packlines()).
+  Return: the number of records written                                    */
+PREC_NREC
+readlinecols(FILE *fp,                   /* TLI file                        */
+             struct lineinfo *li,        /* Column positions                */
+             struct line_transition *lt, /* Line transitions                */
+             PREC_NREC n0,               /* First record to write           */
+             PREC_NREC first,            /* First line to read              */
+             PREC_NREC n){               /* Number of lines to read         */
+  PREC_LNDATA *wl, *elow, *gf;
+  short *isoid;
+  PREC_NREC p, np, nrec=0,
+            npiece = n < TLI_PIECE ? n : TLI_PIECE;
+
+  wl    = (PREC_LNDATA *)calloc(npiece, sizeof(PREC_LNDATA));
+  elow  = (PREC_LNDATA *)calloc(npiece, sizeof(PREC_LNDATA));
+  gf    = (PREC_LNDATA *)calloc(npiece, sizeof(PREC_LNDATA));
+  isoid = (short       *)calloc(npiece, sizeof(short));
+
+  for (p=0; p<n; p+=np){
+    np = n - p < npiece ? n - p : npiece;
+    /* Wavelength:                                                          */
+    fseek(fp, (first+p)*sizeof(PREC_LNDATA) + li->wl_loc,  SEEK_SET);
+    fread(wl,    sizeof(PREC_LNDATA), np, fp);
+    /* Isotope ID:                                                          */
+    fseek(fp, (first+p)*sizeof(short)       + li->iso_loc, SEEK_SET);
+    fread(isoid, sizeof(short),       np, fp);
+    /* Lower-state energy:                                                  */
+    fseek(fp, (first+p)*sizeof(PREC_LNDATA) + li->el_loc,  SEEK_SET);
+    fread(elow,  sizeof(PREC_LNDATA), np, fp);
+    /* gf:                                                                  */
+    fseek(fp, (first+p)*sizeof(PREC_LNDATA) + li->gf_loc,  SEEK_SET);
+    fread(gf,    sizeof(PREC_LNDATA), np, fp);
+
+    nrec += packlines(lt, n0+p, wl, isoid, elow, gf, np);
+  }
+
+  free(wl);
+  free(elow);
+  free(gf);
+  free(isoid);
+  return nrec;
+}
+
+
+/* FUNCTION:
+  Read the n records starting at record 'first' of a TLI v7 file into lt
+  from record n0 on.  first, n, and n0 must be multiples of LT_BLOCK.
+  Return: the number of records read                                       */
+PREC_NREC
+readlinerecs(FILE *fp,                   /* TLI file                        */
+             struct lineinfo *li,        /* Record positions                */
+             struct line_transition *lt, /* Line transitions                */
+             PREC_NREC n0,               /* First record to write           */
+             PREC_NREC first,            /* First record to read            */
+             PREC_NREC n){               /* Number of records to read       */
+  fseek(fp, li->blk_loc + (first>>LT_BLOCKBITS)*sizeof(double), SEEK_SET);
+  fread(lt->wnbase + (n0>>LT_BLOCKBITS), sizeof(double), n>>LT_BLOCKBITS,
+        fp);
+  fseek(fp, li->rec_loc + first*sizeof(struct linerecord), SEEK_SET);
+  return fread(lt->rec + n0, sizeof(struct linerecord), n, fp);
+}
+
+
+/* FUNCTION:
+  Find the blocks [*kf, *kl] of the nb blocks of an isotope in a TLI v7
+  file that may hold lines with wavenumber in [wnmin, wnmax].  The lines of
+  block k have wavenumbers in [base[k+1], base[k]].                         */
+static void
+blockrange(double *base,
+           PREC_NREC nb,
+           double wnmin,
+           double wnmax,
+           PREC_NREC *kf,
+           PREC_NREC *kl){
+  *kf = 0;
+  while (*kf+1 < nb && base[*kf+1] > wnmax)
+    (*kf)++;
+  *kl = nb - 1;
+  while (*kl >= 0 && base[*kl] < wnmin)
+    (*kl)--;
+}
+
+
 /* FUNCTION:
   Read and store the line transition info (central wavelength, isotope
   ID, lowE, log(gf)) into lineinfo.  Return the number of lines read.
+  The lines are stored as packed records ready for computemolext(), with
+  the lines of each isotope sorted by decreasing wavenumber and starting
+  a new block (see struct linerecord).  TLI v7 files already store the
+  lines this way; the columns of TLI v6 files are packed on reading.
+  TLI v7 lines are read in whole blocks, i.e., a few lines beyond the
+  wavenumber range are also stored.
+  In streaming mode (tr->linebuffer > 0) only the range of lines of each
+  isotope is stored, the lines are read later through a linestream.
 
   Return: the number of records read on success, else:
           -1 unexpected EOF
@@ -419,15 +557,16 @@ int readdatarng(struct transit *tr,   /* transit structure                  */
   struct line_transition *lt = &li->lt;  /* line_transition structure       */
   FILE *fp;              /* Data file pointer                               */
   int niso,              /* Number of isotopes in line transition data      */
-      nread,             /* Number of transitions to read for each isotope  */
       i;                 /* for-loop index                                  */
   PREC_NREC nlines,            /* Number of line transitions                */
-            wl_loc, iso_loc,   /* Offsets for isoID, Elow, and gf data      */
-            el_loc, gf_loc,    /* (in memory)                               */
+            nrec,              /* Upper limit of the number of records      */
+            nread,             /* Number of transitions to read per isotope */
             *isotran,          /* Number of transitions per isotope in TLI  */
-            start,             /* Position of first LT for isotope in TLI   */
+            start=0,           /* Position of first LT for isotope in TLI   */
             offset=0;          /* Isotope offset (in number of transitions) */
   int rn;                /* Return IDs                                      */
+  int blocksize;         /* Records per block of a TLI v7 file              */
+  double *base;          /* Block wavenumbers of an isotope (TLI v7)        */
   /* Indices of first and last transitions to be stored                     */
   PREC_NREC ifirst, ilast;
 
@@ -469,34 +608,66 @@ int readdatarng(struct transit *tr,   /* transit structure                  */
     tr_output(TOUT_DEBUG, "Ntransitions[%d]: %d.\n", i, isotran[i]);
   }
 
-  /* Get current location of pointer:                                       */
-  start = ftell(fp);
+  /* Get the location of the line data:                                     */
+  if (li->tli_ver < 7){
+    start = ftell(fp);
+    li->wl_loc  = start;
+    li->iso_loc = li->wl_loc  + nlines*sizeof(PREC_LNDATA);
+    li->el_loc  = li->iso_loc + nlines*sizeof(short);
+    li->gf_loc  = li->el_loc  + nlines*sizeof(PREC_LNDATA);
+    /* Each isotope is padded to a whole block in memory:                   */
+    nrec = nlines + niso*LT_BLOCK;
+  }
+  else{
+    fread(&blocksize, sizeof(int), 1, fp);
+    if (blocksize != LT_BLOCK){
+      tr_output(TOUT_ERROR, "The TLI file has blocks of %d line records, "
+        "but transit uses blocks of %d records.\n", blocksize, LT_BLOCK);
+      exit(EXIT_FAILURE);
+    }
+    li->blk_loc = ftell(fp);
+    li->rec_loc = li->blk_loc + (nlines>>LT_BLOCKBITS)*sizeof(double);
+    nrec = nlines;
+  }
   li->n_l = 0;
 
+  /* Streaming mode, keep only the ranges of lines to read:                 */
+  if (tr->linebuffer > 0){
+    li->nrng     = niso;
+    li->rngfirst = (PREC_NREC *)calloc(niso, sizeof(PREC_NREC));
+    li->rngn     = (PREC_NREC *)calloc(niso, sizeof(PREC_NREC));
+  }
   /* Allocation for line transition structures:                             */
   /* The size might be larger than needed, adjust at the end                */
-  lt->gf    = (PREC_LNDATA *)calloc(nlines, sizeof(PREC_LNDATA));
-  lt->wl    = (PREC_LNDATA *)calloc(nlines, sizeof(PREC_LNDATA));
-  lt->elow  = (PREC_LNDATA *)calloc(nlines, sizeof(PREC_LNDATA));
-  lt->isoid = (short       *)calloc(nlines, sizeof(short));
+  else{
+    lt->rec    = (struct linerecord *)calloc(nrec, sizeof(struct linerecord));
+    lt->wnbase = (double *)calloc(nrec>>LT_BLOCKBITS, sizeof(double));
+  }
   /* Check for allocation errors:                                           */
-  if(!lt->gf || !lt->wl || !lt->elow || !lt->isoid) {
+  if(tr->linebuffer == 0 && (!lt->rec || !lt->wnbase)){
     tr_output(TOUT_ERROR, "Couldn't allocate memory for "
       "linetran structure array of length %i, in function "
-      "readdatarng.\n", nlines);
+      "readdatarng.\n", nrec);
     exit(EXIT_FAILURE);
   }
 
-  /* Starting location for wavelength, isoID, Elow, and gf data in file:    */
-  wl_loc  = start;
-  iso_loc = wl_loc  + nlines*sizeof(PREC_LNDATA);
-  el_loc  = iso_loc + nlines*sizeof(short);
-  gf_loc  = el_loc  + nlines*sizeof(PREC_LNDATA);
-
   for (i=0; i<niso; i++){
-    /* Do binary search in units of TLI:                                    */
-    datafileBS(fp, start, isotran[i], iniw, &ifirst, sizeof(PREC_LNDATA), 0);
-    datafileBS(fp, start, isotran[i], finw, &ilast,  sizeof(PREC_LNDATA), 1);
+    if (li->tli_ver < 7){
+      /* Do binary search in units of TLI:                                  */
+      datafileBS(fp, start, isotran[i], iniw, &ifirst, sizeof(PREC_LNDATA), 0);
+      datafileBS(fp, start, isotran[i], finw, &ilast,  sizeof(PREC_LNDATA), 1);
+    }
+    else{
+      /* Search the blocks of the isotope that hold the range:              */
+      base = (double *)calloc(isotran[i]>>LT_BLOCKBITS, sizeof(double));
+      fseek(fp, li->blk_loc + (offset>>LT_BLOCKBITS)*sizeof(double), SEEK_SET);
+      fread(base, sizeof(double), isotran[i]>>LT_BLOCKBITS, fp);
+      blockrange(base, isotran[i]>>LT_BLOCKBITS, tr->wns.i*tr->wns.fct,
+                 tr->wns.f*tr->wns.fct, &ifirst, &ilast);
+      free(base);
+      ifirst = ifirst*LT_BLOCK;
+      ilast  = (ilast+1)*LT_BLOCK - 1;
+    }
     ifirst += offset;
     ilast  += offset;
     tr_output(TOUT_DEBUG, "Initial and final entries are: "
@@ -504,32 +675,36 @@ int readdatarng(struct transit *tr,   /* transit structure                  */
 
     /* Number of transitions to read:                                       */
     nread = ilast - ifirst + 1;
-    /* Move pointer to each section and read info:                          */
-    /* Wavelength:                                                          */
-    fseek(fp, ifirst*sizeof(PREC_LNDATA) + wl_loc,  SEEK_SET);
-    fread(lt->wl+li->n_l,    sizeof(PREC_LNDATA), nread, fp);
-    /* Isotope ID:                                                          */
-    fseek(fp, ifirst*sizeof(short)       + iso_loc, SEEK_SET);
-    fread(lt->isoid+li->n_l, sizeof(short),       nread, fp);
-    /* Lower-state energy:                                                  */
-    fseek(fp, ifirst*sizeof(PREC_LNDATA) + el_loc,  SEEK_SET);
-    fread(lt->elow+li->n_l,  sizeof(PREC_LNDATA), nread, fp);
-    /* gf:                                                                  */
-    fseek(fp, ifirst*sizeof(PREC_LNDATA) + gf_loc,  SEEK_SET);
-    fread(lt->gf+li->n_l,    sizeof(PREC_LNDATA), nread, fp);
+    if (nread < 0)
+      nread = 0;
+    if (tr->linebuffer > 0){
+      li->rngfirst[i] = ifirst;
+      li->rngn[i]     = nread;
+      li->n_l += nread;
+    }
+    /* Read the lines of this isotope:                                      */
+    else if (li->tli_ver < 7)
+      li->n_l += readlinecols(fp, li, lt, li->n_l, ifirst, nread);
+    else
+      li->n_l += readlinerecs(fp, li, lt, li->n_l, ifirst, nread);
 
-    /* Count the number of lines:                                           */
-    li->n_l += nread;
     /* Move the wl offset to next isotope:                                  */
-    start  += isotran[i]*sizeof(double);
+    if (li->tli_ver < 7)
+      start += isotran[i]*sizeof(double);
     offset += isotran[i];
   }
 
   /* Re-allocate arrays to their correct size:                              */
-  lt->wl    = (PREC_LNDATA *)realloc(lt->wl,    li->n_l*sizeof(PREC_LNDATA));
-  lt->isoid = (short       *)realloc(lt->isoid, li->n_l*sizeof(short));
-  lt->elow  = (PREC_LNDATA *)realloc(lt->elow,  li->n_l*sizeof(PREC_LNDATA));
-  lt->gf    = (PREC_LNDATA *)realloc(lt->gf,    li->n_l*sizeof(PREC_LNDATA));
+  if (tr->linebuffer == 0){
+    lt->rec    = (struct linerecord *)realloc(lt->rec,
+                                   li->n_l*sizeof(struct linerecord));
+    lt->wnbase = (double *)realloc(lt->wnbase,
+                                   (li->n_l>>LT_BLOCKBITS)*sizeof(double));
+  }
+  else
+    tr_output(TOUT_INFO, "Streaming %li line transitions from the TLI "
+      "file (%.1f MB line buffer).\n", li->n_l, tr->linebuffer/1048576.0);
+  free(isotran);
 
   fclose(fp);               /* Close file                                   */
   tr->pi |= TRPI_READDATA;  /* Update progress indicator                    */
@@ -655,6 +830,11 @@ freemem_lineinfo(struct lineinfo *li,
                  long *pi){
   int i;
 
+  /* Free the isotope line ranges of streaming mode:                        */
+  free(li->rngfirst);
+  free(li->rngn);
+  li->nrng = 0;
+
   //transitprint(1,2, "%ld\n", *pi &= TRPI_READINFO);
   //transitprint(1,2, "%ld\n\n", *pi &= TRPI_READBIN);
   if (*pi &= TRPI_READBIN){
@@ -682,11 +862,9 @@ freemem_lineinfo(struct lineinfo *li,
 int
 freemem_linetransition(struct line_transition *lt,
                        long *pi){
-  /* Free the four arrays of lt:                                            */
-  free(lt->wl);
-  free(lt->elow);
-  free(lt->gf);
-  free(lt->isoid);
+  /* Free the line records of lt (NULL in streaming mode):                  */
+  free(lt->rec);
+  free(lt->wnbase);
 
   /* Unset appropiate flags:                                                */
   *pi &= ~TRPI_READDATA;
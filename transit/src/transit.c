@@ -154,6 +154,9 @@ void do_transit(double * transit_out){
     /* Calculate extinction coefficient:                                    */
     fw(extwn, !=0, &transit);
     t0 = timecheck(verblevel, itr, 11, "extwn", tv, t0);
+    /* Save the Voigt profiles computed so far once they make an eighth of
+       the grid, the rest are saved by free_memory():                       */
+    saveprofiles(&transit, transit.ds.op->nDop*transit.ds.op->nLor/8);
 
     /* Initialize structures for the optical-depth calculation:             */
     fw(init_optdepth, !=0, &transit);
@@ -217,8 +220,11 @@ void free_memory(void){
   /* Free all the memory used in transit, and should be
      called at the end of the program. Check if all these data structures
      can be used when called from bart.                                     */
+  saveprofiles(&transit, 1);
   freemem_molecules( transit.ds.mol, &transit.pi);
   freemem_atmosphere(transit.ds.at,  &transit.pi);
+  if (transit.pi & TRPI_OPACITY)
+    freemem_opacity(transit.ds.op, &transit.pi);
   if (transit.fp_opa == NULL)
     freemem_linetransition(&transit.ds.li->lt,  &transit.pi);
   freemem_lineinfo(transit.ds.li,  &transit.pi);
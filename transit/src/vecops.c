@@ -0,0 +1,276 @@
+// Copyright (C) 2015-2016 University of Central Florida. All rights reserved.
+// Transit is under an open-source, reproducible-research license (see LICENSE).
+
+#include <transit.h>
+
+/* Vector kernels.  The AVX2 and AVX-512 versions are compiled for their
+   instruction sets regardless of the compiler flags, and the kernel used
+   is chosen at run time according to what the host CPU supports.         */
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define VEC_X86 1
+#include <immintrin.h>
+#endif
+
+
+/* FUNCTION: y += a*x, scalar version.                                      */
+static void
+axpy_scalar(double *y,
+            const float *x,
+            double a,
+            long n){
+  long i;
+  for (i=0; i<n; i++)
+    y[i] += a*x[i];
+}
+
+
+/* FUNCTION: y[i] += a*x[-i], scalar version.                              */
+static void
+axpyrev_scalar(double *y,
+               const float *x,
+               double a,
+               long n){
+  long i;
+  for (i=0; i<n; i++)
+    y[i] += a*x[-i];
+}
+
+
+/* FUNCTION: y += a*x + b*z, scalar version.                              */
+static void
+axpy2_scalar(double *y,
+             const double *x,
+             double a,
+             const double *z,
+             double b,
+             long n){
+  long i;
+  for (i=0; i<n; i++)
+    y[i] += a*x[i] + b*z[i];
+}
+
+
+#ifdef VEC_X86
+/* FUNCTION: y += a*x, AVX2 version.                                        */
+__attribute__((target("avx2,fma")))
+static void
+axpy_avx2(double *y,
+          const float *x,
+          double a,
+          long n){
+  __m256d va = _mm256_set1_pd(a);
+  long i;
+  for (i=0; i+8<=n; i+=8){
+    _mm256_storeu_pd(y+i,   _mm256_fmadd_pd(va,
+                     _mm256_cvtps_pd(_mm_loadu_ps(x+i)),
+                     _mm256_loadu_pd(y+i)));
+    _mm256_storeu_pd(y+i+4, _mm256_fmadd_pd(va,
+                     _mm256_cvtps_pd(_mm_loadu_ps(x+i+4)),
+                     _mm256_loadu_pd(y+i+4)));
+  }
+  for (; i<n; i++)
+    y[i] += a*x[i];
+}
+
+
+/* FUNCTION: y[i] += a*x[-i], AVX2 version.                                 */
+__attribute__((target("avx2,fma")))
+static void
+axpyrev_avx2(double *y,
+             const float *x,
+             double a,
+             long n){
+  __m256d va = _mm256_set1_pd(a);
+  __m256i rev = _mm256_set_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256 vx;
+  long i;
+  for (i=0; i+8<=n; i+=8){
+    /* x[-i], ..., x[-i-7]:                                                 */
+    vx = _mm256_permutevar8x32_ps(_mm256_loadu_ps(x-i-7), rev);
+    _mm256_storeu_pd(y+i,   _mm256_fmadd_pd(va,
+                     _mm256_cvtps_pd(_mm256_castps256_ps128(vx)),
+                     _mm256_loadu_pd(y+i)));
+    _mm256_storeu_pd(y+i+4, _mm256_fmadd_pd(va,
+                     _mm256_cvtps_pd(_mm256_extractf128_ps(vx, 1)),
+                     _mm256_loadu_pd(y+i+4)));
+  }
+  for (; i<n; i++)
+    y[i] += a*x[-i];
+}
+
+
+/* FUNCTION: y += a*x + b*z, AVX2 version.                                */
+__attribute__((target("avx2,fma")))
+static void
+axpy2_avx2(double *y,
+           const double *x,
+           double a,
+           const double *z,
+           double b,
+           long n){
+  __m256d va = _mm256_set1_pd(a), vb = _mm256_set1_pd(b);
+  long i;
+  for (i=0; i+4<=n; i+=4)
+    _mm256_storeu_pd(y+i, _mm256_fmadd_pd(va, _mm256_loadu_pd(x+i),
+                          _mm256_fmadd_pd(vb, _mm256_loadu_pd(z+i),
+                                          _mm256_loadu_pd(y+i))));
+  for (; i<n; i++)
+    y[i] += a*x[i] + b*z[i];
+}
+
+
+/* FUNCTION: y += a*x, AVX-512 version.                                     */
+__attribute__((target("avx512f")))
+static void
+axpy_avx512(double *y,
+            const float *x,
+            double a,
+            long n){
+  __m512d va = _mm512_set1_pd(a);
+  long i;
+  for (i=0; i+8<=n; i+=8)
+    _mm512_storeu_pd(y+i, _mm512_fmadd_pd(va,
+                     _mm512_cvtps_pd(_mm256_loadu_ps(x+i)),
+                     _mm512_loadu_pd(y+i)));
+  for (; i<n; i++)
+    y[i] += a*x[i];
+}
+
+
+/* FUNCTION: y[i] += a*x[-i], AVX-512 version.                              */
+__attribute__((target("avx512f")))
+static void
+axpyrev_avx512(double *y,
+               const float *x,
+               double a,
+               long n){
+  __m512d va = _mm512_set1_pd(a);
+  __m512i rev = _mm512_set_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+  long i;
+  for (i=0; i+8<=n; i+=8)
+    _mm512_storeu_pd(y+i, _mm512_fmadd_pd(va,
+                     _mm512_permutexvar_pd(rev,
+                       _mm512_cvtps_pd(_mm256_loadu_ps(x-i-7))),
+                     _mm512_loadu_pd(y+i)));
+  for (; i<n; i++)
+    y[i] += a*x[-i];
+}
+
+
+/* FUNCTION: y += a*x + b*z, AVX-512 version.                              */
+__attribute__((target("avx512f")))
+static void
+axpy2_avx512(double *y,
+             const double *x,
+             double a,
+             const double *z,
+             double b,
+             long n){
+  __m512d va = _mm512_set1_pd(a), vb = _mm512_set1_pd(b);
+  long i;
+  for (i=0; i+8<=n; i+=8)
+    _mm512_storeu_pd(y+i, _mm512_fmadd_pd(va, _mm512_loadu_pd(x+i),
+                          _mm512_fmadd_pd(vb, _mm512_loadu_pd(z+i),
+                                          _mm512_loadu_pd(y+i))));
+  for (; i<n; i++)
+    y[i] += a*x[i] + b*z[i];
+}
+#endif
+
+
+/* Selected kernels (-1: not yet selected):                                 */
+static int vec_level = -1;
+static void (*axpy_fcn)(double *, const float *, double, long) = axpy_scalar;
+static void (*axpyrev_fcn)(double *, const float *, double, long) =
+  axpyrev_scalar;
+static void (*axpy2_fcn)(double *, const double *, double, const double *,
+                         double, long) = axpy2_scalar;
+
+
+/* FUNCTION: Use the kernels of instruction set 'level' (VEC_SCALAR,
+   VEC_AVX2, or VEC_AVX512), or of the best instruction set supported by
+   the host CPU if level < 0.  Levels not supported by the CPU fall back to
+   the next supported one.                                                  */
+void
+vecsetlevel(int level){
+  int best = VEC_SCALAR;
+#ifdef VEC_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    best = VEC_AVX2;
+  if (__builtin_cpu_supports("avx512f"))
+    best = VEC_AVX512;
+#endif
+  if (level < 0 || level > best)
+    level = best;
+
+  switch(level){
+#ifdef VEC_X86
+  case VEC_AVX512:
+    axpy_fcn    = axpy_avx512;
+    axpyrev_fcn = axpyrev_avx512;
+    axpy2_fcn   = axpy2_avx512;
+    break;
+  case VEC_AVX2:
+    axpy_fcn    = axpy_avx2;
+    axpyrev_fcn = axpyrev_avx2;
+    axpy2_fcn   = axpy2_avx2;
+    break;
+#endif
+  default:
+    level = VEC_SCALAR;
+    axpy_fcn    = axpy_scalar;
+    axpyrev_fcn = axpyrev_scalar;
+    axpy2_fcn   = axpy2_scalar;
+  }
+  vec_level = level;
+  /* The Voigt-profile kernel of libpu uses the same instruction set:       */
+  voigtsetlevel(level);
+}
+
+
+/* FUNCTION: Instruction set of the kernels in use (selecting the best one
+   for the host CPU if not yet selected).                                   */
+int
+veclevel(void){
+  if (vec_level < 0)
+    vecsetlevel(-1);
+  return vec_level;
+}
+
+
+/* FUNCTION: Add a times the single-precision array x into the
+   double-precision array y:  y[i] += a*x[i],  for i in [0, n).            */
+void
+vecaxpy(double *y,
+        const float *x,
+        double a,
+        long n){
+  axpy_fcn(y, x, a, n);
+}
+
+
+/* FUNCTION: Add a times the single-precision array x, read backwards from
+   x[0], into the double-precision array y:  y[i] += a*x[-i],  for i in
+   [0, n).                                                                  */
+void
+vecaxpyrev(double *y,
+           const float *x,
+           double a,
+           long n){
+  axpyrev_fcn(y, x, a, n);
+}
+
+
+/* FUNCTION: Add a times x plus b times z into y (all double precision):
+   y[i] += a*x[i] + b*z[i],  for i in [0, n).                               */
+void
+vecaxpy2(double *y,
+         const double *x,
+         double a,
+         const double *z,
+         double b,
+         long n){
+  axpy2_fcn(y, x, a, z, b, n);
+}
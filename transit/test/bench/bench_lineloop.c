@@ -0,0 +1,120 @@
+// Copyright (C) 2015-2016 University of Central Florida. All rights reserved.
+// Transit is under an open-source, reproducible-research license (see LICENSE).
+
+/* Micro-benchmark of the per-line lookups of the line-by-line loop (see
+   addlines() in src/extinction.c): the output species and the Doppler-width
+   index of each line, found by searches (valueinarray() and
+   binsearchapprox(), as before the isotope-slot and Doppler-index tables)
+   and by the tables (op->isoslot and dopindex()).  Build and run it with
+   `make bench`; an optional argument sets the number of lines.            */
+
+#include <transit.h>
+
+#define BENCH_NISO   12       /* Isotopes                                   */
+#define BENCH_NMOL   6        /* Molecules (two isotopes each)              */
+#define BENCH_NDOP   40       /* Doppler-width samples                      */
+#define BENCH_NWN    100000   /* Output wavenumbers                         */
+#define BENCH_WNI    1000.0   /* First output wavenumber (cm-1)             */
+#define BENCH_DWN    0.01     /* Output wavenumber spacing (cm-1)           */
+#define DOP_BLOCKBITS 6       /* As in src/extinction.c                     */
+
+
+/* FUNCTION: Seconds since an arbitrary origin.                             */
+static double
+benchclock(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+int
+main(int argc, char **argv){
+  long nlines = argc > 1 ? atol(argv[1]) : 20000000, ln, b, idwn,
+       ndblk = (BENCH_NWN>>DOP_BLOCKBITS) + 1,
+       nper = (nlines + BENCH_NISO - 1)/BENCH_NISO,  /* Lines per isotope   */
+       sum[2] = {0, 0};
+  int molID[BENCH_NMOL], isomol[BENCH_NISO], isoslot[BENCH_NISO],
+      idop0[BENCH_NISO], *doptab, *iso, i, m, idop;
+  double aDop[BENCH_NDOP], alphad[BENCH_NISO], alphal[BENCH_NISO],
+         *wn, ad, t[4];
+  unsigned long seed = 12345;
+
+  /* Molecules listed out of isotope order, log-spaced Doppler widths:      */
+  for (m=0; m<BENCH_NMOL; m++)
+    molID[m] = 101 + (m*5)%BENCH_NMOL;
+  for (i=0; i<BENCH_NISO; i++){
+    isomol[i]  = 101 + i/2;
+    isoslot[i] = valueinarray(molID, isomol[i], BENCH_NMOL);
+    alphad[i]  = 1e-6*(1.0 + 0.1*i);
+    alphal[i]  = 1e-3;
+  }
+  for (i=0; i<BENCH_NDOP; i++)
+    aDop[i] = 5e-4*pow(10.0, 2.0*i/(BENCH_NDOP-1));
+
+  /* Lines sorted by decreasing wavenumber within each isotope:            */
+  wn  = (double *)calloc(nlines, sizeof(double));
+  iso = (int    *)calloc(nlines, sizeof(int));
+  for (ln=0; ln<nlines; ln++){
+    iso[ln] = ln/nper;
+    seed = seed*6364136223846793005UL + 1442695040888963407UL;
+    wn[ln] = BENCH_WNI + BENCH_DWN*(BENCH_NWN-1) *
+             (1.0 - (ln%nper + 0.5*(seed>>40)/(1UL<<24))/(nper+1));
+  }
+
+  /* The Doppler-index table, once per layer (see molextinit()):           */
+  t[0] = benchclock();
+  doptab = (int *)calloc(BENCH_NISO*ndblk, sizeof(int));
+  for (i=0; i<BENCH_NISO; i++){
+    idop0[i] = 0;
+    for (b=0; b<ndblk; b++){
+      ad = alphad[i]*(BENCH_WNI + (b<<DOP_BLOCKBITS)*BENCH_DWN);
+      idop = ad/alphal[i] >= 1e-1 ?
+             binsearchapprox(aDop, ad, 0, BENCH_NDOP) : idop0[i];
+      doptab[i*ndblk + b] = idop < BENCH_NDOP ? idop : BENCH_NDOP-1;
+    }
+  }
+
+  /* Searches per line:                                                     */
+  t[1] = benchclock();
+  for (ln=0; ln<nlines; ln++){
+    i = iso[ln];
+    m = valueinarray(molID, isomol[i], BENCH_NMOL);
+    idop = idop0[i];
+    if (alphad[i]*wn[ln]/alphal[i] >= 1e-1)
+      idop = binsearchapprox(aDop, alphad[i]*wn[ln], 0, BENCH_NDOP);
+    sum[0] += m*BENCH_NDOP + idop;
+  }
+
+  /* Tables per line (see dopindex()):                                      */
+  t[2] = benchclock();
+  for (ln=0; ln<nlines; ln++){
+    i = iso[ln];
+    m = isoslot[i];
+    ad = alphad[i]*wn[ln];
+    idop = idop0[i];
+    if (ad/alphal[i] >= 1e-1){
+      idwn = (wn[ln] - BENCH_WNI)/BENCH_DWN;
+      idop = doptab[i*ndblk + (idwn>>DOP_BLOCKBITS)];
+      while (idop+1 < BENCH_NDOP &&
+             fabs(aDop[idop+1]-ad) <  fabs(aDop[idop]-ad))
+        idop++;
+      while (idop   > 0 && fabs(aDop[idop-1]-ad) <= fabs(aDop[idop]-ad))
+        idop--;
+    }
+    sum[1] += m*BENCH_NDOP + idop;
+  }
+  t[3] = benchclock();
+
+  printf("%ld lines, %d isotopes, %d molecules, %d Doppler samples.\n",
+         nlines, BENCH_NISO, BENCH_NMOL, BENCH_NDOP);
+  printf("Doppler-index table:  %8.3f ms per layer\n", 1e3*(t[1]-t[0]));
+  printf("Per-line searches:    %8.2f ns/line\n", 1e9*(t[2]-t[1])/nlines);
+  printf("Per-line tables:      %8.2f ns/line\n", 1e9*(t[3]-t[2])/nlines);
+  if (sum[0] != sum[1])
+    printf("The table lookups differ from the searches.\n");
+  free(wn);
+  free(iso);
+  free(doptab);
+  return sum[0] != sum[1];
+}
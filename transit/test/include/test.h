@@ -263,10 +263,16 @@ Thank you for using transit!
 } while(0)
 
 
+/* Test batches, one per tested source file:                             */
+TR_BATCH test_extinction ();   /* test/test_extinction.c */
+TR_BATCH test_opacity ();      /* test/test_opacity.c    */
+
+
 #ifndef TEST_TRANSIT
 
-// Define a placeholder for the renamed main();
-int _tr_main(int argc, char **argv) { return 0; }
+// Define a placeholder for the renamed main() (static, since every test
+// file includes this header);
+static inline int _tr_main(int argc, char **argv) { return 0; }
 
 #else
 
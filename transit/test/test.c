@@ -121,6 +121,8 @@ int _tr_test(int argc, char **argv) {
   tr_setup_tests();
 
   // Define tests and batches to run here
+  tr_run_batch(test_extinction);
+  tr_run_batch(test_opacity);
 
   tr_finish_tests();
   return 0;
@@ -0,0 +1,721 @@
+// Copyright (C) 2015-2016 University of Central Florida. All rights reserved.
+// Transit is under an open-source, reproducible-research license (see LICENSE).
+
+/* Tests for extinction.c: the line-by-line extinction engines must agree
+   on a synthetic line list.                                                */
+
+#include <test.h>
+
+/* Synthetic setup dimensions:                                              */
+#define EXT_NISO   2     /* Number of isotopes (one per molecule)           */
+#define EXT_NLINES 20000 /* Number of line transitions                      */
+#define EXT_TEMP   1500  /* Temperature (K)                                 */
+
+static struct transit     ext_tr;
+static struct transithint ext_th;
+static struct opacity     ext_op;
+static struct isotopes    ext_iso;
+static struct molecules   ext_mol;
+static struct lineinfo    ext_li;
+static prop_isof ext_isof[EXT_NISO];
+static PREC_ATM  ext_density[EXT_NISO];
+static double    ext_Z[EXT_NISO];
+
+
+/* FUNCTION: Make an evenly spaced sample.                                  */
+static void
+ext_sample(prop_samp *samp,
+           double wni,
+           double d,
+           long n,
+           int o){
+  long j;
+
+  samp->i = wni;
+  samp->d = d;
+  samp->o = o;
+  samp->n = (n-1)*o + 1;
+  samp->f = wni + (n-1)*d;
+  samp->fct = 1;
+  samp->v = (PREC_RES *)calloc(samp->n, sizeof(PREC_RES));
+  for (j=0; j<samp->n; j++)
+    samp->v[j] = wni + j*d/o;
+}
+
+
+/* FUNCTION: Set up a transit struct with two molecules and a dense list
+   of lines in 2000--2010 cm-1, sorted by decreasing wavenumber within each
+   isotope and packed as readdatarng() leaves them.                         */
+static void
+ext_setup(void){
+  static int done = 0;
+  struct line_transition *lt = &ext_li.lt;
+  unsigned long seed = 12345;
+  PREC_NREC ln, nper = EXT_NLINES/EXT_NISO;
+  PREC_LNDATA *wl, *elow, *gf;
+  short *isoid;
+  int i;
+
+  if (done)
+    return;
+  done = 1;
+
+  ext_tr.ds.th  = &ext_th;
+  ext_tr.ds.op  = &ext_op;
+  ext_tr.ds.iso = &ext_iso;
+  ext_tr.ds.mol = &ext_mol;
+  ext_tr.ds.li  = &ext_li;
+
+  ext_sample(&ext_tr.wns,  2000.0, 0.01, 1001,  1);
+  ext_sample(&ext_tr.owns, 2000.0, 0.01, 1001, 10);
+  ext_tr.timesalpha = 20;
+  ext_tr.nthreads   = 1;
+  ext_tr.lineengine = TLE_LINE;
+
+  ext_th.nDop = ext_th.nLor = 20;
+  ext_th.dmin = 1e-3;
+  ext_th.dmax = 0.25;
+  ext_th.lmin = 1e-4;
+  ext_th.lmax = 10.0;
+  ext_th.ethresh = 1e-8;
+
+  /* Molecules and isotopes (H2O- and CO-like):                             */
+  ext_mol.nmol   = EXT_NISO;
+  ext_mol.mass   = (PREC_ZREC *)calloc(EXT_NISO, sizeof(PREC_ZREC));
+  ext_mol.radius = (PREC_ZREC *)calloc(EXT_NISO, sizeof(PREC_ZREC));
+  ext_mol.ID     = (int       *)calloc(EXT_NISO, sizeof(int));
+  ext_iso.n_i      = EXT_NISO;
+  ext_iso.isof     = ext_isof;
+  ext_iso.isoratio = (double *)calloc(EXT_NISO, sizeof(double));
+  ext_iso.imol     = (int    *)calloc(EXT_NISO, sizeof(int));
+  ext_op.Nmol  = EXT_NISO;
+  ext_op.molID = (int *)calloc(EXT_NISO, sizeof(int));
+  ext_op.isoslot = (int *)calloc(EXT_NISO, sizeof(int));
+  for (i=0; i<EXT_NISO; i++){
+    ext_mol.mass[i]   = i == 0 ? 18.0 : 28.0;
+    ext_mol.radius[i] = 1.5e-8;
+    ext_mol.ID[i]     = 101 + i;
+    ext_op.molID[i]   = 101 + i;
+    ext_op.isoslot[i] = i;
+    ext_isof[i].m     = ext_mol.mass[i];
+    ext_iso.isoratio[i] = 1.0;
+    ext_iso.imol[i]   = i;
+    ext_density[i]    = 2e-4;
+    ext_Z[i]          = 100.0;
+  }
+
+  /* Line transitions with pseudo-random positions and strengths, packed
+     per isotope (wavelengths in cm, lt->wfct = 1):                         */
+  lt->wfct   = 1.0;
+  lt->efct   = 1.0;
+  lt->rec    = (struct linerecord *)calloc(EXT_NLINES + EXT_NISO*LT_BLOCK,
+                                           sizeof(struct linerecord));
+  lt->wnbase = (double *)calloc((EXT_NLINES>>LT_BLOCKBITS) + EXT_NISO,
+                                sizeof(double));
+  wl    = (PREC_LNDATA *)calloc(nper, sizeof(PREC_LNDATA));
+  elow  = (PREC_LNDATA *)calloc(nper, sizeof(PREC_LNDATA));
+  gf    = (PREC_LNDATA *)calloc(nper, sizeof(PREC_LNDATA));
+  isoid = (short       *)calloc(nper, sizeof(short));
+  ext_li.n_l = 0;
+  for (i=0; i<EXT_NISO; i++){
+    for (ln=0; ln<nper; ln++){
+      isoid[ln] = i;
+      /* Decreasing wavenumbers with random gaps (co-added lines included): */
+      seed = seed*6364136223846793005UL + 1442695040888963407UL;
+      wl[ln] = 1.0/(2010.0 - 10.0*(ln + 0.5*(seed>>40)/(1UL<<24))/nper);
+      seed = seed*6364136223846793005UL + 1442695040888963407UL;
+      gf[ln] = pow(10.0, -4.0*(seed>>40)/(1UL<<24));
+      seed = seed*6364136223846793005UL + 1442695040888963407UL;
+      elow[ln] = 5000.0/EXPCTE*(seed>>40)/(1UL<<24);
+    }
+    ext_li.n_l += packlines(lt, ext_li.n_l, wl, isoid, elow, gf, nper);
+  }
+  free(wl);
+  free(elow);
+  free(gf);
+  free(isoid);
+
+  calcprofiles(&ext_tr);
+}
+
+
+/* FUNCTION: Compute the extinction with the given engine and threads.      */
+static PREC_RES **
+ext_compute(int engine,
+            int nthreads,
+            int permol){
+  PREC_RES **kiso;
+  long m, Nmol = permol ? ext_op.Nmol : 1;
+
+  kiso    = (PREC_RES **)calloc(Nmol, sizeof(PREC_RES *));
+  kiso[0] = (PREC_RES  *)calloc(Nmol*ext_tr.wns.n, sizeof(PREC_RES));
+  for (m=1; m<Nmol; m++)
+    kiso[m] = kiso[0] + m*ext_tr.wns.n;
+
+  ext_tr.lineengine = engine;
+  ext_tr.nthreads   = nthreads;
+  computemolext(&ext_tr, kiso, EXT_TEMP, ext_density, ext_Z, permol);
+  return kiso;
+}
+
+
+/* FUNCTION: Largest difference between two extinction arrays, relative
+   to the largest extinction value.                                         */
+static double
+ext_maxdiff(PREC_RES **k1,
+            PREC_RES **k2,
+            int permol){
+  long j, n = (permol ? ext_op.Nmol : 1) * ext_tr.wns.n;
+  double kmax=0, dmax=0;
+
+  for (j=0; j<n; j++){
+    kmax = fmax(kmax, fabs(k1[0][j]));
+    dmax = fmax(dmax, fabs(k1[0][j] - k2[0][j]));
+  }
+  return kmax > 0 ? dmax/kmax : 1.0;
+}
+
+
+/* FUNCTION: Compare the TLE_HIST engine, convolving the histograms
+   directly or by FFT, against TLE_LINE.                                    */
+static char *
+ext_compare(int nthreads,
+            int permol,
+            int usefft){
+  PREC_RES **kline, **khist;
+  double diff;
+
+  ext_setup();
+  /* Force the convolution method through the measured costs:              */
+  ext_op.tmac = usefft ? 1.0 : 0.0;
+  ext_op.tfft = usefft ? 0.0 : 1.0;
+  kline = ext_compute(TLE_LINE, 1,        permol);
+  khist = ext_compute(TLE_HIST, nthreads, permol);
+  diff  = ext_maxdiff(kline, khist, permol);
+
+  free(kline[0]);
+  free(kline);
+  free(khist[0]);
+  free(khist);
+  tr_assert(diff < 1e-10, "The histogram engine disagrees with the "
+                          "per-line engine.");
+  return NULL;
+}
+
+
+TR_TEST test_lineengine_hist () {
+  return ext_compare(1, 0, 0);
+}
+
+TR_TEST test_lineengine_hist_permol () {
+  return ext_compare(1, 1, 0);
+}
+
+TR_TEST test_lineengine_hist_tiled () {
+  return ext_compare(3, 1, 0);
+}
+
+TR_TEST test_lineengine_hist_fft () {
+  return ext_compare(1, 1, 1);
+}
+
+TR_TEST test_lineengine_hist_fft_tiled () {
+  return ext_compare(3, 0, 1);
+}
+
+
+/* FUNCTION: Whether two profile grids have the same sizes, arena layout
+   (aliased profiles included), and computed profiles.                      */
+static int
+ext_sameprofiles(struct opacity *op1,
+                 struct opacity *op2){
+  long c, ncell = op1->nDop*op1->nLor;
+
+  if (op1->profarenasize != op2->profarenasize ||
+      memcmp(op1->profsize[0], op2->profsize[0],
+             ncell*sizeof(PREC_NREC)) != 0 ||
+      memcmp(op1->profoff, op2->profoff, ncell*sizeof(long)) != 0 ||
+      memcmp(op1->profstate, op2->profstate, ncell*sizeof(int)) != 0)
+    return 0;
+  for (c=0; c<ncell; c++)
+    if (op1->profstate[c] == TPROF_READY &&
+        memcmp(op1->profarena + op1->profoff[c],
+               op2->profarena + op2->profoff[c],
+               2*(op1->profsize[0][c]+1)*sizeof(PREC_VOIGT)) != 0)
+      return 0;
+  return 1;
+}
+
+
+/* FUNCTION: Compute the extinction with a fresh (empty) profile grid.
+   Return: the grid, ext_op is left as it was                               */
+static struct opacity
+ext_freshprofiles(int nthreads,
+                  PREC_RES ***kiso){
+  struct opacity keep = ext_op, fresh;
+
+  calcprofiles(&ext_tr);
+  *kiso = ext_compute(TLE_LINE, nthreads, 1);
+  fresh  = ext_op;
+  ext_op = keep;
+  return fresh;
+}
+
+
+/* The profiles computed on demand by several threads must be identical to
+   the ones computed by a single thread, aliased profiles included.         */
+TR_TEST test_calcprofiles_parallel () {
+  struct opacity serial, parallel;
+  PREC_RES **k1, **k3;
+  int same;
+
+  ext_setup();
+  serial   = ext_freshprofiles(1, &k1);
+  parallel = ext_freshprofiles(3, &k3);
+  same = ext_sameprofiles(&parallel, &serial);
+  free(k1[0]);
+  free(k1);
+  free(k3[0]);
+  free(k3);
+  tr_assert(same, "The parallel Voigt-profile grid differs from the serial "
+                  "one.");
+  return NULL;
+}
+
+
+/* Only the profiles that the lines use are computed, and each of them
+   once.                                                                    */
+TR_TEST test_profondemand () {
+  struct opacity fresh;
+  PREC_RES **kiso;
+  long c, nready=0, nbusy=0, ncell = ext_op.nDop*ext_op.nLor;
+
+  ext_setup();
+  fresh = ext_freshprofiles(3, &kiso);
+  for (c=0; c<ncell; c++){
+    /* Aliased cells share the arena slot of the cell above:               */
+    nready += fresh.profstate[c] == TPROF_READY  &&  (c < ext_op.nLor ||
+              fresh.profoff[c] != fresh.profoff[c-ext_op.nLor]);
+    nbusy  += fresh.profstate[c] == TPROF_BUSY;
+  }
+  free(kiso[0]);
+  free(kiso);
+  tr_assert(nbusy == 0, "A Voigt profile was left half computed.");
+  tr_assert(fresh.nprofbuilt > 0 && fresh.nprofbuilt < ncell,
+            "The Voigt profiles were not computed on demand.");
+  tr_assert(fresh.nprofbuilt == nready, "A Voigt profile was computed more "
+                                        "than once.");
+  return NULL;
+}
+
+
+/* The profiles mapped from the cache file must be identical to the ones
+   that were computed and written to it, and must not be computed again.   */
+TR_TEST test_profcache () {
+  struct opacity keep, computed, cached;
+  PREC_RES **k1, **k2;
+  char cache[] = "/tmp/transit_test_voigt.cache";
+  double diff;
+  int same;
+
+  ext_setup();
+  keep = ext_op;
+  ext_tr.f_profcache = cache;
+  unlink(cache);
+  calcprofiles(&ext_tr);                  /* Compute and write              */
+  k1 = ext_compute(TLE_LINE, 1, 1);
+  saveprofiles(&ext_tr, 1);
+  computed = ext_op;
+  calcprofiles(&ext_tr);                  /* Map                            */
+  k2 = ext_compute(TLE_LINE, 1, 1);
+  cached = ext_op;
+  ext_op = keep;
+  ext_tr.f_profcache = NULL;
+  unlink(cache);
+
+  tr_assert(cached.profmap != NULL, "The profile cache file was not used.");
+  same = ext_sameprofiles(&cached, &computed);
+  diff = ext_maxdiff(k1, k2, 1);
+  munmap(cached.profmap, cached.profmapsize);
+  free(k1[0]);
+  free(k1);
+  free(k2[0]);
+  free(k2);
+  tr_assert(cached.nprofbuilt == 0, "The cached Voigt profiles were "
+                                    "computed again.");
+  tr_assert(same && diff == 0.0, "The cached Voigt-profile grid differs "
+                                 "from the computed one.");
+  return NULL;
+}
+
+
+/* The default profile cache file must be named after the user and the
+   profile parameters: other parameters must get another file.              */
+TR_TEST test_profcachename () {
+  struct opacity keep;
+  char name[2][128], prefix[64], tmpdir[] = "/tmp";
+  int i;
+
+  ext_setup();
+  keep = ext_op;
+  ext_tr.profcachedir = tmpdir;
+  for (i=0; i<2; i++){
+    ext_th.dmax = i == 0 ? 0.25 : 0.5;
+    calcprofiles(&ext_tr);
+    strcpy(name[i], ext_tr.f_profcache);
+    if (ext_op.profmap != NULL)
+      munmap(ext_op.profmap, ext_op.profmapsize);
+  }
+  ext_th.dmax = 0.25;
+  ext_op = keep;
+  free(ext_th.f_profcache);
+  ext_th.f_profcache  = NULL;
+  ext_tr.f_profcache  = NULL;
+  ext_tr.profcachedir = NULL;
+
+  sprintf(prefix, "/tmp/transit_voigt.%u.", (unsigned int)geteuid());
+  tr_assert(strncmp(name[0], prefix, strlen(prefix)) == 0,
+            "The profile cache file is not named after the user.");
+  tr_assert(strcmp(name[0], name[1]) != 0, "Different profile parameters "
+                                          "share a profile cache file.");
+  return NULL;
+}
+
+
+/* Each cell of the profile arena must start on a cache line, and its
+   half profile mirrored to both sides must match the full profile with
+   its two sides averaged.                                                  */
+TR_TEST test_profarena () {
+  PREC_VOIGT *full, *half;
+  long i, j, k, ps;
+  double maxrel=0.0;
+  int aligned=1;
+
+  ext_setup();
+  for   (i=0; i<ext_op.nDop; i++)
+    for (j=0; j<ext_op.nLor; j++)
+      makeprofile(&ext_tr, i, j);
+  for   (i=0; i<ext_op.nDop; i++)
+    for (j=0; j<ext_op.nLor; j++){
+      half = profhalf(&ext_op, i, j);
+      ps   = ext_op.profsize[i][j];
+      /* Aliased cells hold the profile of a smaller Doppler width:         */
+      if (i > 0 && half == profhalf(&ext_op, i-1, j))
+        continue;
+      if ((unsigned long)half % 64 != 0)
+        aligned = 0;
+      full = (PREC_VOIGT *)calloc(2*ps+1, sizeof(PREC_VOIGT));
+      voigtn(2*ps+1, ext_tr.wns.d/ext_tr.owns.o*ps, ext_op.aLor[j],
+             ext_op.aDop[i], &full, -1, 2*ps+1 > _voigt_maxelements ?
+             VOIGT_QUICK : 0);
+      for (k=0; k<2*ps+1; k++)
+        maxrel = fmax(maxrel, fabs(profsample(half, ps, k) -
+                      0.5*(full[k]+full[2*ps-k]))/full[ps]);
+      free(full);
+    }
+  tr_assert(aligned, "A profile is not aligned to a cache line.");
+  tr_assert(maxrel < 1e-6, "The mirrored half profiles differ from the full "
+                           "profiles.");
+  return NULL;
+}
+
+
+/* FUNCTION: Compute the extinction (per molecule) with a fresh grid of
+   Voigt profiles of tolerance tol, or of nw x nw log-spaced widths if tol
+   is 0, and with the engine and threads given.
+   Return: the extinction, the number of profiles in *nprof                 */
+static PREC_RES **
+ext_widthgrid(double tol,
+              int nw,
+              int engine,
+              int nthreads,
+              long *nprof){
+  struct opacity keep = ext_op;
+  PREC_RES **kiso;
+
+  ext_th.proftol = tol;
+  ext_th.nDop = ext_th.nLor = nw;
+  calcprofiles(&ext_tr);
+  kiso   = ext_compute(engine, nthreads, 1);
+  *nprof = ext_op.nDop*ext_op.nLor;
+  ext_op = keep;
+  ext_th.proftol = 0.0;
+  ext_th.nDop = ext_th.nLor = 20;
+  return kiso;
+}
+
+
+/* The lines blending the profiles of an adaptive width grid must match a
+   finer grid to about the tolerance, with both engines, and be far more
+   accurate than the nearest profiles of the fixed grid.                    */
+TR_TEST test_widthgrid () {
+  PREC_RES **kfine, **kline, **khist, **ksnap;
+  long nfine, nline, nhist, nsnap;
+  double dline, dhist, dsnap;
+
+  ext_setup();
+  kfine = ext_widthgrid(1e-4, 0,  TLE_LINE, 1, &nfine);
+  kline = ext_widthgrid(1e-3, 0,  TLE_LINE, 1, &nline);
+  khist = ext_widthgrid(1e-3, 0,  TLE_HIST, 3, &nhist);
+  ksnap = ext_widthgrid(0.0,  20, TLE_LINE, 1, &nsnap);
+  dline = ext_maxdiff(kfine, kline, 1);
+  dhist = ext_maxdiff(kline, khist, 1);
+  dsnap = ext_maxdiff(kfine, ksnap, 1);
+  free(kfine[0]);
+  free(kfine);
+  free(kline[0]);
+  free(kline);
+  free(khist[0]);
+  free(khist);
+  free(ksnap[0]);
+  free(ksnap);
+  tr_assert(nline < nfine, "The width grid does not adapt to the tolerance.");
+  /* The tolerance holds per width axis:                                    */
+  tr_assert(dline < 2e-3, "The blended profiles exceed the tolerance.");
+  tr_assert(dline < 0.1*dsnap, "The blended profiles are not more accurate "
+                               "than the nearest profiles.");
+  tr_assert(dhist < 1e-10, "The histogram engine disagrees with the "
+                           "per-line engine on blended profiles.");
+  return NULL;
+}
+
+
+/* The Voigt profile must match the reference table of transit's original
+   Voigt function (Lorentz width of 1.5, Doppler width of 1, 16 line-center
+   shifts), which voigt.max_idl.dat examined as a surface and by the
+   profile area; and the vector kernels must match the scalar one.  The
+   table has four significant digits (5e-4), but its approximation is
+   only good to 5e-3 in the near wings: the peaks and areas are held to
+   the former, the whole profiles to the latter.                            */
+TR_TEST test_voigt_reference () {
+  int nwn=10001, nshift=16, i, j, level;
+  PREC_VOIGT **vpro, row[3][203];
+  double wn, ref, refarea[16]={0}, area[16]={0}, maxrel=0.0, maxpeak=0.0,
+         maxarea=0.0, maxlor=0.0, maxlev=0.0;
+  char line[4096];
+  FILE *fp;
+
+  fp = fopen("test/voigt.080904.dat", "r");
+  tr_assert(fp != NULL, "Cannot open the Voigt reference table.");
+  vpro    = (PREC_VOIGT **)calloc(nshift,     sizeof(PREC_VOIGT *));
+  vpro[0] = (PREC_VOIGT  *)calloc(nshift*nwn, sizeof(PREC_VOIGT));
+  for (j=1; j<nshift; j++)
+    vpro[j] = vpro[0] + j*nwn;
+  voigtn2(nshift, nwn, 75.0, 1.5, 1.0, vpro, -1, 0);
+
+  /* Skip the two header lines, each row holds the wavenumber and the
+     profile for each center shift:                                         */
+  fgets(line, 4096, fp);
+  fgets(line, 4096, fp);
+  for (i=0; i<nwn; i++){
+    fscanf(fp, "%lf", &wn);
+    for (j=0; j<nshift; j++){
+      fscanf(fp, "%lf", &ref);
+      maxrel = fmax(maxrel, fabs(vpro[j][i]-ref)/ref);
+      if (i == nwn/2)
+        maxpeak = fmax(maxpeak, fabs(vpro[j][i]-ref)/ref);
+      refarea[j] += ref       *150.0/(nwn-1);
+      area[j]    += vpro[j][i]*150.0/(nwn-1);
+    }
+  }
+  fclose(fp);
+  /* Beyond +-75 only the Lorentz wings are left out:                       */
+  for (j=0; j<nshift; j++){
+    maxarea = fmax(maxarea, fabs(area[j]-refarea[j])/refarea[j]);
+    maxlor  = fmax(maxlor,  fabs(area[j] - 2.0/PI*atan(75.0/1.5)));
+  }
+  free(vpro[0]);
+  free(vpro);
+
+  for (level=VOIGT_SCALAR; level<=VOIGT_AVX512; level++){
+    voigtsetlevel(level);
+    voigtrow(-10.05, 0.1, 0.05, 203, 1.0, row[level]);
+  }
+  voigtsetlevel(veclevel());
+  for (level=VOIGT_AVX2; level<=VOIGT_AVX512; level++)
+    for (i=0; i<203; i++)
+      maxlev = fmax(maxlev, fabs(row[level][i]-row[0][i])/row[0][i]);
+
+  /* Re[w(1+i)] = 0.30474420525691...:                                     */
+  voigtrow(1.0, 0.0, 1.0, 1, 1.0, row[0]);
+  tr_assert(fabs(row[0][0] - 0.304744205) < 1e-7,
+            "Wrong Faddeeva function value.");
+  tr_assert(maxpeak < 5e-4 && maxarea < 5e-4, "The Voigt peak or area "
+            "differs from the reference table.");
+  tr_assert(maxrel < 5e-3, "The Voigt profile differs from the reference "
+                           "table.");
+  tr_assert(maxlor < 1e-5, "The Voigt profile area is wrong.");
+  tr_assert(maxlev < 1e-6, "The vector Voigt kernels differ from the scalar "
+                           "one.");
+  return NULL;
+}
+
+
+/* Streaming the lines from a TLI file in chunks much smaller than the
+   line list must give the extinction of the lines held in memory: the
+   chunks end at chain breaks, and a co-added chain longer than a chunk
+   grows the chunk instead of being split.                                  */
+TR_TEST test_streammolext () {
+  struct line_transition mem = ext_li.lt, *lt = &ext_li.lt;
+  PREC_NREC nmem = ext_li.n_l, ln, nper = 40*LT_BLOCK,
+            rngfirst[EXT_NISO], rngn[EXT_NISO];
+  PREC_LNDATA wl[40*LT_BLOCK], elow[40*LT_BLOCK], gf[40*LT_BLOCK];
+  short isoid[40*LT_BLOCK];
+  PREC_RES **kmem, **kstr[2];
+  unsigned long seed = 54321;
+  char tli[] = "/tmp/transit_test_stream.tli";
+  double wn, diff=0;
+  FILE *fp;
+  int i, k;
+
+  ext_setup();
+  /* Co-added lines, with a chain break every three blocks except over
+     blocks 10 to 29, a chain of 20 blocks:                                 */
+  lt->rec    = (struct linerecord *)calloc(EXT_NISO*nper,
+                                           sizeof(struct linerecord));
+  lt->wnbase = (double *)calloc(EXT_NISO*nper>>LT_BLOCKBITS, sizeof(double));
+  ext_li.n_l = 0;
+  for (i=0; i<EXT_NISO; i++){
+    wn = 2009.5 - 0.01*i;
+    for (ln=0; ln<nper; ln++){
+      if (ln%(3*LT_BLOCK) == 0 && (ln < 10*LT_BLOCK || ln >= 30*LT_BLOCK))
+        wn -= 0.005;
+      wn -= 0.0005;
+      wl[ln]    = 1.0/wn;
+      isoid[ln] = i;
+      seed = seed*6364136223846793005UL + 1442695040888963407UL;
+      gf[ln] = pow(10.0, -4.0*(seed>>40)/(1UL<<24));
+      seed = seed*6364136223846793005UL + 1442695040888963407UL;
+      elow[ln] = 5000.0/EXPCTE*(seed>>40)/(1UL<<24);
+    }
+    rngfirst[i] = ext_li.n_l;
+    rngn[i] = packlines(lt, ext_li.n_l, wl, isoid, elow, gf, nper);
+    ext_li.n_l += rngn[i];
+  }
+  kmem = ext_compute(TLE_LINE, 1, 1);
+
+  /* The same lines in a TLI v7 file, streamed by a single thread and by
+     wavenumber tiles:                                                      */
+  fp = fopen(tli, "wb");
+  fwrite(lt->wnbase, sizeof(double), ext_li.n_l>>LT_BLOCKBITS, fp);
+  fwrite(lt->rec, sizeof(struct linerecord), ext_li.n_l, fp);
+  fclose(fp);
+  ext_tr.f_line    = tli;
+  ext_li.tli_ver   = 7;
+  ext_li.nrng      = EXT_NISO;
+  ext_li.rngfirst  = rngfirst;
+  ext_li.rngn      = rngn;
+  ext_li.blk_loc   = 0;
+  ext_li.rec_loc   = (ext_li.n_l>>LT_BLOCKBITS)*sizeof(double);
+  free(lt->rec);
+  free(lt->wnbase);
+  lt->rec    = NULL;
+  lt->wnbase = NULL;
+  ext_tr.linebuffer = 100*LT_BLOCK;
+  for (k=0; k<2; k++){
+    kstr[k] = ext_compute(TLE_LINE, k == 0 ? 1 : 3, 1);
+    diff = fmax(diff, ext_maxdiff(kmem, kstr[k], 1));
+    free(kstr[k][0]);
+    free(kstr[k]);
+  }
+
+  ext_tr.linebuffer = 0;
+  ext_li.nrng = 0;
+  ext_li.lt   = mem;
+  ext_li.n_l  = nmem;
+  unlink(tli);
+  free(kmem[0]);
+  free(kmem);
+  tr_assert(diff < 1e-12, "The streamed lines give a different "
+                          "extinction.");
+  return NULL;
+}
+
+
+/* Leaving the isotopes of a molecule out (as when extending an opacity
+   grid with new molecules) must zero its extinction and keep the others'.  */
+TR_TEST test_molext_subset () {
+  PREC_RES **kall, **ksub;
+  double kmax=0, dmax=0, kout=0;
+  long j, n;
+
+  ext_setup();
+  kall = ext_compute(TLE_HIST, 2, 1);
+  ext_op.isoslot[0] = -1;
+  ksub = ext_compute(TLE_HIST, 2, 1);
+  ext_op.isoslot[0] = 0;
+
+  n = ext_tr.wns.n;
+  for (j=0; j<n; j++){
+    kout = fmax(kout, fabs(ksub[0][j]));
+    kmax = fmax(kmax, fabs(kall[1][j]));
+    dmax = fmax(dmax, fabs(kall[1][j] - ksub[1][j]));
+  }
+  free(kall[0]);
+  free(kall);
+  free(ksub[0]);
+  free(ksub);
+  tr_assert(kout == 0, "A molecule left out has extinction.");
+  tr_assert(kmax > 0 && dmax <= 1e-12*kmax, "Leaving a molecule out changes "
+                                            "the extinction of the others.");
+  return NULL;
+}
+
+
+/* Culling the lines below the threshold at the only grid temperature
+   must not change the extinction (this test drops lines from the shared
+   setup, so it runs last).                                                 */
+TR_TEST test_cullmolext () {
+  PREC_RES **kall, **kcull;
+  PREC_NREC nlines;
+  double diff;
+  int i;
+
+  ext_setup();
+  ext_th.ethresh = 1e-4;
+  ext_op.Ntemp   = 1;
+  ext_op.temp    = (PREC_RES  *)calloc(1, sizeof(PREC_RES));
+  ext_op.ziso    = (PREC_ATM **)calloc(EXT_NISO, sizeof(PREC_ATM *));
+  ext_op.temp[0] = EXT_TEMP;
+  for (i=0; i<EXT_NISO; i++){
+    ext_op.ziso[i] = (PREC_ATM *)calloc(1, sizeof(PREC_ATM));
+    ext_op.ziso[i][0] = ext_Z[i];
+  }
+
+  kall   = ext_compute(TLE_LINE, 1, 1);
+  nlines = ext_li.n_l;
+  cullmolext(&ext_tr);
+  tr_assert(ext_op.cull != NULL && ext_li.n_l < nlines,
+            "No lines were culled.");
+  kcull = ext_compute(TLE_LINE, 3, 1);
+  diff  = ext_maxdiff(kall, kcull, 1);
+
+  free(kall[0]);
+  free(kall);
+  free(kcull[0]);
+  free(kcull);
+  tr_assert(diff < 1e-6, "The culled line list gives a different "
+                         "extinction.");
+  return NULL;
+}
+
+
+TR_BATCH test_extinction () {
+  tr_setup_batch();
+  tr_run_test(test_lineengine_hist);
+  tr_run_test(test_lineengine_hist_permol);
+  tr_run_test(test_lineengine_hist_tiled);
+  tr_run_test(test_lineengine_hist_fft);
+  tr_run_test(test_lineengine_hist_fft_tiled);
+  tr_run_test(test_calcprofiles_parallel);
+  tr_run_test(test_profondemand);
+  tr_run_test(test_profcache);
+  tr_run_test(test_profcachename);
+  tr_run_test(test_profarena);
+  tr_run_test(test_widthgrid);
+  tr_run_test(test_voigt_reference);
+  tr_run_test(test_streammolext);
+  tr_run_test(test_molext_subset);
+  tr_run_test(test_cullmolext);
+  tr_finish_batch();
+}
@@ -0,0 +1,796 @@
+// Copyright (C) 2015-2016 University of Central Florida. All rights reserved.
+// Transit is under an open-source, reproducible-research license (see LICENSE).
+
+/* Tests for opacity.c: the opacity file must round trip through the
+   writer and the readers.                                                  */
+
+#include <test.h>
+#include <sys/wait.h>
+
+/* Synthetic grid dimensions:                                               */
+#define OPA_NMOL   2
+#define OPA_NTEMP  3
+#define OPA_NLAYER 4
+#define OPA_NWAVE  5
+
+static char opa_file[] = "/tmp/transit_test_opacity.dat";
+
+
+/* FUNCTION: Set up an opacity struct with a synthetic grid, sample
+   o[r][t][m][w] = r*1000 + t*100 + m*10 + w.                              */
+static void
+opa_setup(struct transit *tr,
+          struct opacity *op){
+  long r, t, m, w;
+  PREC_RES *grid;
+
+  memset(tr, 0, sizeof(struct transit));
+  memset(op, 0, sizeof(struct opacity));
+  tr->ds.op = op;
+  tr->f_opa = opa_file;
+  op->Nmol   = OPA_NMOL;
+  op->Ntemp  = OPA_NTEMP;
+  op->Nlayer = OPA_NLAYER;
+  op->Nwave  = OPA_NWAVE;
+  op->molID = (int      *)calloc(OPA_NMOL,   sizeof(int));
+  op->temp  = (PREC_RES *)calloc(OPA_NTEMP,  sizeof(PREC_RES));
+  op->press = (PREC_RES *)calloc(OPA_NLAYER, sizeof(PREC_RES));
+  op->wns   = (PREC_RES *)calloc(OPA_NWAVE,  sizeof(PREC_RES));
+  for (m=0; m<OPA_NMOL; m++)
+    op->molID[m] = 101 + m;
+  for (t=0; t<OPA_NTEMP; t++)
+    op->temp[t] = 500.0*(t+1);
+  for (r=0; r<OPA_NLAYER; r++)
+    op->press[r] = 1e6*(r+1);
+  for (w=0; w<OPA_NWAVE; w++)
+    op->wns[w] = 2000.0 + w;
+
+  grid  = (PREC_RES *)calloc(OPA_NLAYER*OPA_NTEMP*OPA_NMOL*OPA_NWAVE,
+                             sizeof(PREC_RES));
+  op->o = (PREC_RES ****)calloc(OPA_NLAYER, sizeof(PREC_RES ***));
+  for     (r=0; r<OPA_NLAYER; r++){
+    op->o[r] = (PREC_RES ***)calloc(OPA_NTEMP, sizeof(PREC_RES **));
+    for   (t=0; t<OPA_NTEMP; t++){
+      op->o[r][t] = (PREC_RES **)calloc(OPA_NMOL, sizeof(PREC_RES *));
+      for (m=0; m<OPA_NMOL; m++){
+        op->o[r][t][m] = grid + ((r*OPA_NTEMP + t)*OPA_NMOL + m)*OPA_NWAVE;
+        for (w=0; w<OPA_NWAVE; w++)
+          op->o[r][t][m][w] = r*1000 + t*100 + m*10 + w;
+      }
+    }
+  }
+}
+
+
+/* FUNCTION: Whether op holds the synthetic grid of opa_setup(), in any
+   axis order and sample type, to a relative error 'tol'.                   */
+static int
+opa_close(struct opacity *op,
+          double tol){
+  long r, t, m, w, *s=op->stride;
+
+  if (op->Nmol != OPA_NMOL || op->Ntemp != OPA_NTEMP ||
+      op->Nlayer != OPA_NLAYER || op->Nwave != OPA_NWAVE)
+    return 0;
+  for (m=0; m<OPA_NMOL; m++)
+    if (op->molID[m] != 101 + m)
+      return 0;
+  for (t=0; t<OPA_NTEMP; t++)
+    if (op->temp[t] != 500.0*(t+1))
+      return 0;
+  for (r=0; r<OPA_NLAYER; r++)
+    if (op->press[r] != 1e6*(r+1))
+      return 0;
+  for (w=0; w<OPA_NWAVE; w++)
+    if (op->wns[w] != 2000.0 + w)
+      return 0;
+  for       (r=0; r<OPA_NLAYER; r++)
+    for     (t=0; t<OPA_NTEMP;  t++)
+      for   (m=0; m<OPA_NMOL;   m++)
+        for (w=0; w<OPA_NWAVE;  w++)
+          if (fabs(opasample(op, r*s[0] + t*s[1] + m*s[2] + w*s[3],
+                             (r*OPA_NTEMP + t)*OPA_NMOL + m)
+                   - (r*1000 + t*100 + m*10 + w))
+              > tol*(r*1000 + t*100 + m*10 + w))
+            return 0;
+  return 1;
+}
+
+
+/* FUNCTION: Whether op holds exactly the synthetic grid of opa_setup().   */
+static int
+opa_same(struct opacity *op){
+  return opa_close(op, 0.0);
+}
+
+
+/* FUNCTION: Write the synthetic grid to opa_file in the axis order
+   'order' and sample type 'dtype'.                                         */
+static void
+opa_write(int order,
+          int dtype){
+  struct transit tr;
+  struct opacity op;
+  FILE *fp;
+
+  opa_setup(&tr, &op);
+  tr.opaorder = order;
+  tr.opadtype = dtype;
+  fp = fopen(opa_file, "wb");
+  writeopacity(&tr, fp);
+  fclose(fp);
+}
+
+
+/* The mapped grid must be the written one, and point into the mapping.    */
+TR_TEST test_mapopacity () {
+  struct transit tr;
+  struct opacity op;
+  FILE *fp;
+  int rn, same, inside;
+  char *o;
+
+  opa_write(TOPA_LTMW, TOPA_F64);
+  memset(&tr, 0, sizeof(struct transit));
+  memset(&op, 0, sizeof(struct opacity));
+  tr.ds.op = &op;
+  fp = fopen(opa_file, "rb");
+  rn = mapopacity(&tr, fp);
+  fclose(fp);
+  tr_assert(rn == 0, "The opacity file was not mapped.");
+  same = opa_same(&op);
+  o = (char *)op.o[OPA_NLAYER-1][OPA_NTEMP-1][OPA_NMOL-1];
+  inside = (char *)op.o[0][0][0] >= (char *)op.opamap           &&
+           (unsigned long)op.o[0][0][0] % 4096 == 0                &&
+           o + OPA_NWAVE*sizeof(PREC_RES) <= (char *)op.opamap + op.opamapsize;
+  munmap(op.opamap, op.opamapsize);
+  unlink(opa_file);
+  tr_assert(same, "The mapped opacity grid differs from the written one.");
+  tr_assert(inside, "The opacity grid does not point into the mapping.");
+  return NULL;
+}
+
+
+/* A grid written in the [layer][wave][temp][mol] order must map to the same
+   grid, and interpolate in temperature to the same extinction.             */
+TR_TEST test_mapopacity_lwtm () {
+  struct transit tr;
+  struct opacity op;
+  struct molecules mol;
+  prop_mol molec[OPA_NMOL];
+  PREC_ATM temp[OPA_NLAYER], dens[OPA_NMOL][OPA_NLAYER];
+  PREC_RES kiso[OPA_NLAYER][OPA_NWAVE], *k[OPA_NLAYER];
+  int molID[OPA_NMOL] = {102, 101};   /* Not in the grid order           */
+  long r, m, w;
+  double err=0, ext;
+  FILE *fp;
+  int rn, same, order;
+
+  opa_write(TOPA_LWTM, TOPA_F64);
+  memset(&tr, 0, sizeof(struct transit));
+  memset(&op, 0, sizeof(struct opacity));
+  tr.ds.op = &op;
+  fp = fopen(opa_file, "rb");
+  rn = mapopacity(&tr, fp);
+  fclose(fp);
+  tr_assert(rn == 0, "The opacity file was not mapped.");
+  order = op.order == TOPA_LWTM && op.o == NULL;
+  same  = opa_same(&op);
+
+  /* Layer temperatures between the grid samples (at t=1.5):               */
+  mol.nmol  = OPA_NMOL;
+  mol.ID    = molID;
+  mol.molec = molec;
+  tr.ds.mol = &mol;
+  tr.atm.t    = temp;
+  tr.atm.tfct = 1.0;
+  for (r=0; r<OPA_NLAYER; r++){
+    temp[r] = 1250.0;
+    k[r] = kiso[r];
+    for (m=0; m<OPA_NMOL; m++)
+      dens[m][r] = 1.0 + m + 0.5*r;
+  }
+  for (m=0; m<OPA_NMOL; m++)
+    molec[m].d = dens[m];
+  memset(kiso, 0, sizeof(kiso));
+  for (r=0; r<OPA_NLAYER; r++)
+    interpolmolext(&tr, r, k);
+  for   (r=0; r<OPA_NLAYER; r++)
+    for (w=0; w<OPA_NWAVE;  w++){
+      /* Grid molecule m is molecule 1-m of mol:                            */
+      ext = 0.0;
+      for (m=0; m<OPA_NMOL; m++)
+        ext += dens[1-m][r] * (r*1000 + 150 + m*10 + w);
+      err = fmax(err, fabs(kiso[r][w] - ext)/ext);
+    }
+
+  munmap(op.opamap, op.opamapsize);
+  unlink(opa_file);
+  tr_assert(order, "The axis order of the opacity file was not honoured.");
+  tr_assert(same, "The mapped opacity grid differs from the written one.");
+  tr_assert(err < 1e-12, "The extinction interpolated from the "
+                         "[layer][wave][temp][mol] grid is wrong.");
+  return NULL;
+}
+
+
+/* The interpolated extinction must not depend on the axis order, the
+   sample type, or the vector instruction set; it must skip the grid
+   molecules missing from the atmosphere and hold at the last grid
+   temperature.                                                             */
+TR_TEST test_interpolmolext () {
+  struct transit tr;
+  struct opacity op;
+  struct molecules mol;
+  prop_mol molec[1];
+  PREC_ATM temp[OPA_NLAYER], dens[OPA_NLAYER];
+  PREC_RES kiso[OPA_NLAYER][OPA_NWAVE], *k[OPA_NLAYER];
+  int molID[1] = {102},               /* Grid molecule 1 only               */
+      order[3] = {TOPA_LTMW, TOPA_LTMW, TOPA_LWTM},
+      dtype[3] = {TOPA_F64,  TOPA_F32,  TOPA_F64};
+  long r, w;
+  double err=0, ext;
+  FILE *fp;
+  int i, level, rn=0;
+
+  for (i=0; i<3 && rn == 0; i++){
+    opa_write(order[i], dtype[i]);
+    memset(&tr, 0, sizeof(struct transit));
+    memset(&op, 0, sizeof(struct opacity));
+    tr.ds.op = &op;
+    fp = fopen(opa_file, "rb");
+    rn = mapopacity(&tr, fp);
+    fclose(fp);
+    if (rn != 0)
+      break;
+
+    /* Layer temperatures between grid samples 1 and 2, or at sample 2:     */
+    mol.nmol  = 1;
+    mol.ID    = molID;
+    mol.molec = molec;
+    molec[0].d = dens;
+    tr.ds.mol = &mol;
+    tr.atm.t    = temp;
+    tr.atm.tfct = 1.0;
+    for (r=0; r<OPA_NLAYER; r++){
+      temp[r] = r%2 ? 1500.0 : 1250.0;
+      dens[r] = 1.0 + 0.5*r;
+      k[r] = kiso[r];
+    }
+    for (level=VEC_SCALAR; level<=VEC_AVX512; level++){
+      vecsetlevel(level);
+      memset(kiso, 0, sizeof(kiso));
+      for (r=0; r<OPA_NLAYER; r++)
+        interpolmolext(&tr, r, k);
+      for   (r=0; r<OPA_NLAYER; r++)
+        for (w=0; w<OPA_NWAVE;  w++){
+          ext = dens[r] * (r*1000 + (r%2 ? 200 : 150) + 10 + w);
+          err = fmax(err, fabs(kiso[r][w] - ext)/ext);
+        }
+    }
+    munmap(op.opamap, op.opamapsize);
+  }
+  vecsetlevel(-1);
+  unlink(opa_file);
+  tr_assert(rn == 0, "The opacity file was not mapped.");
+  tr_assert(err < 1e-12, "The interpolated extinction is wrong.");
+  return NULL;
+}
+
+
+/* Reduced-precision grids must map to the written grid within their error
+   bounds: float32 (exact for these integers) and 16-bit log quantized,
+   written whole and block by block.                                        */
+TR_TEST test_mapopacity_dtype () {
+  struct transit tr;
+  struct opacity op;
+  long k;
+  FILE *fp;
+  int rn[3], same[3], i;
+
+  for (i=0; i<3; i++){
+    opa_setup(&tr, &op);
+    tr.opaorder = i == 0 ? TOPA_LWTM : TOPA_LTMW;
+    tr.opadtype = i == 0 ? TOPA_F32  : TOPA_LOG16;
+    tr.fp_opa = fp = fopen(opa_file, "w+b");
+    if (i < 2)
+      writeopacity(&tr, fp);
+    else{
+      beginopacity(&tr, fp);
+      for (k=0; k < OPA_NLAYER*OPA_NTEMP; k++)
+        putopacity(&tr, k/OPA_NTEMP, k%OPA_NTEMP,
+                   op.o[k/OPA_NTEMP][k%OPA_NTEMP]);
+      endopacity(&tr);
+    }
+    memset(&op, 0, sizeof(struct opacity));
+    rn[i] = mapopacity(&tr, fp);
+    fclose(fp);
+    same[i] = rn[i] == 0 && op.dtype == tr.opadtype && op.o == NULL &&
+              opa_close(&op, i == 0 ? 0.0 : 5.3e-4);
+    if (rn[i] == 0)
+      munmap(op.opamap, op.opamapsize);
+    free(op.qlut);
+    unlink(opa_file);
+  }
+  tr_assert(rn[0] == 0 && same[0], "The float32 opacity grid differs from "
+                                   "the written one.");
+  tr_assert(rn[1] == 0 && same[1], "The log-quantized opacity grid exceeds "
+                                   "its error bound.");
+  tr_assert(rn[2] == 0 && same[2], "The log-quantized opacity grid written "
+                                   "by blocks exceeds its error bound.");
+  return NULL;
+}
+
+
+/* A file with a damaged axis must be rejected.                             */
+TR_TEST test_mapopacity_checksum () {
+  struct transit tr;
+  struct opacity op;
+  PREC_RES temp = 1234.0;
+  FILE *fp;
+  int rn;
+
+  opa_write(TOPA_LTMW, TOPA_F64);
+  /* Overwrite the first temperature (after the header, completion map,
+     block checksums, and molecule IDs):                                    */
+  fp = fopen(opa_file, "r+b");
+  fseek(fp, (sizeof(struct opacityhead) + OPA_NLAYER*OPA_NTEMP + 7)/8*8
+            + OPA_NLAYER*OPA_NTEMP*sizeof(unsigned long)
+            + (OPA_NMOL*sizeof(int) + 7)/8*8, SEEK_SET);
+  fwrite(&temp, sizeof(PREC_RES), 1, fp);
+  fclose(fp);
+
+  memset(&op, 0, sizeof(struct opacity));
+  tr.ds.op = &op;
+  fp = fopen(opa_file, "rb");
+  rn = mapopacity(&tr, fp);
+  fclose(fp);
+  unlink(opa_file);
+  tr_assert(rn == -1, "A damaged opacity file was accepted.");
+  return NULL;
+}
+
+
+/* A grid written block by block must resume from the blocks left by an
+   interrupted calculation, except a damaged one, and map as the whole
+   grid once finished.  A partial file with other axes or inputs must be
+   started over, a finished one must be left alone.                         */
+TR_TEST test_putopacity_resume () {
+  struct transit tr;
+  struct opacity op, op2;
+  struct opacityhead head;
+  PREC_RES ****o, bad = -1.0;
+  long k, nblock=OPA_NLAYER*OPA_NTEMP, ndone1, ndone2, ndone3, ndone4,
+       ndone5;
+  FILE *fp;
+  int end2, end3, rn2, rn3, same;
+
+  opa_setup(&tr, &op);
+  o = op.o;
+  tr.opaorder = TOPA_LWTM;
+
+  /* Interrupted after half of the blocks (no endopacity()):               */
+  tr.fp_opa = fp = fopen(opa_file, "w+b");
+  ndone1 = beginopacity(&tr, fp);
+  for (k=0; k < nblock/2; k++)
+    putopacity(&tr, k/OPA_NTEMP, k%OPA_NTEMP, o[k/OPA_NTEMP][k%OPA_NTEMP]);
+  munmap(op.opamap, op.opamapsize);
+  fclose(fp);
+
+  /* Damage the first sample of the grid (in the first block):              */
+  fp = fopen(opa_file, "r+b");
+  fread(&head, sizeof(struct opacityhead), 1, fp);
+  fseek(fp, head.data, SEEK_SET);
+  fwrite(&bad, sizeof(PREC_RES), 1, fp);
+  fclose(fp);
+
+  /* Rerun with the same parameters:                                        */
+  tr.fp_opa = fp = fopen(opa_file, "r+b");
+  ndone2 = beginopacity(&tr, fp);
+  for (k=0; k < nblock; k++)
+    if (!((char *)op.opamap)[sizeof(struct opacityhead) + k])
+      putopacity(&tr, k/OPA_NTEMP, k%OPA_NTEMP, o[k/OPA_NTEMP][k%OPA_NTEMP]);
+  end2 = endopacity(&tr);
+  memset(&op2, 0, sizeof(struct opacity));
+  tr.ds.op = &op2;
+  rn2  = mapopacity(&tr, fp);
+  same = rn2 == 0 && opa_same(&op2);
+  if (rn2 == 0)
+    munmap(op2.opamap, op2.opamapsize);
+  fclose(fp);
+
+  /* Rerun with another temperature sample, on the finished grid and then
+     on the grid missing its last block:                                    */
+  tr.ds.op = &op;
+  op.temp[0] += 1.0;
+  tr.fp_opa = fp = fopen(opa_file, "r+b");
+  ndone4 = beginopacity(&tr, fp);
+  fseek(fp, sizeof(struct opacityhead) + nblock - 1, SEEK_SET);
+  fputc(0, fp);
+  fflush(fp);
+  ndone3 = beginopacity(&tr, fp);
+  putopacity(&tr, 0, 0, o[0][0]);
+  end3 = endopacity(&tr);
+
+  /* Rerun that partial grid with other inputs:                             */
+  op.inputs += 1;
+  ndone5 = beginopacity(&tr, fp);
+  endopacity(&tr);
+  memset(&op2, 0, sizeof(struct opacity));
+  tr.ds.op = &op2;
+  rn3 = mapopacity(&tr, fp);
+  fclose(fp);
+  unlink(opa_file);
+
+  tr_assert(ndone1 == 0 && ndone2 == nblock/2 - 1, "The blocks written "
+            "before the interruption were lost, or a damaged one kept.");
+  tr_assert(end2 == 0 && same, "The resumed opacity grid differs from the "
+                               "written one.");
+  tr_assert(ndone4 == -1, "A finished grid with other axes was started "
+                          "over.");
+  tr_assert(ndone3 == 0 && end3 == 1 && rn3 == 2, "A partial grid with other "
+                                                  "axes was not started over.");
+  tr_assert(ndone5 == 0, "A partial grid with other inputs was resumed.");
+  return NULL;
+}
+
+
+/* A process that finds the file being computed by another must wait for
+   it, and then find the grid finished.                                     */
+TR_TEST test_beginopacity_wait () {
+  struct transit tr;
+  struct opacity op, op2;
+  long k, nblock=OPA_NLAYER*OPA_NTEMP, ndone;
+  struct timespec delay = {0, 200000000};
+  pid_t pid;
+  FILE *fp;
+  int p[2], status, end, rn, same;
+  char c;
+
+  opa_setup(&tr, &op);
+  unlink(opa_file);
+  pipe(p);
+  pid = fork();
+  if (pid == 0){
+    /* The first process locks the file and computes it, slowly:           */
+    tr.fp_opa = fp = fopen(opa_file, "w+b");
+    beginopacity(&tr, fp);
+    write(p[1], "x", 1);
+    nanosleep(&delay, NULL);
+    for (k=0; k < nblock; k++)
+      putopacity(&tr, k/OPA_NTEMP, k%OPA_NTEMP, op.o[k/OPA_NTEMP][k%OPA_NTEMP]);
+    _exit(endopacity(&tr));
+  }
+  read(p[0], &c, 1);
+  tr.fp_opa = fp = fopen(opa_file, "r+b");
+  ndone = beginopacity(&tr, fp);
+  end = endopacity(&tr);
+  waitpid(pid, &status, 0);
+  memset(&op2, 0, sizeof(struct opacity));
+  tr.ds.op = &op2;
+  rn   = mapopacity(&tr, fp);
+  same = rn == 0 && opa_same(&op2);
+  if (rn == 0)
+    munmap(op2.opamap, op2.opamapsize);
+  fclose(fp);
+  close(p[0]);
+  close(p[1]);
+  unlink(opa_file);
+
+  tr_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+            "The first process did not finish the opacity grid.");
+  tr_assert(ndone == nblock && end == 0 && same, "The second process did not "
+            "wait for the opacity grid.");
+  return NULL;
+}
+
+
+/* FUNCTION: Write the synthetic grid to opa_file without header
+   (version 1).                                                             */
+static void
+opa_writev1(struct transit *tr,
+            struct opacity *op){
+  long r, t, m;
+  FILE *fp;
+
+  opa_setup(tr, op);
+  fp = fopen(opa_file, "wb");
+  fwrite(&op->Nmol,   sizeof(long), 1, fp);
+  fwrite(&op->Ntemp,  sizeof(long), 1, fp);
+  fwrite(&op->Nlayer, sizeof(long), 1, fp);
+  fwrite(&op->Nwave,  sizeof(long), 1, fp);
+  fwrite(op->molID, sizeof(int),      OPA_NMOL,   fp);
+  fwrite(op->temp,  sizeof(PREC_RES), OPA_NTEMP,  fp);
+  fwrite(op->press, sizeof(PREC_RES), OPA_NLAYER, fp);
+  fwrite(op->wns,   sizeof(PREC_RES), OPA_NWAVE,  fp);
+  for     (r=0; r<OPA_NLAYER; r++)
+    for   (t=0; t<OPA_NTEMP;  t++)
+      for (m=0; m<OPA_NMOL;   m++)
+        fwrite(op->o[r][t][m], sizeof(PREC_RES), OPA_NWAVE, fp);
+  fclose(fp);
+}
+
+
+/* A file without header (version 1) is left to readopacity().              */
+TR_TEST test_readopacity_v1 () {
+  struct transit tr;
+  struct opacity op;
+  FILE *fp;
+  int rn, same;
+
+  opa_writev1(&tr, &op);
+  memset(&op, 0, sizeof(struct opacity));
+  fp = fopen(opa_file, "rb");
+  rn = mapopacity(&tr, fp);
+  rewind(fp);
+  readopacity(&tr, fp);
+  fclose(fp);
+  unlink(opa_file);
+  same = opa_same(&op);
+  tr_assert(rn == 1, "A version-1 opacity file was not recognized.");
+  tr_assert(same, "The version-1 opacity grid differs from the written "
+                  "one.");
+  return NULL;
+}
+
+
+/* FUNCTION: Set up the run of tr with layers 1 and 2 and wavenumbers 1 to
+   3 of the synthetic grid, or wavenumbers shifted by half a sample if
+   'shift'.                                                                 */
+static void
+opa_run(struct transit *tr,
+        PREC_ATM *press,
+        PREC_RES *wns,
+        int shift){
+  long i;
+
+  tr->rads.n = 2;
+  tr->atm.p  = press;
+  tr->atm.pfct = 1.0;
+  for (i=0; i<2; i++)
+    press[i] = 1e6*(i+2);
+  tr->wns.n = 3;
+  tr->wns.d = 1.0;
+  tr->wns.v = wns;
+  for (i=0; i<3; i++)
+    wns[i] = 2001.0 + i + 0.5*shift;
+}
+
+
+/* FUNCTION: Whether op holds the window of opa_run() of the synthetic
+   grid, for the grid molecules from m0 on.                                 */
+static int
+opa_window(struct opacity *op,
+           long m0){
+  long r, t, m, w, *s=op->stride;
+
+  if (op->Nlayer != 2 || op->Nwave != 3 || op->Nmol != OPA_NMOL-m0 ||
+      op->press[0] != 2e6 || op->wns[0] != 2001.0 || op->molID[0] != 101+m0)
+    return 0;
+  for       (r=0; r<2;         r++)
+    for     (t=0; t<OPA_NTEMP; t++)
+      for   (m=0; m<op->Nmol;  m++)
+        for (w=0; w<3;         w++)
+          if (opasample(op, r*s[0] + t*s[1] + m*s[2] + w*s[3],
+                        (r*OPA_NTEMP + t)*op->Nmol + m)
+              != (r+1)*1000 + t*100 + (m+m0)*10 + w+1)
+            return 0;
+  return 1;
+}
+
+
+/* A run over part of the layers and wavenumbers of a grid must get that
+   window, mapped from a file with header or read (only for the molecules
+   of the atmosphere) from a version-1 file.  A run whose wavenumbers are
+   not in the grid must be rejected.                                        */
+TR_TEST test_opacity_window () {
+  struct transit tr;
+  struct opacity op;
+  struct molecules mol;
+  PREC_ATM press[2];
+  PREC_RES wns[3];
+  int molID[1] = {102};
+  FILE *fp;
+  int rn1, rn2, rn3, map, read;
+
+  opa_write(TOPA_LWTM, TOPA_F64);
+  memset(&tr, 0, sizeof(struct transit));
+  memset(&op, 0, sizeof(struct opacity));
+  tr.ds.op = &op;
+  opa_run(&tr, press, wns, 0);
+  fp = fopen(opa_file, "rb");
+  rn1 = mapopacity(&tr, fp);
+  map = rn1 == 0 && opa_window(&op, 0);
+  if (rn1 == 0)
+    munmap(op.opamap, op.opamapsize);
+
+  memset(&op, 0, sizeof(struct opacity));
+  opa_run(&tr, press, wns, 1);
+  rn2 = mapopacity(&tr, fp);
+  fclose(fp);
+
+  opa_writev1(&tr, &op);
+  memset(&op, 0, sizeof(struct opacity));
+  opa_run(&tr, press, wns, 0);
+  mol.nmol = 1;
+  mol.ID   = molID;
+  tr.ds.mol = &mol;
+  fp = fopen(opa_file, "rb");
+  rn3  = readopacity(&tr, fp);
+  read = rn3 == 0 && opa_window(&op, 1);
+  fclose(fp);
+  unlink(opa_file);
+
+  tr_assert(map, "The mapped window of the opacity grid is wrong.");
+  tr_assert(rn2 == -1, "Wavenumbers outside the opacity grid were "
+                       "accepted.");
+  tr_assert(read, "The window read from a version-1 opacity file is "
+                  "wrong.");
+  return NULL;
+}
+
+
+/* FUNCTION: Write to 'file', in the axis order 'order', shard 'shard' of
+   two of the synthetic grid: wavenumbers w0 to w0+nw-1, of which those
+   from the index core on (ncore of them) are its own, for the nm
+   molecules from m0 on.                                                    */
+static void
+opa_shard(char *file,
+          int order,
+          int shard,
+          long w0,
+          long nw,
+          long core,
+          long ncore,
+          long m0,
+          long nm){
+  struct transit tr;
+  struct opacity op;
+  long r, t, m;
+  FILE *fp;
+
+  opa_setup(&tr, &op);
+  op.Nwave  = nw;
+  op.wns   += w0;
+  op.Nmol   = nm;
+  op.molID += m0;
+  for     (r=0; r<OPA_NLAYER; r++)
+    for   (t=0; t<OPA_NTEMP;  t++){
+      op.o[r][t] += m0;
+      for (m=0; m<nm; m++)
+        op.o[r][t][m] += w0;
+    }
+  op.shard  = shard;
+  op.nshard = 2;
+  op.core   = core;
+  op.ncore  = ncore;
+  tr.opaorder = order;
+  tr.opadtype = TOPA_F64;
+  fp = fopen(file, "wb");
+  writeopacity(&tr, fp);
+  fclose(fp);
+}
+
+
+/* Shards of the synthetic grid, by wavenumbers (padded) and by molecules,
+   must merge into the whole grid; shards that leave a molecule out of a
+   range must be rejected.                                                  */
+TR_TEST test_mergeopacity () {
+  struct transit tr;
+  struct opacity op;
+  char a[] = "/tmp/transit_test_shard_a.dat",
+       b[] = "/tmp/transit_test_shard_b.dat",
+       c[] = "/tmp/transit_test_shard_c.dat",
+       *in[3] = {b, a, c};
+  FILE *fp;
+  int rn1, rn2, rn3=-1, rn4, same=0, merged=0;
+
+  /* Wavenumbers 0 to 2 padded by 3, and 3 to 4 padded by 2, the latter
+     in one shard per molecule:                                             */
+  opa_shard(a, TOPA_LTMW, 0, 0, 4, 0, 3, 0, 2);
+  opa_shard(b, TOPA_LWTM, 1, 2, 3, 1, 2, 0, 1);
+  opa_shard(c, TOPA_LWTM, 1, 2, 3, 1, 2, 1, 1);
+  unlink(opa_file);
+  rn1 = mergeopacity(in, 3, opa_file);
+  rn2 = mergeopacity(in, 2, opa_file);
+  rn4 = mergeopacity(in, 3, a);
+
+  memset(&tr, 0, sizeof(struct transit));
+  memset(&op, 0, sizeof(struct opacity));
+  tr.ds.op = &op;
+  if ((fp = fopen(opa_file, "rb")) != NULL){
+    rn3 = mapopacity(&tr, fp);
+    fclose(fp);
+  }
+  if (rn3 == 0){
+    same   = opa_same(&op);
+    merged = op.nshard == 1 && op.nmerged == 3 && op.ncore == OPA_NWAVE;
+    munmap(op.opamap, op.opamapsize);
+  }
+  unlink(a);
+  unlink(b);
+  unlink(c);
+  unlink(opa_file);
+
+  tr_assert(rn1 == 0 && rn3 == 0, "The opacity shards were not merged.");
+  tr_assert(same, "The merged opacity grid is wrong.");
+  tr_assert(merged, "The merged opacity file has the wrong provenance.");
+  tr_assert(rn2 == -1, "Shards missing a molecule were merged.");
+  tr_assert(rn4 == -1, "The shards were merged into one of them.");
+  return NULL;
+}
+
+
+/* FUNCTION: Share the grid of opa_file into op.
+   Return: whether it was shared and holds the synthetic grid               */
+static int
+opa_share(struct transit *tr,
+          struct opacity *op){
+  FILE *fp;
+  int rn;
+
+  memset(op, 0, sizeof(struct opacity));
+  tr->ds.op = op;
+  fp = fopen(opa_file, "rb");
+  rn = shareopacity(tr, fp);
+  fclose(fp);
+  return rn == 0 && op->mainaddr != NULL && opa_same(op);
+}
+
+
+/* Processes sharing a version-1 file at once must all get the grid, and
+   the segments must be removed once all of them (including one that died
+   without detaching) are gone.                                             */
+TR_TEST test_shareopacity () {
+  struct transit tr;
+  struct opacity op;
+  char name[TSHM_NAMELEN];
+  pid_t pid[4];
+  long pi = 0;
+  int i, status, shared, children=1, gone;
+
+  opa_writev1(&tr, &op);
+  /* Four processes start at once, three detach, one dies attached:         */
+  for (i=0; i<4; i++){
+    pid[i] = fork();
+    if (pid[i] == 0){
+      shared = opa_share(&tr, &op);
+      if (i < 3)
+        freemem_opacity(&op, &pi);
+      _exit(shared ? 0 : 1);
+    }
+  }
+  for (i=0; i<4; i++){
+    waitpid(pid[i], &status, 0);
+    children &= WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+
+  shared = opa_share(&tr, &op);
+  strcpy(name, op.shmname);
+  freemem_opacity(&op, &pi);
+  gone = shm_open(name, O_RDONLY, 0) < 0 && errno == ENOENT;
+  if (!gone)
+    shm_unlink(name);
+  unlink(opa_file);
+  tr_assert(children, "A process did not get the shared opacity grid.");
+  tr_assert(shared, "The version-1 opacity grid was not shared.");
+  tr_assert(gone, "The shared-memory segments were not removed.");
+  return NULL;
+}
+
+
+TR_BATCH test_opacity () {
+  tr_setup_batch();
+  tr_run_test(test_mapopacity);
+  tr_run_test(test_mapopacity_lwtm);
+  tr_run_test(test_interpolmolext);
+  tr_run_test(test_mapopacity_dtype);
+  tr_run_test(test_mapopacity_checksum);
+  tr_run_test(test_putopacity_resume);
+  tr_run_test(test_beginopacity_wait);
+  tr_run_test(test_readopacity_v1);
+  tr_run_test(test_opacity_window);
+  tr_run_test(test_mergeopacity);
+  tr_run_test(test_shareopacity);
+  tr_finish_batch();
+}
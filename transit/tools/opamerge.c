@@ -0,0 +1,26 @@
+// Copyright (C) 2015-2016 University of Central Florida. All rights reserved.
+// Transit is under an open-source, reproducible-research license (see LICENSE).
+
+/* opamerge: merge the opacity files computed in shards, each a range of
+   wavenumbers (--opashard) or a subset of molecules (--opamol), into one
+   opacity file (see mergeopacity()).  Build it with `make opamerge`.       */
+
+#include <transit.h>
+
+int
+main(int argc, char **argv){
+  verblevel = 2;
+  if (argc < 3){
+    fprintf(stderr, "Usage: %s <output opacity file> <shard> [<shard> ...]\n"
+      "Merge the opacity-file shards of transit's --opashard and --opamol "
+      "options.\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (mergeopacity(argv+2, argc-2, argv[1]) != 0){
+    tr_output(TOUT_ERROR, "The opacity shards were not merged.\n");
+    return EXIT_FAILURE;
+  }
+  tr_output(TOUT_RESULT, "Merged %d opacity shards into '%s'.\n", argc-2,
+    argv[1]);
+  return EXIT_SUCCESS;
+}